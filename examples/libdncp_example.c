@@ -28,6 +28,7 @@ void (*hnetd_log)(int priority, const char *format, ...) = example_log;
 /* In this example, we just use hncp's functions */
 #include "udp46.c"
 #include "hncp_io.c"
+#include "hncp_md5.c"
 #include "hncp.c"
 
 int main (int argc, char **argv)
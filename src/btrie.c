@@ -75,6 +75,10 @@ static inline pkey_t mask(plen_t len) {
 	return (full_mask >> i) << i;
 }
 
+//Number of counted lengths in a node (lengths below the node's are always 0)
+#define BTRIE_COUNT_LEN(node) \
+	(((node)->plen > BTRIE_AVAILABLE_COUNT_PLEN)?0:(BTRIE_AVAILABLE_COUNT_PLEN + 1 - (node)->plen))
+
 void *__bt_p; //Helper for iterators
 static struct btrie __bt_all_available; //Used when no node can be found for the available lookup
 
@@ -108,6 +112,8 @@ static inline struct btrie *btrie_new_node(struct btrie *parent, struct btrie **
 	struct btrie *node;
 	if(!(node = malloc(sizeof(struct btrie))))
 		return NULL;
+	node->counted = parent->counted;
+	node->counts = NULL; //Allocated with the first count update
 	INIT_LIST_HEAD(&node->elements.l);
 	node->elements.node = NULL;
 	node->parent = parent;
@@ -117,7 +123,8 @@ static inline struct btrie *btrie_new_node(struct btrie *parent, struct btrie **
 	return node;
 }
 
-static void btrie_delete_maybe(struct btrie *n)
+/* Returns the lowest node which was not deleted on the path */
+static struct btrie *btrie_delete_maybe(struct btrie *n)
 {
 	struct btrie *o, **c, *p;
 	while(list_empty(&n->elements.l) && n->parent && (!n->child[0] || !n->child[1])) {
@@ -126,7 +133,7 @@ static void btrie_delete_maybe(struct btrie *n)
 			o = n->child[1];
 
 		if(o && !(n->plen & remain_mask))
-			return;
+			return n;
 
 		c = &n->parent->child[0];
 		if(*c != n)
@@ -134,14 +141,16 @@ static void btrie_delete_maybe(struct btrie *n)
 
 		*c = o;
 		p = n->parent;
+		free(n->counts);
 		free(n);
 
 		if(o) {
 			o->parent = p;
-			return;
+			return p;
 		}
 		n = p;
 	}
+	return n;
 }
 
 static struct btrie *btrie_add_leaf(struct btrie *parent, struct btrie **child,
@@ -241,12 +250,127 @@ static struct btrie *btrie_node_goc(struct btrie *root, const btrie_key_t *key,
 	return NULL;
 }
 
+/* Computes the available prefixes counts of a node from its children counts.
+ * count[i] is the number of available prefixes of length n->plen + i. */
+static void btrie_count_node(struct btrie *n, uint32_t *count)
+{
+	struct btrie *c;
+	int b, l;
+	if(!BTRIE_COUNT_LEN(n))
+		return;
+
+	memset(count, 0, BTRIE_COUNT_LEN(n) * sizeof(uint32_t));
+	if(!list_empty(&n->elements.l))
+		return;
+
+	if(!n->child[0] && !n->child[1]) { //Only root can have no child
+		count[0]++;
+		return;
+	}
+
+	for(b = 0; b < 2; b++) {
+		if(!(c = n->child[b])) {
+			if(n->plen < BTRIE_AVAILABLE_COUNT_PLEN)
+				count[1]++;
+			continue;
+		}
+		//Siblings of the compressed path to the child
+		for(l = n->plen + 2; l <= c->plen && l <= BTRIE_AVAILABLE_COUNT_PLEN; l++)
+			count[l - n->plen]++;
+		for(l = c->plen; l <= BTRIE_AVAILABLE_COUNT_PLEN; l++)
+			count[l - n->plen] += c->counts[l - c->plen];
+	}
+}
+
+/* Post-order traversal of the nodes below (and including) the given root */
+static struct btrie *btrie_postorder_first(struct btrie *n)
+{
+	while(n->child[0] || n->child[1])
+		n = n->child[0]?n->child[0]:n->child[1];
+	return n;
+}
+
+static struct btrie *btrie_postorder_next(struct btrie *root, struct btrie *n)
+{
+	struct btrie *p = n->parent;
+	if(n == root)
+		return NULL;
+	if(n == p->child[0] && p->child[1])
+		return btrie_postorder_first(p->child[1]);
+	return p;
+}
+
+/* Stops counting, freeing all counts */
+static void btrie_count_disable(struct btrie *root)
+{
+	struct btrie *n;
+	for(n = btrie_postorder_first(root); n; n = btrie_postorder_next(root, n)) {
+		free(n->counts);
+		n->counts = NULL;
+		n->counted = 0;
+	}
+}
+
+/* Updates (allocating if needed) the counts of a node */
+static int btrie_count_set(struct btrie *n)
+{
+	if(!n->counts && BTRIE_COUNT_LEN(n) &&
+			!(n->counts = malloc(BTRIE_COUNT_LEN(n) * sizeof(uint32_t))))
+		return -1;
+	btrie_count_node(n, n->counts);
+	return 0;
+}
+
+/* Updates counts from the given node up to the root. If some malloc fails,
+ * the whole trie stops counting. */
+static void btrie_count_update(struct btrie *n)
+{
+	for(; n->parent; n = n->parent) {
+		if(btrie_count_set(n)) {
+			while(n->parent)
+				n = n->parent;
+			btrie_count_disable(n);
+			return;
+		}
+	}
+}
+
+/* Returns the counts of a node, indexed from its length */
+static const uint32_t *btrie_count_get(struct btrie *n, uint32_t *tmp)
+{
+	if(n->parent)
+		return n->counts;
+	btrie_count_node(n, tmp);
+	return tmp;
+}
+
 void btrie_init(struct btrie *root) {
 	memset(root, 0, sizeof(struct btrie));
 	INIT_LIST_HEAD(&root->elements.l);
 	root->elements.node = NULL;
 }
 
+void btrie_init_counted(struct btrie *root) {
+	btrie_init(root);
+	root->counted = 1;
+}
+
+int btrie_count_enable(struct btrie *root) {
+	struct btrie *n;
+	if(root->counted)
+		return 0;
+
+	//Children are counted before their parent
+	for(n = btrie_postorder_first(root); n; n = btrie_postorder_next(root, n)) {
+		n->counted = 1;
+		if(n->parent && btrie_count_set(n)) {
+			btrie_count_disable(root);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 #define node(element) ((struct btrie *) (element)) //elements is first field in btrie
 #define element(list) ((struct btrie_element *) (list)) //l is first field in btrie_element
 #define next_element(e) element((e)->l.next)
@@ -257,16 +381,23 @@ int btrie_add(struct btrie *root, struct btrie_element *e, const pkey_t *key, pl
 	if(n) {
 		e->node = n;
 		list_add_tail(&e->l, &n->elements.l);
+		if(root->counted)
+			btrie_count_update(n);
 		return 0;
 	}
+	if(root->counted) //Intermediate nodes may have been created
+		btrie_count_update(btrie_node_lookup(root, key, len));
 	return -1;
 }
 
 void btrie_remove(struct btrie_element *e)
 {
 	list_del(&e->l);
-	if(list_empty(&e->node->elements.l))
-		btrie_delete_maybe(e->node);
+	if(list_empty(&e->node->elements.l)) {
+		struct btrie *n = btrie_delete_maybe(e->node);
+		if(n->counted)
+			btrie_count_update(n);
+	}
 }
 
 void btrie_get_key(struct btrie_element *e, btrie_key_t *key)
@@ -754,3 +885,210 @@ up:
 
 	return 0; //Avoid warning
 }
+
+/* Finds where the contain prefix stands in a counted trie.
+ * Returns -1 if the prefix is covered by an element. Otherwise, sets node to
+ * the node of same length, to the first node it contains, or to NULL when the
+ * whole prefix is available. */
+static int btrie_count_locate(struct btrie *root, const btrie_key_t *contain_key, btrie_plen_t contain_len,
+		struct btrie **node)
+{
+	struct btrie *n = btrie_node_lookup(root, contain_key, contain_len), *c;
+	for(c = n; c; c = c->parent)
+		if(!list_empty(&c->elements.l))
+			return -1;
+
+	if(n->plen == contain_len) {
+		*node = n;
+		return 0;
+	}
+
+	c = n->child[nthbit(ntohk(contain_key[index(n->plen)]), remain(n->plen))?1:0];
+	if(!c || contain_len >= c->plen ||
+			((ntohk(contain_key[index(contain_len - 1)]) ^ c->key) & mask(remain(contain_len - 1))))
+		c = NULL;
+
+	*node = c;
+	return 0;
+}
+
+#define BTRIE_KEY_WORDS ((255 + BTRIE_KEY) / BTRIE_KEY)
+
+void btrie_available_count(struct btrie *root, const btrie_key_t *contain_key, btrie_plen_t contain_len,
+		uint32_t *count, btrie_plen_t max_len)
+{
+	uint32_t tmp[BTRIE_AVAILABLE_COUNT_PLEN + 1];
+	btrie_key_t iter_key[BTRIE_KEY_WORDS];
+	btrie_plen_t iter_len;
+	const uint32_t *c;
+	struct btrie *n;
+	int l;
+
+	memset(count, 0, (max_len + 1) * sizeof(uint32_t));
+	if(!root->counted || max_len > BTRIE_AVAILABLE_COUNT_PLEN) {
+		btrie_for_each_available(root, n, iter_key, &iter_len, contain_key, contain_len) {
+			if(iter_len <= max_len)
+				count[iter_len]++;
+		}
+		return;
+	}
+
+	if(btrie_count_locate(root, contain_key, contain_len, &n))
+		return;
+
+	if(!n) {
+		if(contain_len <= max_len)
+			count[contain_len]++;
+		return;
+	}
+
+	//Siblings of the compressed path to n
+	for(l = contain_len + 1; l <= n->plen && l <= max_len; l++)
+		count[l]++;
+
+	c = btrie_count_get(n, tmp);
+	for(l = n->plen; l <= max_len; l++)
+		count[l] += c[l - n->plen];
+}
+
+/* Number of target_len keys in an available prefix of length l.
+ * Saturates at 2^32, which is bigger than any uint32_t n. */
+#define BTRIE_WEIGHT_MAX (1ull << 32)
+#define BTRIE_WEIGHT_SUM_MAX (1ull << 48)
+
+static inline uint64_t btrie_weight(int l, plen_t min_len, plen_t max_len, plen_t target_len)
+{
+	if(l < min_len || l > max_len)
+		return 0;
+	return (target_len - l >= 32)?BTRIE_WEIGHT_MAX:(1ull << (target_len - l));
+}
+
+static inline uint64_t btrie_weight_add(uint64_t a, uint64_t b)
+{
+	a += b;
+	return (a > BTRIE_WEIGHT_SUM_MAX)?BTRIE_WEIGHT_SUM_MAX:a;
+}
+
+/* Number of target_len keys contained in all available prefixes of a subtree */
+static uint64_t btrie_weight_node(struct btrie *n, plen_t min_len, plen_t max_len, plen_t target_len)
+{
+	uint32_t tmp[BTRIE_AVAILABLE_COUNT_PLEN + 1];
+	const uint32_t *c = btrie_count_get(n, tmp);
+	uint64_t w = 0;
+	int l;
+	for(l = (n->plen > min_len)?n->plen:min_len; l <= max_len; l++) {
+		uint32_t cl = c[l - n->plen];
+		if(cl)
+			w = btrie_weight_add(w, (cl > (BTRIE_WEIGHT_SUM_MAX >> 32))?
+					BTRIE_WEIGHT_SUM_MAX:cl * btrie_weight(l, min_len, max_len, target_len));
+	}
+	return w;
+}
+
+/* Sets the bit following iter_key/iter_len and increments iter_len */
+static inline void btrie_key_push(pkey_t *key, plen_t *len, int bit)
+{
+	pkey_t k = ntohk(key[index(*len)]);
+	if(bit)
+		k |= first_bit_mask >> remain(*len);
+	else
+		k &= ~(first_bit_mask >> remain(*len));
+	key[index(*len)] = htonk(k);
+	(*len)++;
+}
+
+int btrie_available_nth(struct btrie *root, btrie_key_t *iter_key, btrie_plen_t *iter_len,
+		const btrie_key_t *contain_key, btrie_plen_t contain_len,
+		btrie_plen_t min_len, btrie_plen_t max_len, btrie_plen_t target_len, uint32_t *n)
+{
+	struct btrie *node, *child;
+	uint64_t w, rest, sib;
+	int b, l;
+
+	if(!root->counted || max_len > BTRIE_AVAILABLE_COUNT_PLEN) {
+		btrie_for_each_available(root, node, iter_key, iter_len, contain_key, contain_len) {
+			if((w = btrie_weight(*iter_len, min_len, max_len, target_len))) {
+				if(*n < w)
+					return 0;
+				*n -= w;
+			}
+		}
+		return -1;
+	}
+
+	if(btrie_count_locate(root, contain_key, contain_len, &node))
+		return -1;
+
+	if(contain_len)
+		memcpy(iter_key, contain_key, ((contain_len - 1) >> 3) + 1);
+	*iter_len = contain_len;
+
+	if(!node)
+		goto block;
+
+	if(node->plen == contain_len)
+		goto node;
+
+	rest = btrie_weight_node(node, min_len, max_len, target_len);
+	for(l = contain_len + 1; l <= node->plen; l++)
+		rest = btrie_weight_add(rest, btrie_weight(l, min_len, max_len, target_len));
+
+edge:
+	//Walking the compressed path toward node, with rest the remaining weight
+	while(*iter_len < node->plen) {
+		sib = btrie_weight(*iter_len + 1, min_len, max_len, target_len);
+		rest -= sib;
+		if(nthbit(node->key, remain(*iter_len))) {
+			if(*n < sib) {
+				btrie_key_push(iter_key, iter_len, 0);
+				return 0;
+			}
+			*n -= sib;
+			btrie_key_push(iter_key, iter_len, 1);
+		} else {
+			if(*n >= rest) {
+				*n -= rest;
+				btrie_key_push(iter_key, iter_len, 1);
+				goto block;
+			}
+			btrie_key_push(iter_key, iter_len, 0);
+		}
+	}
+
+node:
+	if(!list_empty(&node->elements.l))
+		return -1;
+
+	if(!node->child[0] && !node->child[1])
+		goto block;
+
+	for(b = 0; b < 2; b++) {
+		if(!(child = node->child[b])) {
+			w = btrie_weight(node->plen + 1, min_len, max_len, target_len);
+		} else {
+			w = btrie_weight_node(child, min_len, max_len, target_len);
+			for(l = node->plen + 2; l <= child->plen; l++)
+				w = btrie_weight_add(w, btrie_weight(l, min_len, max_len, target_len));
+		}
+
+		if(*n >= w) {
+			*n -= w;
+			continue;
+		}
+
+		btrie_key_push(iter_key, iter_len, b);
+		if(!child)
+			return 0;
+
+		node = child;
+		rest = w;
+		goto edge;
+	}
+	return -1;
+
+block:
+	if(*n < (w = btrie_weight(*iter_len, min_len, max_len, target_len)))
+		return 0;
+	*n -= w;
+	return -1;
+}
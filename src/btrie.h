@@ -54,6 +54,11 @@
  * each key array element is considered as an integer of BTRIE_KEY bits in home byte order. */
 #define BTRIE_KEY_NETWORK_BYTE_ORDER
 
+/* Counted tries (see btrie_init_counted) keep, in each node, the number of
+ * available prefixes of each length up to this value. A node of length l
+ * then uses (BTRIE_AVAILABLE_COUNT_PLEN + 1 - l) * 4 additional bytes. */
+#define BTRIE_AVAILABLE_COUNT_PLEN 128
+
 /* Private */
 #define TYPE_GLUE(a,b,c) a##b##c
 #define TYPE_INT(x) TYPE_GLUE(uint, x, _t)
@@ -71,6 +76,18 @@ struct btrie_element {
 /* Initializes a btrie structure as a trie root. */
 void btrie_init(struct btrie *root);
 
+/* Initializes a btrie structure as a trie root which maintains, in each node,
+ * the number of available prefixes of each length contained in the node.
+ * Counting and picking available prefixes (see below) then takes time
+ * proportional to the key length rather than to the available space. */
+void btrie_init_counted(struct btrie *root);
+
+/* Starts maintaining available prefixes counts in a trie which may already
+ * contain elements, as if it had been initialized with btrie_init_counted.
+ * Returns 0 on success or -1 if some malloc failed (the trie is then left
+ * uncounted). */
+int btrie_count_enable(struct btrie *root);
+
 /* Insert an element in the trie.
  * Returns 0 if insertion succeeded or -1 if some malloc failed. */
 int btrie_add(struct btrie *root, struct btrie_element *new, const btrie_key_t *key, btrie_plen_t len);
@@ -222,13 +239,31 @@ uint64_t btrie_available_space(struct btrie *root, const btrie_key_t *key, btrie
 #define btrie_available_prefixes_count(root, key, len, target_len) \
 			(btrie_available_space(root, key, len, target_len) >> (63 - (target_len - len)))
 
+/* Counts available prefixes contained in the prefix given by contain_key and
+ * contain_len, by prefix length. count[l] is set for l in [0, max_len]. */
+void btrie_available_count(struct btrie *root, const btrie_key_t *contain_key, btrie_plen_t contain_len,
+		uint32_t *count, btrie_plen_t max_len);
+
+/* Considering available prefixes of length in [min_len, max_len] contained in
+ * the prefix given by contain_key and contain_len, ordered by key, looks for
+ * the one containing the nth (starting from 0) key of length target_len.
+ * (min_len <= max_len <= target_len).
+ * Returns 0 and sets iter_key, iter_len and n to the found available prefix
+ * and the index of the key inside it. Returns -1 and decrements n by the
+ * number of considered keys if there are not enough. */
+int btrie_available_nth(struct btrie *root, btrie_key_t *iter_key, btrie_plen_t *iter_len,
+		const btrie_key_t *contain_key, btrie_plen_t contain_len,
+		btrie_plen_t min_len, btrie_plen_t max_len, btrie_plen_t target_len, uint32_t *n);
+
 /***************Private**************/
 struct btrie {
 	struct btrie_element elements; //Must be first for cast
 	struct btrie *parent;
 	struct btrie *child[2];
 	btrie_plen_t plen;
+	uint8_t counted;
 	btrie_key_t key;
+	uint32_t *counts; //Available counts by length, from plen (counted non-root nodes only)
 };
 /************************************/
 
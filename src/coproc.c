@@ -0,0 +1,485 @@
+/*
+ * Copyright (c) 2015 Cisco Systems, Inc.
+ *
+ */
+
+#include "coproc.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include <libubox/uloop.h>
+#include <libubox/list.h>
+
+#include "hnetd.h"
+
+/* Shell loop run by helpers, with the script as $0.
+ * A command is a "<id> <argc> <envc>" line followed by one line per
+ * argument (not including the script) and per environment variable.
+ * The "<id> <exit status>" line is written to fd 3 on completion. */
+static const char coproc_loop[] =
+	"set -f\n"
+	"while read -r _cp_id _cp_argc _cp_envc; do\n"
+	"	set --\n"
+	"	while [ $# -lt $_cp_argc ]; do IFS= read -r _cp_a; set -- \"$@\" \"$_cp_a\"; done\n"
+	"	_cp_env=\n"
+	"	while [ $_cp_envc -gt 0 ]; do IFS= read -r _cp_a; _cp_env=\"$_cp_env$_cp_a\n\"; _cp_envc=$((_cp_envc - 1)); done\n"
+	"	(\n"
+	"		IFS='\n'\n"
+	"		for _cp_a in $_cp_env; do export \"$_cp_a\"; done\n"
+	"		unset IFS _cp_a _cp_env _cp_id _cp_argc _cp_envc\n"
+	"		set +f\n"
+	"		. \"$0\"\n"
+	"	) </dev/null 3>&-\n"
+	"	echo \"$_cp_id $?\" >&3\n"
+	"done\n";
+
+/* A command sent (or about to be sent) to a helper */
+struct coproc_req {
+	struct list_head le;
+	unsigned int id;
+	int status;
+	struct coproc_cmd *cmd;
+};
+
+/* One helper per script */
+struct coproc {
+	struct list_head le;
+	pid_t pid;               //Helper pid, 0 if the script does not use /bin/sh
+	struct uloop_fd in;      //Exit statuses
+	struct uloop_fd out;     //Commands
+	struct list_head reqs;   //Running and queued commands, in order
+	char *buf;               //Commands not written yet
+	size_t len;
+	size_t size;
+	char line[32];           //Partial status line
+	size_t line_len;
+	char script[];
+};
+
+static bool coproc_on = false;
+static unsigned int coproc_id = 0;
+static LIST_HEAD(coprocs);
+
+static void coproc_flush(struct uloop_timeout *t);
+static struct uloop_timeout coproc_flush_timeout = { .cb = coproc_flush };
+
+/* Whether the script is to be run by a plain /bin/sh. Interpreter arguments
+ * (e.g. -e) would be lost when sourced by the helper, so such scripts are not. */
+static bool coproc_is_sh(const char *script)
+{
+	char buf[32];
+	ssize_t len;
+	int fd;
+
+	if(!strchr(script, '/') || (fd = open(script, O_RDONLY | O_CLOEXEC)) < 0)
+		return false;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(len < 10)
+		return false;
+
+	buf[len] = 0;
+	char *c = buf + 2;
+	while(*c == ' ')
+		c++;
+	if(strncmp(buf, "#!", 2) || strncmp(c, "/bin/sh", 7))
+		return false;
+
+	for(c += 7; *c == ' ' || *c == '\t' || *c == '\r'; c++);
+	return *c == '\n';
+}
+
+/* Runs the callbacks of completed commands */
+static void coproc_complete(struct list_head *done)
+{
+	struct coproc_req *r, *rs;
+	list_for_each_entry_safe(r, rs, done, le) {
+		struct coproc_cmd *cmd = r->cmd;
+		list_del(&r->le);
+		if(cmd) {
+			cmd->req = NULL;
+			cmd->cb(cmd, r->status);
+		}
+		free(r);
+	}
+}
+
+/* Stops a helper, moving its commands to the done list */
+static void coproc_stop(struct coproc *c, struct list_head *done)
+{
+	struct coproc_req *r;
+	list_del(&c->le);
+	if(c->pid) {
+		uloop_fd_delete(&c->in);
+		uloop_fd_delete(&c->out);
+		close(c->in.fd);
+		close(c->out.fd);
+	}
+	list_for_each_entry(r, &c->reqs, le)
+		r->status = -1;
+	list_splice_tail(&c->reqs, done);
+	free(c->buf);
+	free(c);
+}
+
+/* Stops a helper which stopped working */
+static void coproc_fail(struct coproc *c)
+{
+	LIST_HEAD(done);
+	L_ERR("coproc: stopping helper %d for %s", (int) c->pid, c->script);
+	coproc_stop(c, &done);
+	coproc_complete(&done);
+}
+
+/* Writes without getting killed when the helper died */
+static ssize_t coproc_write_fd(int fd, const void *buf, size_t len)
+{
+	struct timespec ts = {0, 0};
+	sigset_t pipe, old;
+	ssize_t ret;
+	int err;
+
+	sigemptyset(&pipe);
+	sigaddset(&pipe, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &pipe, &old);
+	ret = write(fd, buf, len);
+	err = errno;
+	if(ret < 0 && err == EPIPE)
+		sigtimedwait(&pipe, NULL, &ts);
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	errno = err;
+	return ret;
+}
+
+/* Writes queued commands. Returns -1 if the helper was stopped. */
+static int coproc_write(struct coproc *c)
+{
+	ssize_t n;
+	size_t written = 0;
+
+	while(written < c->len) {
+		if((n = coproc_write_fd(c->out.fd, c->buf + written, c->len - written)) >= 0) {
+			written += n;
+		} else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			break;
+		} else if(errno != EINTR) {
+			L_ERR("coproc: could not write to helper for %s: %s",
+					c->script, strerror(errno));
+			coproc_fail(c);
+			return -1;
+		}
+	}
+
+	memmove(c->buf, c->buf + written, c->len - written);
+	c->len -= written;
+	if(c->len && !c->out.registered)
+		uloop_fd_add(&c->out, ULOOP_WRITE);
+	else if(!c->len && c->out.registered)
+		uloop_fd_delete(&c->out);
+	return 0;
+}
+
+static void coproc_out_cb(struct uloop_fd *fd, __unused unsigned int events)
+{
+	coproc_write(container_of(fd, struct coproc, out));
+}
+
+static void coproc_flush(__unused struct uloop_timeout *t)
+{
+	struct coproc *c, *cs;
+	list_for_each_entry_safe(c, cs, &coprocs, le)
+		if(c->len)
+			coproc_write(c);
+}
+
+/* Reads exit statuses */
+static void coproc_read(struct coproc *c)
+{
+	LIST_HEAD(done);
+	char buf[256];
+	ssize_t len;
+
+	while((len = read(c->in.fd, buf, sizeof(buf))) != 0) {
+		if(len < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				goto out;
+			break;
+		}
+
+		for(ssize_t i = 0; i < len; i++) {
+			struct coproc_req *r;
+			unsigned int id;
+			int status;
+
+			if(buf[i] != '\n') {
+				if(c->line_len < sizeof(c->line) - 1)
+					c->line[c->line_len++] = buf[i];
+				continue;
+			}
+
+			c->line[c->line_len] = 0;
+			c->line_len = 0;
+			r = list_empty(&c->reqs) ? NULL : list_first_entry(&c->reqs, struct coproc_req, le);
+			if(sscanf(c->line, "%u %d", &id, &status) != 2 || !r || r->id != id) {
+				L_ERR("coproc: unexpected status '%s' from helper for %s", c->line, c->script);
+				goto fail;
+			}
+
+			L_DEBUG("coproc: %s command %u exited with status %d", c->script, id, status);
+			r->status = status;
+			list_move_tail(&r->le, &done);
+		}
+	}
+
+fail:
+	L_ERR("coproc: stopping helper %d for %s", (int) c->pid, c->script);
+	coproc_stop(c, &done);
+out:
+	coproc_complete(&done);
+}
+
+static void coproc_in_cb(struct uloop_fd *fd, __unused unsigned int events)
+{
+	coproc_read(container_of(fd, struct coproc, in));
+}
+
+static int coproc_start(struct coproc *c)
+{
+	int cmds[2], status[2];
+	pid_t pid;
+
+	if(pipe2(cmds, O_CLOEXEC)) {
+		L_ERR("coproc: pipe failed: %s", strerror(errno));
+		return -1;
+	}
+	if(pipe2(status, O_CLOEXEC)) {
+		L_ERR("coproc: pipe failed: %s", strerror(errno));
+		close(cmds[0]);
+		close(cmds[1]);
+		return -1;
+	}
+
+	if(!(pid = fork())) {
+		int in = fcntl(cmds[0], F_DUPFD, 4), out = fcntl(status[1], F_DUPFD, 4);
+		dup2(in, 0);
+		dup2(out, 3);
+		close(in);
+		close(out);
+		execl("/bin/sh", "sh", "-c", coproc_loop, c->script, NULL);
+		_exit(128);
+	}
+
+	close(cmds[0]);
+	close(status[1]);
+	if(pid < 0) {
+		L_ERR("coproc: fork failed: %s", strerror(errno));
+		close(cmds[1]);
+		close(status[0]);
+		return -1;
+	}
+
+	L_INFO("coproc: started helper %d for %s", (int) pid, c->script);
+	c->pid = pid;
+	c->out.fd = cmds[1];
+	c->out.cb = coproc_out_cb;
+	c->in.fd = status[0];
+	c->in.cb = coproc_in_cb;
+	fcntl(c->out.fd, F_SETFL, fcntl(c->out.fd, F_GETFL) | O_NONBLOCK);
+	fcntl(c->in.fd, F_SETFL, fcntl(c->in.fd, F_GETFL) | O_NONBLOCK);
+	uloop_fd_add(&c->in, ULOOP_READ);
+	return 0;
+}
+
+static struct coproc *coproc_find(const char *script)
+{
+	struct coproc *c;
+	list_for_each_entry(c, &coprocs, le)
+		if(!strcmp(c->script, script))
+			return c;
+	return NULL;
+}
+
+/* Returns the helper for the script, starting it if needed. */
+static struct coproc *coproc_get(const char *script)
+{
+	struct coproc *c;
+	if((c = coproc_find(script)))
+		return c;
+
+	if(!(c = calloc(1, sizeof(*c) + strlen(script) + 1))) {
+		L_ERR("coproc: malloc failed");
+		return NULL;
+	}
+
+	strcpy(c->script, script);
+	INIT_LIST_HEAD(&c->reqs);
+	c->in.fd = c->out.fd = -1;
+	if(coproc_is_sh(script) && coproc_start(c)) {
+		free(c);
+		return NULL;
+	}
+
+	list_add(&c->le, &coprocs);
+	return c;
+}
+
+static int coproc_append(struct coproc *c, const char *str, char sep)
+{
+	size_t len = strlen(str);
+	if(c->len + len + 1 > c->size) {
+		size_t size = c->size ? c->size : 256;
+		char *buf;
+		while(size < c->len + len + 1)
+			size *= 2;
+		if(!(buf = realloc(c->buf, size)))
+			return -1;
+		c->buf = buf;
+		c->size = size;
+	}
+	memcpy(c->buf + c->len, str, len);
+	c->buf[c->len + len] = sep;
+	c->len += len + 1;
+	return 0;
+}
+
+static struct coproc_req *coproc_queue(struct coproc_cmd *cmd, char **args, char **env)
+{
+	size_t argc, envc = 0, len;
+	struct coproc_req *r;
+	struct coproc *c;
+	char hdr[64];
+
+	if(!coproc_on || !args[0] || !(c = coproc_get(args[0])) || !c->pid)
+		return NULL;
+
+	for(argc = 1; args[argc]; argc++)
+		if(strchr(args[argc], '\n'))
+			return NULL;
+	for(; env && env[envc]; envc++)
+		if(strchr(env[envc], '\n'))
+			return NULL;
+
+	if(!(r = malloc(sizeof(*r)))) {
+		L_ERR("coproc: malloc failed");
+		return NULL;
+	}
+
+	len = c->len;
+	r->id = ++coproc_id;
+	snprintf(hdr, sizeof(hdr), "%u %zu %zu", r->id, argc - 1, envc);
+	if(coproc_append(c, hdr, '\n')) {
+		free(r);
+		return NULL;
+	}
+	for(size_t i = 1; i < argc; i++)
+		if(coproc_append(c, args[i], '\n'))
+			goto err;
+	for(size_t i = 0; i < envc; i++)
+		if(coproc_append(c, env[i], '\n'))
+			goto err;
+
+	L_DEBUG("coproc_run %s", args[0]);
+	for(size_t i = 1; i < argc; i++)
+		L_DEBUG(" %s", args[i]);
+
+	r->status = -1;
+	r->cmd = cmd;
+	if(cmd)
+		cmd->req = r;
+	list_add_tail(&r->le, &c->reqs);
+	uloop_timeout_set(&coproc_flush_timeout, 0);
+	return r;
+
+err:
+	L_ERR("coproc: malloc failed");
+	c->len = len;
+	free(r);
+	return NULL;
+}
+
+int coproc_run(struct coproc_cmd *cmd, char **args, char **env)
+{
+	return coproc_queue(cmd, args, env) ? 0 : -1;
+}
+
+struct coproc_sync {
+	struct coproc_cmd cmd;
+	bool done;
+	int status;
+};
+
+static void coproc_sync_cb(struct coproc_cmd *cmd, int status)
+{
+	struct coproc_sync *s = container_of(cmd, struct coproc_sync, cmd);
+	s->done = true;
+	s->status = status;
+}
+
+int coproc_call(char **args, int *status)
+{
+	struct coproc_sync s = { .cmd = { .cb = coproc_sync_cb }, .done = false, .status = -1 };
+	struct coproc *c;
+
+	if(!coproc_queue(&s.cmd, args, NULL))
+		return -1;
+
+	/* Helpers are stopped after failing their commands, so the helper
+	 * of args[0] exists as long as s is not completed */
+	while(!s.done && (c = coproc_find(args[0]))) {
+		if(c->len && coproc_write(c))
+			continue;
+
+		struct pollfd fds[2] = {{ .fd = c->in.fd, .events = POLLIN },
+				{ .fd = c->out.fd, .events = c->len ? POLLOUT : 0 }};
+		if(poll(fds, 2, -1) < 0 && errno != EINTR) {
+			L_ERR("coproc: poll failed: %s", strerror(errno));
+			coproc_cancel(&s.cmd);
+			break;
+		}
+		if(fds[0].revents)
+			coproc_read(c);
+	}
+
+	*status = s.status;
+	return 0;
+}
+
+void coproc_cancel(struct coproc_cmd *cmd)
+{
+	if(cmd->req) {
+		cmd->req->cmd = NULL;
+		cmd->req = NULL;
+	}
+}
+
+void coproc_init(void)
+{
+	coproc_on = true;
+}
+
+bool coproc_enabled(void)
+{
+	return coproc_on;
+}
+
+void coproc_term(void)
+{
+	LIST_HEAD(done);
+	coproc_flush(NULL);
+	while(!list_empty(&coprocs))
+		coproc_stop(list_first_entry(&coprocs, struct coproc, le), &done);
+	uloop_timeout_cancel(&coproc_flush_timeout);
+	coproc_on = false;
+	coproc_complete(&done);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2015 Cisco Systems, Inc.
+ *
+ * This file provides persistent script co-processes.
+ * Instead of fork+exec'ing a shell for every call of a /bin/sh script,
+ * one long-lived /bin/sh helper is started per script. Commands are
+ * written to it in batches over a pipe, and the helper sources the
+ * script in a subshell (so that $0, exit and the environment behave as
+ * if the script was executed) and reports the exit status of each
+ * command on a second pipe.
+ *
+ * Co-processes are disabled until coproc_init is called. Commands
+ * which can not be handled (co-processes disabled, script not using
+ * /bin/sh, argument containing a newline, ...) are refused, and the
+ * caller is expected to fork+exec the command itself.
+ */
+
+#ifndef COPROC_H_
+#define COPROC_H_
+
+#include <stdbool.h>
+
+struct coproc_req;
+
+/* A command running in a co-process */
+struct coproc_cmd {
+	/* Called with the exit status of the command, or -1 if the
+	 * co-process died before completing it. */
+	void (*cb)(struct coproc_cmd *, int status);
+	struct coproc_req *req; //Non-NULL while the command is running
+};
+
+/* Enables co-processes. */
+void coproc_init(void);
+
+/* Returns whether co-processes are enabled. */
+bool coproc_enabled(void);
+
+/* Queues a command in the co-process of args[0], with additional
+ * environment variables (NULL terminated array of NAME=value strings,
+ * or NULL). Commands are sent at the end of the current loop iteration
+ * and executed one after the other.
+ * When cmd is not NULL, its callback is called when the command
+ * terminates.
+ * Returns 0 on success. -1 if the command must be run otherwise. */
+int coproc_run(struct coproc_cmd *cmd, char **args, char **env);
+
+/* Runs a command in the co-process of args[0] and waits for its
+ * completion (callbacks of previously queued commands may be called).
+ * Returns 0 and sets the exit status on success.
+ * -1 if the command must be run otherwise. */
+int coproc_call(char **args, int *status);
+
+/* Forgets about a running command (its callback will not be called). */
+void coproc_cancel(struct coproc_cmd *cmd);
+
+/* Stops all co-processes and disables them. */
+void coproc_term(void);
+
+#endif /* COPROC_H_ */
@@ -36,6 +36,90 @@ void dncp_schedule(dncp o)
   o->immediate_scheduled = true;
 }
 
+static void _peers_node_changed(dncp o, dncp_node n);
+
+/* Determine the bidirectional neighbors of n based on current node
+ * data. The result is a newly allocated array (or NULL if none). */
+static dncp_node *_node_collect_neighbors(dncp_node n, int *num)
+{
+  dncp o = n->dncp;
+  dncp_node *neighbors = NULL, n2;
+  struct tlv_attr *a;
+  dncp_t_peer ne;
+  int i, c = 0;
+
+  *num = 0;
+  dncp_node_for_each_tlv_with_t_v(n, a, DNCP_T_PEER, false)
+    c++;
+  if (!c)
+    return NULL;
+  if (!(neighbors = malloc(c * sizeof(*neighbors))))
+    {
+      L_ERR("unable to allocate neighbors of %s", DNCP_NODE_REPR(n));
+      return NULL;
+    }
+  dncp_node_for_each_tlv_with_t_v(n, a, DNCP_T_PEER, false)
+    if ((ne = dncp_tlv_peer(o, a))
+        && (n2 = dncp_node_find_neigh_bidir(n, ne)) && n2 != n)
+      {
+        /* Multiple links to same node are just one edge. */
+        for (i = 0 ; i < *num ; i++)
+          if (neighbors[i] == n2)
+            break;
+        if (i == *num)
+          neighbors[(*num)++] = n2;
+      }
+  return neighbors;
+}
+
+/* Refresh neighbors of n. If they changed, the old neighbor array
+ * (to be freed by the caller) and its size are returned in old and
+ * old_num. */
+static bool _node_refresh_neighbors(dncp_node n,
+                                    dncp_node **old, int *old_num)
+{
+  int i, num;
+  dncp_node *neighbors = _node_collect_neighbors(n, &num);
+
+  if (num == n->num_neighbors)
+    {
+      for (i = 0 ; i < num ; i++)
+        if (!dncp_node_has_neighbor(n, neighbors[i]))
+          break;
+      if (i == num)
+        {
+          free(neighbors);
+          return false;
+        }
+    }
+  *old = n->neighbors;
+  *old_num = n->num_neighbors;
+  n->neighbors = neighbors;
+  n->num_neighbors = num;
+  if (list_empty(&n->in_graph_dirty))
+    list_add_tail(&n->in_graph_dirty, &n->dncp->graph_dirty_nodes);
+  return true;
+}
+
+/* The node data of n changed; update the neighbor graph. As the
+ * neighbor relation is symmetric, only the nodes which were or are
+ * neighbors of n may need to be updated in addition to n itself. */
+static void _node_update_graph(dncp_node n)
+{
+  dncp_node *old, *old2;
+  int i, old_num, old2_num;
+
+  if (!_node_refresh_neighbors(n, &old, &old_num))
+    return;
+  for (i = 0 ; i < old_num + n->num_neighbors ; i++)
+    {
+      dncp_node n2 = i < old_num ? old[i] : n->neighbors[i - old_num];
+      if (_node_refresh_neighbors(n2, &old2, &old2_num))
+        free(old2);
+    }
+  free(old);
+}
+
 void dncp_node_set(dncp_node n, uint32_t update_number,
                    hnetd_time_t t, struct tlv_attr *a)
 {
@@ -51,7 +135,7 @@ void dncp_node_set(dncp_node n, uint32_t update_number,
     {
       L_DEBUG(" .. spurious (no change, we ignore time delta)");
       if (a && a != n->tlv_container)
-        free(a);
+        dncp_node_data_free(n->dncp, a);
       return;
     }
 
@@ -63,7 +147,7 @@ void dncp_node_set(dncp_node n, uint32_t update_number,
         {
           if (n->tlv_container != a)
             {
-              free(a);
+              dncp_node_data_free(n->dncp, a);
               a = n->tlv_container;
             }
           a_valid = n->tlv_container_valid;
@@ -82,26 +166,31 @@ void dncp_node_set(dncp_node n, uint32_t update_number,
     {
       n->origination_time = t;
       n->expiration_time = t + ((1LL << 32) - (1LL << 15));
+      if (n->reachable)
+        n->dncp->next_expiration = TMIN(n->dncp->next_expiration,
+                                        n->expiration_time);
     }
 
   /* If the pointer changed, handle it */
   if (n->tlv_container != a)
     {
-      if (n->last_reachable_prune == n->dncp->last_prune)
+      if (n->reachable)
         dncp_notify_subscribers_tlvs_changed(n, n->tlv_container_valid,
                                              a_valid);
       if (n->tlv_container)
-        free(n->tlv_container);
+        dncp_node_data_free(n->dncp, n->tlv_container);
 
       n->tlv_container = a;
       n->tlv_container_valid = a_valid;
       n->tlv_index_dirty = true;
       n->node_data_hash_dirty = true;
       n->dncp->graph_dirty = true;
+      _node_update_graph(n);
+      _peers_node_changed(n->dncp, n);
     }
 
   /* _anything_ we do here dirties network hash. */
-  n->dncp->network_hash_dirty = true;
+  dncp_node_network_hash_dirty(n);
 
   dncp_schedule(n->dncp);
 }
@@ -114,15 +203,41 @@ static void update_node(__unused struct vlist_tree *t,
   dncp o = container_of(t, dncp_s, nodes);
   dncp_node n_old = container_of(node_old, dncp_node_s, in_nodes);
   __unused dncp_node n_new = container_of(node_new, dncp_node_s, in_nodes);
+  dncp_node *old;
+  int i, old_num;
 
   if (n_old == n_new)
     return;
   if (n_old)
     {
       dncp_node_set(n_old, 0, 0, NULL);
+      list_del(&n_old->in_network_hash_dirty);
+      list_del(&n_old->in_graph_dirty);
+      list_del(&n_old->in_unreachable);
+      list_del(&n_old->in_prune);
+      /* Reachable nodes are removed only if our own node changes (or
+       * everything is torn down); the spanning tree is rebuilt then. */
+      if (n_old->reachable)
+        {
+          dncp_node c, c2;
+
+          list_del(&n_old->in_parent);
+          list_for_each_entry_safe(c, c2, &n_old->children, in_parent)
+            {
+              list_del_init(&c->in_parent);
+              c->parent = NULL;
+            }
+          o->prune_full = true;
+        }
+      /* The node can no longer be found by its neighbors either. */
+      for (i = 0 ; i < n_old->num_neighbors ; i++)
+        if (_node_refresh_neighbors(n_old->neighbors[i], &old, &old_num))
+          free(old);
+      free(n_old->neighbors);
       if (n_old->tlv_index)
         free(n_old->tlv_index);
       free(n_old);
+      o->network_hash_records_dirty = true;
     }
   if (n_new)
     {
@@ -130,6 +245,7 @@ static void update_node(__unused struct vlist_tree *t,
       n_new->tlv_index_dirty = true;
       /* By default unreachable */
       n_new->last_reachable_prune = o->last_prune - 1;
+      list_add_tail(&n_new->in_unreachable, &o->unreachable_nodes);
     }
   o->network_hash_dirty = true;
   o->graph_dirty = true;
@@ -145,6 +261,206 @@ compare_tlvs(const void *a, const void *b, void *ptr __unused)
   return tlv_attr_cmp(&t1->tlv, &t2->tlv);
 }
 
+static uint32_t _peer_hash(const void *buf, int len)
+{
+  const unsigned char *p = buf;
+  uint32_t h = 2166136261u;
+  int i;
+
+  /* FNV-1a */
+  for (i = 0 ; i < len ; i++)
+    h = (h ^ p[i]) * 16777619u;
+  return h & (DNCP_PEER_HASH_SIZE - 1);
+}
+
+static uint32_t _peer_sa6_hash(const struct sockaddr_in6 *sa6)
+{
+  return _peer_hash(&sa6->sin6_addr, sizeof(sa6->sin6_addr))
+    ^ (sa6->sin6_port & (DNCP_PEER_HASH_SIZE - 1));
+}
+
+static void _peer_link(dncp o, dncp_tlv t)
+{
+  dncp_peer p = dncp_tlv_get_extra(t);
+
+  p->tlv = t;
+  list_add_tail(&p->in_peers, &o->peers);
+  list_add(&p->in_peer_hash,
+           &o->peer_hash[_peer_hash(tlv_data(&t->tlv), tlv_len(&t->tlv))]);
+  INIT_LIST_HEAD(&p->in_peer_sa6_hash);
+  p->keepalive_interval = -1;
+  p->timer.index = -1;
+  p->timer.cb = dncp_peer_timeout;
+  dncp_timer_set(o, &p->timer, dncp_time(o));
+}
+
+static void _peer_unlink(dncp o, dncp_peer p)
+{
+  list_del(&p->in_peers);
+  list_del(&p->in_peer_hash);
+  list_del(&p->in_peer_sa6_hash);
+  dncp_timer_set(o, &p->timer, 0);
+}
+
+/* The node data of n changed; forget the keepalive intervals cached
+ * for the peers it is and recheck them. */
+static void _peers_node_changed(dncp o, dncp_node n)
+{
+  bool found = false;
+  dncp_peer p;
+
+  dncp_for_each_peer(o, p)
+    if (!memcmp(tlv_data(&p->tlv->tlv), &n->node_id, DNCP_NI_LEN(o)))
+      {
+        p->keepalive_interval = -1;
+        dncp_timer_advance(o, &p->timer, dncp_time(o));
+        found = true;
+      }
+  if (found)
+    dncp_schedule(o);
+}
+
+dncp_peer dncp_find_peer(dncp o, const void *key)
+{
+  int len = DNCP_NI_LEN(o) + sizeof(dncp_t_peer_s);
+  dncp_peer p;
+
+  list_for_each_entry(p, &o->peer_hash[_peer_hash(key, len)], in_peer_hash)
+    if (memcmp(tlv_data(&p->tlv->tlv), key, len) == 0)
+      return p;
+  return NULL;
+}
+
+dncp_peer dncp_find_peer_by_sa6(dncp o, const struct sockaddr_in6 *sa6)
+{
+  dncp_peer p;
+
+  list_for_each_entry(p, &o->peer_sa6_hash[_peer_sa6_hash(sa6)],
+                      in_peer_sa6_hash)
+    if (memcmp(&p->last_sa6, sa6, sizeof(*sa6)) == 0)
+      return p;
+  return NULL;
+}
+
+void dncp_peer_set_last_sa6(dncp o, dncp_peer p,
+                            const struct sockaddr_in6 *sa6)
+{
+  if (!list_empty(&p->in_peer_sa6_hash)
+      && memcmp(&p->last_sa6, sa6, sizeof(*sa6)) == 0)
+    return;
+  list_del(&p->in_peer_sa6_hash);
+  p->last_sa6 = *sa6;
+  list_add(&p->in_peer_sa6_hash, &o->peer_sa6_hash[_peer_sa6_hash(sa6)]);
+}
+
+/* The own TLV container mirrors o->tlvs in the same (sorted) order, and
+ * is spliced on every local TLV change so that publishing does not have
+ * to walk the whole tree. NULL means it has to be rebuilt. */
+
+static bool _own_tlvs_reserve(dncp o, int len)
+{
+  void *p;
+  int nsize;
+
+  if (o->own_tlvs && len <= o->own_tlvs_size)
+    return true;
+  nsize = o->own_tlvs_size ? o->own_tlvs_size : 256;
+  while (nsize < len)
+    nsize *= 2;
+  if (!(p = realloc(o->own_tlvs, nsize)))
+    {
+      L_ERR("_own_tlvs_reserve: realloc failed");
+      free(o->own_tlvs);
+      o->own_tlvs = NULL;
+      o->own_tlvs_size = 0;
+      return false;
+    }
+  o->own_tlvs = p;
+  o->own_tlvs_size = nsize;
+  return true;
+}
+
+static bool _own_tlvs_rebuild(dncp o)
+{
+  int len = TLV_SIZE;
+  dncp_tlv t;
+  void *p;
+
+  vlist_for_each_element(&o->tlvs, t, in_tlvs)
+    len += tlv_pad_len(&t->tlv);
+  if (!_own_tlvs_reserve(o, len))
+    return false;
+  tlv_init(o->own_tlvs, 0, len);
+  p = tlv_data(o->own_tlvs);
+  vlist_for_each_element(&o->tlvs, t, in_tlvs)
+    {
+      memcpy(p, &t->tlv, tlv_pad_len(&t->tlv));
+      tlv_fill_pad(p);
+      p += tlv_pad_len(&t->tlv);
+    }
+  return true;
+}
+
+/* Offset of the first TLV in the container that is >= a. The container
+ * is produced by us, so it is walked without validity checks, and the
+ * (big endian) header compares as an integer the same way as in
+ * tlv_attr_cmp. */
+static int _own_tlvs_find(dncp o, struct tlv_attr *a, int *r)
+{
+  void *p = tlv_data(o->own_tlvs);
+  void *end = (void *)o->own_tlvs + tlv_pad_len(o->own_tlvs);
+  uint32_t h = be32_to_cpu(a->id_len);
+
+  *r = 1;
+  for ( ; p < end ; p += tlv_pad_len(p))
+    {
+      uint32_t ph = be32_to_cpu(((struct tlv_attr *)p)->id_len);
+
+      if (ph < h)
+        continue;
+      if (ph > h || (*r = tlv_attr_cmp(p, a)) >= 0)
+        break;
+    }
+  return p - (void *)o->own_tlvs;
+}
+
+static void _own_tlvs_splice(dncp o, struct tlv_attr *a, bool add)
+{
+  int used, len = tlv_pad_len(a);
+  int ofs, r;
+  void *p;
+
+  if (!o->own_tlvs)
+    return;
+  used = tlv_pad_len(o->own_tlvs);
+  ofs = _own_tlvs_find(o, a, &r);
+  if (add)
+    {
+      if (!_own_tlvs_reserve(o, used + len))
+        return;
+      p = (void *)o->own_tlvs + ofs;
+      memmove(p + len, p, used - ofs);
+      memcpy(p, a, len);
+      tlv_fill_pad(p);
+      used += len;
+    }
+  else
+    {
+      if (r)
+        {
+          L_ERR("_own_tlvs_splice: %s missing", TLV_REPR(a));
+          free(o->own_tlvs);
+          o->own_tlvs = NULL;
+          o->own_tlvs_size = 0;
+          return;
+        }
+      p = (void *)o->own_tlvs + ofs;
+      memmove(p, p + len, used - ofs - len);
+      used -= len;
+    }
+  tlv_init(o->own_tlvs, 0, used);
+}
+
 static void update_tlv(struct vlist_tree *t,
                        struct vlist_node *node_new,
                        struct vlist_node *node_old)
@@ -153,15 +469,27 @@ static void update_tlv(struct vlist_tree *t,
   dncp_tlv t_old = container_of(node_old, dncp_tlv_s, in_tlvs);
   __unused dncp_tlv t_new = container_of(node_new, dncp_tlv_s, in_tlvs);
 
+  /* Replacing with equal TLV does not change the published content. */
+  if (!t_old || !t_new)
+    {
+      _own_tlvs_splice(o, t_old ? &t_old->tlv : &t_new->tlv, !!t_new);
+      o->tlvs_dirty = true;
+    }
+
   if (t_old)
     {
       dncp_notify_subscribers_local_tlv_changed(o, &t_old->tlv, false);
+      if (dncp_tlv_peer(o, &t_old->tlv))
+        _peer_unlink(o, dncp_tlv_get_extra(t_old));
       free(t_old);
     }
   if (t_new)
-    dncp_notify_subscribers_local_tlv_changed(o, &t_new->tlv, true);
+    {
+      if (dncp_tlv_peer(o, &t_new->tlv))
+        _peer_link(o, t_new);
+      dncp_notify_subscribers_local_tlv_changed(o, &t_new->tlv, true);
+    }
 
-  o->tlvs_dirty = true;
   dncp_schedule(o);
 }
 
@@ -183,11 +511,16 @@ static void update_ep(struct vlist_tree *t,
 
   if (t_old)
     {
+      if (t_old->send_reply_at)
+        dncp_send_buf_free(o, &t_old->reply.buf);
+      dncp_timer_set(o, &t_old->timer, 0);
       free(t_old);
     }
   else
     {
       t_new->published_keepalive_interval = DNCP_KEEPALIVE_INTERVAL(o);
+      t_new->timer.index = -1;
+      t_new->timer.cb = dncp_ep_i_timeout;
     }
   dncp_schedule(o);
 }
@@ -213,6 +546,12 @@ dncp_find_node_by_node_id(dncp o, void *ni, bool create)
   memcpy(&n->node_id, ni, DNCP_NI_LEN(o));
   n->dncp = o;
   n->tlv_index_dirty = true;
+  n->network_hash_index = -1;
+  INIT_LIST_HEAD(&n->in_network_hash_dirty);
+  INIT_LIST_HEAD(&n->in_graph_dirty);
+  INIT_LIST_HEAD(&n->children);
+  INIT_LIST_HEAD(&n->in_parent);
+  INIT_LIST_HEAD(&n->in_prune);
   vlist_add(&o->nodes, &n->in_nodes, n);
   return n;
 }
@@ -229,6 +568,17 @@ bool dncp_init(dncp o, dncp_ext ext, const void *node_id, int len)
   o->ext = ext;
   for (i = 0 ; i < NUM_DNCP_CALLBACKS; i++)
     INIT_LIST_HEAD(&o->subscribers[i]);
+  INIT_LIST_HEAD(&o->network_hash_dirty_nodes);
+  INIT_LIST_HEAD(&o->graph_dirty_nodes);
+  INIT_LIST_HEAD(&o->unreachable_nodes);
+  for (i = 0 ; i < DNCP_NODE_DATA_CLASSES ; i++)
+    INIT_LIST_HEAD(&o->node_data_pool[i]);
+  INIT_LIST_HEAD(&o->peers);
+  for (i = 0 ; i < DNCP_PEER_HASH_SIZE ; i++)
+    {
+      INIT_LIST_HEAD(&o->peer_hash[i]);
+      INIT_LIST_HEAD(&o->peer_sa6_hash[i]);
+    }
   vlist_init(&o->nodes, compare_nodes, update_node);
   o->nodes.keep_old = true;
   vlist_init(&o->tlvs, compare_tlvs, update_tlv);
@@ -260,6 +610,10 @@ bool dncp_set_own_node_id(dncp o, void *nibuf)
   o->own_node = n;
   o->tlvs_dirty = true; /* by default, they are, even if no neighbors yet. */
   n->last_reachable_prune = o->last_prune; /* we're always reachable */
+  n->reachable = true;
+  list_del_init(&n->in_unreachable);
+  o->prune_full = true;
+  o->network_hash_records_dirty = true;
   dncp_schedule(o);
   return true;
 }
@@ -292,6 +646,8 @@ dncp dncp_create(dncp_ext ext)
 
 void dncp_uninit(dncp o)
 {
+  int i;
+
   /* TLVs should be freed first; they're local phenomenom, but may be
    * reflected on eps/nodes. */
   vlist_flush_all(&o->tlvs);
@@ -308,9 +664,23 @@ void dncp_uninit(dncp o)
   /* Finally, we can kill own node too. */
   vlist_flush_all(&o->nodes);
 
-  /* Get rid of TLV index. */
-  if (o->num_tlv_indexes)
-    free(o->tlv_type_to_index);
+  free(o->network_hash_records);
+  free(o->recv_batch_buf);
+  free(o->timers);
+  free(o->tlv_changes);
+  free(o->own_tlvs);
+  free(o->send_buf);
+  free(o->net_state);
+  free(o->net_state_origination);
+
+  /* Nodes are gone, so the node data pool can be emptied. */
+  for (i = 0 ; i < DNCP_NODE_DATA_CLASSES ; i++)
+    {
+      struct list_head *lh, *lh2;
+
+      list_for_each_safe(lh, lh2, &o->node_data_pool[i])
+        free(lh);
+    }
 }
 
 void dncp_destroy(dncp o)
@@ -327,7 +697,7 @@ dncp_node dncp_get_first_node(dncp o)
   if (avl_is_empty(&o->nodes.avl))
     return NULL;
   n = avl_first_element(&o->nodes.avl, n, in_nodes.avl);
-  if (n->last_reachable_prune == o->last_prune)
+  if (n->reachable)
     return n;
   return dncp_node_get_next(n);
 }
@@ -439,7 +809,7 @@ dncp_node dncp_node_get_next(dncp_node n)
   while (1)
     {
       n = avl_next_element(n, in_nodes.avl);
-      if (n->last_reachable_prune == o->last_prune)
+      if (n->reachable)
         return n;
       if (n == last)
         return NULL;
@@ -471,39 +841,30 @@ dncp_tlv dncp_get_next_tlv(dncp o, dncp_tlv n)
 
 static struct tlv_attr *_produce_new_tlvs(dncp_node n)
 {
-  struct tlv_buf tb;
   dncp o = n->dncp;
-  dncp_tlv t;
+  struct tlv_attr *a;
+  int len;
 
   if (!o->tlvs_dirty)
     return NULL;
 
-  /* Dump the contents of dncp->tlvs to single tlv_buf. */
-  /* Based on whether or not that would cause change in things, 'do stuff'. */
-  memset(&tb, 0, sizeof(tb));
-  tlv_buf_init(&tb, 0); /* not passed anywhere */
-  vlist_for_each_element(&o->tlvs, t, in_tlvs)
-    {
-      struct tlv_attr *a = tlv_put_raw(&tb, &t->tlv, tlv_pad_len(&t->tlv));
-      if (!a)
-        {
-          L_ERR("dncp_self_flush: tlv_put_raw failed?!?");
-          tlv_buf_free(&tb);
-          return NULL;
-        }
-      tlv_fill_pad(a);
-    }
-  tlv_fill_pad(tb.head);
+  if (!o->own_tlvs && !_own_tlvs_rebuild(o))
+    return NULL;
 
-  /* Ok, all puts _did_ succeed. */
+  /* Based on whether or not that would cause change in things, 'do stuff'. */
   o->tlvs_dirty = false;
+  if (n->tlv_container && tlv_attr_equal(o->own_tlvs, n->tlv_container))
+    return NULL;
 
-  if (n->tlv_container && tlv_attr_equal(tb.head, n->tlv_container))
+  len = tlv_pad_len(o->own_tlvs);
+  if (!(a = dncp_node_data_alloc(o, len)))
     {
-      tlv_buf_free(&tb);
+      L_ERR("dncp_self_flush: dncp_node_data_alloc failed?!?");
+      o->tlvs_dirty = true;
       return NULL;
     }
-  return tb.head;
+  memcpy(a, o->own_tlvs, len);
+  return a;
 }
 
 void dncp_self_flush(dncp_node n)
@@ -525,7 +886,7 @@ void dncp_self_flush(dncp_node n)
   if (a2)
     {
       if (a)
-        free(a);
+        dncp_node_data_free(o, a);
       a = a2;
     }
   dncp_node_set(n, n->update_number + 1, dncp_time(o),
@@ -538,6 +899,58 @@ struct tlv_attr *dncp_node_get_tlvs(dncp_node n)
 }
 
 
+typedef struct {
+  /* dncp->node_data_pool entry (when free) */
+  struct list_head lh;
+  int size_class; /* -1 = not pooled */
+} dncp_node_data_hdr_s, *dncp_node_data_hdr;
+
+static int _node_data_size_class(int len)
+{
+  int i;
+
+  for (i = 0 ; i < DNCP_NODE_DATA_CLASSES ; i++)
+    if (len <= 1 << (DNCP_NODE_DATA_MIN_SHIFT + i))
+      return i;
+  return -1;
+}
+
+struct tlv_attr *dncp_node_data_alloc(dncp o, int len)
+{
+  int c = _node_data_size_class(len);
+  dncp_node_data_hdr h;
+
+  if (c >= 0 && !list_empty(&o->node_data_pool[c]))
+    {
+      h = list_first_entry(&o->node_data_pool[c], dncp_node_data_hdr_s, lh);
+      list_del(&h->lh);
+      o->node_data_pool_len[c]--;
+    }
+  else
+    {
+      int size = c >= 0 ? 1 << (DNCP_NODE_DATA_MIN_SHIFT + c) : len;
+
+      if (!(h = malloc(sizeof(*h) + size)))
+        return NULL;
+      h->size_class = c;
+    }
+  return (struct tlv_attr *)(h + 1);
+}
+
+void dncp_node_data_free(dncp o, struct tlv_attr *a)
+{
+  dncp_node_data_hdr h = (dncp_node_data_hdr)a - 1;
+  int c = h->size_class;
+
+  if (c < 0 || o->node_data_pool_len[c] >= DNCP_NODE_DATA_POOL_MAX)
+    {
+      free(h);
+      return;
+    }
+  list_add(&h->lh, &o->node_data_pool[c]);
+  o->node_data_pool_len[c]++;
+}
+
 void dncp_calculate_node_data_hash(dncp_node n)
 {
   int l;
@@ -553,89 +966,187 @@ void dncp_calculate_node_data_hash(dncp_node n)
           n == n->dncp->own_node ? " [self]" : "");
 }
 
-void dncp_calculate_network_hash(dncp o)
+void dncp_hash_multi(dncp o, const void **bufs, const size_t *lens,
+                     void **dsts, int n)
 {
-  dncp_node n;
+  int i;
 
-  if (!o->network_hash_dirty)
-    return;
+  if (o->ext->cb.hash_multi)
+    {
+      o->ext->cb.hash_multi(bufs, lens, dsts, n);
+      return;
+    }
+  for (i = 0 ; i < n ; i++)
+    o->ext->cb.hash(bufs[i], lens[i], dsts[i]);
+}
 
-  /* Store original network hash for future study. */
-  dncp_hash_s old_hash = o->network_hash;
+typedef struct {
+  const void *bufs[DNCP_HASH_BATCH];
+  size_t lens[DNCP_HASH_BATCH];
+  void *dsts[DNCP_HASH_BATCH];
+  dncp_node nodes[DNCP_HASH_BATCH];
+  int count;
+} dncp_node_hash_batch_s, *dncp_node_hash_batch;
 
-  int cnt = 0;
-  dncp_for_each_node(o, n)
-    cnt++;
-  int onelen = 4 + DNCP_HASH_LEN(o);
-  void *buf = malloc(cnt * onelen);
-  if (!buf)
+static void _node_hash_batch_flush(dncp o, dncp_node_hash_batch b)
+{
+  dncp_node n;
+  int i;
+
+  if (!b->count)
     return;
-  void *dst = buf;
-  dncp_for_each_node(o, n)
+  dncp_hash_multi(o, b->bufs, b->lens, b->dsts, b->count);
+  for (i = 0 ; i < b->count ; i++)
     {
-      dncp_calculate_node_data_hash(n);
-      *((uint32_t *)dst) = cpu_to_be32(n->update_number);
-      memcpy(dst + 4, &n->node_data_hash, DNCP_HASH_LEN(o));
-      L_DEBUG(".. %s/%d=%s",
-              DNCP_NODE_REPR(n), n->update_number,
-              DNCP_HASH_REPR(n->dncp, &n->node_data_hash));
-      dst += onelen;
+      n = b->nodes[i];
+      n->node_data_hash_dirty = false;
+      L_DEBUG("dncp_calculate_node_data_hash %s=%s%s",
+              DNCP_NODE_REPR(n),
+              DNCP_HASH_REPR(o, &n->node_data_hash),
+              n == o->own_node ? " [self]" : "");
     }
-  o->ext->cb.hash(buf, cnt * onelen, &o->network_hash);
-  free(buf);
-  L_DEBUG("dncp_calculate_network_hash =%s",
-          DNCP_HASH_REPR(o, &o->network_hash));
+  b->count = 0;
+}
 
-  if (memcmp(&old_hash, &o->network_hash, DNCP_HASH_LEN(o)))
-    dncp_trickle_reset(o);
+static void _node_hash_batch_push(dncp o, dncp_node_hash_batch b,
+                                  dncp_node n)
+{
+  int i = b->count;
 
-  o->network_hash_dirty = false;
+  if (!n->node_data_hash_dirty)
+    return;
+  b->bufs[i] = n->tlv_container ? tlv_data(n->tlv_container) : NULL;
+  b->lens[i] = n->tlv_container ? tlv_len(n->tlv_container) : 0;
+  b->dsts[i] = &n->node_data_hash;
+  b->nodes[i] = n;
+  if (++b->count == DNCP_HASH_BATCH)
+    _node_hash_batch_flush(o, b);
 }
 
-bool dncp_add_tlv_index(dncp o, uint16_t type)
+/* Calculate the node data hashes of the nodes about to be written to
+ * the network hash records in batches, instead of one by one. */
+static void _calculate_node_data_hashes(dncp o)
 {
-  if (type < o->tlv_type_to_index_length)
+  dncp_node_hash_batch_s b = { .count = 0 };
+  dncp_node n;
+
+  if (o->network_hash_records_dirty)
     {
-      if (o->tlv_type_to_index[type])
-        {
-          L_DEBUG("dncp_add_tlv_index called for existing index (type %d)",
-                  (int)type);
-          return true;
-        }
+      dncp_for_each_node(o, n)
+        _node_hash_batch_push(o, &b, n);
     }
   else
     {
-      int old_len = o->tlv_type_to_index_length;
-      int old_size = old_len * sizeof(o->tlv_type_to_index[0]);
-      int new_len = type + 1;
-      int new_size = new_len * sizeof(o->tlv_type_to_index[0]);
-      int *ni = realloc(o->tlv_type_to_index, new_size);
-      if (!ni)
-        return false;
-      memset((void *)ni + old_size, 0, new_size - old_size);
-      o->tlv_type_to_index = ni;
-      o->tlv_type_to_index_length = new_len;
-      L_DEBUG("dncp_add_tlv_index grew tlv_type_to_index to %d", new_len);
+      list_for_each_entry(n, &o->network_hash_dirty_nodes,
+                          in_network_hash_dirty)
+        if (n->network_hash_index >= 0)
+          _node_hash_batch_push(o, &b, n);
     }
+  _node_hash_batch_flush(o, &b);
+}
 
-  L_DEBUG("dncp_add_tlv_index: type #%d = index #%d", type, o->num_tlv_indexes);
-  o->tlv_type_to_index[type] = ++o->num_tlv_indexes;
+void dncp_node_network_hash_dirty(dncp_node n)
+{
+  dncp o = n->dncp;
+
+  o->network_hash_dirty = true;
+  if (list_empty(&n->in_network_hash_dirty))
+    list_add_tail(&n->in_network_hash_dirty, &o->network_hash_dirty_nodes);
+}
 
-  /* Free existing indexes */
+static void _node_write_network_hash_record(dncp_node n)
+{
+  dncp o = n->dncp;
+  int onelen = 4 + DNCP_HASH_LEN(o);
+  void *dst = o->network_hash_records + n->network_hash_index * onelen;
+
+  dncp_calculate_node_data_hash(n);
+  *((uint32_t *)dst) = cpu_to_be32(n->update_number);
+  memcpy(dst + 4, &n->node_data_hash, DNCP_HASH_LEN(o));
+  L_DEBUG(".. #%d %s/%d=%s", n->network_hash_index,
+          DNCP_NODE_REPR(n), n->update_number,
+          DNCP_HASH_REPR(o, &n->node_data_hash));
+}
+
+static bool _rebuild_network_hash_records(dncp o)
+{
+  int onelen = 4 + DNCP_HASH_LEN(o);
   dncp_node n;
+  int cnt = 0;
+
+  dncp_for_each_node(o, n)
+    cnt++;
+  if (cnt > o->network_hash_records_size)
+    {
+      int new_size = cnt * 2;
+      void *nr = realloc(o->network_hash_records, new_size * onelen);
+      if (!nr)
+        return false;
+      o->network_hash_records = nr;
+      o->network_hash_records_size = new_size;
+    }
+
+  /* Unreachable nodes may still have index from before. */
   dncp_for_each_node_including_unreachable(o, n)
+    n->network_hash_index = -1;
+
+  cnt = 0;
+  dncp_for_each_node(o, n)
     {
-      if (n->tlv_index)
-        {
-          free(n->tlv_index);
-          n->tlv_index = NULL;
-          n->tlv_index_dirty = true;
-        }
-      assert(n->tlv_index_dirty);
+      n->network_hash_index = cnt++;
+      _node_write_network_hash_record(n);
     }
+  o->network_hash_records_count = cnt;
+  o->network_hash_records_dirty = false;
   return true;
 }
 
+void dncp_calculate_network_hash(dncp o)
+{
+  dncp_node n, n2;
+
+  if (!o->network_hash_dirty)
+    return;
+
+  o->net_state_valid = false;
+
+  /* Store original network hash for future study. */
+  dncp_hash_s old_hash = o->network_hash;
+
+  _calculate_node_data_hashes(o);
+
+  /* If the set of reachable nodes changed, the records have to be
+   * laid out again; otherwise, only the nodes that changed since
+   * last time have to be rewritten in place. */
+  if (o->network_hash_records_dirty)
+    {
+      if (!_rebuild_network_hash_records(o))
+        return;
+      list_for_each_entry_safe(n, n2, &o->network_hash_dirty_nodes,
+                               in_network_hash_dirty)
+        list_del_init(&n->in_network_hash_dirty);
+    }
+  else
+    {
+      list_for_each_entry_safe(n, n2, &o->network_hash_dirty_nodes,
+                               in_network_hash_dirty)
+        {
+          list_del_init(&n->in_network_hash_dirty);
+          if (n->network_hash_index >= 0)
+            _node_write_network_hash_record(n);
+        }
+    }
+  o->ext->cb.hash(o->network_hash_records,
+                  o->network_hash_records_count * (4 + DNCP_HASH_LEN(o)),
+                  &o->network_hash);
+  L_DEBUG("dncp_calculate_network_hash =%s",
+          DNCP_HASH_REPR(o, &o->network_hash));
+
+  if (memcmp(&old_hash, &o->network_hash, DNCP_HASH_LEN(o)))
+    dncp_trickle_reset(o);
+
+  o->network_hash_dirty = false;
+}
 
 bool dncp_ep_has_highest_id(dncp_ep ep)
 {
@@ -661,51 +1172,60 @@ bool dncp_ep_has_highest_id(dncp_ep ep)
 
 void dncp_node_recalculate_index(dncp_node n)
 {
-  int size = n->dncp->num_tlv_indexes * 4 * sizeof(n->tlv_index[0]);
+  struct tlv_attr *a;
+  void *base = n->tlv_container ? tlv_data(n->tlv_container) : NULL;
+  dncp_tlv_range r = NULL;
+  int direct = 0, len = 0, type = -1;
 
   assert(n->tlv_index_dirty);
-  if (!n->tlv_index)
+
+  /* Node data is sorted by type, so one pass tells how many entries
+   * we need, and second fills them in. */
+  tlv_for_each_attr(a, n->tlv_container)
+    if ((int)tlv_id(a) != type)
+      {
+        type = tlv_id(a);
+        if (type < DNCP_TLV_INDEX_DIRECT)
+          direct = type >= direct ? type + 1 : direct;
+        else
+          len++;
+      }
+  len += direct;
+  if (len > n->tlv_index_len || !len)
     {
-      n->tlv_index = calloc(1, size);
-      if (!n->tlv_index)
+      dncp_tlv_range ni = NULL;
+
+      if (len && !(ni = realloc(n->tlv_index, len * sizeof(*ni))))
         return;
+      if (!len)
+        free(n->tlv_index);
+      n->tlv_index = ni;
     }
-  else
-    {
-      memset(n->tlv_index, 0, size);
-    }
-
-  dncp o = n->dncp;
-  struct tlv_attr *a;
-  int type = -1;
-  int idx = 0;
-
-  /* Note: This algorithm isn't particularly clever - while linear in
-   * speed (O(# of indexes + # of entries in tlv_container), it has bit
-   * too significant constant factor for comfort. */
+  n->tlv_index_len = len;
+  if (len)
+    memset(n->tlv_index, 0, len * sizeof(*r));
+  n->tlv_index_direct = direct;
+  for (type = 0 ; type < direct ; type++)
+    n->tlv_index[type].type = type;
+
+  len = direct;
+  type = -1;
   tlv_for_each_attr(a, n->tlv_container)
     {
       if ((int)tlv_id(a) != type)
         {
           type = tlv_id(a);
-          /* No more indexes here -> stop iteration */
-          if (type >= o->tlv_type_to_index_length)
-            break;
-          if (!(idx = o->tlv_type_to_index[type]))
-            continue;
-          n->tlv_index[2 * idx - 2] = a;
-          assert(idx <= n->dncp->num_tlv_indexes);
+          if (type < direct)
+            r = &n->tlv_index[type];
+          else
+            {
+              r = &n->tlv_index[len++];
+              r->type = type;
+            }
+          r->start = (void *)a - base;
         }
-      if (idx)
-        n->tlv_index[2 * idx - 1] = tlv_next(a);
+      r->end = (void *)tlv_next(a) - base;
     }
-
-  /* TBD: What if n->tlv_container_valid && n->tlv_container_valid !=
-   * n->tlv_container (currently we do not support rewriting, but at
-   * some point we might); iterate again? */
-  if (size
-      && n->tlv_container_valid && n->tlv_container_valid == n->tlv_container)
-    memcpy((void *)n->tlv_index + size / 2, n->tlv_index, size / 2);
   n->tlv_index_dirty = false;
 }
 
@@ -754,20 +1274,40 @@ dncp_ep dncp_ep_from_ext_data(void *ext_data)
 struct tlv_attr *
 dncp_node_get_tlv_with_type(dncp_node n, uint16_t type, bool first, bool valid)
 {
-  if (type >= n->dncp->tlv_type_to_index_length
-      || !n->dncp->tlv_type_to_index[type])
-    if (!dncp_add_tlv_index(n->dncp, type))
-      return NULL;
+  dncp_tlv_range r = NULL;
+
+  /* Valid data is either the whole container, or nothing. */
+  if (!n->tlv_container || (valid && !n->tlv_container_valid))
+    return NULL;
   if (n->tlv_index_dirty)
     {
       dncp_node_recalculate_index(n);
-      if (!n->tlv_index)
+      if (n->tlv_index_dirty)
         return NULL;
     }
-  int index = n->dncp->tlv_type_to_index[type] - 1 +
-    (valid ? n->dncp->num_tlv_indexes : 0);
-  int i = index * 2 + (first ? 0 : 1);
-  return n->tlv_index[i];
+  if (type < n->tlv_index_direct)
+    r = &n->tlv_index[type];
+  else
+    {
+      int lo = n->tlv_index_direct, hi = n->tlv_index_len - 1;
+
+      while (lo <= hi)
+        {
+          int mid = (lo + hi) / 2;
+          if (n->tlv_index[mid].type == type)
+            {
+              r = &n->tlv_index[mid];
+              break;
+            }
+          if (n->tlv_index[mid].type < type)
+            lo = mid + 1;
+          else
+            hi = mid - 1;
+        }
+    }
+  if (!r || r->start == r->end)
+    return NULL;
+  return tlv_data(n->tlv_container) + (first ? r->start : r->end);
 }
 
 dncp_node dncp_get_own_node(dncp o)
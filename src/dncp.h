@@ -18,6 +18,7 @@
 
 /* in6_addr */
 #include <netinet/in.h>
+#include <sys/uio.h>
 
 /* IFNAMSIZ */
 #include <net/if.h>
@@ -67,13 +68,14 @@ typedef struct dncp_tlv_struct dncp_tlv_s, *dncp_tlv;
  * - (if local TLV change), local_tlv_change_cb is called
  * .. at some point, when TLV changes are to be published to the network ..
  * - republish_cb is called
- * - tlv_change_cb is called
+ * - tlv_change_cb (per TLV) and tlvs_change_cb (per node) are called
  */
 
 enum {
   DNCP_CALLBACK_LOCAL_TLV,
   DNCP_CALLBACK_REPUBLISH,
   DNCP_CALLBACK_TLV,
+  DNCP_CALLBACK_TLVS,
   DNCP_CALLBACK_NODE,
   DNCP_CALLBACK_EP,
   DNCP_CALLBACK_SOCKET_MSG,
@@ -82,6 +84,12 @@ enum {
 
 typedef struct dncp_subscriber_struct dncp_subscriber_s, *dncp_subscriber;
 
+/* One entry of a node's TLV change-set. */
+typedef struct dncp_tlv_change_struct {
+  struct tlv_attr *tlv;
+  bool add;
+} dncp_tlv_change_s, *dncp_tlv_change;
+
 struct dncp_subscriber_struct {
   /**
    * Place within list of subscribers (owned by dncp while subscription
@@ -120,10 +128,39 @@ struct dncp_subscriber_struct {
    * @param n The node for which change notification occurs.
    * @param tlv The TLV that is being added or removed (there is no 'update').
    * @param add Flag which indicates whether the operation was add or remove.
+   *
+   * For a node update, every tlv_change_cb subscriber is told of all
+   * removals before any of them is told of an addition.
    */
   void (*tlv_change_cb)(dncp_subscriber s,
                         dncp_node n, struct tlv_attr *tlv, bool add);
 
+  /**
+   * Batched TLV change notification.
+   *
+   * This is called once per node update with the whole change-set of
+   * the node (removals first, then additions, both in TLV order). It
+   * is called only if the (filtered) change-set is non-empty.
+   *
+   * It is called after the removals and before the additions have
+   * been passed to tlv_change_cb subscribers.
+   *
+   * @param n The node for which change notification occurs.
+   * @param changes The TLVs that are being added or removed.
+   * @param num_changes Number of entries in changes.
+   */
+  void (*tlvs_change_cb)(dncp_subscriber s, dncp_node n,
+                         dncp_tlv_change changes, int num_changes);
+
+  /**
+   * Optional TLV type filter for tlv_change_cb and tlvs_change_cb.
+   *
+   * If set, only TLVs of the listed types are reported to the
+   * subscriber. It has to stay valid while the subscription is.
+   */
+  const uint16_t *tlv_types;
+  int num_tlv_types;
+
   /**
    * Node change notification.
    *
@@ -192,6 +229,10 @@ struct dncp_ep_struct {
   /* How large can the multicasts be? */
   ssize_t maximum_multicast_size;
 
+  /* If the node states do not fit in one multicast, into how many
+   * multicasts may they be split? (<= 1 = never split) */
+  int maximum_multicast_datagrams;
+
   /* Or unicasts? (0 = no limit) */
   ssize_t maximum_unicast_size;
 
@@ -477,6 +518,21 @@ struct dncp_ext_configuration_struct {
  * FLAG_SECURE is not, packet should be probably ignored. */
 #define DNCP_RECV_FLAG_SECURE_TRIED  0x8
 
+/* One message received in a batch (see recv_batch callback). */
+typedef struct dncp_ext_msg_struct {
+  /* Provided by dncp */
+  void *buf;
+  size_t buf_len;
+
+  /* Filled in by the I/O */
+  size_t len;
+  dncp_ep ep;
+  struct sockaddr_in6 src;
+  struct sockaddr_in6 dst;
+  bool multicast; /* if set, dst is not valid (as NULL dst in recv) */
+  int flags;
+} dncp_ext_msg_s, *dncp_ext_msg;
+
 struct dncp_ext_cbs_struct {
   /* I/O-related callbacks */
 
@@ -487,12 +543,31 @@ struct dncp_ext_cbs_struct {
                   int *flags,
                   void *buf, size_t buf_len);
 
+  /**
+   * Receive up to count messages from the network (optional). If
+   * provided, it is used instead of recv. Returns the number of
+   * messages filled in at the start of msgs; 0 if nothing is
+   * available. The buf pointers of msgs may be reordered among the
+   * messages, but not changed otherwise. Messages larger than buf_len
+   * are dropped.
+   */
+  int (*recv_batch)(dncp_ext e, dncp_ext_msg msgs, int count);
+
   /** Send bytes to the network. */
   void (*send)(dncp_ext e, dncp_ep ep,
                struct sockaddr_in6 *src,
                struct sockaddr_in6 *dst,
                void *buf, size_t buf_len);
 
+  /**
+   * Send a message gathered from several buffers (optional). If not
+   * provided, the buffers are copied together and sent using send.
+   */
+  void (*send_iovec)(dncp_ext e, dncp_ep ep,
+                     struct sockaddr_in6 *src,
+                     struct sockaddr_in6 *dst,
+                     struct iovec *iov, int iov_len);
+
   /* Profile-related callbacks */
 
   /**
@@ -503,6 +578,15 @@ struct dncp_ext_cbs_struct {
    */
   void (*hash)(const void *buf, size_t len, void *dst);
 
+  /**
+   * Optional callback to perform hashing of several independent
+   * buffers at once (bufs[i][:lens[i]] to dsts[i], as above).
+   *
+   * If not provided, hash is called for each of them.
+   */
+  void (*hash_multi)(const void **bufs, const size_t *lens, void **dsts,
+                     int n);
+
   /**
    * Validate node data.
    */
@@ -33,11 +33,55 @@
 /* Rough approximation - should think of real figure. */
 #define DNCP_MAXIMUM_PAYLOAD_SIZE 65536
 
+/* How many messages we ask for at once from recv_batch at most, and
+ * how much memory their buffers may take in total. */
+#define DNCP_RECV_BATCH_SIZE 16
+#define DNCP_RECV_BATCH_BUFFER_SIZE 65536
+
+/* Node data buffers are allocated in power-of-two size classes,
+ * starting from 1 << DNCP_NODE_DATA_MIN_SHIFT bytes; larger ones are
+ * not pooled. At most DNCP_NODE_DATA_POOL_MAX free buffers are kept
+ * per class. */
+#define DNCP_NODE_DATA_MIN_SHIFT 8
+#define DNCP_NODE_DATA_CLASSES 10
+#define DNCP_NODE_DATA_POOL_MAX 8
+
+/* TLV types below this are looked up directly by type in the per-node
+ * TLV index; larger ones with binary search. */
+#define DNCP_TLV_INDEX_DIRECT 64
+
+/* Number of buckets in the peer hash tables (power of two). */
+#define DNCP_PEER_HASH_SIZE 64
+
 #include <libubox/vlist.h>
 #include <libubox/list.h>
 
 typedef struct dncp_ep_i_struct dncp_ep_i_s, *dncp_ep_i;
 
+typedef struct dncp_timer_struct dncp_timer_s, *dncp_timer;
+
+/* TLVs of one type within node data; byte offsets from the start of
+ * the container payload (start == end if there are none). */
+typedef struct {
+  uint16_t type;
+  uint16_t start;
+  uint16_t end;
+} dncp_tlv_range_s, *dncp_tlv_range;
+
+/* Deadline of a per-endpoint or per-peer state machine; the scheduled
+ * ones live in a binary min-heap (dncp->timers), so a timeout only
+ * has to look at the ones that are actually due. */
+struct dncp_timer_struct {
+  /* When the timer fires (0 if not scheduled) */
+  hnetd_time_t at;
+
+  /* Position within dncp->timers (-1 if not scheduled) */
+  int index;
+
+  /* Called when due; the timer is unscheduled before the call. */
+  void (*cb)(dncp o, dncp_timer t);
+};
+
 
 typedef struct __packed {
   unsigned char buf[DNCP_HASH_MAX_LEN];
@@ -66,6 +110,10 @@ struct dncp_struct {
   /* local endpoints (endpoints clients have at least referred to once). */
   struct vlist_tree eps;
 
+  /* local tlvs serialized as a container (NULL = rebuild on use). */
+  struct tlv_attr *own_tlvs;
+  int own_tlvs_size;
+
   /* flag which indicates that we should perhaps re-publish our node
    * in nodes. */
   bool tlvs_dirty;
@@ -98,6 +146,33 @@ struct dncp_struct {
   /* Whole network hash we consider current (based on content of 'nodes'). */
   dncp_hash_s network_hash;
 
+  /* Persistent, node identifier ordered array of (update number, node
+   * data hash) records of reachable nodes; the network hash is
+   * calculated over it. */
+  void *network_hash_records;
+  int network_hash_records_size; /* allocated, in records */
+  int network_hash_records_count; /* used, in records */
+
+  /* flag which indicates that the set of reachable nodes has changed,
+   * and network_hash_records must be rebuilt from scratch. */
+  bool network_hash_records_dirty;
+
+  /* Nodes whose record in network_hash_records is out of date. */
+  struct list_head network_hash_dirty_nodes;
+
+  /* Nodes whose neighbors have changed since the last prune. */
+  struct list_head graph_dirty_nodes;
+
+  /* Nodes that are not reachable (but still within grace interval). */
+  struct list_head unreachable_nodes;
+
+  /* flag which indicates that the next prune has to recalculate the
+   * reachability from scratch, instead of just around the changes. */
+  bool prune_full;
+
+  /* Earliest expiration time of a reachable node (may be too early) */
+  hnetd_time_t next_expiration;
+
   /* First free local interface identifier (we allocate them in
    * monotonically increasing fashion just to keep things simple). */
   int first_free_ep_id;
@@ -105,19 +180,49 @@ struct dncp_struct {
   /* List of subscribers to change notifications. */
   struct list_head subscribers[NUM_DNCP_CALLBACKS];
 
-  /* An array that contains type -> index+1 (if available) or type ->
-   * 0 (if no index yet allocated). */
-  int *tlv_type_to_index;
-
-  /* Highest allocated TLV index. */
-  int tlv_type_to_index_length;
-
-  /* Number of TLV indexes we have. That is, the # of non-empty slots
-   * in the tlv_type_to_index. */
-  int num_tlv_indexes;
+  /* Change-set scratch buffer for TLV notifications. */
+  dncp_tlv_change tlv_changes;
+  int tlv_changes_size;
 
   /* Number of times neighbor has been dropped. */
   int num_neighbor_dropped;
+
+  /* Receive buffers for recv_batch (allocated on first use), and the
+   * size of each. */
+  void *recv_batch_buf;
+  size_t recv_batch_slot_size;
+
+  /* Peers (DNCP_T_PEER local TLVs), and their indexes by (node
+   * identifier, endpoint identifier, peer endpoint identifier), and by
+   * last_sa6. */
+  struct list_head peers;
+  struct list_head peer_hash[DNCP_PEER_HASH_SIZE];
+  struct list_head peer_sa6_hash[DNCP_PEER_HASH_SIZE];
+
+  /* Scheduled timers, as a binary min-heap ordered by 'at'. */
+  dncp_timer *timers;
+  int num_timers;
+  int timers_size; /* allocated */
+
+  /* Cached buffer for building outgoing messages (NULL = in use). */
+  void *send_buf;
+  int send_buf_size;
+
+  /* Serialized NET_STATE + NODE_STATE TLVs matching network_hash
+   * (invalidated when it is recalculated). Only the
+   * ms_since_origination fields are refreshed when it is sent. */
+  void *net_state;
+  int net_state_size; /* allocated */
+  int net_state_len; /* used */
+  hnetd_time_t *net_state_origination; /* per NODE_STATE TLV */
+  hnetd_time_t net_state_refreshed;
+  bool net_state_valid;
+  int num_net_state_hits;
+  int num_net_state_misses;
+
+  /* Free node data buffers, per size class. */
+  struct list_head node_data_pool[DNCP_NODE_DATA_CLASSES];
+  int node_data_pool_len[DNCP_NODE_DATA_CLASSES];
 };
 
 typedef struct dncp_trickle_struct dncp_trickle_s, *dncp_trickle;
@@ -171,12 +276,28 @@ struct dncp_ep_i_struct {
 
   /* The per-ep Trickle state. */
   dncp_trickle_s trickle;
+
+  /* When the per-ep Trickle/keepalive state needs attention next. */
+  dncp_timer_s timer;
 };
 
 typedef struct dncp_peer_struct dncp_peer_s, *dncp_peer;
 
 struct dncp_peer_struct {
-  /* Most recent address we heard from this particular neighbor */
+  /* dncp->peers entry */
+  struct list_head in_peers;
+
+  /* dncp->peer_hash entry */
+  struct list_head in_peer_hash;
+
+  /* dncp->peer_sa6_hash entry (if last_sa6 is set) */
+  struct list_head in_peer_sa6_hash;
+
+  /* The local TLV this peer is stored in */
+  dncp_tlv tlv;
+
+  /* Most recent address we heard from this particular neighbor; use
+   * dncp_peer_set_last_sa6 to change. */
   struct sockaddr_in6 last_sa6;
 
   /* When did we last time receive _consistent_ state from the peer
@@ -185,6 +306,14 @@ struct dncp_peer_struct {
 
   /* The per-(local)peer Trickle state. */
   dncp_trickle_s trickle;
+
+  /* Keepalive interval the peer uses towards us (cached from its node
+   * data; -1 if not known) */
+  hnetd_time_t keepalive_interval;
+
+  /* When the per-peer Trickle/keepalive state or the peer validity
+   * needs to be checked next. */
+  dncp_timer_s timer;
 };
 
 
@@ -202,9 +331,38 @@ struct dncp_node_struct {
   /* When was the last prune during which this node was reachable */
   hnetd_time_t last_reachable_prune;
 
+  /* Is the node currently reachable from our own node. */
+  bool reachable;
+
+  /* dncp->unreachable_nodes entry (if not reachable) */
+  struct list_head in_unreachable;
+
+  /* Bidirectionally connected neighbor nodes; derived from the
+   * DNCP_T_PEER TLVs of both ends whenever node data changes. */
+  dncp_node *neighbors;
+  int num_neighbors;
+
+  /* dncp->graph_dirty_nodes entry (if neighbors changed since prune) */
+  struct list_head in_graph_dirty;
+
+  /* Reachability spanning tree rooted at own node (if reachable) */
+  dncp_node parent;
+  struct list_head children;
+  struct list_head in_parent;
+
+  /* Scratch state of dncp_prune */
+  bool prune_detached;
+  struct list_head in_prune;
+
   /* Node state stuff */
   dncp_hash_s node_data_hash;
   bool node_data_hash_dirty; /* Something related to hash changed */
+
+  /* Index within dncp->network_hash_records (if reachable) or -1. */
+  int network_hash_index;
+
+  /* dncp->network_hash_dirty_nodes entry (if record is out of date). */
+  struct list_head in_network_hash_dirty;
   hnetd_time_t origination_time; /* in monotonic time */
   hnetd_time_t expiration_time; /* in monotonic time */
 
@@ -218,14 +376,16 @@ struct dncp_node_struct {
    * it should be used by us. Either tlv_container, or NULL. */
   struct tlv_attr *tlv_container_valid;
 
-  /* An index of DNCP TLV indexes (that have been registered and
-   * precomputed for this node). Typically NULL, until first access
-   * during which we have to traverse all TLVs in any case and this
-   * gets populated. It contains 'first', 'next' pairs for each
-   * registered index. */
-  struct tlv_attr **tlv_index;
+  /* Where the TLVs of each type present are within tlv_container.
+   * Typically NULL, until first access during which we traverse all
+   * TLVs once. The first tlv_index_direct entries are indexed by type
+   * (covering types up to the highest one below
+   * DNCP_TLV_INDEX_DIRECT), the rest are sorted by type. */
+  dncp_tlv_range tlv_index;
+  int tlv_index_direct;
+  int tlv_index_len;
 
-  /* Flag which indicates whether contents of tlv_idnex are up to date
+  /* Flag which indicates whether contents of tlv_index are up to date
    * with tlv_container. As a result of this, there's no need for
    * re-alloc when tlv_container changes and we don't immediately want
    * to recalculate tlv_index. */
@@ -250,29 +410,59 @@ struct dncp_tlv_struct {
 bool dncp_init(dncp o, dncp_ext ext, const void *node_id, int len);
 void dncp_uninit(dncp o);
 
+/* Node data (tlv_container) buffers; len is the raw length of the
+ * container TLV, header included. dncp_node_set takes ownership of
+ * what it is given, and releases it using dncp_node_data_free. */
+struct tlv_attr *dncp_node_data_alloc(dncp o, int len);
+void dncp_node_data_free(dncp o, struct tlv_attr *a);
+
 /* Private utility - shouldn't be used by clients. */
 void dncp_node_set(dncp_node n,
                    uint32_t update_number, hnetd_time_t t,
                    struct tlv_attr *a);
 void dncp_node_recalculate_index(dncp_node n);
 
-bool dncp_add_tlv_index(dncp o, uint16_t type);
 
 void dncp_schedule(dncp o);
 
 /* Flush own TLV changes to own node. */
 void dncp_self_flush(dncp_node n);
 
+/* Peer lookups. key is the DNCP_T_PEER TLV payload, that is, node
+ * identifier followed by dncp_t_peer_s. */
+dncp_peer dncp_find_peer(dncp o, const void *key);
+dncp_peer dncp_find_peer_by_sa6(dncp o, const struct sockaddr_in6 *sa6);
+void dncp_peer_set_last_sa6(dncp o, dncp_peer p,
+                            const struct sockaddr_in6 *sa6);
+
+#define dncp_for_each_peer(o, p)                        \
+  list_for_each_entry(p, &(o)->peers, in_peers)
+
+#define dncp_for_each_peer_safe(o, p, p2)                       \
+  list_for_each_entry_safe(p, p2, &(o)->peers, in_peers)
+
 /* Various hash calculation utilities. */
 void dncp_calculate_network_hash(dncp o);
+void dncp_node_network_hash_dirty(dncp_node n);
+
+/* Independent buffers are hashed (at most) this many at a time. */
+#define DNCP_HASH_BATCH 16
+void dncp_hash_multi(dncp o, const void **bufs, const size_t *lens,
+                     void **dsts, int n);
 
 /* Utility functions to send frames. */
 void dncp_ep_i_send_network_state(dncp_ep_i l,
                                   struct sockaddr_in6 *src,
                                   struct sockaddr_in6 *dst,
                                   size_t maximum_size,
+                                  int maximum_datagrams,
                                   bool always_ep_id);
 
+/* Outgoing message buffers; the cached per-dncp buffer is reused
+ * whenever it is not in use already. */
+bool dncp_send_buf_init(dncp o, struct tlv_buf *tb, int id, int size_hint);
+void dncp_send_buf_free(dncp o, struct tlv_buf *tb);
+
 void dncp_ep_i_send_buf(dncp_ep_i l,
                         struct sockaddr_in6 *src, struct sockaddr_in6 *dst,
                         struct tlv_buf *buf);
@@ -280,6 +470,14 @@ void dncp_reply_send(dncp_reply reply);
 
 /* Miscellaneous utilities that live in dncp_timeout */
 void dncp_trickle_reset(dncp o);
+void dncp_prune(dncp o);
+
+/* Timer handling. dncp_timer_set (re)schedules the timer, or cancels
+ * it if at is zero; dncp_timer_advance only ever moves it earlier. */
+void dncp_timer_set(dncp o, dncp_timer t, hnetd_time_t at);
+void dncp_timer_advance(dncp o, dncp_timer t, hnetd_time_t at);
+void dncp_ep_i_timeout(dncp o, dncp_timer t);
+void dncp_peer_timeout(dncp o, dncp_timer t);
 
 /* Compatibility / convenience macros to access stuff that used to be fixed. */
 #define DNCP_NI_LEN(o) (o)->ext->conf.node_id_length
@@ -324,6 +522,12 @@ dncp_tlv_peer(dncp o, const struct tlv_attr *a)
   return dncp_tlv_peer2(a, DNCP_NI_LEN(o));
 }
 
+static inline dncp_t_peer
+dncp_peer_get_t_peer(dncp o, dncp_peer p)
+{
+  return dncp_tlv_peer(o, &p->tlv->tlv);
+}
+
 static inline dncp_node_id
 dncp_tlv_get_node_id2(void *tlv, int nidlen)
 {
@@ -337,6 +541,17 @@ dncp_tlv_get_node_id(dncp o, void *tlv)
                                o->ext->conf.node_id_length);
 }
 
+static inline bool
+dncp_node_has_neighbor(dncp_node n, dncp_node n2)
+{
+  int i;
+
+  for (i = 0 ; i < n->num_neighbors ; i++)
+    if (n->neighbors[i] == n2)
+      return true;
+  return false;
+}
+
 static inline dncp_node
 dncp_node_find_neigh_bidir(dncp_node n, dncp_t_peer ne)
 {
@@ -22,19 +22,188 @@
     x(o, s, DNCP_CALLBACK_LOCAL_TLV, local_tlv_change_cb);      \
     x(o, s, DNCP_CALLBACK_REPUBLISH, republish_cb);             \
     x(o, s, DNCP_CALLBACK_TLV, tlv_change_cb);                  \
+    x(o, s, DNCP_CALLBACK_TLVS, tlvs_change_cb);                \
     x(o, s, DNCP_CALLBACK_NODE, node_change_cb);                \
     x(o, s, DNCP_CALLBACK_EP, ep_change_cb);                    \
     x(o, s, DNCP_CALLBACK_SOCKET_MSG, msg_received_cb);         \
   } while(0)
 
+/* Change-set being delivered. The buffer is borrowed from dncp for
+ * the duration of the notification, so that subscribers causing
+ * nested notifications get a buffer of their own. */
+typedef struct {
+  dncp dncp;
+  dncp_tlv_change changes;
+  int num_changes;
+  int size;
+} dncp_changeset_s, *dncp_changeset;
+
+static void _changeset_begin(dncp o, dncp_changeset cs)
+{
+  cs->dncp = o;
+  cs->changes = o->tlv_changes;
+  cs->size = o->tlv_changes_size;
+  cs->num_changes = 0;
+  o->tlv_changes = NULL;
+  o->tlv_changes_size = 0;
+}
+
+static void _changeset_end(dncp_changeset cs)
+{
+  dncp o = cs->dncp;
+
+  free(o->tlv_changes);
+  o->tlv_changes = cs->changes;
+  o->tlv_changes_size = cs->size;
+}
+
+static bool _changeset_push(dncp_changeset cs, struct tlv_attr *a, bool add)
+{
+  if (cs->num_changes == cs->size)
+    {
+      int nsize = cs->size ? cs->size * 2 : 16;
+      void *nc = realloc(cs->changes, nsize * sizeof(*cs->changes));
+
+      if (!nc)
+        {
+          L_ERR("_changeset_push: realloc failed");
+          return false;
+        }
+      cs->changes = nc;
+      cs->size = nsize;
+    }
+  cs->changes[cs->num_changes].tlv = a;
+  cs->changes[cs->num_changes].add = add;
+  cs->num_changes++;
+  return true;
+}
+
+/* This can be only used in a loop which makes sure that the p stays
+ * valid. It ensures that next TLV won't exceed the end, and if it
+ * would, p is invalidated and loop aborts. */
+#define ENSURE_VALID(p, end)                    \
+  if ((end - TLV_SIZE) < (void *)p)             \
+    {                                           \
+      p = NULL;                                 \
+      break;                                    \
+    }                                           \
+  if ((end - tlv_pad_len(p)) < (void *)p)       \
+    {                                           \
+      p = NULL;                                 \
+      break;                                    \
+    }
+
+/* Append either the TLVs that were removed (add = false) or the ones
+ * that were added (add = true) between the two containers. */
+static void _changeset_diff(dncp_changeset cs,
+                            struct tlv_attr *a_old,
+                            struct tlv_attr *a_new,
+                            bool add)
+{
+  void *old_end = (void *)a_old + (a_old ? tlv_pad_len(a_old) : 0);
+  void *new_end = (void *)a_new + (a_new ? tlv_pad_len(a_new) : 0);
+  struct tlv_attr *op = a_old ? tlv_data(a_old) : NULL;
+  struct tlv_attr *np = a_new ? tlv_data(a_new) : NULL;
+  int r;
+
+  /* Keep two pointers, one for old, one for new. */
+
+  /* While there's data in both, and it looks valid, we drain each
+   * 0-1 at the time. */
+  while (op && np)
+    {
+      ENSURE_VALID(op, old_end);
+      ENSURE_VALID(np, new_end);
+      /* Ok, op and np both point at valid structs. */
+      r = tlv_attr_cmp(op, np);
+      /* If they're equal, we can skip both, no sense giving notification */
+      if (!r)
+        {
+          op = tlv_next(op);
+          np = tlv_next(np);
+        }
+      else if (r < 0)
+        {
+          /* op < np => op deleted */
+          if (!add)
+            _changeset_push(cs, op, false);
+          op = tlv_next(op);
+        }
+      else
+        {
+          /* op > np => np added */
+          if (add)
+            _changeset_push(cs, np, true);
+          np = tlv_next(np);
+        }
+    }
+  /* Anything left in op was deleted, and in np added. */
+  while (op && !add)
+    {
+      ENSURE_VALID(op, old_end);
+      _changeset_push(cs, op, false);
+      op = tlv_next(op);
+    }
+  while (np && add)
+    {
+      ENSURE_VALID(np, new_end);
+      _changeset_push(cs, np, true);
+      np = tlv_next(np);
+    }
+}
+
+static bool _subscriber_wants(dncp_subscriber s, struct tlv_attr *a)
+{
+  int i;
+
+  if (!s->num_tlv_types)
+    return true;
+  for (i = 0 ; i < s->num_tlv_types ; i++)
+    if (s->tlv_types[i] == tlv_id(a))
+      return true;
+  return false;
+}
+
+/* Notify of changes [first, last) one TLV at a time. */
+static void _changeset_notify_tlv(dncp_changeset cs, dncp_subscriber s,
+                                  dncp_node n, int first, int last)
+{
+  int i;
+
+  for (i = first ; i < last ; i++)
+    if (_subscriber_wants(s, cs->changes[i].tlv))
+      s->tlv_change_cb(s, n, cs->changes[i].tlv, cs->changes[i].add);
+}
+
+static void _changeset_notify_tlvs(dncp_changeset cs, dncp_subscriber s,
+                                   dncp_node n)
+{
+  int i, num = cs->num_changes;
+
+  if (!s->num_tlv_types)
+    {
+      if (num)
+        s->tlvs_change_cb(s, n, cs->changes, num);
+      return;
+    }
+
+  /* The filtered subset is staged after the change-set itself. */
+  for (i = 0 ; i < num ; i++)
+    if (_subscriber_wants(s, cs->changes[i].tlv))
+      _changeset_push(cs, cs->changes[i].tlv, cs->changes[i].add);
+  if (cs->num_changes > num)
+    s->tlvs_change_cb(s, n, cs->changes + num, cs->num_changes - num);
+  cs->num_changes = num;
+}
+
 #define HANDLE_ADD(o, s, e, cb)                         \
   if (s->cb) list_add(&s->lhs[e], &o->subscribers[e])
 
 void dncp_subscribe(dncp o, dncp_subscriber s)
 {
+  dncp_changeset_s cs;
   dncp_node n;
   dncp_tlv t;
-  struct tlv_attr *a;
 
   HANDLE_ENUM_CB(o, s, HANDLE_ADD);
   if (s->local_tlv_change_cb)
@@ -42,14 +211,19 @@ void dncp_subscribe(dncp o, dncp_subscriber s)
       vlist_for_each_element(&o->tlvs, t, in_tlvs)
         s->local_tlv_change_cb(s, &t->tlv, true);
     }
+  _changeset_begin(o, &cs);
   dncp_for_each_node(o, n)
     {
       if (s->node_change_cb)
         s->node_change_cb(s, n, true);
+      cs.num_changes = 0;
+      _changeset_diff(&cs, NULL, dncp_node_get_tlvs(n), true);
       if (s->tlv_change_cb)
-        dncp_node_for_each_tlv(n, a)
-          s->tlv_change_cb(s, n, a, true);
+        _changeset_notify_tlv(&cs, s, n, 0, cs.num_changes);
+      if (s->tlvs_change_cb)
+        _changeset_notify_tlvs(&cs, s, n);
     }
+  _changeset_end(&cs);
 }
 
 #define HANDLE_DEL(o, s, e, cb)                 \
@@ -57,8 +231,8 @@ void dncp_subscribe(dncp o, dncp_subscriber s)
 
 void dncp_unsubscribe(dncp o, dncp_subscriber s)
 {
+  dncp_changeset_s cs;
   dncp_node n;
-  struct tlv_attr *a;
   dncp_tlv t;
 
   if (s->local_tlv_change_cb)
@@ -66,131 +240,58 @@ void dncp_unsubscribe(dncp o, dncp_subscriber s)
       vlist_for_each_element(&o->tlvs, t, in_tlvs)
         s->local_tlv_change_cb(s, &t->tlv, false);
     }
+  _changeset_begin(o, &cs);
   dncp_for_each_node(o, n)
     {
+      cs.num_changes = 0;
+      _changeset_diff(&cs, dncp_node_get_tlvs(n), NULL, false);
       if (s->tlv_change_cb)
-        dncp_node_for_each_tlv(n, a)
-          s->tlv_change_cb(s, n, a, false);
+        _changeset_notify_tlv(&cs, s, n, 0, cs.num_changes);
+      if (s->tlvs_change_cb)
+        _changeset_notify_tlvs(&cs, s, n);
       if (s->node_change_cb)
         s->node_change_cb(s, n, false);
     }
+  _changeset_end(&cs);
   HANDLE_ENUM_CB(o, s, HANDLE_DEL);
 }
 
-/* This can be only used in a loop which makes sure that the p stays
- * valid. It ensures that next TLV won't exceed the end, and if it
- * would, p is invalidated and loop aborts. */
-#define ENSURE_VALID(p, end)                    \
-  if ((end - TLV_SIZE) < (void *)p)             \
-    {                                           \
-      p = NULL;                                 \
-      break;                                    \
-    }                                           \
-  if ((end - tlv_pad_len(p)) < (void *)p)       \
-    {                                           \
-      p = NULL;                                 \
-      break;                                    \
-    }
-
 void dncp_notify_subscribers_tlvs_changed(dncp_node n,
                                           struct tlv_attr *a_old,
                                           struct tlv_attr *a_new)
 {
+  dncp o = n->dncp;
+  dncp_changeset_s cs;
   dncp_subscriber s;
-  void *old_end = (void *)a_old + (a_old ? tlv_pad_len(a_old) : 0);
-  void *new_end = (void *)a_new + (a_new ? tlv_pad_len(a_new) : 0);
-  int r;
+  int num_removed;
 
-  /* There are two distinct steps here: First we remove missing, and
-   * then we add new ones. Otherwise, there may be confusion if we get
-   * first new + then remove, and the underlying TLV has same
-   * key.. :-p */
-  list_for_each_entry(s, &n->dncp->subscribers[DNCP_CALLBACK_TLV],
-                      lhs[DNCP_CALLBACK_TLV])
-    {
-      struct tlv_attr *op = a_old ? tlv_data(a_old) : NULL;
-      struct tlv_attr *np = a_new ? tlv_data(a_new) : NULL;
-
-      /* Keep two pointers, one for old, one for new. */
+  if (list_empty(&o->subscribers[DNCP_CALLBACK_TLV])
+      && list_empty(&o->subscribers[DNCP_CALLBACK_TLVS]))
+    return;
 
-      /* While there's data in both, and it looks valid, we drain each
-       * 0-1 at the time. */
-      while (op && np)
-        {
-          ENSURE_VALID(op, old_end);
-          ENSURE_VALID(np, new_end);
-          /* Ok, op and np both point at valid structs. */
-          r = tlv_attr_cmp(op, np);
-          /* If they're equal, we can skip both, no sense giving notification */
-          if (!r)
-            {
-              op = tlv_next(op);
-              np = tlv_next(np);
-            }
-          else if (r < 0)
-            {
-              /* op < np => op deleted */
-              s->tlv_change_cb(s, n, op, false);
-              op = tlv_next(op);
-            }
-          else
-            {
-              /* op > np => np added */
-              /* in part 2 */
-              np = tlv_next(np);
-            }
-        }
-      /* Anything left in op was deleted. */
-      while (op)
-        {
-          ENSURE_VALID(op, old_end);
-          s->tlv_change_cb(s, n, op, false);
-          op = tlv_next(op);
-        }
-    }
-  list_for_each_entry(s, &n->dncp->subscribers[DNCP_CALLBACK_TLV],
-                      lhs[DNCP_CALLBACK_TLV])
+  /* The diff is computed once for all subscribers. There are two
+   * distinct steps in it: First we remove missing, and then we add
+   * new ones. Otherwise, there may be confusion if we get first new +
+   * then remove, and the underlying TLV has same key.. :-p */
+  _changeset_begin(o, &cs);
+  _changeset_diff(&cs, a_old, a_new, false);
+  num_removed = cs.num_changes;
+  _changeset_diff(&cs, a_old, a_new, true);
+  if (cs.num_changes)
     {
-      struct tlv_attr *op = a_old ? tlv_data(a_old) : NULL;
-      struct tlv_attr *np = a_new ? tlv_data(a_new) : NULL;
-
-      /* Keep two pointers, one for old, one for new. */
-
-      /* While there's data in both, and it looks valid, we drain each
-       * 0-1 at the time. */
-      while (op && np)
-        {
-          ENSURE_VALID(op, old_end);
-          ENSURE_VALID(np, new_end);
-          /* Ok, op and np both point at valid structs. */
-          r = tlv_attr_cmp(op, np);
-          /* If they're equal, we can skip both, no sense giving notification */
-          if (!r)
-            {
-              op = tlv_next(op);
-              np = tlv_next(np);
-            }
-          else if (r < 0)
-            {
-              /* op < np => op deleted */
-              /* we did this in part 1 */
-              op = tlv_next(op);
-            }
-          else
-            {
-              /* op > np => np added */
-              s->tlv_change_cb(s, n, np, true);
-              np = tlv_next(np);
-            }
-        }
-      /* Anything left in np was added. */
-      while (np)
-        {
-          ENSURE_VALID(np, new_end);
-          s->tlv_change_cb(s, n, np, true);
-          np = tlv_next(np);
-        }
+      /* All per-TLV subscribers see every removal before any of them
+       * sees an addition. */
+      list_for_each_entry(s, &o->subscribers[DNCP_CALLBACK_TLV],
+                          lhs[DNCP_CALLBACK_TLV])
+        _changeset_notify_tlv(&cs, s, n, 0, num_removed);
+      list_for_each_entry(s, &o->subscribers[DNCP_CALLBACK_TLVS],
+                          lhs[DNCP_CALLBACK_TLVS])
+        _changeset_notify_tlvs(&cs, s, n);
+      list_for_each_entry(s, &o->subscribers[DNCP_CALLBACK_TLV],
+                          lhs[DNCP_CALLBACK_TLV])
+        _changeset_notify_tlv(&cs, s, n, num_removed, cs.num_changes);
     }
+  _changeset_end(&cs);
 }
 
 void dncp_notify_subscribers_local_tlv_changed(dncp o,
@@ -66,7 +66,10 @@ static struct tlv_attr *_push_tlv(struct tlv_buf *tb, int t, size_t len)
   if (!tb->head)
     {
       dncp_reply reply = container_of(tb, dncp_reply_s, buf);
-      tlv_buf_init(tb, _bytes_to_exp(reply->l->conf.maximum_unicast_size));
+      if (!dncp_send_buf_init(reply->l->dncp, tb,
+                              _bytes_to_exp(reply->l->conf.maximum_unicast_size),
+                              0))
+        return NULL;
       if (!_push_ep_id_tlv(tb, reply->l, &reply->dst, false))
         return NULL;
     }
@@ -137,52 +140,194 @@ static bool _push_network_state_tlv(struct tlv_buf *tb, dncp o)
   return true;
 }
 
-static bool _push_ep_id_tlv(struct tlv_buf *tb, dncp_ep_i l,
-                            struct sockaddr_in6 *dst, bool always_ep_id)
+static bool _has_ep_id_tlv(dncp_ep_i l, struct sockaddr_in6 *dst,
+                           bool always_ep_id)
+{
+  return !(l->conf.unicast_is_reliable_stream && dst && !always_ep_id);
+}
+
+static void _write_ep_id_tlv(struct tlv_attr *a, dncp_ep_i l)
 {
   dncp_t_ep_id lid;
   int tl = DNCP_NI_LEN(l->dncp) + sizeof(*lid);
 
-  if (l->conf.unicast_is_reliable_stream && dst && !always_ep_id)
+  tlv_init(a, DNCP_T_NODE_ENDPOINT, TLV_SIZE + tl);
+  memcpy(tlv_data(a), &l->dncp->own_node->node_id, DNCP_NI_LEN(l->dncp));
+  lid = tlv_data(a) + DNCP_NI_LEN(l->dncp);
+  lid->ep_id = l->ep_id;
+  tlv_fill_pad(a);
+}
+
+static bool _push_ep_id_tlv(struct tlv_buf *tb, dncp_ep_i l,
+                            struct sockaddr_in6 *dst, bool always_ep_id)
+{
+  int tl = DNCP_NI_LEN(l->dncp) + sizeof(dncp_t_ep_id_s);
+
+  if (!_has_ep_id_tlv(l, dst, always_ep_id))
     return true;
 
   struct tlv_attr *a = _push_tlv(tb, DNCP_T_NODE_ENDPOINT, tl);
 
   if (!a)
     return false;
-  memcpy(tlv_data(a), &l->dncp->own_node->node_id, DNCP_NI_LEN(l->dncp));
-  lid = tlv_data(a) + DNCP_NI_LEN(l->dncp);
-  lid->ep_id = l->ep_id;
+  _write_ep_id_tlv(a, l);
   return true;
 }
 
-static bool _push_network_state(struct tlv_buf *tb, dncp o,
-                                size_t maximum_size)
+static inline int _tlv_size(int len)
 {
-  if (!_push_network_state_tlv(tb, o))
-    return false;
-  /* We multicast only 'stable' state. Unicast, we give everything we have. */
-  if (!o->graph_dirty || !maximum_size)
+  return TLV_SIZE + ((len + TLV_ATTR_ALIGN - 1) & ~(TLV_ATTR_ALIGN - 1));
+}
+
+/* The network state (NET_STATE + NODE_STATE TLVs without node data)
+ * changes only with the network hash, so it is serialized once per
+ * network hash; just the ms_since_origination fields of the node
+ * states are rewritten as time passes. */
+static bool _net_state_update(dncp o)
+{
+  int nilen = DNCP_NI_LEN(o);
+  int hlen = DNCP_HASH_LEN(o);
+  int ns_len = nilen + sizeof(dncp_t_node_state_s) + hlen;
+  hnetd_time_t now = dncp_time(o);
+  dncp_t_node_state s;
+  struct tlv_attr *a;
+  void *p;
+  int i;
+
+  dncp_calculate_network_hash(o);
+  if (o->net_state_valid)
+    {
+      o->num_net_state_hits++;
+    }
+  else
     {
-      int nn = 0;
-      int nilen = DNCP_NI_LEN(o);
-      int hlen = DNCP_HASH_LEN(o);
-      int ns_len = sizeof(dncp_t_node_state_s) + nilen + hlen;
+      int nn = o->network_hash_records_count;
+      int len = _tlv_size(hlen) + nn * _tlv_size(ns_len);
       dncp_node n;
 
-      if (maximum_size)
-        dncp_for_each_node(o, n)
-          nn++;
-      if (!maximum_size
-          || maximum_size >= (tlv_len(tb->head)
-                              + nn * (4 + ns_len)))
+      o->num_net_state_misses++;
+      if (len > o->net_state_size)
         {
-          dncp_for_each_node(o, n)
+          if (!(p = realloc(o->net_state, len)))
             {
-              if (!_push_node_state_tlv(tb, n, false))
-                return false;
+              L_ERR("_net_state_update: realloc failed");
+              return false;
             }
+          o->net_state = p;
+          o->net_state_size = len;
+        }
+      if (!(p = realloc(o->net_state_origination,
+                        (nn ? nn : 1) * sizeof(hnetd_time_t))))
+        {
+          L_ERR("_net_state_update: realloc failed");
+          return false;
+        }
+      o->net_state_origination = p;
+
+      a = o->net_state;
+      tlv_init(a, DNCP_T_NET_STATE, TLV_SIZE + hlen);
+      memcpy(tlv_data(a), &o->network_hash, hlen);
+      tlv_fill_pad(a);
+      p = o->net_state + tlv_pad_len(a);
+      i = 0;
+      dncp_for_each_node(o, n)
+        {
+          if (i == nn)
+            break;
+          a = p;
+          tlv_init(a, DNCP_T_NODE_STATE, TLV_SIZE + ns_len);
+          memcpy(tlv_data(a), &n->node_id, nilen);
+          s = tlv_data(a) + nilen;
+          s->update_number = cpu_to_be32(n->update_number);
+          memcpy(tlv_data(a) + nilen + sizeof(*s), &n->node_data_hash, hlen);
+          tlv_fill_pad(a);
+          o->net_state_origination[i++] = n->origination_time;
+          p += tlv_pad_len(a);
         }
+      o->net_state_len = p - o->net_state;
+      o->net_state_refreshed = -1;
+      o->net_state_valid = true;
+    }
+  if (o->net_state_refreshed != now)
+    {
+      p = o->net_state + _tlv_size(hlen);
+      for (i = 0 ; p < o->net_state + o->net_state_len ; i++)
+        {
+          s = p + TLV_SIZE + nilen;
+          s->ms_since_origination =
+            cpu_to_be32(now - o->net_state_origination[i]);
+          p += _tlv_size(ns_len);
+        }
+      o->net_state_refreshed = now;
+    }
+  return true;
+}
+
+/* Whether node states fit in (with maximum_size; 0 = unlimited) after
+ * len bytes of other TLVs. */
+static bool _net_state_fits(dncp o, size_t maximum_size, size_t len)
+{
+  int ns_len = sizeof(dncp_t_node_state_s) + DNCP_NI_LEN(o) + DNCP_HASH_LEN(o);
+
+  /* We multicast only 'stable' state. Unicast, we give everything we have. */
+  if (!maximum_size)
+    return true;
+  if (o->graph_dirty)
+    return false;
+  return maximum_size >= len + o->network_hash_records_count * (4 + ns_len);
+}
+
+static bool _push_network_state(struct tlv_buf *tb, dncp o,
+                                size_t maximum_size)
+{
+  struct tlv_attr *a, *a2;
+  bool check_dup = false;
+  void *p, *end;
+
+  if (!_net_state_update(o))
+    return false;
+
+  /* Node identifiers are unique, so duplicates are possible only
+   * if the buffer had node states in it already. */
+  if (tb->head)
+    tlv_for_each_attr(a, tb->head)
+      if (tlv_id(a) == DNCP_T_NODE_STATE)
+        {
+          check_dup = true;
+          break;
+        }
+
+  /* First the network state TLV, and then node states if they fit. */
+  end = o->net_state + o->net_state_len;
+  for (p = o->net_state ; p < end ; p += tlv_pad_len(a))
+    {
+      a = p;
+      if (!(a2 = _push_tlv(tb, tlv_id(a), tlv_len(a))))
+        return false;
+      memcpy(tlv_data(a2), tlv_data(a), tlv_len(a));
+      if (p == o->net_state)
+        {
+          _maybe_pop_tlv(tb, a2);
+          if (!_net_state_fits(o, maximum_size, tlv_len(tb->head)))
+            break;
+        }
+      else if (check_dup)
+        _maybe_pop_tlv(tb, a2);
+    }
+  return true;
+}
+
+/* Append TLVs of a reply to another one bound to the same destination. */
+static bool _merge_reply(dncp_reply reply, dncp_reply reply2)
+{
+  struct tlv_attr *a, *a2;
+
+  tlv_for_each_attr(a, reply2->buf.head)
+    {
+      if (!(a2 = _push_tlv(&reply->buf, tlv_id(a), tlv_len(a))))
+        return false;
+      memcpy(tlv_data(a2), tlv_data(a), tlv_len(a));
+      _maybe_pop_tlv(&reply->buf, a2);
     }
   return true;
 }
@@ -203,6 +348,59 @@ static bool _push_req_node_data_tlv(struct tlv_buf *tb,
 
 /****************************************** Actual payload sending utilities */
 
+static bool _send_buf_grow(struct tlv_buf *buf, int minlen)
+{
+  int nlen = buf->buflen * 2;
+  void *nbuf;
+
+  if (nlen < buf->buflen + minlen)
+    nlen = buf->buflen + minlen;
+  if (!(nbuf = realloc(buf->buf, nlen)))
+    return false;
+  buf->buf = nbuf;
+  buf->buflen = nlen;
+  return true;
+}
+
+bool dncp_send_buf_init(dncp o, struct tlv_buf *tb, int id, int size_hint)
+{
+  memset(tb, 0, sizeof(*tb));
+  tb->grow = _send_buf_grow;
+  if (o->send_buf)
+    {
+      tb->buf = o->send_buf;
+      tb->buflen = o->send_buf_size;
+      o->send_buf = NULL;
+    }
+  if (size_hint < (int)TLV_SIZE)
+    size_hint = TLV_SIZE;
+  if (tb->buflen < size_hint && !_send_buf_grow(tb, size_hint - tb->buflen))
+    {
+      L_ERR("dncp_send_buf_init: realloc failed");
+      free(tb->buf);
+      tb->buf = NULL;
+      return false;
+    }
+  tlv_buf_init(tb, id);
+  return true;
+}
+
+void dncp_send_buf_free(dncp o, struct tlv_buf *tb)
+{
+  if (!tb->buf)
+    return;
+  if (!o->send_buf || o->send_buf_size < tb->buflen)
+    {
+      free(o->send_buf);
+      o->send_buf = tb->buf;
+      o->send_buf_size = tb->buflen;
+    }
+  else
+    free(tb->buf);
+  tb->buf = NULL;
+  tb->buflen = 0;
+}
+
 void dncp_ep_i_send_buf(dncp_ep_i l,
                         struct sockaddr_in6 *src, struct sockaddr_in6 *dst,
                         struct tlv_buf *buf)
@@ -211,7 +409,7 @@ void dncp_ep_i_send_buf(dncp_ep_i l,
 
   o->ext->cb.send(o->ext, &l->conf, src, dst,
                   tlv_data(buf->head), tlv_len(buf->head));
-  tlv_buf_free(buf);
+  dncp_send_buf_free(o, buf);
 }
 
 void dncp_reply_send(dncp_reply reply)
@@ -221,27 +419,119 @@ void dncp_reply_send(dncp_reply reply)
 }
 
 
+/* Send the buffers as one message; they are copied together only if
+ * the platform cannot gather them itself. */
+static void _send_iovec(dncp_ep_i l,
+                        struct sockaddr_in6 *src, struct sockaddr_in6 *dst,
+                        struct iovec *iov, int iov_len)
+{
+  dncp o = l->dncp;
+  struct tlv_buf tb;
+  size_t len = 0;
+  void *p;
+  int i;
+
+  if (o->ext->cb.send_iovec)
+    {
+      o->ext->cb.send_iovec(o->ext, &l->conf, src, dst, iov, iov_len);
+      return;
+    }
+  for (i = 0 ; i < iov_len ; i++)
+    len += iov[i].iov_len;
+  if (!dncp_send_buf_init(o, &tb, 0, TLV_SIZE + len))
+    return;
+  p = tlv_data(tb.head);
+  for (i = 0 ; i < iov_len ; i++)
+    {
+      memcpy(p, iov[i].iov_base, iov[i].iov_len);
+      p += iov[i].iov_len;
+    }
+  o->ext->cb.send(o->ext, &l->conf, src, dst, tlv_data(tb.head), len);
+  dncp_send_buf_free(o, &tb);
+}
+
+/* How many node states fit in each of (at most) maximum_datagrams
+ * datagrams of maximum_size after len bytes of other TLVs; 0 if they
+ * cannot be split that way. */
+static int _net_state_split(dncp o, size_t maximum_size,
+                            int maximum_datagrams, size_t len)
+{
+  int ns_size = _tlv_size(sizeof(dncp_t_node_state_s) + DNCP_NI_LEN(o)
+                          + DNCP_HASH_LEN(o));
+  int nn = o->network_hash_records_count;
+  int per;
+
+  if (maximum_datagrams <= 1 || o->graph_dirty || maximum_size <= len)
+    return 0;
+  per = (maximum_size - len) / ns_size;
+  if (!per || (nn + per - 1) / per > maximum_datagrams)
+    return 0;
+  return per;
+}
+
 void dncp_ep_i_send_network_state(dncp_ep_i l,
                                   struct sockaddr_in6 *src,
                                   struct sockaddr_in6 *dst,
                                   size_t maximum_size,
+                                  int maximum_datagrams,
                                   bool always_ep_id)
 {
-  struct tlv_buf tb;
+  uint32_t epbuf[(TLV_SIZE + DNCP_NI_MAX_LEN + sizeof(dncp_t_ep_id_s) + 3) / 4];
+  struct tlv_attr *a = (struct tlv_attr *)epbuf;
   dncp o = l->dncp;
+  int hsize = _tlv_size(DNCP_HASH_LEN(o));
+  int ns_size = _tlv_size(sizeof(dncp_t_node_state_s) + DNCP_NI_LEN(o)
+                          + DNCP_HASH_LEN(o));
+  struct iovec iov[3];
+  int iov_len = 0;
+  size_t len = 0;
+  void *p, *end;
+  int per;
+
+  if (!_net_state_update(o))
+    return;
+  if (_has_ep_id_tlv(l, dst, always_ep_id))
+    {
+      _write_ep_id_tlv(a, l);
+      iov[iov_len].iov_base = a;
+      iov[iov_len++].iov_len = len = tlv_pad_len(a);
+    }
+
+  /* The cached network state goes out as-is if it fits. */
+  len += hsize;
+  iov[iov_len].iov_base = o->net_state;
+  if (_net_state_fits(o, maximum_size, len))
+    {
+      iov[iov_len++].iov_len = o->net_state_len;
+      L_DEBUG("dncp_ep_i_send_network_state -> " SA6_F "%%" DNCP_LINK_F,
+              SA6_D(dst), DNCP_LINK_D(l));
+      _send_iovec(l, src, dst, iov, iov_len);
+      return;
+    }
+  iov[iov_len++].iov_len = hsize;
 
-  memset(&tb, 0, sizeof(tb));
-  tlv_buf_init(&tb, 0); /* not passed anywhere */
-  if (!_push_ep_id_tlv(&tb, l, dst, always_ep_id))
-    goto done;
-  if (!_push_network_state(&tb, o, maximum_size))
-    goto done;
-  L_DEBUG("dncp_ep_i_send_network_state -> " SA6_F "%%" DNCP_LINK_F,
-          SA6_D(dst), DNCP_LINK_D(l));
-  dncp_ep_i_send_buf(l, src, dst, &tb);
-  return;
- done:
-  tlv_buf_free(&tb);
+  /* Otherwise, the node states are split across several datagrams,
+   * each with the network state, so that receivers can still spot
+   * the differing nodes directly. If even that is not possible, just
+   * the network state is sent. */
+  if (!(per = _net_state_split(o, maximum_size, maximum_datagrams, len)))
+    {
+      L_DEBUG("dncp_ep_i_send_network_state -> " SA6_F "%%" DNCP_LINK_F
+              " (short)", SA6_D(dst), DNCP_LINK_D(l));
+      _send_iovec(l, src, dst, iov, iov_len);
+      return;
+    }
+  end = o->net_state + o->net_state_len;
+  for (p = o->net_state + hsize ; p < end ; p += per * ns_size)
+    {
+      iov[iov_len].iov_base = p;
+      iov[iov_len].iov_len = end - p < per * ns_size ? end - p : per * ns_size;
+      L_DEBUG("dncp_ep_i_send_network_state -> " SA6_F "%%" DNCP_LINK_F
+              " (%d/%d node states)", SA6_D(dst), DNCP_LINK_D(l),
+              (int)((p - o->net_state - hsize) / ns_size + 1),
+              o->network_hash_records_count);
+      _send_iovec(l, src, dst, iov, iov_len + 1);
+    }
 }
 
 /************************************************************ Input handling */
@@ -249,17 +539,9 @@ void dncp_ep_i_send_network_state(dncp_ep_i l,
 static dncp_tlv
 _find_local_tlv_by_remote(dncp o, struct sockaddr_in6 *remote)
 {
-  dncp_tlv t;
-  dncp_t_peer ne;
+  dncp_peer p = dncp_find_peer_by_sa6(o, remote);
 
-  dncp_for_each_tlv(o, t)
-    if ((ne = dncp_tlv_peer(o, &t->tlv)))
-      {
-        dncp_peer n = dncp_tlv_get_extra(t);
-        if (memcmp(&n->last_sa6, remote, sizeof(*remote)) == 0)
-          return t;
-      }
-  return NULL;
+  return p ? p->tlv : NULL;
 }
 
 static dncp_tlv
@@ -267,20 +549,19 @@ _heard(dncp_ep_i l, dncp_t_ep_id lid, struct sockaddr_in6 *src,
        bool multicast)
 {
   int nplen = sizeof(dncp_t_peer_s) + DNCP_NI_LEN(l->dncp);
-  void *np = alloca(nplen);
-  dncp_t_peer n_sample = np + DNCP_NI_LEN(l->dncp);
+  unsigned char np[DNCP_NI_MAX_LEN + sizeof(dncp_t_peer_s)];
+  dncp_t_peer n_sample = (dncp_t_peer)(np + DNCP_NI_LEN(l->dncp));
   memcpy(np, dncp_tlv_get_node_id(l->dncp, lid), DNCP_NI_LEN(l->dncp));
   n_sample->peer_ep_id = lid->ep_id;
   n_sample->ep_id = l->ep_id;
 
-  dncp_peer n;
-  dncp_tlv t = dncp_find_tlv(l->dncp, DNCP_T_PEER, np, nplen);
-  if (!t)
+  dncp_peer n = dncp_find_peer(l->dncp, np);
+  if (!n)
     {
       /* Doing add based on multicast is relatively insecure. */
       if (multicast)
         return NULL;
-      t = dncp_add_tlv(l->dncp, DNCP_T_PEER, np, nplen, sizeof(*n));
+      dncp_tlv t = dncp_add_tlv(l->dncp, DNCP_T_PEER, np, nplen, sizeof(*n));
       if (!t)
         return NULL;
       n = dncp_tlv_get_extra(t);
@@ -289,14 +570,74 @@ _heard(dncp_ep_i l, dncp_t_ep_id lid, struct sockaddr_in6 *src,
               DNCP_NI_REPR(l->dncp, dncp_tlv_get_node_id(l->dncp, lid)),
               DNCP_LINK_D(l));
     }
-  else
-    n = dncp_tlv_get_extra(t);
 
   if (!multicast)
+    dncp_peer_set_last_sa6(l->dncp, n, src);
+  return n->tlv;
+}
+
+/* Whether node state is newer than what we have of the node. */
+static bool _node_state_is_new(dncp o, dncp_node n, dncp_t_node_state ns,
+                               dncp_hash h)
+{
+  uint32_t new_update_number = be32_to_cpu(ns->update_number);
+
+  return !n
+    || (dncp_update_number_gt(n->update_number, new_update_number)
+        || (new_update_number == n->update_number
+            && memcmp(&n->node_data_hash, h, DNCP_HASH_LEN(o)) != 0));
+}
+
+/* Node data in received node states is verified in batches; when the
+ * hash of one is needed, the following new node states carrying data
+ * are hashed as well. */
+typedef struct {
+  struct tlv_attr *tlvs[DNCP_HASH_BATCH];
+  dncp_hash_s hashes[DNCP_HASH_BATCH];
+  int count, i;
+} dncp_node_data_batch_s, *dncp_node_data_batch;
+
+static dncp_hash _node_data_batch_get(dncp o, dncp_node_data_batch b,
+                                      struct tlv_attr *msg,
+                                      struct tlv_attr *first)
+{
+  int nilen = DNCP_NI_LEN(o);
+  int ns_len = sizeof(dncp_t_node_state_s) + nilen + DNCP_HASH_LEN(o);
+  const void *bufs[DNCP_HASH_BATCH];
+  size_t lens[DNCP_HASH_BATCH];
+  void *dsts[DNCP_HASH_BATCH];
+  struct tlv_attr *a;
+
+  while (b->i < b->count && b->tlvs[b->i] != first)
+    b->i++;
+  if (b->i < b->count)
+    return &b->hashes[b->i];
+  b->count = b->i = 0;
+  tlv_for_each_attr(a, msg)
     {
-      n->last_sa6 = *src;
+      if ((void *)a < (void *)first)
+        continue;
+      if (a != first)
+        {
+          if (tlv_id(a) != DNCP_T_NODE_STATE || (int)tlv_len(a) <= ns_len)
+            continue;
+          if (!_node_state_is_new(o,
+                                  dncp_find_node_by_node_id(o, tlv_data(a),
+                                                            false),
+                                  tlv_data(a) + nilen,
+                                  tlv_data(a) + nilen
+                                  + sizeof(dncp_t_node_state_s)))
+            continue;
+        }
+      bufs[b->count] = tlv_data(a) + ns_len;
+      lens[b->count] = tlv_len(a) - ns_len;
+      dsts[b->count] = &b->hashes[b->count];
+      b->tlvs[b->count] = a;
+      if (++b->count == DNCP_HASH_BATCH)
+        break;
     }
-  return t;
+  dncp_hash_multi(o, bufs, lens, dsts, b->count);
+  return &b->hashes[0];
 }
 
 /* Handle a single received message. */
@@ -312,10 +653,11 @@ handle_message(dncp_ep_i l,
   dncp_t_ep_id lid = NULL;
   bool seen_lid = false;
   dncp_peer ne = NULL;
-  struct tlv_buf tb;
   uint32_t new_update_number;
   bool should_request_network_state = false;
+  bool inconsistent_network_state = false;
   bool updated_or_requested_state = false;
+  bool seen_node_state = false;
   bool multicast = dst == NULL;
   int nilen = DNCP_NI_LEN(l->dncp);
   int hlen = DNCP_HASH_LEN(l->dncp);
@@ -323,6 +665,7 @@ handle_message(dncp_ep_i l,
   char fake_lid[DNCP_NI_MAX_LEN + sizeof(*lid)];
   bool is_local = false;
   dncp_reply_s reply = { .has_src = !!dst, .dst = *src, .l = l };
+  dncp_node_data_batch_s nd_batch = { .count = 0 };
 
   if (reply.has_src)
     reply.src = *dst;
@@ -422,7 +765,7 @@ handle_message(dncp_ep_i l,
                 break;
               }
 
-            if (n->last_reachable_prune != o->last_prune)
+            if (!n->reachable)
               {
                 L_DEBUG("not reachable request, ignoring");
                 break;
@@ -460,7 +803,7 @@ handle_message(dncp_ep_i l,
             /* MUST: rate limit check */
             if ((dncp_time(o) - l->last_req_network_state) >=
                 l->conf.trickle_imin)
-              should_request_network_state = true;
+              inconsistent_network_state = true;
           }
         break;
 
@@ -476,12 +819,10 @@ handle_message(dncp_ep_i l,
             L_INFO("invalid length node state TLV received - ignoring");
             break;
           }
+        seen_node_state = true;
         n = dncp_find_node_by_node_id(o, ni, false);
         new_update_number = be32_to_cpu(ns->update_number);
-        bool interesting = !n
-          || (dncp_update_number_gt(n->update_number, new_update_number)
-              || (new_update_number == n->update_number
-                  && memcmp(&n->node_data_hash, h, hlen) != 0));
+        bool interesting = _node_state_is_new(o, n, ns, h);
         L_DEBUG("saw %s %s for %s/%p (update number %d)",
                 interesting ? "new" : "old",
                 nd_len ? "state" : "state+data",
@@ -495,10 +836,9 @@ handle_message(dncp_ep_i l,
         if (nd_len > 0)
           {
             void *nd_data = tlv_data(a) + ns_len;
-            dncp_hash_s nd_hash;
+            dncp_hash nd_hash = _node_data_batch_get(o, &nd_batch, msg, a);
 
-            o->ext->cb.hash(nd_data, nd_len, &nd_hash);
-            if (memcmp(&nd_hash, h, hlen))
+            if (memcmp(nd_hash, h, hlen))
               {
                 L_INFO("broken hash compared to data in node state");
                 break;
@@ -514,6 +854,7 @@ handle_message(dncp_ep_i l,
                   {
                     o->collided = true;
                     n->update_number = new_update_number + 1000 - 1;
+                    dncp_node_network_hash_dirty(n);
                     /* republish increments the count too */
                     o->republish_tlvs = true;
                     dncp_schedule(o);
@@ -521,22 +862,26 @@ handle_message(dncp_ep_i l,
                 return;
               }
             /* Ok. nd contains more recent TLV data than what we have
-             * already. Woot. */
-            memset(&tb, 0, sizeof(tb));
-            tlv_buf_init(&tb, 0); /* not passed anywhere */
-            if (tlv_put_raw(&tb, nd_data, nd_len))
-              {
-                dncp_node_set(n, new_update_number,
-                              dncp_time(o) - be32_to_cpu(ns->ms_since_origination),
-                              tb.head);
-                memcpy(&n->node_data_hash, h, hlen);
-                n->node_data_hash_dirty = false;
-              }
-            else
+             * already. Woot. If it is actually same as what we have,
+             * just bump the update number; otherwise, copy it out of
+             * the receive buffer (which is reused for next packet). */
+            struct tlv_attr *nd = n->tlv_container;
+            if (!nd || tlv_len(nd) != (unsigned int)nd_len
+                || memcmp(tlv_data(nd), nd_data, nd_len))
               {
-                L_DEBUG("tlv_put_raw failed");
-                tlv_buf_free(&tb);
+                int len = nd_len + sizeof(*nd);
+
+                if (!(nd = dncp_node_data_alloc(o, len)))
+                  return; /* OOM */
+                tlv_init(nd, 0, len);
+                memcpy(tlv_data(nd), nd_data, nd_len);
+                tlv_fill_pad(nd);
               }
+            dncp_node_set(n, new_update_number,
+                          dncp_time(o) - be32_to_cpu(ns->ms_since_origination),
+                          nd);
+            memcpy(&n->node_data_hash, h, hlen);
+            n->node_data_hash_dirty = false;
             found_data = true;
           }
         if (!found_data)
@@ -557,7 +902,12 @@ handle_message(dncp_ep_i l,
   }
 
   /* Now, we can handle whether or not to send a network state request
-   * based on the flags we know. */
+   * based on the flags we know. If node states were included (possibly
+   * just some of them, if the sender split them across several
+   * datagrams), any differing nodes were already spotted above; the
+   * full network state would not tell us more. */
+  if (inconsistent_network_state && !seen_node_state)
+    should_request_network_state = true;
   if (should_request_network_state && !updated_or_requested_state && !is_local)
     {
       (void)_push_network_state_tlv(&reply.buf, l->dncp);
@@ -573,90 +923,183 @@ handle_message(dncp_ep_i l,
   if (multicast)
     {
       t = t + random() % (l->conf.trickle_imin / 2);
-      if (!l->send_reply_at || l->send_reply_at > t)
+      /* Requests triggered by consecutive datagrams of the same sender
+       * (e.g. split node states) are sent together. */
+      if (l->send_reply_at
+          && !memcmp(&l->reply.dst, &reply.dst, sizeof(reply.dst))
+          && _merge_reply(&l->reply, &reply))
+        {
+          if (l->send_reply_at > t)
+            l->send_reply_at = t;
+          dncp_send_buf_free(o, &reply.buf);
+          dncp_schedule(o);
+        }
+      else if (!l->send_reply_at || l->send_reply_at > t)
         {
           if (l->send_reply_at)
-            tlv_buf_free(&l->reply.buf);
+            dncp_send_buf_free(o, &l->reply.buf);
           l->send_reply_at = t;
           l->reply = reply;
           dncp_schedule(o);
         }
+      else
+        dncp_send_buf_free(o, &reply.buf);
     }
   else
     dncp_reply_send(&reply);
 }
 
 
-void dncp_ext_readable(dncp o)
+/* Filter and dispatch a single received message. */
+static void _received(dncp o, dncp_ep ep,
+                      struct sockaddr_in6 *src, struct sockaddr_in6 *dst,
+                      int flags, struct tlv_attr *msg)
 {
-  unsigned char buf[DNCP_MAXIMUM_PAYLOAD_SIZE+sizeof(struct tlv_attr)];
-  struct tlv_attr *msg = (struct tlv_attr *)buf;
-  ssize_t read;
-  struct sockaddr_in6 *src;
-  struct sockaddr_in6 *dst;
-  dncp_ep_i l;
-  dncp_ep ep;
+  dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
   dncp_subscriber s;
-  int flags;
-
-  while ((read = o->ext->cb.recv(o->ext, &ep, &src, &dst, &flags,
-                                 msg->data, DNCP_MAXIMUM_PAYLOAD_SIZE)) > 0)
-    {
-      tlv_init(msg, 0, read + sizeof(struct tlv_attr));
-
-      l = container_of(ep, dncp_ep_i_s, conf);
 
-      /* This is raw */
-      list_for_each_entry(s, &o->subscribers[DNCP_CALLBACK_SOCKET_MSG],
-                          lhs[DNCP_CALLBACK_SOCKET_MSG])
-        s->msg_received_cb(s, ep, src, dst, flags, msg);
+  /* This is raw */
+  list_for_each_entry(s, &o->subscribers[DNCP_CALLBACK_SOCKET_MSG],
+                      lhs[DNCP_CALLBACK_SOCKET_MSG])
+    s->msg_received_cb(s, ep, src, dst, flags, msg);
 
-      if (!l->enabled)
-        {
-          L_DEBUG("ignoring packet on non-enabled interface %s",
-                  l->conf.ifname);
-          continue;
-        }
+  if (!l->enabled)
+    {
+      L_DEBUG("ignoring packet on non-enabled interface %s",
+              l->conf.ifname);
+      return;
+    }
 
-      if (dst
-          && !(flags & DNCP_RECV_FLAG_SRC_LINKLOCAL) !=
-          !(flags & DNCP_RECV_FLAG_DST_LINKLOCAL))
-        {
-          L_DEBUG("ignoring linklocal <> non-linklocal traffic");
-          continue;
-        }
+  if (dst
+      && !(flags & DNCP_RECV_FLAG_SRC_LINKLOCAL) !=
+      !(flags & DNCP_RECV_FLAG_DST_LINKLOCAL))
+    {
+      L_DEBUG("ignoring linklocal <> non-linklocal traffic");
+      return;
+    }
 
-      if (!(flags & DNCP_RECV_FLAG_SRC_LINKLOCAL))
+  if (!(flags & DNCP_RECV_FLAG_SRC_LINKLOCAL))
+    {
+      if (flags & DNCP_RECV_FLAG_SECURE)
         {
-          if (flags & DNCP_RECV_FLAG_SECURE)
+          if (!ep->accept_secure_nonlocal_traffic)
             {
-              if (!ep->accept_secure_nonlocal_traffic)
-                {
-                  L_DEBUG("ignoring secure non-local traffic from" SA6_F,
-                          SA6_D(src));
-                  continue;
-                }
+              L_DEBUG("ignoring secure non-local traffic from" SA6_F,
+                      SA6_D(src));
+              return;
             }
-          else
+        }
+      else
+        {
+          if (!ep->accept_insecure_nonlocal_traffic)
             {
-              if (!ep->accept_insecure_nonlocal_traffic)
-                {
-                  L_DEBUG("ignoring insecure non-local traffic from" SA6_F,
-                          SA6_D(src));
-                  continue;
-                }
+              L_DEBUG("ignoring insecure non-local traffic from" SA6_F,
+                      SA6_D(src));
+              return;
             }
         }
+    }
 
-      if (dst
-          && (flags & (DNCP_RECV_FLAG_SECURE | DNCP_RECV_FLAG_SECURE_TRIED))
-          == DNCP_RECV_FLAG_SECURE_TRIED)
+  if (dst
+      && (flags & (DNCP_RECV_FLAG_SECURE | DNCP_RECV_FLAG_SECURE_TRIED))
+      == DNCP_RECV_FLAG_SECURE_TRIED)
+    {
+      L_DEBUG("ignoring insecure unicast from " SA6_F, SA6_D(src));
+      return;
+    }
+  handle_message(l, src, dst, msg);
+}
+
+/* Largest message accepted on any endpoint. */
+static size_t _recv_batch_msg_size(dncp o)
+{
+  size_t size = 0;
+  dncp_ep ep;
+
+  dncp_for_each_ep(o, ep)
+    {
+      if (ep->maximum_unicast_size <= 0)
+        return DNCP_MAXIMUM_PAYLOAD_SIZE;
+      if ((size_t)ep->maximum_unicast_size > size)
+        size = ep->maximum_unicast_size;
+      if (ep->maximum_multicast_size > 0
+          && (size_t)ep->maximum_multicast_size > size)
+        size = ep->maximum_multicast_size;
+    }
+  if (!size || size > DNCP_MAXIMUM_PAYLOAD_SIZE)
+    return DNCP_MAXIMUM_PAYLOAD_SIZE;
+  return size;
+}
+
+/* Drain the I/O using recv_batch, and dispatch each burst. Slots are
+ * only as large as the largest message the endpoints accept (larger
+ * ones are dropped by the I/O), and there are as many of them as fit
+ * in DNCP_RECV_BATCH_BUFFER_SIZE. */
+static void _readable_batch(dncp o)
+{
+  size_t msg_size = _recv_batch_msg_size(o);
+  size_t slot_size = msg_size + sizeof(struct tlv_attr);
+  int count = DNCP_RECV_BATCH_BUFFER_SIZE / slot_size;
+  dncp_ext_msg_s msgs[DNCP_RECV_BATCH_SIZE];
+  int i, r;
+
+  if (count < 1)
+    count = 1;
+  else if (count > DNCP_RECV_BATCH_SIZE)
+    count = DNCP_RECV_BATCH_SIZE;
+  if (o->recv_batch_slot_size != slot_size)
+    {
+      free(o->recv_batch_buf);
+      o->recv_batch_buf = NULL;
+      o->recv_batch_slot_size = 0;
+    }
+  if (!o->recv_batch_buf)
+    {
+      if (!(o->recv_batch_buf = malloc(slot_size * count)))
         {
-          L_DEBUG("ignoring insecure unicast from " SA6_F, SA6_D(src));
-          continue;
+          L_ERR("unable to allocate receive buffers");
+          return;
         }
-      handle_message(l, src, dst, msg);
+      o->recv_batch_slot_size = slot_size;
+    }
+  for (i = 0 ; i < count ; i++)
+    {
+      msgs[i].buf = o->recv_batch_buf + i * slot_size
+        + sizeof(struct tlv_attr);
+      msgs[i].buf_len = msg_size;
+    }
+  while ((r = o->ext->cb.recv_batch(o->ext, msgs, count)) > 0)
+    for (i = 0 ; i < r ; i++)
+      {
+        dncp_ext_msg m = &msgs[i];
+        struct tlv_attr *msg = m->buf - sizeof(struct tlv_attr);
 
+        tlv_init(msg, 0, m->len + sizeof(struct tlv_attr));
+        _received(o, m->ep, &m->src, m->multicast ? NULL : &m->dst,
+                  m->flags, msg);
+      }
+}
+
+void dncp_ext_readable(dncp o)
+{
+  unsigned char buf[DNCP_MAXIMUM_PAYLOAD_SIZE+sizeof(struct tlv_attr)];
+  struct tlv_attr *msg = (struct tlv_attr *)buf;
+  ssize_t read;
+  struct sockaddr_in6 *src;
+  struct sockaddr_in6 *dst;
+  dncp_ep ep;
+  int flags;
+
+  if (o->ext->cb.recv_batch)
+    {
+      _readable_batch(o);
+      return;
+    }
+  while ((read = o->ext->cb.recv(o->ext, &ep, &src, &dst, &flags,
+                                 msg->data, DNCP_MAXIMUM_PAYLOAD_SIZE)) > 0)
+    {
+      tlv_init(msg, 0, read + sizeof(struct tlv_attr));
+      _received(o, ep, src, dst, flags, msg);
     }
 }
 
@@ -670,7 +1113,7 @@ void dncp_ext_ep_peer_state(dncp_ep ep,
 
   if (connected)
     {
-      dncp_ep_i_send_network_state(l, local, remote, 0, true);
+      dncp_ep_i_send_network_state(l, local, remote, 0, 1, true);
       return;
     }
   dncp_tlv t = _find_local_tlv_by_remote(o, remote);
@@ -679,6 +1122,7 @@ void dncp_ext_ep_peer_state(dncp_ep ep,
     {
       dncp_peer n = dncp_tlv_get_extra(t);
       n->last_contact = 0;
+      dncp_timer_advance(o, &n->timer, dncp_time(o));
     }
   dncp_schedule(o);
 }
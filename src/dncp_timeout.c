@@ -13,6 +13,97 @@
 
 #include "dncp_i.h"
 
+static void _timer_place(dncp o, dncp_timer t, int i)
+{
+  o->timers[i] = t;
+  t->index = i;
+}
+
+static void _timer_sift_up(dncp o, dncp_timer t)
+{
+  int i = t->index;
+
+  while (i > 0)
+    {
+      int parent = (i - 1) / 2;
+      if (o->timers[parent]->at <= t->at)
+        break;
+      _timer_place(o, o->timers[parent], i);
+      i = parent;
+    }
+  _timer_place(o, t, i);
+}
+
+static void _timer_sift_down(dncp o, dncp_timer t)
+{
+  int i = t->index;
+
+  while (true)
+    {
+      int child = 2 * i + 1;
+      if (child >= o->num_timers)
+        break;
+      if (child + 1 < o->num_timers
+          && o->timers[child + 1]->at < o->timers[child]->at)
+        child++;
+      if (t->at <= o->timers[child]->at)
+        break;
+      _timer_place(o, o->timers[child], i);
+      i = child;
+    }
+  _timer_place(o, t, i);
+}
+
+void dncp_timer_set(dncp o, dncp_timer t, hnetd_time_t at)
+{
+  if (t->index < 0)
+    {
+      if (!at)
+        return;
+      if (o->num_timers == o->timers_size)
+        {
+          int size = o->timers_size ? o->timers_size * 2 : 16;
+          dncp_timer *timers = realloc(o->timers, size * sizeof(*timers));
+          if (!timers)
+            {
+              L_ERR("unable to grow timer heap to %d", size);
+              return;
+            }
+          o->timers = timers;
+          o->timers_size = size;
+        }
+      t->at = at;
+      _timer_place(o, t, o->num_timers++);
+      _timer_sift_up(o, t);
+      return;
+    }
+  if (!at)
+    {
+      dncp_timer last = o->timers[--o->num_timers];
+      if (last != t)
+        {
+          _timer_place(o, last, t->index);
+          _timer_sift_up(o, last);
+          _timer_sift_down(o, last);
+        }
+      t->index = -1;
+      t->at = 0;
+      return;
+    }
+  bool earlier = at < t->at;
+  t->at = at;
+  if (earlier)
+    _timer_sift_up(o, t);
+  else
+    _timer_sift_down(o, t);
+}
+
+void dncp_timer_advance(dncp o, dncp_timer t, hnetd_time_t at)
+{
+  if (t->index < 0 || at < t->at)
+    dncp_timer_set(o, t, at);
+}
+
 static void ep_i_set_keepalive_interval(dncp_ep_i l, uint32_t value)
 {
   if (l->published_keepalive_interval == value)
@@ -31,6 +122,17 @@ static void ep_i_set_keepalive_interval(dncp_ep_i l, uint32_t value)
       dncp_add_tlv(o, DNCP_T_KEEPALIVE_INTERVAL, &ka, sizeof(ka), 0);
     }
   l->published_keepalive_interval = value;
+
+  /* Keep-alives may be due sooner now (on the endpoint, or towards its
+   * peers). */
+  hnetd_time_t now = dncp_time(o);
+  dncp_peer n;
+
+  if (l->enabled && !l->conf.unicast_only)
+    dncp_timer_advance(o, &l->timer, now);
+  dncp_for_each_peer(o, n)
+    if (dncp_peer_get_t_peer(o, n)->ep_id == l->ep_id)
+      dncp_timer_advance(o, &n->timer, now);
 }
 
 
@@ -57,13 +159,17 @@ static void trickle_send_nocheck(dncp_trickle t, dncp_ep_i l, dncp_peer ne)
   t->num_sent++;
   t->last_sent = dncp_time(l->dncp);
   int maximum_size = ne ? 0 : l->conf.maximum_multicast_size;
+  int maximum_datagrams = ne ? 1 : l->conf.maximum_multicast_datagrams;
   /* If Trickle has backed off, just send the short form, i.e. at most
    * just endpoint id + network state. */
   if (t->i != l->conf.trickle_imin)
-    maximum_size = 4 + sizeof(dncp_t_ep_id_s) + DNCP_NI_LEN(l->dncp)
-      + 4 + DNCP_HASH_LEN(l->dncp);
+    {
+      maximum_size = 4 + sizeof(dncp_t_ep_id_s) + DNCP_NI_LEN(l->dncp)
+        + 4 + DNCP_HASH_LEN(l->dncp);
+      maximum_datagrams = 1;
+    }
   dncp_ep_i_send_network_state(l, NULL, ne ? &ne->last_sa6: NULL,
-                               maximum_size, false);
+                               maximum_size, maximum_datagrams, false);
 }
 
 static void trickle_send(dncp_trickle t, dncp_ep_i l, dncp_peer ne)
@@ -80,93 +186,178 @@ static void trickle_send(dncp_trickle t, dncp_ep_i l, dncp_peer ne)
 static void _node_set_reachable(dncp_node n, bool value)
 {
   dncp o = n->dncp;
-  bool is_reachable = o->last_prune == n->last_reachable_prune;
 
-  if (is_reachable != value)
-    {
-      o->network_hash_dirty = true;
-
-      if (!value)
-        dncp_notify_subscribers_tlvs_changed(n, n->tlv_container_valid, NULL);
+  if (n->reachable == value)
+    return;
+  o->network_hash_dirty = true;
+  o->network_hash_records_dirty = true;
 
-      dncp_notify_subscribers_node_changed(n, value);
+  if (!value)
+    dncp_notify_subscribers_tlvs_changed(n, n->tlv_container_valid, NULL);
 
-      if (value)
-        dncp_notify_subscribers_tlvs_changed(n, NULL, n->tlv_container_valid);
+  n->reachable = value;
+  if (value)
+    list_del_init(&n->in_unreachable);
+  else
+    {
+      /* It was still reachable during the previous prune. */
+      n->last_reachable_prune = o->last_prune;
+      list_add_tail(&n->in_unreachable, &o->unreachable_nodes);
     }
+
+  dncp_notify_subscribers_node_changed(n, value);
+
   if (value)
-    n->last_reachable_prune = dncp_time(o);
+    dncp_notify_subscribers_tlvs_changed(n, NULL, n->tlv_container_valid);
 }
 
-static void _prune_rec(dncp_node n)
+/* Take n and its subtree out of the reachability spanning tree. The
+ * nodes stay reachable until dncp_prune decides otherwise. */
+static void _prune_detach(dncp_node n, struct list_head *detached)
 {
-  struct tlv_attr *a;
-  dncp_t_peer ne;
-  dncp_node n2;
-
-  if (!n)
-    return;
-
-  /* Stop the iteration if we're already added to current
-   * generation. */
-  if (n->in_nodes.version == n->dncp->nodes.version)
-    return;
-
-  /* If it was expired, we can ignore it and pretend it did not happen. */
-  if (dncp_time(n->dncp) >= n->expiration_time)
-    return;
+  dncp_node c, c2;
+
+  list_del_init(&n->in_parent);
+  n->parent = NULL;
+  n->prune_detached = true;
+  list_add_tail(&n->in_prune, detached);
+  list_for_each_entry_safe(c, c2, &n->children, in_parent)
+    _prune_detach(c, detached);
+}
 
-  L_DEBUG("_prune_rec %s / %p", DNCP_NODE_REPR(n), n);
+static void _prune_attach(dncp_node n, dncp_node parent,
+                          struct list_head *queue)
+{
+  dncp o = n->dncp;
 
-  /* Refresh the entry - we clearly did reach it. */
-  vlist_add(&n->dncp->nodes, &n->in_nodes, n);
+  L_DEBUG("_prune_attach %s / %p", DNCP_NODE_REPR(n), n);
+  if (n->prune_detached)
+    {
+      list_del_init(&n->in_prune);
+      n->prune_detached = false;
+    }
+  n->parent = parent;
+  if (parent)
+    list_add_tail(&n->in_parent, &parent->children);
+  list_add_tail(&n->in_prune, queue);
+  o->next_expiration = TMIN(o->next_expiration, n->expiration_time);
   _node_set_reachable(n, true);
-
-  /* Look at it's neighbors. */
-  /* Ignore if it's not _bidirectional_ neighbor. Unidirectional
-   * ones lead to graph not settling down. */
-  dncp_node_for_each_tlv_with_t_v(n, a, DNCP_T_PEER, false)
-    if ((ne = dncp_tlv_peer(n->dncp, a)))
-      if ((n2 = dncp_node_find_neigh_bidir(n, ne)))
-        _prune_rec(n2);
 }
 
-static void dncp_prune(dncp o)
+void dncp_prune(dncp o)
 {
   hnetd_time_t now = dncp_time(o);
   int grace_interval = o->ext->conf.grace_interval;
   hnetd_time_t grace_after = now - grace_interval;
+  struct list_head detached, queue;
+  dncp_node n, n2;
+  int i;
 
   /* Logic fails if time isn't moving forward-ish */
   assert(now != o->last_prune);
 
-  L_DEBUG("dncp_prune %p", o);
+  INIT_LIST_HEAD(&detached);
+  INIT_LIST_HEAD(&queue);
 
-  /* Prune the node graph. IOW, start at own node, flood fill, and zap
-   * anything that didn't seem appropriate. */
-  vlist_update(&o->nodes);
+  /* Nodes expiring (or change of own node) mean recalculating
+   * everything. Otherwise, we only have to look at the parts of the
+   * spanning tree that lost a link, and at the nodes that gained
+   * one. */
+  if (o->prune_full
+      || (o->next_expiration && o->next_expiration <= now))
+    {
+      L_DEBUG("dncp_prune %p (full)", o);
+      o->prune_full = false;
+      o->next_expiration = 0;
+      dncp_for_each_node_including_unreachable(o, n)
+        if (n->reachable && !n->prune_detached)
+          _prune_detach(n, &detached);
+      if (now < o->own_node->expiration_time)
+        _prune_attach(o->own_node, NULL, &queue);
+    }
+  else
+    {
+      L_DEBUG("dncp_prune %p", o);
+      list_for_each_entry(n, &o->graph_dirty_nodes, in_graph_dirty)
+        {
+          dncp_node c, c2;
 
-  _prune_rec(o->own_node);
+          if (!n->reachable || n->prune_detached)
+            continue;
+          if (n != o->own_node
+              && (!n->parent || !dncp_node_has_neighbor(n, n->parent)))
+            {
+              _prune_detach(n, &detached);
+              continue;
+            }
+          list_for_each_entry_safe(c, c2, &n->children, in_parent)
+            if (!dncp_node_has_neighbor(n, c))
+              _prune_detach(c, &detached);
+        }
 
-  dncp_node n;
-  hnetd_time_t next_time = 0;
-  vlist_for_each_element(&o->nodes, n, in_nodes)
+      /* Detached nodes with a neighbor still in the tree are
+       * reachable through it. */
+      list_for_each_entry_safe(n, n2, &detached, in_prune)
+        for (i = 0 ; i < n->num_neighbors ; i++)
+          {
+            dncp_node p = n->neighbors[i];
+            if (p->reachable && !p->prune_detached
+                && now < n->expiration_time)
+              {
+                _prune_attach(n, p, &queue);
+                break;
+              }
+          }
+
+      /* Reachable nodes which gained neighbors may have made some
+       * more reachable. */
+      list_for_each_entry(n, &o->graph_dirty_nodes, in_graph_dirty)
+        if (n->reachable && !n->prune_detached && list_empty(&n->in_prune))
+          list_add_tail(&n->in_prune, &queue);
+    }
+
+  /* Flood fill from the queue to nodes not in the tree. */
+  while (!list_empty(&queue))
     {
-      if (n->in_nodes.version == o->nodes.version)
+      n = list_first_entry(&queue, dncp_node_s, in_prune);
+      list_del_init(&n->in_prune);
+      for (i = 0 ; i < n->num_neighbors ; i++)
         {
-          /* Determine when the origination time overflows */
-          next_time = TMIN(next_time, n->expiration_time);
-          continue;
+          n2 = n->neighbors[i];
+          if (n2->reachable && !n2->prune_detached)
+            continue;
+          /* If it was expired, we can ignore it and pretend it did
+           * not happen. */
+          if (now >= n2->expiration_time)
+            continue;
+          _prune_attach(n2, n, &queue);
         }
+    }
+
+  /* Whatever is still detached, is no longer reachable. */
+  list_for_each_entry_safe(n, n2, &detached, in_prune)
+    {
+      list_del_init(&n->in_prune);
+      n->prune_detached = false;
+      _node_set_reachable(n, false);
+    }
+
+  list_for_each_entry_safe(n, n2, &o->graph_dirty_nodes, in_graph_dirty)
+    list_del_init(&n->in_graph_dirty);
+
+  /* Zap the unreachable nodes that have been so for grace interval. */
+  hnetd_time_t next_time = o->next_expiration;
+  list_for_each_entry_safe(n, n2, &o->unreachable_nodes, in_unreachable)
+    {
       if (n->last_reachable_prune < grace_after)
-        continue;
+        {
+          vlist_delete(&o->nodes, &n->in_nodes);
+          continue;
+        }
       next_time = TMIN(next_time,
                        n->last_reachable_prune + grace_interval + 1);
-      vlist_add(&o->nodes, &n->in_nodes, n);
-      _node_set_reachable(n, false);
     }
   o->next_prune = next_time;
-  vlist_flush(&o->nodes);
   o->last_prune = now;
 }
 
@@ -263,12 +454,64 @@ static hnetd_time_t handle_trickle_and_ka(dncp_trickle t,
   return next;
 }
 
+void dncp_ep_i_timeout(dncp o, dncp_timer t)
+{
+  dncp_ep_i l = container_of(t, dncp_ep_i_s, timer);
+
+  if (!l->enabled || l->conf.unicast_only)
+    return;
+  dncp_timer_set(o, t, handle_trickle_and_ka(&l->trickle, l, NULL));
+}
+
+void dncp_peer_timeout(dncp o, dncp_timer t)
+{
+  dncp_peer n = container_of(t, dncp_peer_s, timer);
+  dncp_t_peer ne = dncp_peer_get_t_peer(o, n);
+  dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
+  dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
+  hnetd_time_t next = 0;
+  hnetd_time_t now = dncp_time(o);
+
+  if (n->keepalive_interval < 0)
+    n->keepalive_interval = _neighbor_interval(o, ne);
+
+  if (ep->unicast_only)
+    {
+      hnetd_time_t next_time = handle_trickle_and_ka(&n->trickle, l, n);
+      SET_NEXT(next_time, "n-trickle-ka");
+    }
+
+  /* Zero interval is valid only on unicast stream connection
+   * (=~TCP/TLS/..). In that case, we can ignore keepalive
+   * handling here. */
+  if (n->keepalive_interval || !ep->unicast_is_reliable_stream)
+    {
+      hnetd_time_t next_time = n->last_contact
+        + n->keepalive_interval * o->ext->conf.keepalive_multiplier_percent
+        / 100;
+
+      if (next_time <= now)
+        {
+          /* Zap the neighbor */
+#if L_LEVEL >= 7
+          L_DEBUG("Neighbor %s gone on " DNCP_LINK_F " - nothing in %d ms",
+                  DNCP_NI_REPR(o, dncp_tlv_get_node_id(o, ne)),
+                  DNCP_LINK_D(l), (int) (now - n->last_contact));
+#endif /* L_LEVEL >= 7 */
+          dncp_remove_tlv(o, n->tlv);
+          o->num_neighbor_dropped++;
+          return;
+        }
+      SET_NEXT(next_time, "neighbor validity");
+    }
+  dncp_timer_set(o, t, next);
+}
+
 void dncp_ext_timeout(dncp o)
 {
   hnetd_time_t next = 0;
   hnetd_time_t now = o->ext->cb.get_time(o->ext);
   dncp_ep ep;
-  dncp_tlv t, t2;
 
   /* Assumption: We're within RTC step here -> can use same timestamp
    * all the way. */
@@ -336,55 +579,22 @@ void dncp_ext_timeout(dncp o)
 
       ep_i_set_keepalive_interval(l, ep->keepalive_interval);
 
-      if (ep->unicast_only)
-        continue;
-
-      hnetd_time_t next_time = handle_trickle_and_ka(&l->trickle, l, NULL);
-      SET_NEXT(next_time, "l-trickle-ka");
+      /* Multicast Trickle is driven by the endpoint's timer; make sure
+       * it has one (e.g. just enabled, or no longer unicast only). */
+      if (!ep->unicast_only && l->timer.index < 0)
+        dncp_timer_set(o, &l->timer, now);
     }
 
-  /* Look at neighbors we should be worried about.. */
-  /* vlist_for_each_element(&l->neighbors, n, in_neighbors) */
-  dncp_t_peer ne;
-  dncp_for_each_tlv_safe(o, t, t2)
-    if ((ne = dncp_tlv_peer(o, &t->tlv)))
-      {
-        dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
-        dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
-        dncp_peer n = dncp_tlv_get_extra(t);
-        hnetd_time_t interval = _neighbor_interval(o, ne);
-
-        if (ep->unicast_only)
-          {
-            hnetd_time_t next_time = handle_trickle_and_ka(&n->trickle, l, n);
-            SET_NEXT(next_time, "n-trickle-ka");
-          }
-
-        /* Zero interval is valid only on unicast stream connection
-         * (=~TCP/TLS/..). In that case, we can ignore keepalive
-         * handling here. */
-        if (!interval && ep->unicast_is_reliable_stream)
-          continue;
-
-        hnetd_time_t next_time = n->last_contact
-          + interval * o->ext->conf.keepalive_multiplier_percent / 100;
-
-        /* No cause to do anything right now. */
-        if (next_time > now)
-          {
-            SET_NEXT(next_time, "neighbor validity");
-            continue;
-          }
-
-        /* Zap the neighbor */
-#if L_LEVEL >= 7
-        L_DEBUG("Neighbor %s gone on " DNCP_LINK_F " - nothing in %d ms",
-                DNCP_NI_REPR(o, dncp_tlv_get_node_id(o, ne)),
-                DNCP_LINK_D(l), (int) (now - n->last_contact));
-#endif /* L_LEVEL >= 7 */
-        dncp_remove_tlv(o, t);
-        o->num_neighbor_dropped++;
-      }
+  /* Run the endpoint and peer timers that are due; the callbacks
+   * reschedule them as needed. */
+  dncp_timer t;
+  while (o->num_timers && (t = o->timers[0])->at <= now)
+    {
+      dncp_timer_set(o, t, 0);
+      t->cb(o, t);
+    }
+  if (o->num_timers)
+    SET_NEXT(o->timers[0]->at, "timer");
 
   if (next && !o->immediate_scheduled)
     {
@@ -414,20 +624,22 @@ void dncp_trickle_reset(dncp o)
     {
       dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
       trickle_set_i(&l->trickle, l, ep->trickle_imin);
+      if (l->enabled && !ep->unicast_only)
+        dncp_timer_advance(o, &l->timer, l->trickle.send_time);
     }
 
   /* Per-peer */
-  dncp_t_peer ne;
-  dncp_tlv t;
-  dncp_for_each_tlv(o, t)
-    if ((ne = dncp_tlv_peer(o, &t->tlv)))
-      {
-        dncp_peer n = dncp_tlv_get_extra(t);
-        dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
-        dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
-
-        trickle_set_i(&n->trickle, l, ep->trickle_imin);
-      }
+  dncp_peer n;
+  dncp_for_each_peer(o, n)
+    {
+      dncp_t_peer ne = dncp_peer_get_t_peer(o, n);
+      dncp_ep ep = dncp_find_ep_by_id(o, ne->ep_id);
+      dncp_ep_i l = container_of(ep, dncp_ep_i_s, conf);
+
+      trickle_set_i(&n->trickle, l, ep->trickle_imin);
+      if (ep->unicast_only)
+        dncp_timer_advance(o, &n->timer, n->trickle.send_time);
+    }
 }
 
 void dncp_ext_ep_ready(dncp_ep ep, bool enabled)
@@ -448,13 +660,13 @@ void dncp_ext_ep_ready(dncp_ep ep, bool enabled)
   else
     {
       dncp o = l->dncp;
-      dncp_tlv t, t2;
-      dncp_t_peer ne;
+      dncp_peer n, n2;
+
+      dncp_for_each_peer_safe(o, n, n2)
+        if (dncp_peer_get_t_peer(o, n)->ep_id == l->ep_id)
+          dncp_remove_tlv(o, n->tlv);
 
-      dncp_for_each_tlv_safe(o, t, t2)
-        if ((ne = dncp_tlv_peer(o, &t->tlv)))
-          if (ne->ep_id == l->ep_id)
-            dncp_remove_tlv(o, t);
+      dncp_timer_set(o, &l->timer, 0);
 
       /* kill TLV, if any */
       ep_i_set_keepalive_interval(l, DNCP_KEEPALIVE_INTERVAL(o));
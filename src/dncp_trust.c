@@ -620,6 +620,8 @@ int _rpc_set(struct platform_rpc_method *m, const struct blob_attr *in, __unused
   return 0;
 }
 
+static const uint16_t _tlv_types[] = { DNCP_T_TRUST_VERDICT };
+
 dncp_trust dncp_trust_create(dncp o, const char *filename)
 {
   dncp_trust t = calloc(1, sizeof(*t));
@@ -631,6 +633,8 @@ dncp_trust dncp_trust_create(dncp o, const char *filename)
   t->tree.keep_old = true;
   t->timeout.cb = _trust_write_cb;
   t->subscriber.tlv_change_cb = _tlv_cb;
+  t->subscriber.tlv_types = _tlv_types;
+  t->subscriber.num_tlv_types = ARRAY_SIZE(_tlv_types);
   if (filename)
     t->filename = strdup(filename);
   _trust_load(t);
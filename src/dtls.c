@@ -82,6 +82,41 @@
  * ( does it matter? it seems one context is enough. ) */
 #define USE_ONE_CONTEXT
 
+/* Number of buckets in the connection hash table (power of two). */
+#define CONNECTION_HASH_SIZE 64
+
+/* Number of buckets in the input source hash table (power of two). */
+#define SOURCE_HASH_SIZE 64
+
+/* DTLS record content type of application data; everything else
+ * counts as handshake. */
+#define RECORD_APPLICATION_DATA 23
+
+/* Session identifier context; required for resumption of sessions
+ * with verified peer certificates. */
+#define SESSION_ID_CONTEXT "hnetd"
+
+/* Client side sessions, most recently used first. (The server side
+ * ones are in the OpenSSL session cache.) */
+typedef struct {
+  struct list_head in_sessions;
+  struct sockaddr_in6 remote_addr;
+  SSL_SESSION *session;
+} dtls_session_s, *dtls_session;
+
+/* Input token buckets of a source (remote address). The entries are
+ * allocated up front, and reused in least recently used order. */
+typedef struct {
+  struct list_head in_sources;
+  struct list_head in_source_hash;
+  struct in6_addr addr;
+  uint32_t scope_id;
+  hnetd_time_t last;
+
+  /* Tokens (in thousandths of a packet) for handshake and data. */
+  int tokens[2];
+} dtls_source_s, *dtls_source;
+
 /* These lurk in queue, waiting for connection to finish (outbound). */
 typedef struct {
   struct list_head in_queued_buffers;
@@ -92,6 +127,13 @@ typedef struct {
 typedef struct {
   struct list_head in_connections;
 
+  /* Hash bucket by remote address. */
+  struct list_head in_connection_hash;
+
+  /* In d->readable_connections if there is (possibly) something to
+   * read. */
+  struct list_head in_readable_connections;
+
   struct list_head queued_buffers;
 
   dtls d;
@@ -137,6 +179,15 @@ typedef struct dtls_struct {
   udp46 u46_client;
 
   struct list_head connections;
+  struct list_head connection_hash[CONNECTION_HASH_SIZE];
+  struct list_head readable_connections;
+
+  struct list_head sessions;
+  int num_sessions;
+
+  dtls_source sources;
+  struct list_head source_lru;
+  struct list_head source_hash[SOURCE_HASH_SIZE];
 
 #ifdef DTLS_OPENSSL
   unsigned char cookie_secret[COOKIE_SECRET_LENGTH];
@@ -155,13 +206,19 @@ typedef struct dtls_struct {
 
   time_t t;
   int pps;
+
+  dtls_stats_s stats;
 } dtls_s;
 
 static dtls_limits_s _default_limits = {
   .input_pps = 100,
+  .input_handshake_pps_per_source = 20,
+  .input_data_pps_per_source = 50,
+  .num_input_sources = 256,
   .connection_idle_limit_seconds = 1800,
   .num_non_data_connections = 10,
   .num_data_connections = 100,
+  .num_cached_sessions = 100,
 };
 
 #define DTLS_LIMIT(x) (d->limits.x ? d->limits.x : _default_limits.x)
@@ -281,6 +338,104 @@ static void _qb_free(dtls_queued_buffer qb)
   free(qb);
 }
 
+static dtls_session _session_find(dtls d, const struct sockaddr_in6 *dst)
+{
+  dtls_session s;
+
+  list_for_each_entry(s, &d->sessions, in_sessions)
+    if (memcmp(dst, &s->remote_addr, sizeof(*dst)) == 0)
+      return s;
+  return NULL;
+}
+
+static void _session_free(dtls d, dtls_session s)
+{
+  list_del(&s->in_sessions);
+  SSL_SESSION_free(s->session);
+  free(s);
+  d->num_sessions--;
+}
+
+/* Remember the session of an established client connection, so that
+ * the next connection to the same remote can resume it instead of
+ * doing a full handshake. */
+static void _session_save(dtls_connection dc)
+{
+  dtls d = dc->d;
+  SSL_SESSION *session = SSL_get1_session(dc->ssl);
+  dtls_session s;
+
+  if (!session)
+    return;
+  if (!(s = _session_find(d, &dc->remote_addr)))
+    {
+      if (d->num_sessions >= DTLS_LIMIT(num_cached_sessions))
+        _session_free(d, list_last_entry(&d->sessions, dtls_session_s,
+                                         in_sessions));
+      if (!(s = calloc(1, sizeof(*s))))
+        {
+          SSL_SESSION_free(session);
+          return;
+        }
+      s->remote_addr = dc->remote_addr;
+      d->num_sessions++;
+    }
+  else
+    {
+      list_del(&s->in_sessions);
+      SSL_SESSION_free(s->session);
+    }
+  s->session = session;
+  list_add(&s->in_sessions, &d->sessions);
+}
+
+/* Forget the cached session of a connection, so that the next
+ * handshake with the remote is a full one. */
+static void _session_forget(dtls_connection dc)
+{
+  dtls d = dc->d;
+  dtls_session s;
+
+  if (!dc->is_client)
+    SSL_CTX_remove_session(d->ssl_server_ctx, SSL_get_session(dc->ssl));
+  else if ((s = _session_find(d, &dc->remote_addr)))
+    _session_free(d, s);
+}
+
+static int _verify_cert_cb(int ok, X509_STORE_CTX *ctx);
+
+/* Resumed handshakes do not verify the peer certificate, and the trust
+ * verdict (e.g. from the unknown cert callback) may have changed since
+ * the session was established. So verify the certificate stored in the
+ * session the same way a full handshake would have. */
+static bool _connection_resume_trusted(dtls_connection dc)
+{
+  SSL *ssl = dc->ssl;
+  X509_STORE_CTX *ctx;
+  X509 *cert;
+  bool ok = false;
+
+  if (!(SSL_get_verify_mode(ssl) & SSL_VERIFY_PEER))
+    return true;
+  if (!(cert = SSL_get_peer_certificate(ssl)))
+    return false;
+  if ((ctx = X509_STORE_CTX_new()))
+    {
+      if (X509_STORE_CTX_init(ctx, SSL_CTX_get_cert_store(SSL_get_SSL_CTX(ssl)),
+                              cert, SSL_get_peer_cert_chain(ssl)) == 1)
+        {
+          X509_STORE_CTX_set_default(ctx, dc->is_client ? "ssl_server"
+                                     : "ssl_client");
+          X509_STORE_CTX_set_verify_cb(ctx, _verify_cert_cb);
+          ok = X509_verify_cert(ctx) == 1;
+        }
+      X509_STORE_CTX_free(ctx);
+    }
+  X509_free(cert);
+  _drain_errors();
+  return ok;
+}
+
 static void _connection_free(dtls_connection dc)
 {
   dtls_queued_buffer qb, qb2;
@@ -296,6 +451,8 @@ static void _connection_free(dtls_connection dc)
   list_for_each_entry_safe(qb, qb2, &dc->queued_buffers, in_queued_buffers)
     _qb_free(qb);
   list_del(&dc->in_connections);
+  list_del(&dc->in_connection_hash);
+  list_del(&dc->in_readable_connections);
   SSL_free(dc->ssl);
   uloop_timeout_cancel(&dc->uto);
   free(dc);
@@ -386,11 +543,25 @@ static bool _connection_poll_read(dtls_connection dc)
         {
           L_DEBUG("connection %p accept->data", dc);
         to_data:
+          if (SSL_session_reused(dc->ssl) && !_connection_resume_trusted(dc))
+            {
+              L_INFO("connection %p resumed by untrusted peer", dc);
+              _session_forget(dc);
+              return _connection_shutdown(dc);
+            }
           if (dc->d->num_data_connections == DTLS_LIMIT(num_data_connections))
             _connection_drop(d, true);
           dc->d->num_non_data_connections--;
           dc->d->num_data_connections++;
           dc->state = STATE_DATA;
+          if (SSL_session_reused(dc->ssl))
+            d->stats.num_resumed_handshakes++;
+          else
+            d->stats.num_full_handshakes++;
+          L_DEBUG("connection %p %s handshake", dc,
+                  SSL_session_reused(dc->ssl) ? "resumed" : "full");
+          if (dc->is_client)
+            _session_save(dc);
           goto redo;
         }
       break;
@@ -426,7 +597,7 @@ static bool _connection_poll_read(dtls_connection dc)
           L_DEBUG(" .. shutdown flag is set");
           return _connection_shutdown(dc);
         }
-      if (dc->d->readable)
+      if (!list_empty(&dc->in_readable_connections))
         {
           L_DEBUG("already readable, no need for further polling of ready");
           return true;
@@ -436,6 +607,9 @@ static bool _connection_poll_read(dtls_connection dc)
           L_DEBUG("nothing in queue according to SSL_peek");
           return true;
         }
+      list_add_tail(&dc->in_readable_connections, &d->readable_connections);
+      if (dc->d->readable)
+        return true;
       dc->d->readable = true;
       if (dc->d->readable_cb)
         dc->d->readable_cb(dc->d, dc->d->readable_cb_context);
@@ -518,13 +692,32 @@ static void _connection_uto_cb(struct uloop_timeout *t)
   _connection_poll(dc);
 }
 
+static uint32_t _addr_hash(const struct in6_addr *a, uint32_t x)
+{
+  const unsigned char *p = (const unsigned char *)a;
+  uint32_t h = 2166136261u;
+  unsigned int i;
+
+  /* FNV-1a */
+  for (i = 0 ; i < sizeof(*a) ; i++)
+    h = (h ^ p[i]) * 16777619u;
+  return h ^ x;
+}
+
+static uint32_t _connection_hash(const struct sockaddr_in6 *sa6)
+{
+  return _addr_hash(&sa6->sin6_addr, sa6->sin6_port ^ sa6->sin6_scope_id)
+    & (CONNECTION_HASH_SIZE - 1);
+}
+
 static dtls_connection
 _connection_find(dtls d, int is_client, const struct sockaddr_in6 *dst)
 {
   dtls_connection dc;
 
   L_DEBUG("_connection_find dst:%s", HEX_REPR(dst, sizeof(*dst)));
-  list_for_each_entry(dc, &d->connections, in_connections)
+  list_for_each_entry(dc, &d->connection_hash[_connection_hash(dst)],
+                      in_connection_hash)
     if (dc->state != STATE_SHUTDOWN
         && (is_client < 0 || (!is_client == !dc->is_client)))
       if (memcmp(dst, &dc->remote_addr, sizeof(*dst)) == 0)
@@ -557,6 +750,7 @@ _connection_create(dtls d, bool is_client,
   if (d->num_non_data_connections == DTLS_LIMIT(num_non_data_connections))
     _connection_drop(d, false);
   INIT_LIST_HEAD(&dc->queued_buffers);
+  INIT_LIST_HEAD(&dc->in_readable_connections);
   dc->d = d;
   _dtls_update_t(d);
   dc->last_use = d->t;
@@ -577,6 +771,16 @@ _connection_create(dtls d, bool is_client,
     }
   SSL_set_ex_data(ssl, 0, dc);
   SSL_set_options(ssl, SSL_OP_COOKIE_EXCHANGE);
+  if (is_client)
+    {
+      dtls_session s = _session_find(d, remote_addr);
+
+      if (s && SSL_set_session(ssl, s->session) != 1)
+        {
+          L_DEBUG("unable to resume cached session");
+          _drain_errors();
+        }
+    }
 
   dc->rbio = BIO_new(BIO_s_mem());
   dc->wbio = BIO_new(BIO_s_mem());
@@ -585,6 +789,8 @@ _connection_create(dtls d, bool is_client,
 
   SSL_set_bio(ssl, dc->rbio, dc->wbio);
   list_add(&dc->in_connections, &d->connections);
+  list_add(&dc->in_connection_hash,
+           &d->connection_hash[_connection_hash(remote_addr)]);
 
   dc->ssl = ssl;
   L_DEBUG("Created new %s connection %p to %s",
@@ -593,6 +799,86 @@ _connection_create(dtls d, bool is_client,
   return dc;
 }
 
+static bool _sources_init(dtls d)
+{
+  int i, n = DTLS_LIMIT(num_input_sources);
+  dtls_source sources = calloc(n, sizeof(*sources));
+
+  if (!sources)
+    {
+      L_ERR("unable to allocate %d input sources", n);
+      return false;
+    }
+  free(d->sources);
+  d->sources = sources;
+  INIT_LIST_HEAD(&d->source_lru);
+  for (i = 0 ; i < SOURCE_HASH_SIZE ; i++)
+    INIT_LIST_HEAD(&d->source_hash[i]);
+  for (i = 0 ; i < n ; i++)
+    {
+      list_add_tail(&sources[i].in_sources, &d->source_lru);
+      INIT_LIST_HEAD(&sources[i].in_source_hash);
+    }
+  return true;
+}
+
+/* Token bucket admission of a received packet, per source and record
+ * type. */
+static bool _source_admit(dtls d, const struct sockaddr_in6 *sa6,
+                          bool is_data)
+{
+  struct list_head *h =
+    &d->source_hash[_addr_hash(&sa6->sin6_addr, sa6->sin6_scope_id)
+                    & (SOURCE_HASH_SIZE - 1)];
+  int rate[2] = { DTLS_LIMIT(input_handshake_pps_per_source),
+                  DTLS_LIMIT(input_data_pps_per_source) };
+  hnetd_time_t now = hnetd_time();
+  dtls_source s;
+  int i;
+
+  if (!d->sources)
+    return true;
+  list_for_each_entry(s, h, in_source_hash)
+    if (s->scope_id == sa6->sin6_scope_id
+        && !memcmp(&s->addr, &sa6->sin6_addr, sizeof(s->addr)))
+      goto found;
+
+  /* Forget the least recently heard from source. */
+  s = list_last_entry(&d->source_lru, dtls_source_s, in_sources);
+  list_del_init(&s->in_source_hash);
+  s->addr = sa6->sin6_addr;
+  s->scope_id = sa6->sin6_scope_id;
+  s->last = now;
+  for (i = 0 ; i < 2 ; i++)
+    s->tokens[i] = rate[i] * 1000;
+  list_add(&s->in_source_hash, h);
+
+ found:
+  list_move(&s->in_sources, &d->source_lru);
+  if (now > s->last)
+    {
+      for (i = 0 ; i < 2 ; i++)
+        {
+          int64_t t = s->tokens[i] + (now - s->last) * rate[i];
+
+          s->tokens[i] = t < rate[i] * 1000 ? t : rate[i] * 1000;
+        }
+      s->last = now;
+    }
+  if (s->tokens[is_data] < 1000)
+    {
+      L_DEBUG("dropping %s packet due to too big per-source pps (> %d)",
+              is_data ? "data" : "handshake", rate[is_data]);
+      if (is_data)
+        d->stats.num_dropped_data++;
+      else
+        d->stats.num_dropped_handshake++;
+      return false;
+    }
+  s->tokens[is_data] -= 1000;
+  return true;
+}
+
 static void _dtls_poll(dtls d, bool is_client)
 {
   struct sockaddr_in6 remote_addr, local_addr;
@@ -607,10 +893,13 @@ static void _dtls_poll(dtls d, bool is_client)
     }
 
   _dtls_update_t(d);
+  if (!_source_admit(d, &remote_addr, buf[0] == RECORD_APPLICATION_DATA))
+    return;
   if (d->pps++ >= DTLS_LIMIT(input_pps))
     {
       L_DEBUG("dropping packet due to too big pps (%d > %d)",
               d->pps, DTLS_LIMIT(input_pps));
+      d->stats.num_dropped_input++;
       return;
     }
 
@@ -680,6 +969,7 @@ void dtls_set_unknown_cert_cb(dtls d,
 dtls dtls_create(uint16_t port)
 {
   dtls d = calloc(1, sizeof(*d));
+  int i;
 
   if (!_ssl_initialized)
     {
@@ -689,9 +979,15 @@ dtls dtls_create(uint16_t port)
     }
   if (!d)
     goto fail;
+  INIT_LIST_HEAD(&d->connections);
+  for (i = 0 ; i < CONNECTION_HASH_SIZE ; i++)
+    INIT_LIST_HEAD(&d->connection_hash[i]);
+  INIT_LIST_HEAD(&d->readable_connections);
+  INIT_LIST_HEAD(&d->sessions);
+  if (!_sources_init(d))
+    goto fail;
   if (!(d->u46_server = udp46_create(port)))
     goto fail;
-  INIT_LIST_HEAD(&d->connections);
 
   if (!(d->u46_client = udp46_create(0)))
     goto fail;
@@ -713,6 +1009,11 @@ dtls dtls_create(uint16_t port)
   SSL_CTX_set_cookie_verify_cb(ctx, _cookie_verify_cb);
   RAND_bytes(d->cookie_secret, COOKIE_SECRET_LENGTH);
 #endif /* DTLS_OPENSSL */
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, DTLS_LIMIT(num_cached_sessions));
+  SSL_CTX_set_session_id_context(ctx,
+                                 (const unsigned char *)SESSION_ID_CONTEXT,
+                                 strlen(SESSION_ID_CONTEXT));
   d->ssl_server_ctx = ctx;
 
 #ifndef USE_ONE_CONTEXT
@@ -740,7 +1041,21 @@ dtls dtls_create(uint16_t port)
 
 void dtls_set_limits(dtls d, dtls_limits limits)
 {
+  int n = DTLS_LIMIT(num_input_sources);
+
   d->limits = *limits;
+  if (n != DTLS_LIMIT(num_input_sources))
+    (void)_sources_init(d);
+  SSL_CTX_sess_set_cache_size(d->ssl_server_ctx,
+                              DTLS_LIMIT(num_cached_sessions));
+  while (d->num_sessions > DTLS_LIMIT(num_cached_sessions))
+    _session_free(d, list_last_entry(&d->sessions, dtls_session_s,
+                                     in_sessions));
+}
+
+void dtls_get_stats(dtls d, dtls_stats stats)
+{
+  *stats = d->stats;
 }
 
 
@@ -755,6 +1070,7 @@ void dtls_start(dtls d)
 void dtls_destroy(dtls d)
 {
   dtls_connection dc, dc2;
+  dtls_session s, s2;
 
   if (d->psk)
     free(d->psk);
@@ -764,27 +1080,53 @@ void dtls_destroy(dtls d)
 #endif /* USE_ONE_CONTEXT */
   list_for_each_entry_safe(dc, dc2, &d->connections, in_connections)
     _connection_free(dc);
+  list_for_each_entry_safe(s, s2, &d->sessions, in_sessions)
+    _session_free(d, s);
+  free(d->sources);
   udp46_destroy(d->u46_server);
   udp46_destroy(d->u46_client);
   free(d);
 }
 
+/* Read and discard the rest of the current record. */
+static void _drop_pending(SSL *ssl)
+{
+  unsigned char buf[256];
+
+  while (SSL_pending(ssl) > 0 && SSL_read(ssl, buf, sizeof(buf)) > 0);
+}
+
 /* Send/receive data. */
 ssize_t dtls_recv(dtls d,
                   struct sockaddr_in6 **src,
                   struct sockaddr_in6 **dst,
                   void *buf, size_t len)
 {
-  dtls_connection dc;
+  dtls_connection dc, dc2;
+  unsigned char c;
 
   L_DEBUG("dtls_recvfrom");
   d->readable = false;
-  list_for_each_entry(dc, &d->connections, in_connections)
+  /* Only connections that have had something to read are tried; they
+   * stay on the list only while they have more to give. */
+  list_for_each_entry_safe(dc, dc2, &d->readable_connections,
+                           in_readable_connections)
     {
-      ssize_t rv = SSL_read(dc->ssl, buf, len);
+      ssize_t rv;
+
+      /* Messages that do not fit in buf are dropped, instead of
+       * being returned in pieces. */
+      while ((rv = SSL_read(dc->ssl, buf, len)) > 0
+             && (size_t)rv == len && SSL_pending(dc->ssl) > 0)
+        {
+          L_DEBUG(" .. dropping oversized message from s-connection %p", dc);
+          _drop_pending(dc->ssl);
+        }
       if (rv > 0)
         {
           L_DEBUG(" .. winner from s-connection %p: %d bytes", dc, (int)rv);
+          if (SSL_pending(dc->ssl) <= 0 && SSL_peek(dc->ssl, &c, 1) <= 0)
+            list_del_init(&dc->in_readable_connections);
           *src = &dc->remote_addr;
           if (dc->has_local_addr)
             *dst = &dc->local_addr;
@@ -792,6 +1134,7 @@ ssize_t dtls_recv(dtls d,
             *dst = NULL;
           return rv;
         }
+      list_del_init(&dc->in_readable_connections);
     }
   return -1;
 }
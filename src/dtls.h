@@ -67,6 +67,21 @@ typedef struct {
    */
   int input_pps;
 
+  /*
+   * Acceptable packets per second from a single source (remote
+   * address), separately for handshake (and other non-data) records
+   * and for application data records. A source may burst up to one
+   * second's worth; anything more is silently dropped.
+   */
+  int input_handshake_pps_per_source;
+  int input_data_pps_per_source;
+
+  /*
+   * How many sources are tracked for the above; the least recently
+   * heard from ones are forgotten first.
+   */
+  int num_input_sources;
+
   /*
    * How many seconds a connection can be idle before it is eliminated.
    */
@@ -82,10 +97,33 @@ typedef struct {
    */
   int num_data_connections;
 
+  /*
+   * Maximum number of sessions cached for resumption (separately for
+   * client and server side).
+   */
+  int num_cached_sessions;
+
 } dtls_limits_s, *dtls_limits;
 
 void dtls_set_limits(dtls d, dtls_limits limits);
 
+typedef struct {
+  /* Handshakes completed with a new session. */
+  int num_full_handshakes;
+
+  /* Handshakes completed by resuming a cached session. */
+  int num_resumed_handshakes;
+
+  /* Received packets dropped due to input_pps. */
+  int num_dropped_input;
+
+  /* Received packets dropped due to the per-source limits. */
+  int num_dropped_handshake;
+  int num_dropped_data;
+} dtls_stats_s, *dtls_stats;
+
+void dtls_get_stats(dtls d, dtls_stats stats);
+
 
 /* Callback to call when dtls has new data. */
 void dtls_set_readable_cb(dtls d, dtls_readable_cb cb, void *cb_context);
@@ -17,80 +17,152 @@
 /* One eweq task in the queue */
 struct exeq_task {
 	struct list_head le;
+	hnetd_time_t added;
+	char *key;
+	char **env;
 	char *args[];
 	/* Additional data first contains the array of pointers
 	 * provided to execv: {arg1_p, arg2_p, arg3_p, NULL}
+	 * Then, the environment array: {env1_p, env2_p, NULL}
 	 * Then, it contains all the strings that are used in the
-	 * previous array: arg1:arg2:arg3
+	 * previous arrays and the key: arg1:arg2:arg3:env1:env2:key
 	 */
 };
 
 static void exeq_start_maybe(struct exeq *e)
 {
-	if(e->process.pending || list_empty(&e->tasks))
+	if(e->process.pending || e->cmd.req || list_empty(&e->tasks))
 		return;
 
 	struct exeq_task *t = list_first_entry(&e->tasks, struct exeq_task, le);
-	pid_t pid = fork();
-	if (pid == 0) {
-		execv(t->args[0], t->args);
-		L_ERR("execv error: %s\n", strerror(errno));
-		_exit(128);
+	if(coproc_run(&e->cmd, t->args, t->env)) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			for (int i = 0 ; t->env[i] ; i++)
+				putenv(t->env[i]);
+			execv(t->args[0], t->args);
+			L_ERR("execv error: %s\n", strerror(errno));
+			_exit(128);
+		}
+		L_DEBUG("exeq_run %s", t->args[0]);
+		for (int i = 1 ; t->args[i] ; i++)
+			L_DEBUG(" %s", t->args[i]);
+
+		e->process.pid = pid;
+		if(uloop_process_add(&e->process))
+			L_ERR("Could not add process %d to uloop", pid);
 	}
-	L_DEBUG("exeq_run %s", t->args[0]);
-	for (int i = 1 ; t->args[i] ; i++)
-		L_DEBUG(" %s", t->args[i]);
-
-	e->process.pid = pid;
-	if(uloop_process_add(&e->process))
-		L_ERR("Could not add process %d to uloop", pid);
+	e->added = t->added;
+	e->stats.queued--;
 	list_del(&t->le);
 	free(t);
 }
 
+static void exeq_done(struct exeq *e)
+{
+	hnetd_time_t latency = hnetd_time() - e->added;
+
+	e->stats.executed++;
+	e->stats.latency_sum += latency;
+	if(latency > e->stats.latency_max)
+		e->stats.latency_max = latency;
+	exeq_start_maybe(e);
+}
+
 static  void _process_handler(struct uloop_process *c, int ret)
 {
 	struct exeq *e = container_of(c, struct exeq, process);
-	if(ret)
+	if(ret) {
 		L_WARN("Child process %d exited with status %d", c->pid, ret);
-	else
+		e->stats.failed++;
+	} else {
 		L_DEBUG("Child process %d terminated normally.", c->pid, ret);
-	exeq_start_maybe(e);
+	}
+	exeq_done(e);
 }
 
-/* Add a task to the queue.
- * The arguments are copied and can therefore be freed after the call. */
-int exeq_add(struct exeq *e, char **args)
+static void _coproc_handler(struct coproc_cmd *cmd, int status)
+{
+	struct exeq *e = container_of(cmd, struct exeq, cmd);
+	if(status) {
+		L_WARN("Co-process command exited with status %d", status);
+		e->stats.failed++;
+	}
+	exeq_done(e);
+}
+
+static char **exeq_copy_strings(char **dst, char *const *src, char **str)
 {
-	size_t datalen = 0;
+	for(; src && *src; src++) {
+		strcpy(*str, *src);
+		*(dst++) = *str;
+		*str += strlen(*src) + 1;
+	}
+	*(dst++) = NULL;
+	return dst;
+}
+
+int exeq_add_key(struct exeq *e, char **args, char **env, const char *key)
+{
+	size_t datalen = key?(strlen(key) + 1):0;
 	struct exeq_task *task;
-	size_t arg_cnt;
+	size_t arg_cnt, env_cnt = 0;
 	char *str;
 	for(arg_cnt = 0; args[arg_cnt] ; arg_cnt++)
 		datalen += strlen(args[arg_cnt]) + 1;
+	for(; env && env[env_cnt] ; env_cnt++)
+		datalen += strlen(env[env_cnt]) + 1;
 
-	if(!(task = malloc(sizeof(*task) + (arg_cnt + 1) * sizeof(char *) + datalen))) {
+	if(!(task = malloc(sizeof(*task) + (arg_cnt + env_cnt + 2) * sizeof(char *) + datalen))) {
 		L_ERR("exeq_add: malloc failed");
 		return -1;
 	}
 
-	str = (char *)&task->args[arg_cnt + 1];
-	for(arg_cnt = 0; args[arg_cnt]; arg_cnt++) {
-		strcpy(str, args[arg_cnt]);
-		task->args[arg_cnt] = str;
-		str += strlen(args[arg_cnt]) + 1;
+	str = (char *)&task->args[arg_cnt + env_cnt + 2];
+	task->env = exeq_copy_strings(task->args, args, &str);
+	exeq_copy_strings(task->env, env, &str);
+	task->key = NULL;
+	if(key) {
+		task->key = strcpy(str, key);
+		if(exeq_cancel(e, key))
+			L_DEBUG("exeq: replaced pending task %s", key);
 	}
-	task->args[arg_cnt] = NULL;
 
+	task->added = hnetd_time();
 	list_add_tail(&task->le, &e->tasks);
+	if(++e->stats.queued > e->stats.max_queued)
+		e->stats.max_queued = e->stats.queued;
 	exeq_start_maybe(e);
 	return 0;
 }
 
+int exeq_cancel(struct exeq *e, const char *key)
+{
+	struct exeq_task *t;
+	list_for_each_entry(t, &e->tasks, le) {
+		if(t->key && !strcmp(t->key, key)) {
+			list_del(&t->le);
+			free(t);
+			e->stats.queued--;
+			e->stats.coalesced++;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Add a task to the queue.
+ * The arguments are copied and can therefore be freed after the call. */
+int exeq_add(struct exeq *e, char **args)
+{
+	return exeq_add_key(e, args, NULL, NULL);
+}
+
 void exeq_init(struct exeq *e)
 {
 	memset(&e->process, 0, sizeof(*e));
 	e->process.cb = _process_handler;
+	e->cmd.cb = _coproc_handler;
 	INIT_LIST_HEAD(&e->tasks);
 }
 
@@ -99,7 +171,10 @@ void exeq_term(struct exeq *e)
 	struct exeq_task *t, *ts;
 	list_for_each_entry_safe(t, ts, &e->tasks, le)
 		free(t);
+	INIT_LIST_HEAD(&e->tasks);
+	e->stats.queued = 0;
 
 	uloop_process_delete(&e->process);
+	coproc_cancel(&e->cmd);
 }
 
@@ -6,6 +6,9 @@
  * This file provides a process execution fifo.
  * It uses execv and will not execute the next task before
  * the previous one has finished.
+ * Tasks may be given a key, in which case a new task replaces
+ * the pending (not yet started) task with the same key.
+ * When enabled, /bin/sh scripts are run by a co-process (see coproc.h).
  */
 
 #ifndef EXEQ_H_
@@ -14,10 +17,27 @@
 #include <libubox/uloop.h>
 #include <libubox/list.h>
 
+#include "hnetd.h"
+#include "coproc.h"
+
+/* Execution queue counters */
+struct exeq_stats {
+	unsigned int queued;      //Number of pending tasks
+	unsigned int max_queued;  //Maximum number of pending tasks
+	unsigned int executed;    //Number of terminated tasks
+	unsigned int failed;      //Number of tasks with non-zero exit status
+	unsigned int coalesced;   //Number of tasks replaced before being started
+	hnetd_time_t latency_sum; //Sum of delays between addition and termination
+	hnetd_time_t latency_max; //Maximum delay between addition and termination
+};
+
 /* A single execution queue structure */
 struct exeq {
 	struct uloop_process process;
+	struct coproc_cmd cmd;    //Running task, when run by a co-process
 	struct list_head tasks;
+	hnetd_time_t added;       //When the running task was added
+	struct exeq_stats stats;
 };
 
 /* Initializes a queue structure */
@@ -28,6 +48,17 @@ void exeq_init(struct exeq *);
  * Returns 0 on success. -errorcode on error. */
 int exeq_add(struct exeq *, char **args);
 
+/* Add a task to the queue, with additional environment variables
+ * (NULL terminated array of NAME=value strings, or NULL).
+ * When key is not NULL, the pending task with the same key, if any,
+ * is dropped. Everything is copied.
+ * Returns 0 on success. -errorcode on error. */
+int exeq_add_key(struct exeq *, char **args, char **env, const char *key);
+
+/* Drops the pending task with the given key.
+ * Returns 1 if a task was dropped, 0 otherwise. */
+int exeq_cancel(struct exeq *, const char *key);
+
 /* Cancels the execution queue.
  * (Does not interrupt the current process if currently running) */
 void exeq_term(struct exeq *e);
@@ -13,6 +13,7 @@
 
 #include "hncp_i.h"
 #include "hncp_io.h"
+#include "hncp_md5.h"
 
 #include <libubox/md5.h>
 
@@ -171,6 +172,7 @@ bool hncp_init(hncp o)
         .keepalive_interval = HNCP_KEEPALIVE_INTERVAL,
         .maximum_unicast_size = HNCP_MAXIMUM_UNICAST_SIZE,
         .maximum_multicast_size = HNCP_MAXIMUM_MULTICAST_SIZE,
+        .maximum_multicast_datagrams = HNCP_MAXIMUM_MULTICAST_DATAGRAMS,
         .accept_node_data_updates_via_multicast = true
       },
       .node_id_length = HNCP_NI_LEN,
@@ -184,6 +186,7 @@ bool hncp_init(hncp o)
     .cb = {
       /* Rest of callbacks are populated in the hncp_io_init */
       .hash = hncp_hash_md5,
+      .hash_multi = hncp_md5_multi,
       .validate_node_data = hncp_validate_node_data,
       .handle_collision = hncp_handle_collision_randomly
     }
@@ -215,10 +218,9 @@ void hncp_uninit(hncp h)
       hep = dncp_ep_get_ext_data(ep);
       uloop_timeout_cancel(&hep->join_timeout);
     }
-  hncp_io_uninit(h);
-  if (!h->dncp)
-    return;
+  /* dncp teardown may still schedule timeouts; get rid of them after it. */
   dncp_destroy(h->dncp);
+  hncp_io_uninit(h);
 }
 
 dncp hncp_get_dncp(hncp o)
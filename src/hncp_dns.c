@@ -0,0 +1,693 @@
+/*
+ * $Id: hncp_dns.c $
+ *
+ * Copyright (c) 2015 cisco Systems, Inc.
+ *
+ */
+
+/* The DNS server keeps a tree of names (canonical lowercase escaped
+ * strings), each with the records (and delegated zone servers) derived
+ * from the TLVs currently present in the network. Each TLV keeps track
+ * of the records it produced, so that they can be removed when the TLV
+ * goes away.
+ *
+ * Queries within a delegated zone are forwarded with a new random id
+ * through a socket of their own, connected to the zone server (so the
+ * kernel picks a random source port and drops replies from anywhere
+ * else), and the reply relayed back to the client. */
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libubox/avl.h>
+#include <libubox/avl-cmp.h>
+#include <libubox/list.h>
+#include <libubox/uloop.h>
+
+#include "hncp_dns.h"
+#include "hnetd.h"
+#include "hnetd_time.h"
+#include "prefix_utils.h"
+#include "dncp_proto.h"
+#include "hncp_proto.h"
+#include "dns_util.h"
+#include "udp46.h"
+
+/* Records change whenever the network does, so they are not cached
+ * (same as dnsmasq's default local-ttl) */
+#define HNCP_DNS_TTL 0
+
+/* Maximum UDP message size without EDNS0 */
+#define HNCP_DNS_MAX_UDP 512
+
+/* Maximum message size we relay */
+#define HNCP_DNS_MAX_MSG 4096
+
+/* How many forwarded queries may be outstanding (each holds a socket;
+ * same as dnsmasq's default dns-forward-max), and for how long */
+#define HNCP_DNS_MAX_QUERIES 150
+#define HNCP_DNS_QUERY_TIMEOUT 5000
+
+/* Zone servers are stored with this (otherwise unused) record type */
+#define HNCP_DNS_T_ZONE 0
+
+struct hncp_dns_struct
+{
+  /* Server socket (queries from clients) */
+  udp46 server;
+
+  /* /dev/urandom, for the ids of forwarded queries */
+  int random_fd;
+
+  struct sockaddr_in6 local_server;
+
+  /* Domain as a label list */
+  uint8_t domain[DNS_MAX_LL_LEN];
+  int domain_len;
+
+  /* Names (hncp_dns_name) with at least one record */
+  struct avl_tree names;
+
+  /* TLVs (hncp_dns_tlv) we know of */
+  struct list_head tlvs;
+
+  /* Forwarded queries (hncp_dns_query), oldest first */
+  struct list_head queries;
+  int num_queries;
+  struct uloop_timeout timeout;
+};
+
+typedef struct hncp_dns_name_struct
+{
+  struct avl_node in_names;
+  struct list_head rrs;
+  char name[];
+} hncp_dns_name_s, *hncp_dns_name;
+
+typedef struct hncp_dns_rr_struct
+{
+  struct list_head in_name;
+  struct list_head in_tlv;
+  hncp_dns_name name;
+
+  /* Zone server (HNCP_DNS_T_ZONE only) */
+  struct sockaddr_in6 server;
+
+  uint16_t type;
+  uint16_t rdlen;
+  uint8_t rdata[];
+} hncp_dns_rr_s, *hncp_dns_rr;
+
+typedef struct hncp_dns_tlv_struct
+{
+  struct list_head in_tlvs;
+  const void *owner;
+  bool self;
+
+  /* Records produced by the TLV */
+  struct list_head rrs;
+
+  /* Copy of the TLV */
+  struct tlv_attr tlv[];
+} hncp_dns_tlv_s, *hncp_dns_tlv;
+
+typedef struct hncp_dns_query_struct
+{
+  struct list_head in_queries;
+  hncp_dns d;
+
+  /* Socket connected to the server */
+  struct uloop_fd fd;
+
+  hnetd_time_t sent;
+  uint16_t id;
+  uint16_t client_id;
+  struct sockaddr_in6 client;
+  struct sockaddr_in6 dst;
+} hncp_dns_query_s, *hncp_dns_query;
+
+/* Label list -> canonical (lowercase escaped) name */
+static int _ll2name(const uint8_t *ll, int ll_len, char *buf, int buf_len)
+{
+  char *c;
+  int r = ll2escaped(ll, ll_len, buf, buf_len);
+
+  if (r < 0)
+    return r;
+  for (c = buf ; *c ; c++)
+    *c = tolower(*c);
+  return r;
+}
+
+static hncp_dns_name _find_name(hncp_dns d, const uint8_t *ll, int ll_len)
+{
+  char buf[DNS_MAX_ESCAPED_LEN];
+  hncp_dns_name n;
+
+  if (_ll2name(ll, ll_len, buf, sizeof(buf)) < 0)
+    return NULL;
+  return avl_find_element(&d->names, buf, n, in_names);
+}
+
+static hncp_dns_rr _add_rr(hncp_dns d, hncp_dns_tlv t,
+                           const uint8_t *ll, int ll_len, uint16_t type,
+                           const void *rdata, uint16_t rdlen)
+{
+  char buf[DNS_MAX_ESCAPED_LEN];
+  hncp_dns_name n;
+  hncp_dns_rr rr;
+
+  if (_ll2name(ll, ll_len, buf, sizeof(buf)) < 0)
+    return NULL;
+  if (!(n = avl_find_element(&d->names, buf, n, in_names)))
+    {
+      if (!(n = calloc(1, sizeof(*n) + strlen(buf) + 1)))
+        return NULL;
+      strcpy(n->name, buf);
+      n->in_names.key = n->name;
+      INIT_LIST_HEAD(&n->rrs);
+      avl_insert(&d->names, &n->in_names);
+    }
+  if (!(rr = calloc(1, sizeof(*rr) + rdlen)))
+    goto out;
+  rr->name = n;
+  rr->type = type;
+  rr->rdlen = rdlen;
+  memcpy(rr->rdata, rdata, rdlen);
+  list_add_tail(&rr->in_name, &n->rrs);
+  list_add_tail(&rr->in_tlv, &t->rrs);
+  L_DEBUG("hncp_dns added %s type %d", n->name, type);
+  return rr;
+
+ out:
+  if (list_empty(&n->rrs))
+    {
+      avl_delete(&d->names, &n->in_names);
+      free(n);
+    }
+  return NULL;
+}
+
+static void _remove_rrs(hncp_dns d, hncp_dns_tlv t)
+{
+  hncp_dns_rr rr, rr2;
+
+  list_for_each_entry_safe(rr, rr2, &t->rrs, in_tlv)
+    {
+      hncp_dns_name n = rr->name;
+
+      L_DEBUG("hncp_dns removed %s type %d", n->name, rr->type);
+      list_del(&rr->in_name);
+      list_del(&rr->in_tlv);
+      free(rr);
+      if (list_empty(&n->rrs))
+        {
+          avl_delete(&d->names, &n->in_names);
+          free(n);
+        }
+    }
+}
+
+/* Label list of <label>.<domain> */
+static int _push_domain_name(hncp_dns d, const void *label, int label_len,
+                             uint8_t *ll, int ll_left)
+{
+  uint8_t *oll = ll;
+
+  if (label_len)
+    DNS_PUSH_LABEL(ll, ll_left, label, label_len);
+  ll_left -= d->domain_len;
+  if (ll_left < 0)
+    return DNS_RESULT_OOB;
+  memcpy(ll, d->domain, d->domain_len);
+  return ll - oll + d->domain_len;
+}
+
+static int _add_browse_rr(hncp_dns d, hncp_dns_tlv t, const char *browse,
+                          const uint8_t *zone, int zone_len)
+{
+  uint8_t ll[DNS_MAX_LL_LEN];
+  uint8_t *c = ll;
+  int left = sizeof(ll), r;
+
+  DNS_PUSH_LABEL_STRING(c, left, browse);
+  DNS_PUSH_LABEL_STRING(c, left, "_dns-sd");
+  DNS_PUSH_LABEL_STRING(c, left, "_udp");
+  if ((r = _push_domain_name(d, NULL, 0, c, left)) < 0)
+    return r;
+  return _add_rr(d, t, ll, c - ll + r, ns_t_ptr, zone, zone_len) ? 0 : -1;
+}
+
+/* Produce the records of a TLV */
+static void _add_rrs(hncp_dns d, hncp_dns_tlv t)
+{
+  struct tlv_attr *a = t->tlv;
+  uint8_t ll[DNS_MAX_LL_LEN];
+  char buf[DNS_MAX_ESCAPED_LEN];
+  int r;
+
+  if (!d->domain_len)
+    return;
+
+  switch (tlv_id(a))
+    {
+    case HNCP_T_NODE_NAME:
+      {
+        hncp_t_node_name rname = tlv_data(a);
+        struct in6_addr addr;
+        int namelen = tlv_len(a) - sizeof(hncp_t_node_name_s);
+
+        if (namelen <= 0 || namelen < rname->name_length
+            || !rname->name_length || rname->name_length >= DNS_MAX_L_LEN)
+          return;
+        r = _push_domain_name(d, rname->name, rname->name_length,
+                              ll, sizeof(ll));
+        if (r < 0)
+          return;
+        memcpy(&addr, &rname->address, sizeof(addr));
+        if (IN6_IS_ADDR_V4MAPPED(&addr))
+          _add_rr(d, t, ll, r, ns_t_a, &addr.s6_addr[12], 4);
+        else
+          _add_rr(d, t, ll, r, ns_t_aaaa, &addr, 16);
+      }
+      break;
+
+    case HNCP_T_DNS_DELEGATED_ZONE:
+      {
+        hncp_t_dns_delegated_zone dh = tlv_data(a);
+        int ll_len;
+        hncp_dns_rr rr;
+
+        if (tlv_len(a) < (sizeof(*dh)+1))
+          return;
+        ll_len = tlv_len(a) - sizeof(*dh);
+        if ((ll_len = ll2escaped(dh->ll, ll_len, buf, sizeof(buf))) < 0)
+          return;
+
+        if (dh->flags & HNCP_T_DNS_DELEGATED_ZONE_FLAG_BROWSE)
+          _add_browse_rr(d, t, "b", dh->ll, ll_len);
+        if (dh->flags & HNCP_T_DNS_DELEGATED_ZONE_FLAG_LEGACY_BROWSE)
+          _add_browse_rr(d, t, "lb", dh->ll, ll_len);
+        if (!(rr = _add_rr(d, t, dh->ll, ll_len, HNCP_DNS_T_ZONE, NULL, 0)))
+          return;
+        if (t->self)
+          {
+            rr->server = d->local_server;
+          }
+        else
+          {
+            rr->server.sin6_family = AF_INET6;
+            memcpy(&rr->server.sin6_addr, dh->address, 16);
+            rr->server.sin6_port = htons(NS_DEFAULTPORT);
+          }
+      }
+      break;
+    }
+}
+
+void hncp_dns_tlv_change(hncp_dns d, const void *owner, bool self,
+                         struct tlv_attr *tlv, bool add)
+{
+  hncp_dns_tlv t;
+
+  if (tlv_id(tlv) != HNCP_T_NODE_NAME
+      && tlv_id(tlv) != HNCP_T_DNS_DELEGATED_ZONE)
+    return;
+
+  if (!add)
+    {
+      list_for_each_entry(t, &d->tlvs, in_tlvs)
+        if (t->owner == owner && tlv_attr_equal(t->tlv, tlv))
+          {
+            _remove_rrs(d, t);
+            list_del(&t->in_tlvs);
+            free(t);
+            return;
+          }
+      return;
+    }
+
+  if (!(t = malloc(sizeof(*t) + tlv_raw_len(tlv))))
+    return;
+  t->owner = owner;
+  t->self = self;
+  INIT_LIST_HEAD(&t->rrs);
+  memcpy(t->tlv, tlv, tlv_raw_len(tlv));
+  list_add_tail(&t->in_tlvs, &d->tlvs);
+  _add_rrs(d, t);
+}
+
+void hncp_dns_set_domain(hncp_dns d, const char *domain)
+{
+  uint8_t ll[DNS_MAX_LL_LEN];
+  hncp_dns_tlv t;
+  char *c;
+  int r;
+
+  if ((r = escaped2ll(domain, ll, sizeof(ll))) < 0)
+    {
+      L_ERR("hncp_dns invalid domain %s", domain);
+      return;
+    }
+  for (c = (char *)ll ; c < (char *)ll + r ; c++)
+    *c = tolower(*c);
+  if (r == d->domain_len && !memcmp(ll, d->domain, r))
+    return;
+
+  L_DEBUG("hncp_dns domain set to %s", domain);
+  list_for_each_entry(t, &d->tlvs, in_tlvs)
+    _remove_rrs(d, t);
+  memcpy(d->domain, ll, r);
+  d->domain_len = r;
+  list_for_each_entry(t, &d->tlvs, in_tlvs)
+    _add_rrs(d, t);
+}
+
+/* Whether ll is within (or equal to) the domain */
+static bool _in_domain(hncp_dns d, const uint8_t *ll, int ll_len)
+{
+  int i;
+
+  while (ll_len > d->domain_len)
+    {
+      ll_len -= *ll + 1;
+      ll += *ll + 1;
+    }
+  if (ll_len != d->domain_len)
+    return false;
+  for (i = 0 ; i < ll_len ; i++)
+    if (tolower(ll[i]) != d->domain[i])
+      return false;
+  return true;
+}
+
+static void _query_free(hncp_dns d, hncp_dns_query q)
+{
+  list_del(&q->in_queries);
+  d->num_queries--;
+  uloop_fd_delete(&q->fd);
+  close(q->fd.fd);
+  free(q);
+}
+
+static void _expire_queries(hncp_dns d)
+{
+  hncp_dns_query q, q2;
+  hnetd_time_t now = hnetd_time();
+
+  list_for_each_entry_safe(q, q2, &d->queries, in_queries)
+    {
+      if (q->sent + HNCP_DNS_QUERY_TIMEOUT > now
+          && d->num_queries < HNCP_DNS_MAX_QUERIES)
+        break;
+      _query_free(d, q);
+    }
+  if (!list_empty(&d->queries))
+    {
+      q = list_first_entry(&d->queries, hncp_dns_query_s, in_queries);
+      uloop_timeout_set(&d->timeout, q->sent + HNCP_DNS_QUERY_TIMEOUT - now);
+    }
+}
+
+static void _timeout_cb(struct uloop_timeout *t)
+{
+  _expire_queries(container_of(t, hncp_dns_s, timeout));
+}
+
+static void _query_cb(struct uloop_fd *fd, unsigned int events __unused)
+{
+  hncp_dns_query q = container_of(fd, hncp_dns_query_s, fd);
+  uint8_t msg[HNCP_DNS_MAX_MSG];
+  HEADER *h = (HEADER *)msg;
+  ssize_t len;
+
+  /* The socket is connected, so only the server's replies arrive */
+  while ((len = recv(fd->fd, msg, sizeof(msg), 0)) >= 0)
+    if (len >= (ssize_t)sizeof(HEADER) && h->qr && h->id == q->id)
+      {
+        h->id = q->client_id;
+        udp46_send(q->d->server, &q->dst, &q->client, msg, len);
+        _query_free(q->d, q);
+        return;
+      }
+}
+
+static int _query_socket(const struct sockaddr_in6 *server)
+{
+  int off = 0;
+  int fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+  if (fd < 0)
+    return -1;
+  /* Zone servers may be IPv4 (mapped) too */
+  if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0
+      || connect(fd, (const struct sockaddr *)server, sizeof(*server)) < 0)
+    {
+      close(fd);
+      return -1;
+    }
+  return fd;
+}
+
+static void _forward(hncp_dns d, hncp_dns_rr zone,
+                     const struct sockaddr_in6 *src,
+                     const struct sockaddr_in6 *dst,
+                     uint8_t *msg, size_t len)
+{
+  HEADER *h = (HEADER *)msg;
+  hncp_dns_query q;
+  uint16_t id;
+
+  if (read(d->random_fd, &id, sizeof(id)) != sizeof(id))
+    {
+      L_ERR("hncp_dns unable to read random id: %s", strerror(errno));
+      return;
+    }
+  if (!(q = calloc(1, sizeof(*q))))
+    return;
+  if ((q->fd.fd = _query_socket(&zone->server)) < 0)
+    {
+      L_ERR("hncp_dns unable to open query socket: %s", strerror(errno));
+      free(q);
+      return;
+    }
+  q->d = d;
+  q->fd.cb = _query_cb;
+  uloop_fd_add(&q->fd, ULOOP_READ);
+  q->sent = hnetd_time();
+  q->id = id;
+  q->client_id = h->id;
+  q->client = *src;
+  q->dst = *dst;
+  list_add_tail(&q->in_queries, &d->queries);
+  d->num_queries++;
+  if (d->num_queries == 1 || d->num_queries > HNCP_DNS_MAX_QUERIES)
+    _expire_queries(d);
+
+  L_DEBUG("hncp_dns forwarding query for %s to %s",
+          zone->name->name, ADDR_REPR(&zone->server.sin6_addr));
+  h->id = id;
+  if (send(q->fd.fd, msg, len, 0) < 0)
+    L_DEBUG("hncp_dns forward failed: %s", strerror(errno));
+}
+
+static int _push_rr(uint8_t **c, uint8_t *end, hncp_dns_rr rr)
+{
+  uint8_t *p = *c;
+
+  if (p + 12 + rr->rdlen > end)
+    return -1;
+  /* Name is compressed to the question name */
+  *p++ = 0xC0;
+  *p++ = sizeof(HEADER);
+  NS_PUT16(rr->type, p);
+  NS_PUT16(ns_c_in, p);
+  NS_PUT32(HNCP_DNS_TTL, p);
+  NS_PUT16(rr->rdlen, p);
+  memcpy(p, rr->rdata, rr->rdlen);
+  *c = p + rr->rdlen;
+  return 0;
+}
+
+/* Handle a query. Returns the length of the reply written to msg, or 0
+ * if there is nothing to reply (yet). */
+static size_t _handle_query(hncp_dns d,
+                            const struct sockaddr_in6 *src,
+                            const struct sockaddr_in6 *dst,
+                            uint8_t *msg, size_t len)
+{
+  HEADER *h = (HEADER *)msg;
+  uint8_t *ll = msg + sizeof(HEADER), *c = ll;
+  uint8_t *end = msg + len;
+  uint16_t qtype, qclass;
+  hncp_dns_name n;
+  hncp_dns_rr rr;
+  int ll_len, ancount = 0;
+
+  if (len < sizeof(HEADER) || h->qr)
+    return 0;
+
+  /* Reply header and question (the rest is dropped) */
+  h->qr = 1;
+  h->aa = 0;
+  h->tc = 0;
+  h->ra = 0;
+  h->ad = 0;
+  h->ancount = h->nscount = h->arcount = 0;
+  if (h->opcode != ns_o_query)
+    {
+      h->qdcount = 0;
+      h->rcode = ns_r_notimpl;
+      return sizeof(HEADER);
+    }
+  if (ntohs(h->qdcount) != 1)
+    goto formerr;
+  while (c < end && *c)
+    {
+      if (*c > DNS_MAX_L_LEN - 1)
+        goto formerr;
+      c += *c + 1;
+    }
+  if (c + 5 > end || c + 1 - ll > DNS_MAX_LL_LEN)
+    goto formerr;
+  ll_len = ++c - ll;
+  NS_GET16(qtype, c);
+  NS_GET16(qclass, c);
+  len = c - msg;
+
+  if (qclass != ns_c_in && qclass != ns_c_any)
+    goto refused;
+
+  /* Local records */
+  if ((n = _find_name(d, ll, ll_len)))
+    {
+      bool local = false;
+
+      list_for_each_entry(rr, &n->rrs, in_name)
+        {
+          if (rr->type == HNCP_DNS_T_ZONE)
+            continue;
+          local = true;
+          if (rr->type != qtype && qtype != ns_t_any)
+            continue;
+          if (_push_rr(&c, msg + HNCP_DNS_MAX_UDP, rr))
+            {
+              h->tc = 1;
+              break;
+            }
+          ancount++;
+        }
+      if (local)
+        {
+          h->aa = 1;
+          h->rcode = ns_r_noerror;
+          h->ancount = htons(ancount);
+          return c - msg;
+        }
+    }
+
+  /* Delegated zones (longest match first) */
+  for (c = ll ; *c ; c += *c + 1)
+    if ((n = _find_name(d, c, ll_len - (c - ll))))
+      list_for_each_entry(rr, &n->rrs, in_name)
+        if (rr->type == HNCP_DNS_T_ZONE)
+          {
+            /* Forward the question (without additional records) */
+            h->qr = 0;
+            _forward(d, rr, src, dst, msg, len);
+            return 0;
+          }
+
+  if (!d->domain_len || !_in_domain(d, ll, ll_len))
+    goto refused;
+  h->aa = 1;
+  h->rcode = ll_len == d->domain_len ? ns_r_noerror : ns_r_nxdomain;
+  return len;
+
+ formerr:
+  h->qdcount = 0;
+  h->rcode = ns_r_formerr;
+  return sizeof(HEADER);
+
+ refused:
+  h->rcode = ns_r_refused;
+  return len;
+}
+
+static void _server_cb(udp46 s __unused, void *context)
+{
+  hncp_dns d = context;
+  struct sockaddr_in6 src, dst;
+  uint8_t msg[HNCP_DNS_MAX_MSG];
+  ssize_t len;
+
+  while ((len = udp46_recv(d->server, &src, &dst, msg, sizeof(msg))) >= 0)
+    if ((len = _handle_query(d, &src, &dst, msg, len)))
+      udp46_send(d->server, &dst, &src, msg, len);
+}
+
+hncp_dns hncp_dns_create(uint16_t port,
+                         const char *local_server, uint16_t local_port)
+{
+  hncp_dns d = calloc(1, sizeof(*d));
+
+  if (!d)
+    return NULL;
+  avl_init(&d->names, avl_strcmp, false, NULL);
+  INIT_LIST_HEAD(&d->tlvs);
+  INIT_LIST_HEAD(&d->queries);
+  d->timeout.cb = _timeout_cb;
+  d->random_fd = -1;
+  d->local_server.sin6_family = AF_INET6;
+  d->local_server.sin6_port = htons(local_port);
+  if (inet_pton(AF_INET, local_server,
+                &d->local_server.sin6_addr.s6_addr[12]) == 1)
+    {
+      d->local_server.sin6_addr.s6_addr[10] = 0xff;
+      d->local_server.sin6_addr.s6_addr[11] = 0xff;
+    }
+  else if (inet_pton(AF_INET6, local_server,
+                     &d->local_server.sin6_addr) != 1)
+    {
+      L_ERR("hncp_dns invalid local server %s", local_server);
+      goto fail;
+    }
+  if ((d->random_fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC)) < 0)
+    {
+      L_ERR("hncp_dns unable to open /dev/urandom: %s", strerror(errno));
+      goto fail;
+    }
+  if (!(d->server = udp46_create(port)))
+    {
+      L_ERR("hncp_dns unable to open socket (port %d)", port);
+      goto fail;
+    }
+  udp46_set_readable_cb(d->server, _server_cb, d);
+  return d;
+
+ fail:
+  if (d->random_fd >= 0)
+    close(d->random_fd);
+  free(d);
+  return NULL;
+}
+
+void hncp_dns_destroy(hncp_dns d)
+{
+  hncp_dns_tlv t, t2;
+  hncp_dns_query q, q2;
+
+  list_for_each_entry_safe(t, t2, &d->tlvs, in_tlvs)
+    {
+      _remove_rrs(d, t);
+      free(t);
+    }
+  list_for_each_entry_safe(q, q2, &d->queries, in_queries)
+    _query_free(d, q);
+  uloop_timeout_cancel(&d->timeout);
+  udp46_destroy(d->server);
+  close(d->random_fd);
+  free(d);
+}
@@ -0,0 +1,48 @@
+/*
+ * $Id: hncp_dns.h $
+ *
+ * Copyright (c) 2015 cisco Systems, Inc.
+ *
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "tlv.h"
+
+/* This module implements a small DNS server which answers directly
+ * from the HNCP state (instead of dnsmasq configured with a generated
+ * file):
+ *
+ * - <routername>.<domain> A/AAAA records (from NODE_NAME TLVs)
+ *
+ * - b._dns-sd._udp.<domain> and lb._dns-sd._udp.<domain> PTR records
+ *   (from browseable DNS_DELEGATED_ZONE TLVs)
+ *
+ * - forwarding of queries within delegated zones to the zone's server
+ *   (or the local hybrid proxy for our own zones)
+ *
+ * The records are updated as TLVs come and go, so changes are visible
+ * immediately. Other names within the domain are answered with
+ * NXDOMAIN, and names outside it are refused. */
+
+typedef struct hncp_dns_struct hncp_dns_s, *hncp_dns;
+
+/* Open the server on the given UDP port. Queries within zones
+ * delegated by the local node are forwarded to
+ * local_server#local_port. */
+hncp_dns hncp_dns_create(uint16_t port,
+                         const char *local_server, uint16_t local_port);
+
+/* Set the domain of the host and browse records. */
+void hncp_dns_set_domain(hncp_dns d, const char *domain);
+
+/* Notify of an added/removed NODE_NAME or DNS_DELEGATED_ZONE TLV of a
+ * node (owner is used to tell nodes apart, self is true for the local
+ * node). */
+void hncp_dns_tlv_change(hncp_dns d, const void *owner, bool self,
+                         struct tlv_attr *tlv, bool add);
+
+void hncp_dns_destroy(hncp_dns d);
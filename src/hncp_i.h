@@ -18,6 +18,8 @@
 #include "dncp_util.h"
 #include "udp46.h"
 
+#include <net/if.h>
+
 /* TLV handling */
 #include "prefix_utils.h"
 
@@ -100,11 +102,24 @@ struct hncp_bfs_head {
   /* List head for implementing BFS */
   struct list_head head;
 
-  /* Next-hop in path (also used to mark visited nodes) */
-  const struct in6_addr *next_hop;
-  const struct in6_addr *next_hop4;
-  const char *ifname;
+  /* Next-hop in path (ifname is empty if the node is not reached) */
+  struct in6_addr next_hop;
+  struct in6_addr next_hop4;
+  bool has_next_hop4;
+  char ifname[IFNAMSIZ];
   unsigned hopcount;
+
+  /* Shortest-path tree rooted at own node (maintained incrementally) */
+  struct hncp_bfs_head *parent;
+  struct list_head children;
+  struct list_head in_parent;
+
+  /* Best known parent while queued for recomputation */
+  struct hncp_bfs_head *candidate;
+  unsigned candidate_hopcount;
+
+  /* Entry in the routing dirty list (neighbors or path changed) */
+  struct list_head in_dirty;
 };
 
 typedef struct hncp_ep_struct hncp_ep_s, *hncp_ep;
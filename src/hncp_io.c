@@ -127,6 +127,60 @@ static void _schedule_timeout(dncp_ext ext, int msecs)
   uloop_timeout_set(&h->timeout, msecs);
 }
 
+/* Figure out the endpoint and flags of a received packet. Returns
+ * false if the packet should be ignored. Multicast dst is mapped to
+ * NULL. */
+static bool
+_recv_filter(hncp h,
+             struct sockaddr_in6 *src,
+             struct sockaddr_in6 **dst_store,
+             dncp_ep *ep,
+             int *flags)
+{
+  struct sockaddr_in6 *dst = *dst_store;
+  char ifname[IFNAMSIZ];
+
+  if (!dst)
+    {
+      L_DEBUG("no dst..?");
+      return false;
+    }
+  if (!dst->sin6_scope_id)
+    {
+      L_DEBUG("no scope id..?");
+      return false;
+    }
+  if (!if_indextoname(dst->sin6_scope_id, ifname))
+    {
+      L_ERR("unable to receive - if_indextoname:%s", strerror(errno));
+      return false;
+    }
+
+  *ep = dncp_find_ep_by_name(h->dncp, ifname);
+
+  if (!*ep)
+    return false;
+
+  if (IN6_IS_ADDR_LINKLOCAL(&src->sin6_addr))
+    *flags |= DNCP_RECV_FLAG_SRC_LINKLOCAL;
+
+  if (IN6_IS_ADDR_LINKLOCAL(&dst->sin6_addr))
+    *flags |= DNCP_RECV_FLAG_DST_LINKLOCAL;
+
+  /* 'NULL' = multicast from dncp point of view. */
+  if (IN6_IS_ADDR_MULTICAST(&dst->sin6_addr))
+    {
+      if (memcmp(&dst->sin6_addr, &h->multicast_address,
+                 sizeof(h->multicast_address)))
+        {
+          L_DEBUG("hncp_io_recv: got wrong multicast address traffic?");
+          return false;
+        }
+      *dst_store = NULL;
+    }
+  return true;
+}
+
 static ssize_t
 _recv(dncp_ext ext,
       dncp_ep *ep,
@@ -137,7 +191,6 @@ _recv(dncp_ext ext,
 {
   hncp h = container_of(ext, hncp_s, ext);
   ssize_t r = -1;
-  char ifname[IFNAMSIZ];
   struct sockaddr_in6 *src, *dst;
   int f;
 
@@ -162,62 +215,108 @@ _recv(dncp_ext ext,
           src = &src_store;
           dst = &dst_store;
         }
-      if (!dst)
+      if (!_recv_filter(h, src, &dst, ep, &f))
+        continue;
+      *src_store = src;
+      *dst_store = dst;
+      *flags = f;
+      break;
+    }
+  return r;
+}
+
+/* Fill in the rest of a received message; returns false if it should
+ * be ignored. */
+static bool
+_recv_msg(hncp h, dncp_ext_msg m,
+          struct sockaddr_in6 *src, struct sockaddr_in6 *dst, int f)
+{
+  if (!_recv_filter(h, src, &dst, &m->ep, &f))
+    return false;
+  m->src = *src;
+  m->multicast = !dst;
+  if (dst)
+    m->dst = *dst;
+  m->flags = f;
+  return true;
+}
+
+static int
+_recv_batch(dncp_ext ext, dncp_ext_msg msgs, int count)
+{
+  hncp h = container_of(ext, hncp_s, ext);
+  udp46_msg_s um[UDP46_RECV_BATCH_MAX];
+  int i, n, r, got = 0, f = 0;
+
+#ifdef DTLS
+  if (h->d)
+    {
+      struct sockaddr_in6 *src, *dst;
+      ssize_t l;
+
+      f |= DNCP_RECV_FLAG_SECURE_TRIED;
+      while (got < count
+             && (l = dtls_recv(h->d, &src, &dst,
+                               msgs[got].buf, msgs[got].buf_len)) > 0)
         {
-          L_DEBUG("no dst..?");
-          continue;
+          msgs[got].len = l;
+          if (_recv_msg(h, &msgs[got], src, dst,
+                        f | DNCP_RECV_FLAG_SECURE))
+            got++;
         }
-      if (!dst->sin6_scope_id)
+    }
+#endif /* DTLS */
+  do
+    {
+      int base = got;
+
+      n = count - got;
+      if (n > UDP46_RECV_BATCH_MAX)
+        n = UDP46_RECV_BATCH_MAX;
+      if (n <= 0)
+        break;
+      for (i = 0 ; i < n ; i++)
         {
-          L_DEBUG("no scope id..?");
-          continue;
+          um[i].buf = msgs[base + i].buf;
+          um[i].buf_size = msgs[base + i].buf_len;
         }
-      if (!if_indextoname(dst->sin6_scope_id, ifname))
+      r = udp46_recv_batch(h->u46_server, um, n);
+      for (i = 0 ; i < n ; i++)
+        msgs[base + i].buf = um[i].buf;
+      for (i = 0 ; i < r ; i++)
         {
-          L_ERR("unable to receive - if_indextoname:%s", strerror(errno));
-          continue;
-        }
+          dncp_ext_msg m = &msgs[got];
 
-      *ep = dncp_find_ep_by_name(h->dncp, ifname);
-
-      if (!*ep)
-        continue;
-
-      if (IN6_IS_ADDR_LINKLOCAL(&src->sin6_addr))
-        f |= DNCP_RECV_FLAG_SRC_LINKLOCAL;
-
-      if (IN6_IS_ADDR_LINKLOCAL(&dst->sin6_addr))
-        f |= DNCP_RECV_FLAG_DST_LINKLOCAL;
-
-      /* 'NULL' = multicast from dncp point of view. */
-      if (IN6_IS_ADDR_MULTICAST(&dst->sin6_addr))
-        {
-          if (memcmp(&dst->sin6_addr, &h->multicast_address,
-                     sizeof(h->multicast_address)))
+          /* Move buffer of the message over ignored one(s), if any. */
+          if (m != &msgs[base + i])
             {
-              L_DEBUG("hncp_io_recv: got wrong multicast address traffic?");
-              continue;
+              void *b = m->buf;
+
+              m->buf = msgs[base + i].buf;
+              msgs[base + i].buf = b;
             }
-          dst = NULL;
+          m->len = um[i].len;
+          if (_recv_msg(h, m, &um[i].src, &um[i].dst, f))
+            got++;
         }
-      *src_store = src;
-      *dst_store = dst;
-      *flags = f;
-      break;
-    }
-  return r;
+    } while (!got && r > 0);
+  return got;
 }
 
 static void
-_send(dncp_ext ext, dncp_ep ep,
-      struct sockaddr_in6 *src,
-      struct sockaddr_in6 *dst,
-      void *buf, size_t len)
+_send_iovec(dncp_ext ext, dncp_ep ep,
+            struct sockaddr_in6 *src,
+            struct sockaddr_in6 *dst,
+            struct iovec *iov, int iov_len)
 {
   hncp h = container_of(ext, hncp_s, ext);
   struct sockaddr_in6 rdst;
+  size_t len = 0;
   ssize_t r;
+  int i;
 
+  for (i = 0 ; i < iov_len ; i++)
+    len += iov[i].iov_len;
   if (!dst)
     sockaddr_in6_set(&rdst, &h->multicast_address, HNCP_PORT);
   else
@@ -226,13 +325,31 @@ _send(dncp_ext ext, dncp_ep ep,
 #ifdef DTLS
   if (h->d && !IN6_IS_ADDR_MULTICAST(&rdst.sin6_addr))
     {
+      void *buf = iov[0].iov_base, *p;
+
       /* Change destination port to DTLS server port too if it is the
        * default port. Otherwise answer on the different port (which
        * is presumably already DTLS protected due to protection in
        * input path).*/
       if (rdst.sin6_port == htons(HNCP_PORT))
         rdst.sin6_port = htons(HNCP_DTLS_SERVER_PORT);
+      /* DTLS records are built from one contiguous buffer. */
+      if (iov_len > 1)
+        {
+          if (!(buf = malloc(len)))
+            {
+              L_ERR("_send_iovec: malloc failed");
+              return;
+            }
+          for (p = buf, i = 0 ; i < iov_len ; i++)
+            {
+              memcpy(p, iov[i].iov_base, iov[i].iov_len);
+              p += iov[i].iov_len;
+            }
+        }
       r = dtls_send(h->d, src, &rdst, buf, len);
+      if (buf != iov[0].iov_base)
+        free(buf);
       if (r >= 0 && (size_t) r != len)
         L_ERR("short dtls send?!?");
       else if (r < 0)
@@ -241,15 +358,26 @@ _send(dncp_ext ext, dncp_ep ep,
   else
 #endif /* DTLS */
     {
-      r = udp46_send(h->u46_server, src, &rdst, buf, len);
+      r = udp46_send_iovec(h->u46_server, src, &rdst, iov, iov_len);
       if (r >= 0 && (size_t) r != len)
         L_ERR("short udp46_send?!?");
       else if (r < 0)
         L_DEBUG("udp46_send failed: %s for %d bytes " SA6_F "->" SA6_F,
-                strerror(errno), len, SA6_D(src), SA6_D(dst));
+                strerror(errno), (int)len, SA6_D(src), SA6_D(dst));
     }
 }
 
+static void
+_send(dncp_ext ext, dncp_ep ep,
+      struct sockaddr_in6 *src,
+      struct sockaddr_in6 *dst,
+      void *buf, size_t len)
+{
+  struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+  _send_iovec(ext, ep, src, dst, &iov, 1);
+}
+
 static hnetd_time_t _get_time(dncp_ext ext __unused)
 {
   return hnetd_time();
@@ -303,7 +431,9 @@ bool hncp_io_init(hncp h)
     return false;
   h->timeout.cb = _timeout;
   h->ext.cb.recv = _recv;
+  h->ext.cb.recv_batch = _recv_batch;
   h->ext.cb.send = _send;
+  h->ext.cb.send_iovec = _send_iovec;
   h->ext.cb.get_hwaddrs = _get_hwaddrs;
   h->ext.cb.get_time = _get_time;
   h->ext.cb.schedule_timeout = _schedule_timeout;
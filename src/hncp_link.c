@@ -71,7 +71,7 @@ static void calculate_link(struct hncp_link *l, dncp_ep ep, bool enable)
 
 	if (enable) {
 		struct tlv_attr *c;
-		dncp_node_for_each_tlv(dncp_get_own_node(l->dncp), c) {
+		dncp_node_for_each_tlv_with_type(dncp_get_own_node(l->dncp), c, DNCP_T_PEER) {
 			dncp_t_peer ne = dncp_tlv_peer(l->dncp, c);
 			if (ne && ne->ep_id == dncp_ep_get_id(ep))
 				++peercnt;
@@ -83,7 +83,7 @@ static void calculate_link(struct hncp_link *l, dncp_ep ep, bool enable)
 		L_DEBUG("hncp_link_calculate: local node advertises %d "
 			"neighbors on iface %d", (int)peercnt, (int)dncp_ep_get_id(ep));
 
-		dncp_node_for_each_tlv(dncp_get_own_node(l->dncp), c) {
+		dncp_node_for_each_tlv_with_type(dncp_get_own_node(l->dncp), c, DNCP_T_PEER) {
 			dncp_t_peer cn = dncp_tlv_peer(l->dncp, c);
 
 			if (!cn || cn->ep_id != dncp_ep_get_id(ep))
@@ -98,11 +98,11 @@ static void calculate_link(struct hncp_link *l, dncp_ep ep, bool enable)
 			hncp_t_version peervertlv = NULL;
 
 			struct tlv_attr *pc;
-			dncp_node_for_each_tlv(peer, pc) {
-				if (tlv_id(pc) == HNCP_T_VERSION &&
-						tlv_len(pc) > sizeof(*peervertlv))
+			dncp_node_for_each_tlv_with_type(peer, pc, HNCP_T_VERSION)
+				if (tlv_len(pc) > sizeof(*peervertlv))
 					peervertlv = tlv_data(pc);
 
+			dncp_node_for_each_tlv_with_type(peer, pc, DNCP_T_PEER) {
 				dncp_t_peer pn = dncp_tlv_peer(l->dncp, pc);
 				if (!pn || pn->ep_id != cn->peer_ep_id ||
 				    memcmp(dncp_tlv_get_node_id(l->dncp, pn), &dncp_get_own_node(l->dncp)->node_id, DNCP_NI_LEN(l->dncp)))
@@ -213,6 +213,8 @@ static void cb_tlv(dncp_subscriber s, dncp_node n,
 	}
 }
 
+static const uint16_t cb_tlv_types[] = {DNCP_T_PEER};
+
 struct hncp_link* hncp_link_create(dncp dncp, const struct hncp_link_config *conf)
 {
 	struct hncp_link *l = calloc(1, sizeof(*l));
@@ -221,6 +223,8 @@ struct hncp_link* hncp_link_create(dncp dncp, const struct hncp_link_config *con
 		INIT_LIST_HEAD(&l->users);
 
 		l->subscr.tlv_change_cb = cb_tlv;
+		l->subscr.tlv_types = cb_tlv_types;
+		l->subscr.num_tlv_types = ARRAY_SIZE(cb_tlv_types);
 		dncp_subscribe(dncp, &l->subscr);
 
 		l->iface.cb_intiface = cb_intiface;
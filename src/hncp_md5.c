@@ -0,0 +1,322 @@
+/*
+ * $Id: hncp_md5.c $
+ *
+ * Copyright (c) 2015 cisco Systems, Inc.
+ *
+ */
+
+/* Multi-buffer MD5.
+ *
+ * MD5 of a single message is inherently serial, but node data of
+ * different nodes can be hashed independently. So, each SIMD lane
+ * hashes a different message; whenever a lane finishes its message,
+ * it picks up the next one. Without SIMD support (or with just one
+ * message), the plain libubox implementation is used instead.
+ */
+
+#include "hncp_md5.h"
+
+#include <string.h>
+#include <stdint.h>
+#include <libubox/md5.h>
+#include <libubox/utils.h>
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+#define MD5_LANES 8
+typedef __m256i md5_v;
+#define V_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define V_STORE(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define V_SET1(x) _mm256_set1_epi32((int)(x))
+#define V_ADD(a, b) _mm256_add_epi32(a, b)
+#define V_AND(a, b) _mm256_and_si256(a, b)
+#define V_OR(a, b) _mm256_or_si256(a, b)
+#define V_XOR(a, b) _mm256_xor_si256(a, b)
+#define V_ANDNOT(a, b) _mm256_andnot_si256(a, b)
+#define V_ROTL(x, s) \
+  _mm256_or_si256(_mm256_slli_epi32(x, s), _mm256_srli_epi32(x, 32 - (s)))
+
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define MD5_LANES 4
+typedef __m128i md5_v;
+#define V_LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define V_STORE(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define V_SET1(x) _mm_set1_epi32((int)(x))
+#define V_ADD(a, b) _mm_add_epi32(a, b)
+#define V_AND(a, b) _mm_and_si128(a, b)
+#define V_OR(a, b) _mm_or_si128(a, b)
+#define V_XOR(a, b) _mm_xor_si128(a, b)
+#define V_ANDNOT(a, b) _mm_andnot_si128(a, b)
+#define V_ROTL(x, s) \
+  _mm_or_si128(_mm_slli_epi32(x, s), _mm_srli_epi32(x, 32 - (s)))
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+
+#define MD5_LANES 4
+typedef uint32x4_t md5_v;
+#define V_LOAD(p) vld1q_u32(p)
+#define V_STORE(p, v) vst1q_u32(p, v)
+#define V_SET1(x) vdupq_n_u32(x)
+#define V_ADD(a, b) vaddq_u32(a, b)
+#define V_AND(a, b) vandq_u32(a, b)
+#define V_OR(a, b) vorrq_u32(a, b)
+#define V_XOR(a, b) veorq_u32(a, b)
+#define V_ANDNOT(a, b) vbicq_u32(b, a)
+#define V_ROTL(x, s) vsriq_n_u32(vshlq_n_u32(x, s), x, 32 - (s))
+
+#endif
+
+#ifdef MD5_LANES
+
+const int hncp_md5_lanes = MD5_LANES;
+
+#define MD5_BLOCK 64
+
+#define MD5_F(b, c, d) V_OR(V_AND(b, c), V_ANDNOT(b, d))
+#define MD5_G(b, c, d) V_OR(V_AND(b, d), V_ANDNOT(d, c))
+#define MD5_H(b, c, d) V_XOR(V_XOR(b, c), d)
+#define MD5_I(b, c, d) V_XOR(c, V_OR(b, V_XOR(d, V_SET1(0xffffffff))))
+
+#define MD5_STEP(f, a, b, c, d, k, t, s)                                \
+  a = V_ADD(a, V_ADD(V_ADD(f(b, c, d), V_LOAD(w[k])), V_SET1(t)));      \
+  a = V_ADD(V_ROTL(a, s), b)
+
+typedef struct {
+  /* Full blocks of the message left. */
+  const unsigned char *p;
+  size_t blocks;
+
+  /* Padding (+ whatever did not fill a block) of the message. */
+  unsigned char tail[2 * MD5_BLOCK];
+  int tail_i, tail_blocks;
+
+  /* Index of the message; -1 if the lane is idle. */
+  int idx;
+} md5_lane_s, *md5_lane;
+
+static const uint32_t md5_iv[4] = {
+  0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476
+};
+
+static const unsigned char md5_idle_block[MD5_BLOCK];
+
+static void _md5_lanes_compress(uint32_t st[4][MD5_LANES],
+                                uint32_t w[16][MD5_LANES])
+{
+  md5_v a = V_LOAD(st[0]), b = V_LOAD(st[1]);
+  md5_v c = V_LOAD(st[2]), d = V_LOAD(st[3]);
+  md5_v aa = a, bb = b, cc = c, dd = d;
+
+  MD5_STEP(MD5_F, a, b, c, d, 0, 0xd76aa478, 7);
+  MD5_STEP(MD5_F, d, a, b, c, 1, 0xe8c7b756, 12);
+  MD5_STEP(MD5_F, c, d, a, b, 2, 0x242070db, 17);
+  MD5_STEP(MD5_F, b, c, d, a, 3, 0xc1bdceee, 22);
+  MD5_STEP(MD5_F, a, b, c, d, 4, 0xf57c0faf, 7);
+  MD5_STEP(MD5_F, d, a, b, c, 5, 0x4787c62a, 12);
+  MD5_STEP(MD5_F, c, d, a, b, 6, 0xa8304613, 17);
+  MD5_STEP(MD5_F, b, c, d, a, 7, 0xfd469501, 22);
+  MD5_STEP(MD5_F, a, b, c, d, 8, 0x698098d8, 7);
+  MD5_STEP(MD5_F, d, a, b, c, 9, 0x8b44f7af, 12);
+  MD5_STEP(MD5_F, c, d, a, b, 10, 0xffff5bb1, 17);
+  MD5_STEP(MD5_F, b, c, d, a, 11, 0x895cd7be, 22);
+  MD5_STEP(MD5_F, a, b, c, d, 12, 0x6b901122, 7);
+  MD5_STEP(MD5_F, d, a, b, c, 13, 0xfd987193, 12);
+  MD5_STEP(MD5_F, c, d, a, b, 14, 0xa679438e, 17);
+  MD5_STEP(MD5_F, b, c, d, a, 15, 0x49b40821, 22);
+
+  MD5_STEP(MD5_G, a, b, c, d, 1, 0xf61e2562, 5);
+  MD5_STEP(MD5_G, d, a, b, c, 6, 0xc040b340, 9);
+  MD5_STEP(MD5_G, c, d, a, b, 11, 0x265e5a51, 14);
+  MD5_STEP(MD5_G, b, c, d, a, 0, 0xe9b6c7aa, 20);
+  MD5_STEP(MD5_G, a, b, c, d, 5, 0xd62f105d, 5);
+  MD5_STEP(MD5_G, d, a, b, c, 10, 0x02441453, 9);
+  MD5_STEP(MD5_G, c, d, a, b, 15, 0xd8a1e681, 14);
+  MD5_STEP(MD5_G, b, c, d, a, 4, 0xe7d3fbc8, 20);
+  MD5_STEP(MD5_G, a, b, c, d, 9, 0x21e1cde6, 5);
+  MD5_STEP(MD5_G, d, a, b, c, 14, 0xc33707d6, 9);
+  MD5_STEP(MD5_G, c, d, a, b, 3, 0xf4d50d87, 14);
+  MD5_STEP(MD5_G, b, c, d, a, 8, 0x455a14ed, 20);
+  MD5_STEP(MD5_G, a, b, c, d, 13, 0xa9e3e905, 5);
+  MD5_STEP(MD5_G, d, a, b, c, 2, 0xfcefa3f8, 9);
+  MD5_STEP(MD5_G, c, d, a, b, 7, 0x676f02d9, 14);
+  MD5_STEP(MD5_G, b, c, d, a, 12, 0x8d2a4c8a, 20);
+
+  MD5_STEP(MD5_H, a, b, c, d, 5, 0xfffa3942, 4);
+  MD5_STEP(MD5_H, d, a, b, c, 8, 0x8771f681, 11);
+  MD5_STEP(MD5_H, c, d, a, b, 11, 0x6d9d6122, 16);
+  MD5_STEP(MD5_H, b, c, d, a, 14, 0xfde5380c, 23);
+  MD5_STEP(MD5_H, a, b, c, d, 1, 0xa4beea44, 4);
+  MD5_STEP(MD5_H, d, a, b, c, 4, 0x4bdecfa9, 11);
+  MD5_STEP(MD5_H, c, d, a, b, 7, 0xf6bb4b60, 16);
+  MD5_STEP(MD5_H, b, c, d, a, 10, 0xbebfbc70, 23);
+  MD5_STEP(MD5_H, a, b, c, d, 13, 0x289b7ec6, 4);
+  MD5_STEP(MD5_H, d, a, b, c, 0, 0xeaa127fa, 11);
+  MD5_STEP(MD5_H, c, d, a, b, 3, 0xd4ef3085, 16);
+  MD5_STEP(MD5_H, b, c, d, a, 6, 0x04881d05, 23);
+  MD5_STEP(MD5_H, a, b, c, d, 9, 0xd9d4d039, 4);
+  MD5_STEP(MD5_H, d, a, b, c, 12, 0xe6db99e5, 11);
+  MD5_STEP(MD5_H, c, d, a, b, 15, 0x1fa27cf8, 16);
+  MD5_STEP(MD5_H, b, c, d, a, 2, 0xc4ac5665, 23);
+
+  MD5_STEP(MD5_I, a, b, c, d, 0, 0xf4292244, 6);
+  MD5_STEP(MD5_I, d, a, b, c, 7, 0x432aff97, 10);
+  MD5_STEP(MD5_I, c, d, a, b, 14, 0xab9423a7, 15);
+  MD5_STEP(MD5_I, b, c, d, a, 5, 0xfc93a039, 21);
+  MD5_STEP(MD5_I, a, b, c, d, 12, 0x655b59c3, 6);
+  MD5_STEP(MD5_I, d, a, b, c, 3, 0x8f0ccc92, 10);
+  MD5_STEP(MD5_I, c, d, a, b, 10, 0xffeff47d, 15);
+  MD5_STEP(MD5_I, b, c, d, a, 1, 0x85845dd1, 21);
+  MD5_STEP(MD5_I, a, b, c, d, 8, 0x6fa87e4f, 6);
+  MD5_STEP(MD5_I, d, a, b, c, 15, 0xfe2ce6e0, 10);
+  MD5_STEP(MD5_I, c, d, a, b, 6, 0xa3014314, 15);
+  MD5_STEP(MD5_I, b, c, d, a, 13, 0x4e0811a1, 21);
+  MD5_STEP(MD5_I, a, b, c, d, 4, 0xf7537e82, 6);
+  MD5_STEP(MD5_I, d, a, b, c, 11, 0xbd3af235, 10);
+  MD5_STEP(MD5_I, c, d, a, b, 2, 0x2ad7d2bb, 15);
+  MD5_STEP(MD5_I, b, c, d, a, 9, 0xeb86d391, 21);
+
+  V_STORE(st[0], V_ADD(a, aa));
+  V_STORE(st[1], V_ADD(b, bb));
+  V_STORE(st[2], V_ADD(c, cc));
+  V_STORE(st[3], V_ADD(d, dd));
+}
+
+static void _md5_lane_start(md5_lane l, int i, uint32_t st[4][MD5_LANES],
+                            int idx, const void *buf, size_t len)
+{
+  size_t rest = len % MD5_BLOCK;
+  uint64_t bits = cpu_to_le64((uint64_t)len << 3);
+  int k;
+
+  l->idx = idx;
+  l->p = buf;
+  l->blocks = len / MD5_BLOCK;
+  l->tail_i = 0;
+  l->tail_blocks = rest < MD5_BLOCK - 8 ? 1 : 2;
+  memset(l->tail, 0, sizeof(l->tail));
+  if (rest)
+    memcpy(l->tail, l->p + l->blocks * MD5_BLOCK, rest);
+  l->tail[rest] = 0x80;
+  memcpy(l->tail + l->tail_blocks * MD5_BLOCK - 8, &bits, 8);
+  for (k = 0 ; k < 4 ; k++)
+    st[k][i] = md5_iv[k];
+}
+
+static void _md5_lane_finish(int i, uint32_t st[4][MD5_LANES], void *dst)
+{
+  uint32_t h;
+  int k;
+
+  for (k = 0 ; k < 4 ; k++)
+    {
+      h = cpu_to_le32(st[k][i]);
+      memcpy((unsigned char *)dst + k * 4, &h, 4);
+    }
+}
+
+static void _md5_multi(const void **bufs, const size_t *lens,
+                       void **dsts, int n)
+{
+  md5_lane_s lanes[MD5_LANES];
+  uint32_t st[4][MD5_LANES];
+  uint32_t w[16][MD5_LANES];
+  int i, j, active = 0, next = 0;
+
+  for (i = 0 ; i < MD5_LANES ; i++)
+    {
+      if (next < n)
+        {
+          _md5_lane_start(&lanes[i], i, st, next, bufs[next], lens[next]);
+          next++;
+          active++;
+        }
+      else
+        {
+          lanes[i].idx = -1;
+          for (j = 0 ; j < 4 ; j++)
+            st[j][i] = 0;
+        }
+    }
+  while (active)
+    {
+      for (i = 0 ; i < MD5_LANES ; i++)
+        {
+          md5_lane l = &lanes[i];
+          const unsigned char *p =
+            l->idx < 0 ? md5_idle_block
+            : l->blocks ? l->p : l->tail + l->tail_i * MD5_BLOCK;
+          uint32_t v;
+
+          for (j = 0 ; j < 16 ; j++)
+            {
+              memcpy(&v, p + j * 4, 4);
+              w[j][i] = le32_to_cpu(v);
+            }
+        }
+      _md5_lanes_compress(st, w);
+      for (i = 0 ; i < MD5_LANES ; i++)
+        {
+          md5_lane l = &lanes[i];
+
+          if (l->idx < 0)
+            continue;
+          if (l->blocks)
+            {
+              l->p += MD5_BLOCK;
+              l->blocks--;
+              continue;
+            }
+          l->tail_i++;
+          if (--l->tail_blocks)
+            continue;
+          _md5_lane_finish(i, st, dsts[l->idx]);
+          if (next < n)
+            {
+              _md5_lane_start(l, i, st, next, bufs[next], lens[next]);
+              next++;
+            }
+          else
+            {
+              l->idx = -1;
+              active--;
+            }
+        }
+    }
+}
+
+#else
+
+const int hncp_md5_lanes = 1;
+
+#endif /* MD5_LANES */
+
+static void _md5(const void *buf, size_t len, void *dst)
+{
+  md5_ctx_t ctx;
+
+  md5_begin(&ctx);
+  md5_hash(buf, len, &ctx);
+  md5_end(dst, &ctx);
+}
+
+void hncp_md5_multi(const void **bufs, const size_t *lens, void **dsts, int n)
+{
+  int i;
+
+#ifdef MD5_LANES
+  if (n > 1)
+    {
+      _md5_multi(bufs, lens, dsts, n);
+      return;
+    }
+#endif /* MD5_LANES */
+  for (i = 0 ; i < n ; i++)
+    _md5(bufs[i], lens[i], dsts[i]);
+}
@@ -0,0 +1,20 @@
+/*
+ * $Id: hncp_md5.h $
+ *
+ * Copyright (c) 2015 cisco Systems, Inc.
+ *
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* Number of independent messages hashed in parallel (1 if there is no
+ * SIMD implementation for the target). */
+extern const int hncp_md5_lanes;
+
+/**
+ * Calculate MD5 of n independent buffers (bufs[i][:lens[i]] to
+ * dsts[i]), interleaving them across SIMD lanes when available.
+ */
+void hncp_md5_multi(const void **bufs, const size_t *lens, void **dsts, int n);
@@ -335,6 +335,10 @@ static void _tlv_cb(dncp_subscriber s,
 	}
 }
 
+static const uint16_t _tlv_types[] = {
+	HNCP_T_PIM_BORDER_PROXY, HNCP_T_PIM_RPA_CANDIDATE
+};
+
 static void _cb_extiface(struct iface_user *u, const char *ifname, bool enabled)
 {
 	hncp_multicast m = container_of(u, hncp_multicast_s, iface);
@@ -399,6 +403,8 @@ hncp_multicast hncp_multicast_create(hncp h, hncp_multicast_params p)
 	exeq_init(&m->exeq);
 
 	m->subscriber.tlv_change_cb = _tlv_cb;
+	m->subscriber.tlv_types = _tlv_types;
+	m->subscriber.num_tlv_types = ARRAY_SIZE(_tlv_types);
 	dncp_subscribe(m->dncp, &m->subscriber);
 
 	m->iface.cb_intiface = _cb_intiface;
@@ -1570,6 +1570,10 @@ static void hpa_dncp_tlv_change_cb(dncp_subscriber s,
 }
 
 
+static const uint16_t hpa_dncp_tlv_types[] = {
+	HNCP_T_EXTERNAL_CONNECTION, HNCP_T_ASSIGNED_PREFIX, HNCP_T_NODE_ADDRESS
+};
+
 static void hpa_dncp_node_change_cb(dncp_subscriber s,
 		dncp_node n, bool add)
 {
@@ -2126,6 +2130,8 @@ hncp_pa hncp_pa_create(hncp hncp, struct hncp_link *hncp_link)
 
 	pa_core_init(&hp->pa);
 	pa_core_init(&hp->aa);
+	pa_core_set_batched(&hp->pa, 1);
+	pa_core_set_batched(&hp->aa, 1);
 	pa_store_init(&hp->store, 100);
 	pa_store_bind(&hp->store, &hp->pa, &hp->store_pa_b);
 	pa_store_bind(&hp->store, &hp->aa, &hp->store_aa_b);
@@ -2186,6 +2192,8 @@ hncp_pa hncp_pa_create(hncp hncp, struct hncp_link *hncp_link)
 	hp->dncp_user.node_change_cb = hpa_dncp_node_change_cb;
 	hp->dncp_user.republish_cb = hpa_dncp_republish_cb;
 	hp->dncp_user.tlv_change_cb = hpa_dncp_tlv_change_cb;
+	hp->dncp_user.tlv_types = hpa_dncp_tlv_types;
+	hp->dncp_user.num_tlv_types = ARRAY_SIZE(hpa_dncp_tlv_types);
 	dncp_subscribe(hp->dncp, &hp->dncp_user);
 
 	//Subscribe to HNCP Link
@@ -149,6 +149,10 @@ typedef struct __packed {
  * here) should work.  */
 #define HNCP_MAXIMUM_MULTICAST_SIZE (1280-40-8)
 
+/* Node states that do not fit in one multicast are split across at
+ * most this many; beyond that, peers have to ask via unicast. */
+#define HNCP_MAXIMUM_MULTICAST_DATAGRAMS 8
+
 /* Very arbitrary. On some implementations, I have seen some issues
  * with 10+kb frames so we use this for now. It MUST be significantly
  * more than 4k, due to how code is written at the moment. */
@@ -7,16 +7,78 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/file.h>
+#include <sys/socket.h>
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <net/if.h>
+
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif /* __linux__ */
 
 #include "hncp_routing.h"
 #include "dncp_i.h"
 #include "hncp_i.h"
 #include "iface.h"
+#include "coproc.h"
+
+/* Routing table and protocol used for BFS routes (see hnetd-routing) */
+#define HNCP_ROUTING_TABLE 33333
+#define HNCP_ROUTING_PROTO 73
+#define HNCP_ROUTING_THROW_METRIC 2147483645
+
+/* Window for coalescing bursts of changes into one routing run (ms) */
+#define HNCP_ROUTING_DELAY 50
+
+enum hncp_route_type {
+	HNCP_ROUTE_IPV6_ASSIGNED,
+	HNCP_ROUTE_IPV4_ASSIGNED,
+	HNCP_ROUTE_IPV6_PREFIX,
+	HNCP_ROUTE_IPV4_PREFIX,
+	HNCP_ROUTE_IPV6_UPLINK,
+	HNCP_ROUTE_IPV4_UPLINK,
+};
+
+static const char *hncp_route_cmds[] = {
+	[HNCP_ROUTE_IPV6_ASSIGNED] = "bfsipv6assigned",
+	[HNCP_ROUTE_IPV4_ASSIGNED] = "bfsipv4assigned",
+	[HNCP_ROUTE_IPV6_PREFIX] = "bfsipv6prefix",
+	[HNCP_ROUTE_IPV4_PREFIX] = "bfsipv4prefix",
+	[HNCP_ROUTE_IPV6_UPLINK] = "bfsipv6uplink",
+	[HNCP_ROUTE_IPV4_UPLINK] = "bfsipv4uplink",
+};
+
+/* Identity of a route in the kernel; fields not relevant for a type are 0 */
+struct hncp_route_key {
+	uint32_t type;
+	uint32_t metric;
+	struct prefix dst;
+	struct prefix domain;
+};
+
+struct hncp_route {
+	struct vlist_node node;
+	struct hncp_route_key key;
+	struct in6_addr via;
+	char ifname[IFNAMSIZ];
+
+	/* Routing run which last produced this route */
+	unsigned run;
+
+	/* Could not be installed (missing interface), added again next run */
+	bool failed;
+};
+
+struct hncp_route_op {
+	bool add;
+	struct hncp_route route;
+};
 
 struct hncp_routing_struct {
 	dncp_subscriber_s subscr;
@@ -29,13 +91,49 @@ struct hncp_routing_struct {
 	size_t ifaces_cnt;
 	struct uloop_process configure_proc;
 	struct uloop_process routing_proc;
+	struct coproc_cmd routing_cmd;
 	bool configure_pending;
 	bool routing_pending;
+
+	/* Routes currently installed (or handed to the script) */
+	struct vlist_tree routes;
+	unsigned run;
+	bool prepared;
+
+	/* Changes of the current run, deletions are applied first */
+	struct hncp_route_op *ops;
+	size_t ops_cnt, ops_size;
+
+	/* Batch file of the running bfsbatch (empty if none) */
+	char batch[32];
+
+	/* rtnetlink socket for programming routes, fd -1 => script only */
+	struct uloop_fd rtnl;
+	uint32_t rtnl_seq;
+
+	/* Some routes failed, run again when interfaces change */
+	bool retry;
+
+	/* Root of the shortest-path tree; the tree is rebuilt if it changes */
+	dncp_node root;
+
+	/* Nodes whose neighbors or path changed since the last run */
+	struct list_head dirty;
+
+	/* Buckets (by hopcount) of nodes queued for recomputation */
+	struct list_head *queue;
+	size_t queue_size;
 };
 
 static void hncp_routing_spawn(char **argv)
 {
+	int status;
+	if (!coproc_call(argv, &status))
+		return;
+
 	pid_t pid = hncp_run(argv);
+	if (pid < 0)
+		return;
 	waitpid(pid, NULL, 0);
 }
 
@@ -56,6 +154,13 @@ static void hncp_configure_exec(struct uloop_process *p, __unused int ret)
 	}
 }
 
+static void hncp_routing_trigger(hncp_bfs bfs)
+{
+	// Coalesce: later changes within the window do not push the run out
+	if (bfs->t.cb && !bfs->t.pending)
+		uloop_timeout_set(&bfs->t, HNCP_ROUTING_DELAY);
+}
+
 static void hncp_routing_intiface(struct iface_user *u, const char *ifname, bool enable)
 {
 	hncp_bfs bfs = container_of(u, hncp_bfs_s, iface);
@@ -82,6 +187,10 @@ static void hncp_routing_intiface(struct iface_user *u, const char *ifname, bool
 		bfs->configure_pending = true;
 		hncp_configure_exec(&bfs->configure_proc, 0);
 	}
+
+	// Routes via a (re)appearing interface may be installable now
+	if (enable && bfs->retry)
+		hncp_routing_trigger(bfs);
 }
 
 static void hncp_routing_intaddr(struct iface_user *u, __unused const char *ifname,
@@ -90,215 +199,775 @@ static void hncp_routing_intaddr(struct iface_user *u, __unused const char *ifna
 	// Reschedule routing run when we have an IPv4-address on link
 	hncp_bfs bfs = container_of(u, hncp_bfs_s, iface);
 	if (addr4)
-		uloop_timeout_set(&bfs->t, 0);
+		hncp_routing_trigger(bfs);
+}
+
+#define hncp_routing_head(n) (&((hncp_node)dncp_node_get_ext_data(n))->bfs)
+#define hncp_routing_node(h) dncp_node_from_ext_data(container_of(h, hncp_node_s, bfs))
+#define hncp_routing_reached(bfs, h) ((h) == hncp_routing_head((bfs)->root) || (h)->ifname[0])
+
+static void hncp_routing_head_init(struct hncp_bfs_head *h)
+{
+	memset(h, 0, sizeof(*h));
+	INIT_LIST_HEAD(&h->head);
+	INIT_LIST_HEAD(&h->children);
+	INIT_LIST_HEAD(&h->in_parent);
+	INIT_LIST_HEAD(&h->in_dirty);
 }
 
-static void hncp_routing_cb(dncp_subscriber s, __unused dncp_node n,
-		struct tlv_attr *tlv, __unused bool add)
+static void hncp_routing_dirty(hncp_bfs bfs, struct hncp_bfs_head *h)
+{
+	if (list_empty(&h->in_dirty))
+		list_add_tail(&h->in_dirty, &bfs->dirty);
+}
+
+/* Forget the whole tree if our own node changed (the old one is gone) */
+static void hncp_routing_check_root(hncp_bfs bfs)
+{
+	dncp_node n;
+
+	if (bfs->root == bfs->dncp->own_node)
+		return;
+
+	// Never touch list entries here, they may point to the old root
+	vlist_for_each_element(&bfs->dncp->nodes, n, in_nodes)
+		hncp_routing_head_init(hncp_routing_head(n));
+	INIT_LIST_HEAD(&bfs->dirty);
+
+	bfs->root = bfs->dncp->own_node;
+	if (bfs->root)
+		hncp_routing_dirty(bfs, hncp_routing_head(bfs->root));
+}
+
+/* Drop h and its subtree from the tree; they are recomputed in the next run */
+static void hncp_routing_invalidate(hncp_bfs bfs, struct hncp_bfs_head *h)
+{
+	struct hncp_bfs_head *c, *c2;
+
+	list_del_init(&h->in_parent);
+	h->parent = NULL;
+	h->ifname[0] = 0;
+	h->has_next_hop4 = false;
+	h->hopcount = 0;
+	hncp_routing_dirty(bfs, h);
+
+	list_for_each_entry_safe(c, c2, &h->children, in_parent)
+		hncp_routing_invalidate(bfs, c);
+}
+
+static const uint16_t hncp_routing_tlv_types[] = {
+	DNCP_T_PEER, HNCP_T_ASSIGNED_PREFIX, HNCP_T_EXTERNAL_CONNECTION, HNCP_T_NODE_ADDRESS
+};
+
+static void hncp_routing_cb(dncp_subscriber s, dncp_node n,
+		dncp_tlv_change changes, int num_changes)
 {
 	hncp_bfs bfs = container_of(s, hncp_bfs_s, subscr);
-	if (tlv_id(tlv) == HNCP_T_ASSIGNED_PREFIX || tlv_id(tlv) == HNCP_T_DELEGATED_PREFIX ||
-			tlv_id(tlv) == DNCP_T_PEER || tlv_id(tlv) == HNCP_T_EXTERNAL_CONNECTION ||
-			tlv_id(tlv) == HNCP_T_NODE_ADDRESS)
-		uloop_timeout_set(&bfs->t, 0);
+
+	hncp_routing_check_root(bfs);
+	for (int i = 0; i < num_changes && bfs->root; ++i) {
+		if (tlv_id(changes[i].tlv) == DNCP_T_PEER) {
+			hncp_routing_dirty(bfs, hncp_routing_head(n));
+			break;
+		}
+	}
+
+	// Without peer changes only prefix content changed, the tree stays as it is
+	hncp_routing_trigger(bfs);
 }
 
-static void hncp_routing_exec(struct uloop_process *p, __unused int ret)
+static void hncp_routing_node_cb(dncp_subscriber s, dncp_node n, bool add)
 {
-	hncp_bfs bfs = container_of(p, hncp_bfs_s, routing_proc);
-	if (!(bfs->routing_pending && !bfs->routing_proc.pending))
+	hncp_bfs bfs = container_of(s, hncp_bfs_s, subscr);
+	struct hncp_bfs_head *h = hncp_routing_head(n);
+	struct hncp_bfs_head *c, *c2;
+
+	hncp_routing_check_root(bfs);
+	if (n == bfs->root)
 		return;
-	bfs->routing_proc.cb = hncp_routing_exec;
-	bfs->routing_proc.pid = fork();
-	if (bfs->routing_proc.pid) {
-		uloop_process_add(&bfs->routing_proc);
-		bfs->routing_pending = false;
+
+	if (add) {
+		hncp_routing_head_init(h);
 		return;
 	}
 
+	// Unreachable: detach now, the node may be gone by the next run
+	list_for_each_entry_safe(c, c2, &h->children, in_parent)
+		hncp_routing_invalidate(bfs, c);
+	list_del_init(&h->in_parent);
+	list_del_init(&h->in_dirty);
+	hncp_routing_head_init(h);
+	hncp_routing_trigger(bfs);
+}
+
+/* Next-hop towards direct neighbor n of our own node (first usable peer) */
+static bool hncp_routing_own_next_hop(hncp_bfs bfs, dncp_node n, struct hncp_bfs_head *h)
+{
 	dncp dncp = bfs->dncp;
-	struct list_head queue = LIST_HEAD_INIT(queue);
-	dncp_node c, n;
-	char dst[PREFIX_MAXBUFFLEN] = "", via[INET6_ADDRSTRLEN] = "";
-	char domain[PREFIX_MAXBUFFLEN] = "", metric[16];
-	char *argv[] = {(char*)bfs->script, "bfsprepare", dst, via, NULL, metric, domain, NULL};
-
-	vlist_for_each_element(&dncp->nodes, c, in_nodes) {
-		hncp_node hc = dncp_node_get_ext_data(c);
-		// Mark all nodes as not visited
-		hc->bfs.next_hop = NULL;
-		hc->bfs.next_hop4 = NULL;
-		hc->bfs.hopcount = 0;
-	}
-
-	hncp_routing_spawn(argv);
-	hncp_node hon = dncp_node_get_ext_data(dncp->own_node);
-	list_add_tail(&hon->bfs.head, &queue);
-
-	while (!list_empty(&queue)) {
-		hncp_node hc = container_of(list_first_entry(&queue, struct hncp_bfs_head, head), hncp_node_s,bfs);
-		c = dncp_node_from_ext_data(hc);
-		argv[4] = (char*)hc->bfs.ifname;
-		L_WARN("Router %s", DNCP_NODE_REPR(c));
-
-		struct tlv_attr *a, *a2;
-		dncp_node_for_each_tlv(c, a) {
-			hncp_t_assigned_prefix_header ap;
-			dncp_t_peer ne;
-			if ((ne = dncp_tlv_peer(dncp, a))) {
-				if (!(n = dncp_node_find_neigh_bidir(c, ne)))
-					continue; // Connection not mutual
-
-				hncp_node hn = dncp_node_get_ext_data(n);
-				if (hn->bfs.next_hop || n == dncp->own_node)
-					continue; // Already visited
-
-
-				if (c == dncp->own_node) { // We are at the start, lookup neighbor
-					dncp_ep ep = dncp_find_ep_by_id(dncp, ne->ep_id);
-					if (!ep)
-						continue;
-					dncp_tlv tlv = dncp_find_tlv(dncp, DNCP_T_PEER, tlv_data(a), tlv_len(a));
-					dncp_peer neigh = tlv ? dncp_tlv_get_extra(tlv) : NULL;
-					if (neigh) {
-						hn->bfs.next_hop = &neigh->last_sa6.sin6_addr;
-						hn->bfs.ifname = ep->ifname;
-					}
+	struct tlv_attr *a, *na;
+	dncp_t_peer ne;
+	hncp_t_node_address ra;
 
-					struct tlv_attr *na;
-					hncp_t_node_address ra;
-					dncp_node_for_each_tlv_with_type(n, na, HNCP_T_NODE_ADDRESS) {
-						if ((ra = hncp_tlv_ra(na))) {
-							if (ra->ep_id == ne->peer_ep_id &&
-							    IN6_IS_ADDR_V4MAPPED(&ra->address)) {
-								hn->bfs.next_hop4 = &ra->address;
-								break;
-							}
-						}
-					}
-				} else { // Inherit next-hop from predecessor
-					hn->bfs.next_hop = hc->bfs.next_hop;
-					hn->bfs.next_hop4 = hc->bfs.next_hop4;
-					hn->bfs.ifname = hc->bfs.ifname;
-				}
+	dncp_node_for_each_tlv_with_type(dncp->own_node, a, DNCP_T_PEER) {
+		if (!(ne = dncp_tlv_peer(dncp, a)) ||
+				memcmp(dncp_tlv_get_node_id(dncp, ne), &n->node_id, DNCP_NI_LEN(dncp)) ||
+				dncp_node_find_neigh_bidir(dncp->own_node, ne) != n)
+			continue;
+
+		dncp_ep ep = dncp_find_ep_by_id(dncp, ne->ep_id);
+		dncp_peer neigh = dncp_find_peer(dncp, tlv_data(a));
+		if (!ep || !neigh)
+			continue;
+
+		h->next_hop = neigh->last_sa6.sin6_addr;
+		strncpy(h->ifname, ep->ifname, sizeof(h->ifname) - 1);
+		h->ifname[sizeof(h->ifname) - 1] = 0;
+		h->has_next_hop4 = false;
+
+		dncp_node_for_each_tlv_with_type(n, na, HNCP_T_NODE_ADDRESS) {
+			if ((ra = hncp_tlv_ra(na)) && ra->ep_id == ne->peer_ep_id &&
+					IN6_IS_ADDR_V4MAPPED(&ra->address)) {
+				h->next_hop4 = ra->address;
+				h->has_next_hop4 = true;
+				break;
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+/* Queue n if reaching it through predecessor p is better than what it has */
+static void hncp_routing_offer(hncp_bfs bfs, dncp_node n, dncp_node p)
+{
+	struct hncp_bfs_head *h = hncp_routing_head(n), *hp = hncp_routing_head(p);
+	unsigned hopcount = hp->hopcount + 1;
+	struct hncp_bfs_head tmp;
+
+	if (n == bfs->root || !n->reachable || !hncp_routing_reached(bfs, hp))
+		return;
+
+	if (hncp_routing_reached(bfs, h) && h->hopcount <= hopcount)
+		return;
+
+	if (!list_empty(&h->head) && h->candidate_hopcount <= hopcount)
+		return;
+
+	if (p == bfs->root && !hncp_routing_own_next_hop(bfs, n, &tmp))
+		return;
+
+	if (hopcount >= bfs->queue_size)
+		return; // Cannot happen, paths are shorter than the number of nodes
+
+	h->candidate = hp;
+	h->candidate_hopcount = hopcount;
+	list_del(&h->head);
+	list_add_tail(&h->head, &bfs->queue[hopcount]);
+}
+
+/* Incrementally update the shortest-path tree: only nodes on paths
+ * through changed edges are recomputed, starting from their intact
+ * neighbors, and improvements propagate in order of hopcount. */
+static void hncp_routing_update_tree(hncp_bfs bfs)
+{
+	struct hncp_bfs_head *h, *h2, *c, *c2, tmp;
+	dncp_node n, root = bfs->root;
+	size_t count = 0, i;
+	int j;
+
+	if (bfs->queue_size < bfs->dncp->nodes.avl.count + 1) {
+		size_t size = bfs->dncp->nodes.avl.count * 2 + 1;
+		struct list_head *queue = realloc(bfs->queue, size * sizeof(*queue));
+		if (!queue)
+			return;
+		bfs->queue = queue;
+		bfs->queue_size = size;
+	}
+	for (i = 0; i < bfs->queue_size; ++i)
+		INIT_LIST_HEAD(&bfs->queue[i]);
+
+	// Our own neighbors are checked every run as peer addresses may change
+	hncp_routing_dirty(bfs, hncp_routing_head(root));
+
+	// Detach subtrees hanging off removed edges or changed next-hops
+	list_for_each_entry(h, &bfs->dirty, in_dirty) {
+		n = hncp_routing_node(h);
+		if (n != root && !n->reachable) {
+			hncp_routing_invalidate(bfs, h);
+			continue;
+		}
+
+		if (h->parent && !dncp_node_has_neighbor(n, hncp_routing_node(h->parent))) {
+			hncp_routing_invalidate(bfs, h);
+			continue;
+		}
+
+		list_for_each_entry_safe(c, c2, &h->children, in_parent) {
+			dncp_node cn = hncp_routing_node(c);
+			if (!dncp_node_has_neighbor(n, cn))
+				hncp_routing_invalidate(bfs, c);
+			else if (n == root && (!hncp_routing_own_next_hop(bfs, cn, &tmp) ||
+					memcmp(&tmp.next_hop, &c->next_hop, sizeof(tmp.next_hop)) ||
+					strcmp(tmp.ifname, c->ifname) || tmp.has_next_hop4 != c->has_next_hop4 ||
+					(tmp.has_next_hop4 && memcmp(&tmp.next_hop4, &c->next_hop4,
+								     sizeof(tmp.next_hop4)))))
+				hncp_routing_invalidate(bfs, c);
+		}
+	}
+
+	// Seed from the dirty nodes and their intact neighbors
+	list_for_each_entry_safe(h, h2, &bfs->dirty, in_dirty) {
+		n = hncp_routing_node(h);
+		for (j = 0; j < n->num_neighbors; ++j) {
+			hncp_routing_offer(bfs, n->neighbors[j], n);
+			hncp_routing_offer(bfs, n, n->neighbors[j]);
+		}
+		list_del_init(&h->in_dirty);
+	}
+
+	for (i = 1; i < bfs->queue_size; ++i) {
+		while (!list_empty(&bfs->queue[i])) {
+			h = list_first_entry(&bfs->queue[i], struct hncp_bfs_head, head);
+			list_del_init(&h->head);
+
+			if (!hncp_routing_reached(bfs, h->candidate) ||
+					h->candidate->hopcount + 1 != h->candidate_hopcount)
+				continue;
+
+			n = hncp_routing_node(h);
+			list_del(&h->in_parent);
+			list_add_tail(&h->in_parent, &h->candidate->children);
+			h->parent = h->candidate;
+			h->hopcount = h->candidate_hopcount;
 
-				if (!hn->bfs.next_hop || !hn->bfs.ifname)
+			if (h->parent == hncp_routing_head(root)) {
+				hncp_routing_own_next_hop(bfs, n, h);
+			} else {
+				h->next_hop = h->parent->next_hop;
+				h->next_hop4 = h->parent->next_hop4;
+				h->has_next_hop4 = h->parent->has_next_hop4;
+				strcpy(h->ifname, h->parent->ifname);
+			}
+			++count;
+
+			for (j = 0; j < n->num_neighbors; ++j)
+				hncp_routing_offer(bfs, n->neighbors[j], n);
+		}
+	}
+
+	L_DEBUG("hncp_routing: recomputed paths of %zu nodes", count);
+}
+
+static int hncp_route_compare(const void *k1, const void *k2, __unused void *ptr)
+{
+	return memcmp(k1, k2, sizeof(struct hncp_route_key));
+}
+
+static void hncp_route_op(hncp_bfs bfs, bool add, const struct hncp_route *r)
+{
+	if (bfs->ops_cnt == bfs->ops_size) {
+		size_t size = bfs->ops_size ? bfs->ops_size * 2 : 32;
+		struct hncp_route_op *ops = realloc(bfs->ops, size * sizeof(*ops));
+		if (!ops) {
+			L_ERR("hncp_routing: unable to queue route change");
+			return;
+		}
+		bfs->ops = ops;
+		bfs->ops_size = size;
+	}
+	bfs->ops[bfs->ops_cnt].add = add;
+	bfs->ops[bfs->ops_cnt++].route = *r;
+}
+
+static void hncp_route_update(struct vlist_tree *t, struct vlist_node *node_new,
+		struct vlist_node *node_old)
+{
+	hncp_bfs bfs = container_of(t, hncp_bfs_s, routes);
+	struct hncp_route *r_new = container_of(node_new, struct hncp_route, node);
+	struct hncp_route *r_old = container_of(node_old, struct hncp_route, node);
+
+	if (node_new && node_old) {
+		// First route found by the BFS (shortest path) wins
+		if (r_old->run != bfs->run && (r_old->failed ||
+				memcmp(&r_old->via, &r_new->via, sizeof(r_old->via)) ||
+				strcmp(r_old->ifname, r_new->ifname))) {
+			if (!r_old->failed)
+				hncp_route_op(bfs, false, r_old);
+			hncp_route_op(bfs, true, r_new);
+			r_old->via = r_new->via;
+			strcpy(r_old->ifname, r_new->ifname);
+			r_old->failed = false;
+		}
+		r_old->run = bfs->run;
+		free(r_new);
+	} else if (node_new) {
+		hncp_route_op(bfs, true, r_new);
+	} else if (node_old) {
+		if (!r_old->failed)
+			hncp_route_op(bfs, false, r_old);
+		free(r_old);
+	}
+}
+
+static void hncp_routing_add(hncp_bfs bfs, enum hncp_route_type type,
+		const struct prefix *dst, const struct in6_addr *via, const char *ifname,
+		unsigned metric, const struct prefix *domain)
+{
+	struct hncp_route *r = calloc(1, sizeof(*r));
+	if (!r)
+		return;
+
+	r->key.type = type;
+	r->run = bfs->run;
+
+	// Only keep what identifies the route in the kernel in the key
+	if (type != HNCP_ROUTE_IPV4_UPLINK) {
+		r->key.dst.prefix = dst->prefix;
+		r->key.dst.plen = dst->plen;
+	}
+
+	if (type != HNCP_ROUTE_IPV6_PREFIX && type != HNCP_ROUTE_IPV4_PREFIX) {
+		r->key.metric = metric;
+		r->via = *via;
+		strncpy(r->ifname, ifname, sizeof(r->ifname) - 1);
+	}
+
+	if (domain) {
+		r->key.domain.prefix = domain->prefix;
+		r->key.domain.plen = domain->plen;
+	}
+
+	vlist_add(&bfs->routes, &r->node, &r->key);
+}
+
+#ifdef __linux__
+static void hncp_routing_nl_put(struct nlmsghdr *nh, int type, const void *data, size_t len)
+{
+	struct rtattr *rta = (void*)nh + NLMSG_ALIGN(nh->nlmsg_len);
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+static void hncp_routing_nl_addr(struct nlmsghdr *nh, int type, bool ipv4,
+		const struct in6_addr *addr)
+{
+	if (ipv4)
+		hncp_routing_nl_put(nh, type, &addr->s6_addr[12], 4);
+	else
+		hncp_routing_nl_put(nh, type, addr, sizeof(*addr));
+}
+
+static uint8_t hncp_routing_nl_plen(bool ipv4, const struct prefix *p)
+{
+	return (ipv4) ? (p->plen >= 96 ? p->plen - 96 : 0) : p->plen;
+}
+
+/* Serialize one route change into buf; returns number of messages (1-2)
+ * or -1 if the interface of the route does not exist */
+static int hncp_routing_nl_route(hncp_bfs bfs, void *buf, const struct hncp_route_op *op)
+{
+	const struct hncp_route *r = &op->route;
+	bool ipv4 = r->key.type == HNCP_ROUTE_IPV4_ASSIGNED ||
+		r->key.type == HNCP_ROUTE_IPV4_PREFIX || r->key.type == HNCP_ROUTE_IPV4_UPLINK;
+	bool uplink = r->key.type == HNCP_ROUTE_IPV6_UPLINK || r->key.type == HNCP_ROUTE_IPV4_UPLINK;
+	bool throw = r->key.type == HNCP_ROUTE_IPV6_PREFIX || r->key.type == HNCP_ROUTE_IPV4_PREFIX;
+	const struct prefix *dst = uplink ? &r->key.domain : &r->key.dst;
+	int msgs = (r->key.type == HNCP_ROUTE_IPV6_UPLINK) ? 2 : 1;
+	uint32_t ifindex = 0;
+
+	if (!throw && !(ifindex = if_nametoindex(r->ifname))) {
+		L_WARN("hncp_routing: no interface %s for %s route", r->ifname,
+				hncp_route_cmds[r->key.type]);
+		return -1;
+	}
+
+	for (int i = 0; i < msgs; ++i) {
+		struct nlmsghdr *nh = buf;
+		struct rtmsg *rtm = NLMSG_DATA(nh);
+		uint32_t table = HNCP_ROUTING_TABLE;
+		uint32_t metric = throw ? HNCP_ROUTING_THROW_METRIC : r->key.metric;
+
+		memset(nh, 0, NLMSG_SPACE(sizeof(*rtm)));
+		nh->nlmsg_len = NLMSG_LENGTH(sizeof(*rtm));
+		nh->nlmsg_type = op->add ? RTM_NEWROUTE : RTM_DELROUTE;
+		nh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+		if (op->add)
+			nh->nlmsg_flags |= NLM_F_CREATE | NLM_F_EXCL;
+		nh->nlmsg_seq = ++bfs->rtnl_seq;
+
+		rtm->rtm_family = ipv4 ? AF_INET : AF_INET6;
+		rtm->rtm_dst_len = hncp_routing_nl_plen(ipv4, dst);
+		rtm->rtm_protocol = HNCP_ROUTING_PROTO;
+		rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+		rtm->rtm_type = throw ? RTN_THROW : RTN_UNICAST;
+		rtm->rtm_table = throw ? RT_TABLE_MAIN : RT_TABLE_UNSPEC;
+		if (ipv4 && !throw)
+			rtm->rtm_flags = RTNH_F_ONLINK;
+
+		if (rtm->rtm_dst_len)
+			hncp_routing_nl_addr(nh, RTA_DST, ipv4, &dst->prefix);
+
+		if (r->key.type == HNCP_ROUTE_IPV6_UPLINK) {
+			// Source-specific default: once for unspecified source, once for prefix
+			if (i == 0) {
+				rtm->rtm_src_len = 128;
+				hncp_routing_nl_put(nh, RTA_SRC, &in6addr_any, sizeof(in6addr_any));
+			} else {
+				rtm->rtm_src_len = r->key.dst.plen;
+				hncp_routing_nl_put(nh, RTA_SRC, &r->key.dst.prefix,
+						sizeof(r->key.dst.prefix));
+			}
+		}
+
+		if (!throw) {
+			hncp_routing_nl_addr(nh, RTA_GATEWAY, ipv4, &r->via);
+			hncp_routing_nl_put(nh, RTA_OIF, &ifindex, sizeof(ifindex));
+			hncp_routing_nl_put(nh, RTA_TABLE, &table, sizeof(table));
+		}
+		hncp_routing_nl_put(nh, RTA_PRIORITY, &metric, sizeof(metric));
+
+		buf += NLMSG_ALIGN(nh->nlmsg_len);
+	}
+	return msgs;
+}
+
+/* Consume acknowledgements of route changes; failures are only logged */
+static void hncp_routing_nl_recv(struct uloop_fd *fd, __unused unsigned int events)
+{
+	uint8_t rbuf[8192];
+	ssize_t rlen;
+
+	while ((rlen = recv(fd->fd, rbuf, sizeof(rbuf), 0))) {
+		if (rlen < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				L_ERR("hncp_routing: netlink recv failed: %s", strerror(errno));
+			break;
+		}
+
+		for (struct nlmsghdr *nh = (void*)rbuf; NLMSG_OK(nh, (size_t)rlen);
+				nh = NLMSG_NEXT(nh, rlen)) {
+			if (nh->nlmsg_type != NLMSG_ERROR)
+				continue;
+
+			struct nlmsgerr *err = NLMSG_DATA(nh);
+			// Existing or already removed routes are fine
+			if (err->error && err->error != -EEXIST && err->error != -ESRCH)
+				L_WARN("hncp_routing: route %s failed: %s",
+						err->msg.nlmsg_type == RTM_NEWROUTE ? "add" : "del",
+						strerror(-err->error));
+		}
+	}
+}
+
+static bool hncp_routing_nl_send(hncp_bfs bfs, void *buf, size_t len)
+{
+	if (send(bfs->rtnl.fd, buf, len, 0) != (ssize_t)len) {
+		L_ERR("hncp_routing: netlink send failed: %s", strerror(errno));
+		return false;
+	}
+
+	// The kernel answers right away, drain so the socket buffer cannot fill up
+	hncp_routing_nl_recv(&bfs->rtnl, ULOOP_READ);
+	return true;
+}
+
+static void hncp_routing_nl_failed(hncp_bfs bfs, const struct hncp_route_op *op)
+{
+	struct hncp_route *r = vlist_find(&bfs->routes, &op->route.key, r, node);
+	if (r) {
+		r->failed = true;
+		bfs->retry = true;
+	}
+}
+
+static void hncp_routing_nl_apply(hncp_bfs bfs)
+{
+	/* Enough for one route change (two messages at most) */
+	const size_t maxlen = 2 * NLMSG_SPACE(sizeof(struct rtmsg) + 4 * RTA_SPACE(16) + 4 * RTA_SPACE(4));
+	uint8_t buf[8192];
+	size_t len = 0;
+
+	for (int pass = 0; pass < 2; ++pass) {
+		for (size_t i = 0; i < bfs->ops_cnt; ++i) {
+			if (bfs->ops[i].add != (pass == 1))
+				continue;
+
+			if (len + maxlen > sizeof(buf)) {
+				hncp_routing_nl_send(bfs, buf, len);
+				len = 0;
+			}
+
+			int n = hncp_routing_nl_route(bfs, &buf[len], &bfs->ops[i]);
+			if (n < 0 && bfs->ops[i].add)
+				hncp_routing_nl_failed(bfs, &bfs->ops[i]);
+			for (int j = 0; j < n; ++j)
+				len += NLMSG_ALIGN(((struct nlmsghdr*)&buf[len])->nlmsg_len);
+		}
+	}
+
+	if (len)
+		hncp_routing_nl_send(bfs, buf, len);
+}
+
+static void hncp_routing_nl_init(hncp_bfs bfs, int fd)
+{
+	bfs->rtnl.fd = fd;
+	bfs->rtnl.cb = hncp_routing_nl_recv;
+	uloop_fd_add(&bfs->rtnl, ULOOP_READ);
+}
+#endif /* __linux__ */
+
+static void hncp_routing_script_route(FILE *fp, const struct hncp_route_op *op)
+{
+	const struct hncp_route *r = &op->route;
+	bool ipv4 = r->key.type == HNCP_ROUTE_IPV4_ASSIGNED || r->key.type == HNCP_ROUTE_IPV4_UPLINK;
+	char dst[PREFIX_MAXBUFFLEN], via[INET6_ADDRSTRLEN], domain[PREFIX_MAXBUFFLEN];
+
+	prefix_ntop(dst, sizeof(dst), &r->key.dst.prefix, r->key.dst.plen);
+	fprintf(fp, "%s %s %s", op->add ? "add" : "del", hncp_route_cmds[r->key.type], dst);
+
+	if (r->key.type == HNCP_ROUTE_IPV6_PREFIX || r->key.type == HNCP_ROUTE_IPV4_PREFIX) {
+		fputc('\n', fp);
+		return;
+	}
+
+	if (ipv4)
+		inet_ntop(AF_INET, &r->via.s6_addr[12], via, sizeof(via));
+	else
+		inet_ntop(AF_INET6, &r->via, via, sizeof(via));
+	fprintf(fp, " %s %s %u", via, r->ifname, r->key.metric);
+
+	if (r->key.type == HNCP_ROUTE_IPV6_UPLINK || r->key.type == HNCP_ROUTE_IPV4_UPLINK) {
+		if (r->key.domain.plen == 0)
+			strcpy(domain, "default");
+		else
+			prefix_ntop(domain, sizeof(domain), &r->key.domain.prefix, r->key.domain.plen);
+		fprintf(fp, " %s", domain);
+	}
+	fputc('\n', fp);
+}
+
+/* Hand the whole batch to a single script invocation via a batch file */
+static bool hncp_routing_script_apply(hncp_bfs bfs)
+{
+	char *argv[] = {(char*)bfs->script, "bfsbatch", bfs->batch, NULL};
+	FILE *fp;
+	int fd;
+
+	strcpy(bfs->batch, "/tmp/hnetd-routing.XXXXXX");
+	if ((fd = mkstemp(bfs->batch)) < 0 || !(fp = fdopen(fd, "w"))) {
+		L_ERR("hncp_routing: unable to create batch file: %s", strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			unlink(bfs->batch);
+		}
+		bfs->batch[0] = 0;
+		return false;
+	}
+
+	for (int pass = 0; pass < 2; ++pass)
+		for (size_t i = 0; i < bfs->ops_cnt; ++i)
+			if (bfs->ops[i].add == (pass == 1))
+				hncp_routing_script_route(fp, &bfs->ops[i]);
+	fclose(fp);
+
+	L_DEBUG("hncp_routing: %s bfsbatch with %zu changes", bfs->script, bfs->ops_cnt);
+	if (!coproc_run(&bfs->routing_cmd, argv, NULL))
+		return true;
+
+	bfs->routing_proc.pid = hncp_run(argv);
+	if (bfs->routing_proc.pid < 0) {
+		L_ERR("hncp_routing: unable to run %s: %s", bfs->script, strerror(errno));
+		unlink(bfs->batch);
+		bfs->batch[0] = 0;
+		return false;
+	}
+	uloop_process_add(&bfs->routing_proc);
+	return true;
+}
+
+static void hncp_routing_apply(hncp_bfs bfs)
+{
+	if (!bfs->ops_cnt)
+		return;
+
+#ifdef __linux__
+	if (bfs->rtnl.fd >= 0) {
+		hncp_routing_nl_apply(bfs);
+		bfs->ops_cnt = 0;
+		return;
+	}
+#endif /* __linux__ */
+
+	if (bfs->script)
+		hncp_routing_script_apply(bfs);
+	bfs->ops_cnt = 0;
+}
+
+/* Collect the routes towards the prefixes of (reached) node c */
+static void hncp_routing_node_routes(hncp_bfs bfs, dncp_node c)
+{
+	dncp dncp = bfs->dncp;
+	hncp_node hc = dncp_node_get_ext_data(c);
+	struct tlv_attr *a, *a2;
+	hncp_t_assigned_prefix_header ap;
+
+	L_DEBUG("Router %s", DNCP_NODE_REPR(c));
+
+	dncp_node_for_each_tlv_with_type(c, a, HNCP_T_EXTERNAL_CONNECTION) {
+		hncp_t_delegated_prefix_header dp;
+		tlv_for_each_attr(a2, a)
+			if ((dp = hncp_tlv_dp(a2))) {
+				struct prefix from = { .plen = dp->prefix_length_bits };
+				size_t plen = ROUND_BITS_TO_BYTES(from.plen);
+				unsigned int flen = ROUND_BYTES_TO_4BYTES(sizeof(*dp) +
+									  ROUND_BITS_TO_BYTES(dp->prefix_length_bits));
+				struct tlv_attr *b;
+
+				memcpy(&from.prefix, &dp[1], plen);
+
+				hncp_routing_add(bfs, (!IN6_IS_ADDR_V4MAPPED(&from.prefix)) ?
+						HNCP_ROUTE_IPV6_PREFIX : HNCP_ROUTE_IPV4_PREFIX,
+						&from, NULL, NULL, 0, NULL);
+
+				if (tlv_len(a2) < flen || c == dncp->own_node)
 					continue;
 
-				hn->bfs.hopcount = hc->bfs.hopcount + 1;
-				list_add_tail(&hn->bfs.head, &queue);
-			} else if (tlv_id(a) == HNCP_T_EXTERNAL_CONNECTION) {
-				hncp_t_delegated_prefix_header dp;
-				tlv_for_each_attr(a2, a)
-					if ((dp = hncp_tlv_dp(a2))) {
-						struct prefix from = { .plen = dp->prefix_length_bits };
-						size_t plen = ROUND_BITS_TO_BYTES(from.plen);
-						unsigned int flen = ROUND_BYTES_TO_4BYTES(sizeof(*dp) +
-											  ROUND_BITS_TO_BYTES(dp->prefix_length_bits));
-						struct in6_addr domainaddr;
-						struct tlv_attr *b;
-
-						memcpy(&from.prefix, &dp[1], plen);
-						prefix_ntop(dst, sizeof(dst), &from.prefix, from.plen);
-
-						if (c != dncp->own_node)
-							snprintf(metric, sizeof(metric), "%u", hc->bfs.hopcount);
-						else
-							metric[0] = 0;
-
-						if (!IN6_IS_ADDR_V4MAPPED(&from.prefix))
-							argv[1] = "bfsipv6prefix";
-						else
-							argv[1] = "bfsipv4prefix";
-
-						hncp_routing_spawn(argv);
-
-						if (tlv_len(a2) < flen || !metric[0] || !hc->bfs.ifname)
-							continue;
-
-						tlv_for_each_in_buf(b, tlv_data(a2) + flen, tlv_len(a2) - flen) {
-							hncp_t_prefix_policy d = tlv_data(b);
-							if (tlv_id(b) != HNCP_T_PREFIX_POLICY || tlv_len(b) < 1 || d->type > 128)
-								continue;
-
-							plen = ROUND_BITS_TO_BYTES(d->type);
-							if (tlv_len(b) < 1 + plen)
-								continue;
-
-							if (d->type == 0) {
-								strcpy(domain, "default");
-							} else {
-								memcpy(&domainaddr, d->id, plen);
-								memset(&domainaddr.s6_addr[plen], 0, sizeof(domainaddr) - plen);
-								prefix_ntop(domain, sizeof(domain), &domainaddr, d->type);
-							}
-
-							if (!IN6_IS_ADDR_V4MAPPED(&from.prefix) && hc->bfs.next_hop) {
-								argv[1] = "bfsipv6uplink";
-								inet_ntop(AF_INET6, hc->bfs.next_hop, via, sizeof(via));
-								hncp_routing_spawn(argv);
-							} else if (IN6_IS_ADDR_V4MAPPED(&from.prefix) && hc->bfs.next_hop4 &&
-								iface_has_ipv4_address(hc->bfs.ifname)) {
-								argv[1] = "bfsipv4uplink";
-								inet_ntop(AF_INET, &hc->bfs.next_hop4->s6_addr[12], via, sizeof(via));
-								hncp_routing_spawn(argv);
-							}
-						}
-					}
-			} else if ((ap = hncp_tlv_ap(a)) && c != dncp->own_node && hc->bfs.ifname) {
-				struct iface *ifo = iface_get(hc->bfs.ifname);
-				dncp_ep ep = dncp_find_ep_by_name(dncp, hc->bfs.ifname);
-				if (!dncp_ep_is_enabled(ep))
-					ep = NULL;
-				// Skip routes for prefixes on connected links
-				if (ep && ifo && (ifo->flags & IFACE_FLAG_ADHOC) != IFACE_FLAG_ADHOC && hc->bfs.hopcount == 1) {
-					dncp_t_peer_s np = {
-						.peer_ep_id = ap->ep_id,
-						.ep_id = dncp_ep_get_id(ep)
-					};
-					size_t buflen = sizeof(np) + DNCP_NI_LEN(dncp);
-					void *buf = alloca(buflen);
-					memcpy(buf, &c->node_id, DNCP_NI_LEN(dncp));
-					memcpy(buf + DNCP_NI_LEN(dncp), &np, sizeof(np));
-
-
-					if (dncp_find_tlv(dncp, DNCP_T_PEER, buf, buflen))
+				tlv_for_each_in_buf(b, tlv_data(a2) + flen, tlv_len(a2) - flen) {
+					hncp_t_prefix_policy d = tlv_data(b);
+					if (tlv_id(b) != HNCP_T_PREFIX_POLICY || tlv_len(b) < 1 || d->type > 128)
+						continue;
+
+					plen = ROUND_BITS_TO_BYTES(d->type);
+					if (tlv_len(b) < 1 + plen)
 						continue;
-				}
 
-				struct prefix to = { .plen = ap->prefix_length_bits };
-				size_t plen = ROUND_BITS_TO_BYTES(to.plen);
-				memcpy(&to.prefix, &ap[1], plen);
-				unsigned linkid = (ep) ? dncp_ep_get_id(ep) : 0;
-				prefix_ntop(dst, sizeof(dst), &to.prefix, to.plen);
-				snprintf(metric, sizeof(metric), "%u", hc->bfs.hopcount << 8 | linkid);
-
-				if (!IN6_IS_ADDR_V4MAPPED(&to.prefix) && hc->bfs.next_hop) {
-					inet_ntop(AF_INET6, hc->bfs.next_hop, via, sizeof(via));
-					argv[1] = "bfsipv6assigned";
-					hncp_routing_spawn(argv);
-				} else if (IN6_IS_ADDR_V4MAPPED(&to.prefix) && hc->bfs.next_hop4 &&
-					iface_has_ipv4_address(hc->bfs.ifname)) {
-					inet_ntop(AF_INET, &hc->bfs.next_hop4->s6_addr[12], via, sizeof(via));
-					argv[1] = "bfsipv4assigned";
-					hncp_routing_spawn(argv);
+					struct prefix domain = { .plen = d->type };
+					memcpy(&domain.prefix, d->id, plen);
+
+					if (!IN6_IS_ADDR_V4MAPPED(&from.prefix)) {
+						hncp_routing_add(bfs, HNCP_ROUTE_IPV6_UPLINK, &from,
+								&hc->bfs.next_hop, hc->bfs.ifname,
+								hc->bfs.hopcount, &domain);
+					} else if (hc->bfs.has_next_hop4 &&
+							iface_has_ipv4_address(hc->bfs.ifname)) {
+						hncp_routing_add(bfs, HNCP_ROUTE_IPV4_UPLINK, &from,
+								&hc->bfs.next_hop4, hc->bfs.ifname,
+								hc->bfs.hopcount, &domain);
+					}
 				}
 			}
+	}
+
+	if (c == dncp->own_node)
+		return;
+
+	dncp_node_for_each_tlv_with_type(c, a, HNCP_T_ASSIGNED_PREFIX) {
+		if (!(ap = hncp_tlv_ap(a)))
+			continue;
+
+		struct iface *ifo = iface_get(hc->bfs.ifname);
+		dncp_ep ep = dncp_find_ep_by_name(dncp, hc->bfs.ifname);
+		if (!dncp_ep_is_enabled(ep))
+			ep = NULL;
+		// Skip routes for prefixes on connected links
+		if (ep && ifo && (ifo->flags & IFACE_FLAG_ADHOC) != IFACE_FLAG_ADHOC && hc->bfs.hopcount == 1) {
+			dncp_t_peer_s np = {
+				.peer_ep_id = ap->ep_id,
+				.ep_id = dncp_ep_get_id(ep)
+			};
+			size_t buflen = sizeof(np) + DNCP_NI_LEN(dncp);
+			void *buf = alloca(buflen);
+			memcpy(buf, &c->node_id, DNCP_NI_LEN(dncp));
+			memcpy(buf + DNCP_NI_LEN(dncp), &np, sizeof(np));
+
+
+			if (dncp_find_peer(dncp, buf))
+				continue;
 		}
 
-		list_del(&hc->bfs.head);
+		struct prefix to = { .plen = ap->prefix_length_bits };
+		size_t plen = ROUND_BITS_TO_BYTES(to.plen);
+		memcpy(&to.prefix, &ap[1], plen);
+		unsigned linkid = (ep) ? dncp_ep_get_id(ep) : 0;
+		unsigned metric = hc->bfs.hopcount << 8 | linkid;
+
+		if (!IN6_IS_ADDR_V4MAPPED(&to.prefix)) {
+			hncp_routing_add(bfs, HNCP_ROUTE_IPV6_ASSIGNED, &to,
+					&hc->bfs.next_hop, hc->bfs.ifname, metric, NULL);
+		} else if (hc->bfs.has_next_hop4 && iface_has_ipv4_address(hc->bfs.ifname)) {
+			hncp_routing_add(bfs, HNCP_ROUTE_IPV4_ASSIGNED, &to,
+					&hc->bfs.next_hop4, hc->bfs.ifname, metric, NULL);
+		}
+	}
+}
+
+static void hncp_routing_exec(hncp_bfs bfs)
+{
+	// Wait for a running batch so changes are applied in order
+	if (!bfs->routing_pending || bfs->routing_proc.pending || bfs->routing_cmd.req)
+		return;
+	bfs->routing_pending = false;
+	bfs->retry = false;
+
+	if (!bfs->prepared && bfs->script) {
+		// Clean up leftovers once, afterwards routes are changed incrementally
+		char *argv[] = {(char*)bfs->script, "bfsprepare", NULL};
+		hncp_routing_spawn(argv);
+		bfs->prepared = true;
+	}
+
+	hncp_routing_check_root(bfs);
+	if (!bfs->root)
+		return;
+
+	hncp_routing_update_tree(bfs);
+
+	// Routes are cheap to derive from the tree, collect all of them
+	++bfs->run;
+	vlist_update(&bfs->routes);
+
+	dncp_node c;
+	dncp_for_each_node(bfs->dncp, c)
+		if (hncp_routing_reached(bfs, hncp_routing_head(c)))
+			hncp_routing_node_routes(bfs, c);
+
+	vlist_flush(&bfs->routes);
+	hncp_routing_apply(bfs);
+}
+
+static void hncp_routing_batch_done(hncp_bfs bfs)
+{
+	if (bfs->batch[0]) {
+		unlink(bfs->batch);
+		bfs->batch[0] = 0;
 	}
-	_exit(0);
+	hncp_routing_exec(bfs);
+}
+
+static void hncp_routing_proc_cb(struct uloop_process *p, __unused int ret)
+{
+	hncp_routing_batch_done(container_of(p, hncp_bfs_s, routing_proc));
+}
+
+static void hncp_routing_cmd_cb(struct coproc_cmd *cmd, __unused int status)
+{
+	hncp_routing_batch_done(container_of(cmd, hncp_bfs_s, routing_cmd));
 }
 
 static void hncp_routing_schedule(struct uloop_timeout *t)
 {
 	hncp_bfs bfs = container_of(t, hncp_bfs_s, t);
 	bfs->routing_pending = true;
-	hncp_routing_exec(&bfs->routing_proc, 0);
+	hncp_routing_exec(bfs);
 }
 
-hncp_bfs hncp_routing_create(hncp hncp, const char *script, bool incremental)
+hncp_bfs hncp_routing_create(hncp hncp, const char *script, bool incremental,
+		bool netlink)
 {
 	hncp_bfs bfs = calloc(1, sizeof(*bfs));
 
@@ -306,11 +975,40 @@ hncp_bfs hncp_routing_create(hncp hncp, const char *script, bool incremental)
 	bfs->dncp = hncp_get_dncp(hncp);
 	bfs->script = script;
 	bfs->iface.cb_intiface = hncp_routing_intiface;
+	bfs->routing_proc.cb = hncp_routing_proc_cb;
+	bfs->routing_cmd.cb = hncp_routing_cmd_cb;
+	bfs->rtnl.fd = -1;
+	INIT_LIST_HEAD(&bfs->dirty);
+
+	vlist_init(&bfs->routes, hncp_route_compare, hncp_route_update);
+	bfs->routes.keep_old = true;
+
+#ifdef __linux__
+	if (netlink) {
+		int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+		struct sockaddr_nl rtnl_kernel = { .nl_family = AF_NETLINK };
+		if (fd >= 0 && connect(fd, (const struct sockaddr*)&rtnl_kernel, sizeof(rtnl_kernel))) {
+			close(fd);
+			fd = -1;
+		}
+
+		if (fd >= 0)
+			hncp_routing_nl_init(bfs, fd);
+		else
+			L_WARN("hncp_routing: no rtnetlink, falling back to %s bfsbatch", script);
+	}
+#else
+	if (netlink)
+		L_WARN("hncp_routing: no rtnetlink, falling back to %s bfsbatch", script);
+#endif /* __linux__ */
 
 	if (incremental) {
 		bfs->t.cb = hncp_routing_schedule;
 		bfs->iface.cb_intaddr = hncp_routing_intaddr;
-		bfs->subscr.tlv_change_cb = hncp_routing_cb;
+		bfs->subscr.tlvs_change_cb = hncp_routing_cb;
+		bfs->subscr.tlv_types = hncp_routing_tlv_types;
+		bfs->subscr.num_tlv_types = ARRAY_SIZE(hncp_routing_tlv_types);
+		bfs->subscr.node_change_cb = hncp_routing_node_cb;
 		dncp_subscribe(bfs->dncp, &bfs->subscr);
 	}
 
@@ -326,6 +1024,20 @@ void hncp_routing_destroy(hncp_bfs bfs)
 	if (bfs->t.cb)
 		dncp_unsubscribe(bfs->dncp, &bfs->subscr);
 
+	// Installed routes are left in place, just like bfsprepare finds them
+	vlist_flush_all(&bfs->routes);
+	free(bfs->ops);
+	free(bfs->queue);
+
+	if (bfs->rtnl.fd >= 0) {
+		uloop_fd_delete(&bfs->rtnl);
+		close(bfs->rtnl.fd);
+	}
+
+	// A running batch is left to the script, only forget about it
+	coproc_cancel(&bfs->routing_cmd);
+	uloop_process_delete(&bfs->routing_proc);
+
 	free(bfs->ifaces);
 	free(bfs);
 }
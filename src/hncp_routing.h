@@ -11,5 +11,8 @@
 struct hncp_routing_struct;
 typedef struct hncp_routing_struct hncp_bfs_s, *hncp_bfs;
 
-hncp_bfs hncp_routing_create(hncp hncp, const char *script, bool incremental);
+/* Routes are handed to script (bfsbatch), or programmed over rtnetlink
+ * if netlink is set and available. */
+hncp_bfs hncp_routing_create(hncp hncp, const char *script, bool incremental,
+		bool netlink);
 void hncp_routing_destroy(hncp_bfs bfs);
@@ -28,11 +28,14 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <libubox/md5.h>
+#include <libubox/avl-cmp.h>
 
 #include "hncp_sd.h"
 #include "hncp_i.h"
 #include "dns_util.h"
 #include "iface.h"
+#include "coproc.h"
+#include "hncp_dns.h"
 
 #define DNS_PORT 53
 
@@ -91,6 +94,12 @@ struct hncp_sd_struct
   /* Parameters received when created (pointers within owned by someone else) */
   hncp_sd_params_s p;
 
+  /* Records derived from the HNCP TLVs (hncp_sd_record), and per-node
+   * copies of the TLVs the PCP records are derived from
+   * (hncp_sd_node). */
+  struct avl_tree records;
+  struct avl_tree nodes;
+
   /* State (md5) hashes used to keep track of what has been committed. */
   char dnsmasq_state[16];
   char ohp_state[16];
@@ -100,8 +109,44 @@ struct hncp_sd_struct
   /* Callbacks from other modules */
   struct iface_user iface;
   struct hncp_link_user link;
+
+  /* Built-in DNS server (if enabled) */
+  hncp_dns dns;
 };
 
+/* One line of dnsmasq configuration, or one script argument. As
+ * several TLVs may produce the same record, they are reference
+ * counted; the daemons are reconfigured only when the set changes. */
+typedef struct hncp_sd_record_struct
+{
+  struct avl_node in_records;
+  int refcount;
+
+  /* Type (RECORD_*) followed by the value */
+  char key[];
+} hncp_sd_record_s, *hncp_sd_record;
+
+#define RECORD_HOST   'h' /* <name>,<address> */
+#define RECORD_B      'b' /* <zone> */
+#define RECORD_LB     'l' /* <zone> */
+#define RECORD_SERVER 's' /* <zone>/<server>#<port> */
+#define RECORD_DDZ    'z' /* <zone> (browseable) */
+#define RECORD_PCP    'p' /* <prefix>=<server> */
+
+#define RECORD_MAX_LEN (DNS_MAX_ESCAPED_LEN + 64)
+
+typedef struct hncp_sd_node_struct
+{
+  struct avl_node in_nodes;
+  struct list_head tlvs;
+} hncp_sd_node_s, *hncp_sd_node;
+
+typedef struct hncp_sd_tlv_struct
+{
+  struct list_head in_tlvs;
+  struct tlv_attr tlv[];
+} hncp_sd_tlv_s, *hncp_sd_tlv;
+
 static void _should_update(hncp_sd sd, int v)
 {
   L_DEBUG("hncp_sd/should_update:%d", v);
@@ -117,6 +162,13 @@ static void _should_update(hncp_sd sd, int v)
     L_DEBUG(" .. already pending, and should be run");
 }
 
+/* Run a script in its co-process if possible, fork+exec otherwise */
+static void _sh_run(char **args)
+{
+  if (coproc_run(NULL, args, NULL))
+    hncp_run(args);
+}
+
 /* Convenience wrapper around MD5 hashing */
 static bool _sh_changed(md5_ctx_t *ctx, void *result)
 {
@@ -131,6 +183,223 @@ static bool _sh_changed(md5_ctx_t *ctx, void *result)
   return false;
 }
 
+static int _record_flag(char type)
+{
+  switch (type)
+    {
+    case RECORD_DDZ:
+      return UPDATE_FLAG_DDZ;
+    case RECORD_PCP:
+      return UPDATE_FLAG_PCP;
+    default:
+      return UPDATE_FLAG_DNSMASQ;
+    }
+}
+
+static void _record_change(hncp_sd sd, const char *key, bool add)
+{
+  hncp_sd_record r = avl_find_element(&sd->records, key, r, in_records);
+
+  if (add)
+    {
+      if (r)
+        {
+          r->refcount++;
+          return;
+        }
+      if (!(r = calloc(1, sizeof(*r) + strlen(key) + 1)))
+        return;
+      strcpy(r->key, key);
+      r->refcount = 1;
+      r->in_records.key = r->key;
+      avl_insert(&sd->records, &r->in_records);
+    }
+  else
+    {
+      if (!r || --r->refcount)
+        return;
+      avl_delete(&sd->records, &r->in_records);
+      free(r);
+    }
+  L_DEBUG("hncp_sd record %s %s", add ? "added" : "removed", key);
+  _should_update(sd, _record_flag(key[0]));
+}
+
+static hncp_sd_record _first_record(hncp_sd sd, char type)
+{
+  char key[2] = { type, 0 };
+  hncp_sd_record r = avl_find_ge_element(&sd->records, key, r, in_records);
+
+  return r && r->key[0] == type ? r : NULL;
+}
+
+static hncp_sd_record _next_record(hncp_sd sd, hncp_sd_record r)
+{
+  char type = r->key[0];
+
+  if (avl_is_last(&sd->records, &r->in_records))
+    return NULL;
+  r = avl_next_element(r, in_records);
+  return r->key[0] == type ? r : NULL;
+}
+
+#define _for_each_record(sd, r, type)                                   \
+  for (r = _first_record(sd, type) ; r ; r = _next_record(sd, r))
+
+/* Records derived from a single NODE_NAME or DNS_DELEGATED_ZONE TLV */
+static void _tlv_records(hncp_sd sd, dncp_node n,
+                         struct tlv_attr *a, bool add)
+{
+  char key[RECORD_MAX_LEN];
+
+  if (tlv_id(a) == HNCP_T_NODE_NAME)
+    {
+      hncp_t_node_name rname = tlv_data(a);
+      int namelen = tlv_len(a) - sizeof(hncp_t_node_name_s);
+
+      if (namelen > 0 && namelen >= rname->name_length
+          && rname->name_length && rname->name_length <= DNS_MAX_L_LEN)
+        {
+          snprintf(key, sizeof(key), "%c%.*s,%s", RECORD_HOST,
+                   rname->name_length, rname->name,
+                   ADDR_REPR(&rname->address));
+          _record_change(sd, key, add);
+        }
+    }
+  else if (tlv_id(a) == HNCP_T_DNS_DELEGATED_ZONE)
+    {
+      /* Decode the labels */
+      char buf[DNS_MAX_ESCAPED_LEN];
+      char buf2[INET6_ADDRSTRLEN];
+      char *server;
+      int port;
+      hncp_t_dns_delegated_zone dh;
+
+      if (tlv_len(a) < (sizeof(*dh)+1))
+        return;
+
+      dh = tlv_data(a);
+      if (ll2escaped(dh->ll, tlv_len(a) - sizeof(*dh),
+                     buf, sizeof(buf)) < 0)
+        return;
+
+      if (dh->flags & HNCP_T_DNS_DELEGATED_ZONE_FLAG_BROWSE)
+        {
+          snprintf(key, sizeof(key), "%c%s", RECORD_B, buf);
+          _record_change(sd, key, add);
+          snprintf(key, sizeof(key), "%c%s", RECORD_DDZ, buf);
+          _record_change(sd, key, add);
+        }
+      if (dh->flags & HNCP_T_DNS_DELEGATED_ZONE_FLAG_LEGACY_BROWSE)
+        {
+          snprintf(key, sizeof(key), "%c%s", RECORD_LB, buf);
+          _record_change(sd, key, add);
+        }
+      if (dncp_node_is_self(n))
+        {
+          server = LOCAL_OHP_ADDRESS;
+          port = LOCAL_OHP_PORT;
+        }
+      else
+        {
+          server = buf2;
+          port = DNS_PORT;
+          if (!inet_ntop(AF_INET6, dh->address,
+                         buf2, sizeof(buf2)))
+            {
+              L_ERR("inet_ntop failed in _tlv_records");
+              return;
+            }
+        }
+      snprintf(key, sizeof(key), "%c%s/%s#%d", RECORD_SERVER,
+               buf, server, port);
+      _record_change(sd, key, add);
+    }
+}
+
+/* PCP server records of a node; they depend on both its
+ * EXTERNAL_CONNECTION and NODE_ADDRESS TLVs. */
+static void _pcp_records(hncp_sd sd, dncp_node n, hncp_sd_node sn, bool add)
+{
+  struct in6_addr *a4 = NULL, *a6 = NULL;
+  hncp_t_node_address ra;
+  hncp_t_delegated_prefix_header dp;
+  hncp_sd_tlv t;
+  struct tlv_attr *a;
+  char key[RECORD_MAX_LEN];
+
+  list_for_each_entry(t, &sn->tlvs, in_tlvs)
+    if ((ra = hncp_tlv_ra(t->tlv)))
+      {
+        if (IN6_IS_ADDR_V4MAPPED(&ra->address))
+          a4 = &ra->address;
+        else
+          a6 = &ra->address;
+      }
+  list_for_each_entry(t, &sn->tlvs, in_tlvs)
+    {
+      if (tlv_id(t->tlv) != HNCP_T_EXTERNAL_CONNECTION)
+        continue;
+      /* If we don't know address for real, might as well give up */
+      if (!a4 && !a6)
+        {
+          if (add)
+            L_DEBUG("no address at all found for %s", DNCP_NODE_REPR(n));
+          return;
+        }
+      tlv_for_each_attr(a, t->tlv)
+        {
+          if ((dp = hncp_tlv_dp(a)))
+            {
+              struct prefix p = {.plen = dp->prefix_length_bits };
+              bmemcpy(&p.prefix, dp->prefix_data, 0, p.plen);
+
+              bool is_ipv4 = prefix_is_ipv4(&p);
+              struct in6_addr *sa = is_ipv4 ? a4 : a6;
+              if (!sa)
+                {
+                  if (add)
+                    L_INFO("no PCP server found for %s", PREFIX_REPR(&p));
+                  continue;
+                }
+
+              snprintf(key, sizeof(key), "%c%s=%s", RECORD_PCP,
+                       PREFIX_REPR(&p),
+                       dncp_node_is_self(n) ?
+                       is_ipv4 ? "127.0.0.1" : "::1" :
+                       ADDR_REPR(sa));
+              _record_change(sd, key, add);
+            }
+        }
+    }
+}
+
+static int _node_cmp(const void *k1, const void *k2, void *ptr __unused)
+{
+  return (k1 > k2) - (k1 < k2);
+}
+
+static void _node_tlv_change(hncp_sd_node sn, struct tlv_attr *tlv, bool add)
+{
+  hncp_sd_tlv t;
+
+  if (add)
+    {
+      if (!(t = malloc(sizeof(*t) + tlv_raw_len(tlv))))
+        return;
+      memcpy(t->tlv, tlv, tlv_raw_len(tlv));
+      list_add_tail(&t->in_tlvs, &sn->tlvs);
+      return;
+    }
+  list_for_each_entry(t, &sn->tlvs, in_tlvs)
+    if (tlv_attr_equal(t->tlv, tlv))
+      {
+        list_del(&t->in_tlvs);
+        free(t);
+        return;
+      }
+}
+
 static int _push_reverse_ll(struct prefix *p, uint8_t *buf, int buf_len)
 {
   uint8_t *obuf = buf;
@@ -212,9 +481,28 @@ void hncp_sd_dump_link_fqdn(hncp_sd sd, dncp_ep ep,
            ifname, sd->router_name, sd->hncp->domain);
 }
 
+/* Publish a DDZ TLV unless it is already there; stale contains the
+ * previously published ones which have not been republished yet. */
+static void _publish_ddz_tlv(hncp_sd sd, hncp_t_dns_delegated_zone dh,
+                             int len, dncp_tlv *stale, int num_stale)
+{
+  dncp_tlv t = dncp_find_tlv(sd->dncp, HNCP_T_DNS_DELEGATED_ZONE, dh, len);
+  int i;
+
+  if (!t)
+    {
+      dncp_add_tlv(sd->dncp, HNCP_T_DNS_DELEGATED_ZONE, dh, len, 0);
+      return;
+    }
+  for (i = 0 ; i < num_stale ; i++)
+    if (stale[i] == t)
+      stale[i] = NULL;
+}
+
 static void _publish_ddz(hncp_sd sd, dncp_ep ep,
                          int flags_forward,
-                         struct prefix *assigned_prefix)
+                         struct prefix *assigned_prefix,
+                         dncp_tlv *stale, int num_stale)
 {
   hncp_t_dns_delegated_zone dh;
   unsigned char buf[sizeof(struct tlv_attr) +
@@ -235,7 +523,7 @@ static void _publish_ddz(hncp_sd sd, dncp_ep ep,
     return;
   int flen = sizeof(*dh) + r;
   dh->flags = flags_forward;
-  dncp_add_tlv(sd->dncp, HNCP_T_DNS_DELEGATED_ZONE, dh, flen, 0);
+  _publish_ddz_tlv(sd, dh, flen, stale, num_stale);
 
   /* Reverse DDZ handling */
   /* (.ip6.arpa. or .in-addr.arpa.). */
@@ -246,21 +534,33 @@ static void _publish_ddz(hncp_sd sd, dncp_ep ep,
         return;
       flen = sizeof(*dh) + r;
       dh->flags = 0;
-      dncp_add_tlv(sd->dncp, HNCP_T_DNS_DELEGATED_ZONE, dh, flen, 0);
+      _publish_ddz_tlv(sd, dh, flen, stale, num_stale);
     }
 }
 
 static void _publish_ddzs(hncp_sd sd)
 {
-  dncp_tlv t;
+  dncp_tlv t, *stale;
   hncp_t_assigned_prefix_header ah;
   dncp_ep ep;
+  int i, num_stale = 0;
 
   if (!(sd->should_update & UPDATE_FLAG_LOCAL_DDZ))
     return;
   sd->should_update &= ~UPDATE_FLAG_LOCAL_DDZ;
   L_DEBUG("_publish_ddzs");
-  (void)dncp_remove_tlvs_by_type(sd->dncp, HNCP_T_DNS_DELEGATED_ZONE);
+
+  /* Only the DDZs that actually changed are removed and added, so
+   * that unchanged ones are not withdrawn from the network. */
+  dncp_for_each_tlv(sd->dncp, t)
+    if (tlv_id(dncp_tlv_get_attr(t)) == HNCP_T_DNS_DELEGATED_ZONE)
+      num_stale++;
+  stale = alloca(sizeof(*stale) * (num_stale + 1));
+  num_stale = 0;
+  dncp_for_each_tlv(sd->dncp, t)
+    if (tlv_id(dncp_tlv_get_attr(t)) == HNCP_T_DNS_DELEGATED_ZONE)
+      stale[num_stale++] = t;
+
   dncp_for_each_tlv(sd->dncp, t)
     if ((ah = hncp_tlv_ap(dncp_tlv_get_attr(t))))
       {
@@ -275,7 +575,8 @@ static void _publish_ddzs(hncp_sd sd)
         memcpy(&p.prefix, ah->prefix_data, ROUND_BITS_TO_BYTES(p.plen));
 
         _publish_ddz(sd, ep, HNCP_T_DNS_DELEGATED_ZONE_FLAG_BROWSE
-                     | HNCP_T_DNS_DELEGATED_ZONE_FLAG_LEGACY_BROWSE, &p);
+                     | HNCP_T_DNS_DELEGATED_ZONE_FLAG_LEGACY_BROWSE, &p,
+                     stale, num_stale);
       }
 
   /*
@@ -303,15 +604,18 @@ static void _publish_ddzs(hncp_sd sd)
       if (found)
         continue;
       /* Not found -> produce forward DDZ only. */
-      _publish_ddz(sd, ep, 0, NULL);
+      _publish_ddz(sd, ep, 0, NULL, stale, num_stale);
     }
+
+  for (i = 0 ; i < num_stale ; i++)
+    dncp_remove_tlv(sd->dncp, stale[i]);
 }
 
 bool hncp_sd_write_dnsmasq_conf(hncp_sd sd, const char *filename)
 {
-  dncp_node n;
-  struct tlv_attr *a;
+  hncp_sd_record r;
   FILE *f = fopen(filename, "w");
+  char line[RECORD_MAX_LEN + DNS_MAX_ESCAPED_LEN + 64];
   md5_ctx_t ctx;
 
   md5_begin(&ctx);
@@ -320,10 +624,8 @@ bool hncp_sd_write_dnsmasq_conf(hncp_sd sd, const char *filename)
       L_ERR("unable to open %s for writing dnsmasq conf", filename);
       return false;
     }
-  /* Basic idea: Traverse through the hncp node+tlv graph _once_,
-   * producing appropriate configuration file.
-   *
-   * What do we need to take care of?
+  /* The records were derived from the TLVs as they changed; what we
+   * produce here is:
    * - <routername>.<domain>
    *
    * (These are all in DNS Delegated Zone TLVs)
@@ -333,65 +635,31 @@ bool hncp_sd_write_dnsmasq_conf(hncp_sd sd, const char *filename)
    * <subdomain>'s ~NS (remote, real IP)
    * <subdomain>'s ~NS (local, LOCAL_OHP_ADDRESS)
    */
-  dncp_for_each_node(sd->dncp, n)
+#define WRITE_LINE(...) do                              \
+    {                                                   \
+      snprintf(line, sizeof(line), __VA_ARGS__);        \
+      md5_hash(line, strlen(line), &ctx);               \
+      fputs(line, f);                                   \
+    } while(0)
+
+  _for_each_record(sd, r, RECORD_HOST)
     {
-      dncp_node_for_each_tlv_with_type(n, a, HNCP_T_NODE_NAME) {
-        hncp_t_node_name rname = tlv_data(a);
-        int namelen = tlv_len(a) - sizeof(hncp_t_node_name_s);
-        if (namelen > 0 && namelen >= rname->name_length
-            && rname->name_length && rname->name_length <= DNS_MAX_L_LEN)
-          {
-            md5_hash(rname, tlv_len(a), &ctx);
-            fprintf(f, "host-record=%.*s.%s,%s\n",
-                    rname->name_length, rname->name, sd->hncp->domain,
-                    ADDR_REPR(&rname->address));
-          }
-      }
+      const char *address = strrchr(r->key, ',');
 
-      dncp_node_for_each_tlv_with_type(n, a, HNCP_T_DNS_DELEGATED_ZONE)
-        {
-          /* Decode the labels */
-          char buf[DNS_MAX_ESCAPED_LEN];
-          char buf2[256];
-          char *server;
-          int port;
-          hncp_t_dns_delegated_zone dh;
-
-          if (tlv_len(a) < (sizeof(*dh)+1))
-            continue;
-
-          dh = tlv_data(a);
-          if (ll2escaped(dh->ll, tlv_len(a) - sizeof(*dh),
-                         buf, sizeof(buf)) < 0)
-            continue;
-
-          md5_hash(a, tlv_raw_len(a), &ctx);
-
-          if (dh->flags & HNCP_T_DNS_DELEGATED_ZONE_FLAG_BROWSE)
-            fprintf(f, "ptr-record=b._dns-sd._udp.%s,%s\n",
-                    sd->hncp->domain, buf);
-          if (dh->flags & HNCP_T_DNS_DELEGATED_ZONE_FLAG_LEGACY_BROWSE)
-            fprintf(f, "ptr-record=lb._dns-sd._udp.%s,%s\n",
-                    sd->hncp->domain, buf);
-          if (dncp_node_is_self(n))
-            {
-              server = LOCAL_OHP_ADDRESS;
-              port = LOCAL_OHP_PORT;
-            }
-          else
-            {
-              server = buf2;
-              port = DNS_PORT;
-              if (!inet_ntop(AF_INET6, dh->address,
-                             buf2, sizeof(buf2)))
-                {
-                  L_ERR("inet_ntop failed in hncp_sd_write_dnsmasq_conf");
-                  continue;
-                }
-            }
-          fprintf(f, "server=/%s/%s#%d\n", buf, server, port);
-        }
+      WRITE_LINE("host-record=%.*s.%s,%s\n",
+                 (int)(address - r->key - 1), r->key + 1,
+                 sd->hncp->domain, address + 1);
     }
+  _for_each_record(sd, r, RECORD_B)
+    WRITE_LINE("ptr-record=b._dns-sd._udp.%s,%s\n",
+               sd->hncp->domain, r->key + 1);
+  _for_each_record(sd, r, RECORD_LB)
+    WRITE_LINE("ptr-record=lb._dns-sd._udp.%s,%s\n",
+               sd->hncp->domain, r->key + 1);
+  _for_each_record(sd, r, RECORD_SERVER)
+    WRITE_LINE("server=/%s\n", r->key + 1);
+#undef WRITE_LINE
+
   /* Default is 150. Given 0.5 second lifetime on service queries,
    * that's not much. */
   fprintf(f, "dns-forward-max=12345\n");
@@ -402,11 +670,88 @@ bool hncp_sd_write_dnsmasq_conf(hncp_sd sd, const char *filename)
   return _sh_changed(&ctx, &sd->dnsmasq_state);
 }
 
+static bool _is_reverse_zone(const char *zone, int len)
+{
+  static const char *suffixes[] = { ".in-addr.arpa", ".ip6.arpa" };
+  unsigned int i;
+
+  if (len && zone[len - 1] == '.')
+    len--;
+  for (i = 0 ; i < ARRAY_SIZE(suffixes) ; i++)
+    {
+      int slen = strlen(suffixes[i]);
+      if (len > slen && !strncasecmp(zone + len - slen, suffixes[i], slen))
+        return true;
+    }
+  return false;
+}
+
+static void _forward_conf(hncp_sd sd, FILE *f, md5_ctx_t *ctx)
+{
+  char line[RECORD_MAX_LEN + DNS_MAX_ESCAPED_LEN + 64];
+  const char *prev = NULL;
+  int prev_len = 0;
+  hncp_sd_record r;
+
+#define WRITE_LINE(...) do                              \
+    {                                                   \
+      snprintf(line, sizeof(line), __VA_ARGS__);        \
+      if (ctx)                                          \
+        md5_hash(line, strlen(line), ctx);              \
+      if (f)                                            \
+        fputs(line, f);                                 \
+    } while(0)
+
+  WRITE_LINE("server=/%s/::1#%d\n", sd->hncp->domain, sd->p.dns_port);
+
+  /* Records are sorted, so servers of a zone are next to each other */
+  _for_each_record(sd, r, RECORD_SERVER)
+    {
+      const char *zone = r->key + 1;
+      int len = strchr(zone, '/') - zone;
+
+      if (!_is_reverse_zone(zone, len)
+          || (prev && prev_len == len && !strncmp(prev, zone, len)))
+        continue;
+      WRITE_LINE("server=/%.*s/::1#%d\n", len, zone, sd->p.dns_port);
+      prev = zone;
+      prev_len = len;
+    }
+
+  /* RFC1918 rebinds are ok for the home domain */
+  WRITE_LINE("rebind-domain-ok=%s\n", sd->hncp->domain);
+#undef WRITE_LINE
+}
+
+/* With the built-in DNS server, dnsmasq only forwards the home domain
+ * and the reverse zones to it. The file is rewritten only if its
+ * content changes; returns whether it did. */
+bool hncp_sd_write_dnsmasq_forward_conf(hncp_sd sd, const char *filename)
+{
+  md5_ctx_t ctx;
+  FILE *f;
+
+  md5_begin(&ctx);
+  _forward_conf(sd, NULL, &ctx);
+  if (!_sh_changed(&ctx, &sd->dnsmasq_state))
+    return false;
+
+  if (!(f = fopen(filename, "w")))
+    {
+      L_ERR("unable to open %s for writing dnsmasq conf", filename);
+      memset(&sd->dnsmasq_state, 0, sizeof(sd->dnsmasq_state));
+      return false;
+    }
+  _forward_conf(sd, f, NULL);
+  fclose(f);
+  return true;
+}
+
 bool hncp_sd_restart_dnsmasq(hncp_sd sd)
 {
   char *args[] = { (char *)sd->p.dnsmasq_script, "restart", NULL};
 
-  hncp_run(args);
+  _sh_run(args);
   return true;
 }
 
@@ -430,8 +775,7 @@ bool hncp_sd_restart_dnsmasq(hncp_sd sd)
 
 bool hncp_sd_reconfigure_ddz(hncp_sd sd)
 {
-  dncp_node n;
-  struct tlv_attr *a;
+  hncp_sd_record r;
   char buf[ARGS_MAX_LEN];
   char *c = buf;
   char *args[ARGS_MAX_COUNT];
@@ -441,31 +785,16 @@ bool hncp_sd_reconfigure_ddz(hncp_sd sd)
   PUSH_ARG(sd->p.ddz_script);
   PUSH_ARG(sd->hncp->domain);
   md5_begin(&ctx);
-  dncp_for_each_node(sd->dncp, n)
+  md5_hash(sd->hncp->domain, strlen(sd->hncp->domain), &ctx);
+  _for_each_record(sd, r, RECORD_DDZ)
     {
-      dncp_node_for_each_tlv_with_type(n, a, HNCP_T_DNS_DELEGATED_ZONE)
-        {
-          /* Decode the labels */
-          char buf[DNS_MAX_ESCAPED_LEN];
-          hncp_t_dns_delegated_zone dh = tlv_data(a);
-
-          if (tlv_len(a) < (sizeof(*dh)+1))
-            continue;
-          if (!(dh->flags & HNCP_T_DNS_DELEGATED_ZONE_FLAG_BROWSE))
-            continue;
-          dh = tlv_data(a);
-          if (ll2escaped(dh->ll, tlv_len(a) - sizeof(*dh),
-                         buf, sizeof(buf)) < 0)
-            continue;
-
-          md5_hash(buf, strlen(buf), &ctx);
-          PUSH_ARG(buf);
-        }
+      md5_hash(r->key + 1, strlen(r->key + 1), &ctx);
+      PUSH_ARG(r->key + 1);
     }
   if (_sh_changed(&ctx, &sd->ddz_state))
     {
       args[narg] = NULL;
-      hncp_run(args);
+      _sh_run(args);
       return true;
     }
   return false;
@@ -523,7 +852,7 @@ bool hncp_sd_reconfigure_ohp(hncp_sd sd)
   args[narg] = NULL;
   if (_sh_changed(&ctx, &sd->ohp_state))
     {
-      hncp_run(args);
+      _sh_run(args);
       return true;
     }
   return false;
@@ -531,80 +860,26 @@ bool hncp_sd_reconfigure_ohp(hncp_sd sd)
 
 bool hncp_sd_reconfigure_pcp(hncp_sd sd)
 {
+  hncp_sd_record r;
   char buf[ARGS_MAX_LEN];
   char *c = buf;
   char *args[ARGS_MAX_COUNT];
   int narg = 0;
   bool first = true;
   md5_ctx_t ctx;
-  dncp_node n;
-  struct tlv_attr *tlv, *a;
-  hncp_t_node_address ra;
-  hncp_t_delegated_prefix_header dp;
-  char tbuf[123];
 
   md5_begin(&ctx);
   PUSH_ARG(sd->p.pcp_script);
 
-  /* ohp can _always_ listen to all interfaces that have been
-   * configured. Less flapping of the binary, and it hurts nobody if
-   * it is active on few more interfaces (well, fine, slight overhead
-   * from mdnsresponder, but who cares). */
-
-  dncp_for_each_node(sd->dncp, n)
+  _for_each_record(sd, r, RECORD_PCP)
     {
-      struct in6_addr *a4 = NULL, *a6 = NULL;
-      dncp_node_for_each_tlv_with_type(n, tlv, HNCP_T_EXTERNAL_CONNECTION)
+      md5_hash(r->key + 1, strlen(r->key + 1), &ctx);
+      if (first)
         {
-          if (!a4 && !a6)
-            {
-              dncp_node_for_each_tlv(n, a)
-                {
-                  if ((ra = hncp_tlv_ra(a)))
-                    {
-                      if (IN6_IS_ADDR_V4MAPPED(&ra->address))
-                        a4 = &ra->address;
-                      else
-                        a6 = &ra->address;
-                    }
-                }
-              /* If we don't know address for real, might as well give up */
-              if (!a4 && !a6)
-                {
-                  L_DEBUG("no address at all found for %s",
-                          DNCP_NODE_REPR(n));
-                  break;
-                }
-            }
-          tlv_for_each_attr(a, tlv)
-            {
-              if ((dp = hncp_tlv_dp(a)))
-                {
-                  struct prefix p = {.plen = dp->prefix_length_bits };
-                  bmemcpy(&p.prefix, dp->prefix_data, 0, p.plen);
-
-                  bool is_ipv4 = prefix_is_ipv4(&p);
-                  struct in6_addr *sa = is_ipv4 ? a4 : a6;
-                  if (!sa)
-                    {
-                      L_INFO("no PCP server found for %s", PREFIX_REPR(&p));
-                      continue;
-                    }
-
-                  sprintf(tbuf, "%s=%s", PREFIX_REPR(&p),
-                          dncp_node_is_self(n) ?
-                          is_ipv4 ? "127.0.0.1" : "::1" :
-                          ADDR_REPR(sa));
-                  md5_hash(tbuf, strlen(tbuf), &ctx);
-                  if (first)
-                    {
-                      PUSH_ARG("start");
-                      first = false;
-                    }
-                  PUSH_ARG(tbuf);
-                }
-            }
+          PUSH_ARG("start");
+          first = false;
         }
+      PUSH_ARG(r->key + 1);
     }
 
   if (first)
@@ -613,7 +888,7 @@ bool hncp_sd_reconfigure_pcp(hncp_sd sd)
   args[narg] = NULL;
   if (_sh_changed(&ctx, &sd->pcp_state))
     {
-      hncp_run(args);
+      _sh_run(args);
       return true;
     }
   return false;
@@ -777,6 +1052,8 @@ static void _refresh_domain(hncp_sd sd)
     {
       L_DEBUG("set sd domain to %s", new_domain);
       strcpy(sd->hncp->domain, new_domain);
+      if (sd->dns)
+        hncp_dns_set_domain(sd->dns, new_domain);
       _should_update(sd, UPDATE_FLAG_ALL & ~UPDATE_FLAG_DOMAIN);
     }
 }
@@ -790,16 +1067,18 @@ static void _refresh_rname(hncp_sd sd)
   _set_router_name(sd);
 }
 
-static void _tlv_cb(dncp_subscriber s,
-                    dncp_node n, struct tlv_attr *tlv, bool add)
+static void _tlv_change(hncp_sd sd, dncp_node n, hncp_sd_node sn,
+                        struct tlv_attr *tlv, bool add)
 {
-  hncp_sd sd = container_of(s, hncp_sd_s, subscriber);
   dncp o = sd->dncp;
 
-  L_NOTICE("[sd]_tlv_cb %s %s %s",
+  L_NOTICE("[sd]_tlv_change %s %s %s",
            add ? "add" : "remove",
            dncp_node_is_self(n) ? "local" : DNCP_NODE_REPR(n),
            TLV_REPR(tlv));
+  if (sd->dns)
+    hncp_dns_tlv_change(sd->dns, n, dncp_node_is_self(n), tlv, add);
+  _tlv_records(sd, n, tlv, add);
   switch (tlv_id(tlv))
     {
     case HNCP_T_NODE_NAME:
@@ -819,16 +1098,9 @@ static void _tlv_cb(dncp_subscriber s,
               L_DEBUG("router name conflict, we're higher, ignoring");
             }
         }
-      /* Router name/address changes trigger dnsmasq update due to
-       * synthesized <routername>.<domain> host records. */
-      _should_update(sd, UPDATE_FLAG_DNSMASQ);
       break;
 
     case HNCP_T_DNS_DELEGATED_ZONE:
-      /* Dnsmasq forwarder file reflects what's in published DDZ's. If
-       * they change, it (could) change too. */
-      _should_update(sd, UPDATE_FLAG_DNSMASQ | UPDATE_FLAG_DDZ);
-
       /* Check also if it's name matches our router name directly ->
        * rename us if it does. */
       if (_tlv_ddz_matches(sd, tlv) && !dncp_node_is_self(n))
@@ -846,20 +1118,60 @@ static void _tlv_cb(dncp_subscriber s,
       break;
 
     case HNCP_T_NODE_ADDRESS:
-      /* Router name/address changes trigger dnsmasq update due to
-       * synthesized <routername>.<domain> host records. */
-      /* Addresses of where to find PCP server may also have changed */
-      _should_update(sd, UPDATE_FLAG_DNSMASQ | UPDATE_FLAG_PCP);
-      break;
-
     case HNCP_T_EXTERNAL_CONNECTION:
-      /* Delegated prefixes may have changed -> possibly update PCP */
-      _should_update(sd, UPDATE_FLAG_PCP);
+      /* Addresses of where to find PCP server, or delegated
+       * prefixes, may have changed; the records are rederived by the
+       * caller once the whole change-set is in. */
+      _node_tlv_change(sn, tlv, add);
       break;
 
     }
 }
 
+static void _tlvs_cb(dncp_subscriber s, dncp_node n,
+                     dncp_tlv_change changes, int num_changes)
+{
+  hncp_sd sd = container_of(s, hncp_sd_s, subscriber);
+  hncp_sd_node sn = NULL;
+  int i;
+
+  /* Dnsmasq, DDZ and PCP configuration is updated only if the records
+   * derived from the changed TLVs change. */
+  for (i = 0 ; i < num_changes ; i++)
+    if (tlv_id(changes[i].tlv) == HNCP_T_NODE_ADDRESS
+        || tlv_id(changes[i].tlv) == HNCP_T_EXTERNAL_CONNECTION)
+      {
+        if (!(sn = avl_find_element(&sd->nodes, n, sn, in_nodes)))
+          {
+            if (!(sn = calloc(1, sizeof(*sn))))
+              return;
+            INIT_LIST_HEAD(&sn->tlvs);
+            sn->in_nodes.key = n;
+            avl_insert(&sd->nodes, &sn->in_nodes);
+          }
+        _pcp_records(sd, n, sn, false);
+        break;
+      }
+  for (i = 0 ; i < num_changes ; i++)
+    _tlv_change(sd, n, sn, changes[i].tlv, changes[i].add);
+  if (!sn)
+    return;
+  _pcp_records(sd, n, sn, true);
+  if (list_empty(&sn->tlvs))
+    {
+      avl_delete(&sd->nodes, &sn->in_nodes);
+      free(sn);
+    }
+}
+
+
+static const uint16_t _tlv_types[] = {
+  HNCP_T_NODE_NAME,
+  HNCP_T_DNS_DELEGATED_ZONE,
+  HNCP_T_DOMAIN_NAME,
+  HNCP_T_NODE_ADDRESS,
+  HNCP_T_EXTERNAL_CONNECTION
+};
 
 void hncp_sd_update(hncp_sd sd)
 {
@@ -876,7 +1188,9 @@ void hncp_sd_update(hncp_sd sd)
       sd->should_update &= ~UPDATE_FLAG_DNSMASQ;
       if (sd->p.dnsmasq_script && sd->p.dnsmasq_bonus_file)
         {
-          if (hncp_sd_write_dnsmasq_conf(sd, sd->p.dnsmasq_bonus_file))
+          if (sd->dns ?
+              hncp_sd_write_dnsmasq_forward_conf(sd, sd->p.dnsmasq_bonus_file) :
+              hncp_sd_write_dnsmasq_conf(sd, sd->p.dnsmasq_bonus_file))
             hncp_sd_restart_dnsmasq(sd);
         }
     }
@@ -947,6 +1261,8 @@ hncp_sd hncp_sd_create(hncp h, hncp_sd_params p, struct hncp_link *l)
   sd->p = *p;
   if (!sd)
     return NULL;
+  avl_init(&sd->records, avl_strcmp, false, NULL);
+  avl_init(&sd->nodes, _node_cmp, false, NULL);
 
   sd->iface.cb_intaddr = _intaddr_cb;
   sd->link.cb_elected = _election_cb;
@@ -981,9 +1297,23 @@ hncp_sd hncp_sd_create(hncp h, hncp_sd_params p, struct hncp_link *l)
   strcpy(sd->router_name, sd->router_name_base);
   _set_router_name(sd);
 
+  /* Records are then kept up to date from the subscriber callbacks */
+  if (p->dns_port)
+    {
+      if (!(sd->dns = hncp_dns_create(p->dns_port, LOCAL_OHP_ADDRESS,
+                                      LOCAL_OHP_PORT)))
+        {
+          L_ERR("unable to create dns server on port %d", p->dns_port);
+          abort();
+        }
+      hncp_dns_set_domain(sd->dns, sd->hncp->domain);
+    }
+
   /* Set up the hncp subscriber */
   sd->subscriber.local_tlv_change_cb = _local_tlv_cb;
-  sd->subscriber.tlv_change_cb = _tlv_cb;
+  sd->subscriber.tlvs_change_cb = _tlvs_cb;
+  sd->subscriber.tlv_types = _tlv_types;
+  sd->subscriber.num_tlv_types = ARRAY_SIZE(_tlv_types);
   sd->subscriber.republish_cb = _republish_cb;
   sd->subscriber.ep_change_cb = _force_republish_cb;
   dncp_subscribe(o, &sd->subscriber);
@@ -996,6 +1326,20 @@ void hncp_sd_destroy(hncp_sd sd)
   iface_unregister_user(&sd->iface);
   dncp_unsubscribe(sd->dncp, &sd->subscriber);
   uloop_timeout_cancel(&sd->timeout);
+  if (sd->dns)
+    hncp_dns_destroy(sd->dns);
+  /* Unsubscribing removed all TLVs, so these should be empty by now */
+  hncp_sd_record r, r2;
+  avl_remove_all_elements(&sd->records, r, in_records, r2)
+    free(r);
+  hncp_sd_node sn, sn2;
+  avl_remove_all_elements(&sd->nodes, sn, in_nodes, sn2)
+    {
+      hncp_sd_tlv t, t2;
+      list_for_each_entry_safe(t, t2, &sn->tlvs, in_tlvs)
+        free(t);
+      free(sn);
+    }
   free(sd);
 }
 
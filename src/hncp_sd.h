@@ -46,6 +46,12 @@ typedef struct hncp_sd_params_struct
 
   /* Domain name (if desired, optional, copied from others if set there) */
   const char *domain_name;
+
+  /* UDP port of the built-in DNS server (optional). When set, it
+   * serves the records and forwarders otherwise given to dnsmasq, and
+   * the dnsmasq configuration only forwards the home domain and the
+   * reverse zones to it. */
+  int dns_port;
 } hncp_sd_params_s, *hncp_sd_params;
 
 hncp_sd hncp_sd_create(hncp h, hncp_sd_params p, struct hncp_link *l);
@@ -15,6 +15,7 @@
 #include "platform.h"
 #include "hncp_proto.h"
 #include "hncp_tunnel.h"
+#include "coproc.h"
 
 #include <linux/udp.h>
 #ifndef UDP_NO_CHECK6_RX
@@ -79,6 +80,9 @@ static struct hncp_tunnel_l2tpv3* hncp_tunnel_get_l2tpv3(struct hncp_tunnel *t,
 static int hncp_tunnel_spawn(char *argv[])
 {
 	int status = -1;
+	if (!coproc_call(argv, &status))
+		return status;
+
 	pid_t pid = fork();
 
 	if (pid == 0) {
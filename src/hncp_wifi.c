@@ -155,6 +155,8 @@ static void wifi_tlv_cb(dncp_subscriber s,
 		uloop_timeout_set(&wifi->to, 1000);
 }
 
+static const uint16_t wifi_tlv_types[] = {HNCP_T_SSID};
+
 hncp_wifi hncp_wifi_init(hncp hncp, char *scriptpath)
 {
 	hncp_wifi wifi;
@@ -166,6 +168,8 @@ hncp_wifi hncp_wifi_init(hncp hncp, char *scriptpath)
 	wifi->script = scriptpath;
 	wifi->dncp = hncp->dncp;
 	wifi->subscriber.tlv_change_cb = wifi_tlv_cb;
+	wifi->subscriber.tlv_types = wifi_tlv_types;
+	wifi->subscriber.num_tlv_types = ARRAY_SIZE(wifi_tlv_types);
 	exeq_init(&wifi->exeq);
 	dncp_subscribe(wifi->dncp, &wifi->subscriber);
 	return wifi;
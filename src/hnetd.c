@@ -23,6 +23,7 @@
 #include "hncp_pa.h"
 #include "hncp_sd.h"
 #include "hncp_multicast.h"
+#include "coproc.h"
 #include "hncp_routing.h"
 #include "hncp_tunnel.h"
 #include "hncp_wifi.h"
@@ -98,6 +99,9 @@ int usage() {
 	 "\t--verify-dir <(DTLS) path to trusted cert directory>\n"
 	 "\t-M multicast_script (enables draft-pfister-homenet-multicast support)\n"
 	 "\t-w wifi_script,[ssid1:pass2,[ssid2:pass2,...]]\n"
+	 "\t--coproc (run /bin/sh scripts in persistent co-processes)\n"
+	 "\t--routing-netlink (program routes with rtnetlink instead of the routing script)\n"
+	 "\t--dnsport <port of built-in DNS server replacing dnsmasq configuration>\n"
 	 );
     return(3);
 }
@@ -164,6 +168,7 @@ int main(__unused int argc, char *argv[])
 	const char *pidfile = NULL;
 	const char *wifi = NULL;
 	bool strict = false;
+	bool routing_netlink = false;
 
 	enum {
 		GOL_IPPREFIX = 1000,
@@ -177,6 +182,9 @@ int main(__unused int argc, char *argv[])
 		GOL_TRUST, /* DTLS trust cache filename */
 		GOL_DIR, /* DTLS trusted cert dir */
 		GOL_PATH, /* DTLS trusted cert file path */
+		GOL_COPROC,
+		GOL_DNSPORT,
+		GOL_RTNL,
 	};
 
 	struct option longopts[] = {
@@ -192,6 +200,9 @@ int main(__unused int argc, char *argv[])
 			{ "privatekey",    required_argument,      NULL,           GOL_KEY },
 			{ "verifydir",    required_argument,      NULL,           GOL_DIR },
 			{ "verifypath",    required_argument,      NULL,           GOL_PATH },
+			{ "coproc",      no_argument,            NULL,           GOL_COPROC },
+			{ "dnsport",     required_argument,      NULL,           GOL_DNSPORT },
+			{ "routing-netlink", no_argument,        NULL,           GOL_RTNL },
 			{ "help",	 no_argument,		 NULL,           '?' },
 			{ NULL,          0,                      NULL,           0 }
 	};
@@ -270,6 +281,19 @@ int main(__unused int argc, char *argv[])
 		case GOL_PATH:
 			dtls_path = optarg;
 			break;
+		case GOL_COPROC:
+			coproc_init();
+			break;
+		case GOL_DNSPORT:
+			sd_params.dns_port = atoi(optarg);
+			if (sd_params.dns_port < 1 || sd_params.dns_port > 65535) {
+				L_ERR("Invalid DNS port %s", optarg);
+				return usage();
+			}
+			break;
+		case GOL_RTNL:
+			routing_netlink = true;
+			break;
 		case GOL_KEY:
 #ifdef DTLS
 			dtls_key = optarg;
@@ -357,7 +381,7 @@ int main(__unused int argc, char *argv[])
 			}
 	}
 	if (routing_script)
-		hncp_routing_create(h, routing_script, !strict);
+		hncp_routing_create(h, routing_script, !strict, routing_netlink);
 
 #ifdef __linux__
 	if (tunnel_script)
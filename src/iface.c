@@ -11,6 +11,7 @@
 #include <ifaddrs.h>
 #include <stdarg.h>
 #include <limits.h>
+#include <errno.h>
 #include <arpa/inet.h>
 
 #include <sys/socket.h>
@@ -211,6 +212,15 @@ static void iface_link_event(struct uloop_fd *fd, __unused unsigned events)
 	ssize_t read;
 	do {
 		read = recv(fd->fd, &resp, sizeof(resp), MSG_DONTWAIT);
+		if (read >= 0 && NLMSG_OK(&resp.hdr, (size_t)read) &&
+				resp.hdr.nlmsg_type == NLMSG_ERROR) {
+			struct nlmsgerr *err = NLMSG_DATA(&resp.hdr);
+			if (err->error)
+				L_WARN("rtnetlink request type %d failed: %s",
+						(int)err->msg.nlmsg_type, strerror(-err->error));
+			continue;
+		}
+
 		if (read < 0 || !NLMSG_OK(&resp.hdr, (size_t)read) ||
 				(resp.hdr.nlmsg_type != RTM_NEWLINK &&
 						resp.hdr.nlmsg_type != RTM_DELLINK))
@@ -235,6 +245,33 @@ static void iface_link_event(struct uloop_fd *fd, __unused unsigned events)
 
 static struct uloop_fd rtnl_fd = { .fd = -1 };
 
+// Requests are batched and sent at once at the end of the current loop iteration
+static void iface_rtnl_flush(struct uloop_timeout *t);
+static struct {
+	struct uloop_timeout flush;
+	size_t len;
+	uint8_t buf[16384];
+} rtnl_batch = { .flush = { .cb = iface_rtnl_flush } };
+
+static void iface_rtnl_flush(__unused struct uloop_timeout *t)
+{
+	if (rtnl_batch.len && send(rtnl_fd.fd, rtnl_batch.buf, rtnl_batch.len, 0) < 0)
+		L_WARN("Unable to send rtnetlink requests: %s", strerror(errno));
+	rtnl_batch.len = 0;
+}
+
+static void iface_rtnl_send(const struct nlmsghdr *nhm)
+{
+	size_t len = NLMSG_ALIGN(nhm->nlmsg_len);
+	if (rtnl_batch.len + len > sizeof(rtnl_batch.buf))
+		iface_rtnl_flush(NULL);
+
+	memcpy(&rtnl_batch.buf[rtnl_batch.len], nhm, nhm->nlmsg_len);
+	rtnl_batch.len += len;
+	if (!rtnl_batch.flush.pending)
+		uloop_timeout_set(&rtnl_batch.flush, 0);
+}
+
 void iface_set_unreachable_route(const struct prefix *p, bool enable)
 {
 	struct req {
@@ -261,7 +298,57 @@ void iface_set_unreachable_route(const struct prefix *p, bool enable)
 		req.rtm.rtm_type = RTN_UNREACHABLE;
 	}
 
-	send(rtnl_fd.fd, &req, req.nhm.nlmsg_len, 0);
+	iface_rtnl_send(&req.nhm);
+}
+
+static void iface_rtnl_attr(struct nlmsghdr *nhm, int type, const void *data, size_t len)
+{
+	struct rtattr *rta = (struct rtattr *)(((uint8_t *)nhm) + NLMSG_ALIGN(nhm->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	nhm->nlmsg_len = NLMSG_ALIGN(nhm->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+void iface_set_kernel_address(const char *ifname, const struct prefix *p,
+		uint32_t preferred, uint32_t valid, bool enable)
+{
+	struct {
+		struct nlmsghdr nhm;
+		struct ifaddrmsg ifa;
+		uint8_t attrs[2 * RTA_SPACE(sizeof(struct in6_addr)) + RTA_SPACE(sizeof(struct ifa_cacheinfo))];
+	} req = {
+		.nhm = {NLMSG_LENGTH(sizeof(req.ifa)), RTM_DELADDR, NLM_F_REQUEST, 1, 0},
+		.ifa = {AF_INET6, p->plen, 0, RT_SCOPE_UNIVERSE, if_nametoindex(ifname)},
+	};
+	const void *addr = &p->prefix;
+	size_t addrlen = sizeof(p->prefix);
+
+	if (!req.ifa.ifa_index) {
+		L_WARN("Unable to set address on unknown interface %s", ifname);
+		return;
+	}
+
+	if (prefix_is_ipv4(p)) {
+		req.ifa.ifa_family = AF_INET;
+		req.ifa.ifa_prefixlen = prefix_af_length(p);
+		addr = &p->prefix.s6_addr[12];
+		addrlen = sizeof(struct in_addr);
+	}
+
+	if (enable) {
+		req.nhm.nlmsg_type = RTM_NEWADDR;
+		req.nhm.nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
+	}
+
+	iface_rtnl_attr(&req.nhm, IFA_LOCAL, addr, addrlen);
+	iface_rtnl_attr(&req.nhm, IFA_ADDRESS, addr, addrlen);
+	if (enable && req.ifa.ifa_family == AF_INET6) {
+		struct ifa_cacheinfo cache = {.ifa_prefered = preferred, .ifa_valid = valid};
+		iface_rtnl_attr(&req.nhm, IFA_CACHEINFO, &cache, sizeof(cache));
+	}
+
+	iface_rtnl_send(&req.nhm);
 }
 #endif /* __linux__ */
 
@@ -227,6 +227,10 @@ void iface_flush(void);
 
 #ifdef __linux__
 void iface_set_unreachable_route(const struct prefix *p, bool enable);
+
+// Set / unset an address (lifetimes in seconds) with rtnetlink
+void iface_set_kernel_address(const char *ifname, const struct prefix *p,
+		uint32_t preferred, uint32_t valid, bool enable);
 #endif
 
 #endif
@@ -48,9 +48,26 @@ const char *pa_hex_dump(uint8_t *ptr, size_t len, char *s) {
 		} \
 	} while(0)
 
-#define pa_routine_schedule(ldp) do { \
-	if(!(ldp)->routine_to.pending) \
-		uloop_timeout_set(&(ldp)->routine_to, PA_RUN_DELAY); }while(0)
+/* Returns whether the Advertised Prefix is better than the current best one. */
+#define pa_advp_better(advp, best) \
+	(!(best) || (advp)->priority > (best)->priority || \
+	(((advp)->priority == (best)->priority) && \
+			(PA_NODE_ID_CMP((advp)->node_id, (best)->node_id) > 0)))
+
+static void pa_routine_schedule(struct pa_ldp *ldp)
+{
+	struct pa_core *core = ldp->core;
+	if(!core->batched) {
+		if(!ldp->routine_to.pending)
+			uloop_timeout_set(&ldp->routine_to, PA_RUN_DELAY);
+		return;
+	}
+
+	if(list_empty(&ldp->in_pending))
+		list_add_tail(&ldp->in_pending, &core->pending_ldps);
+	if(!core->routine_to.pending)
+		uloop_timeout_set(&core->routine_to, PA_RUN_DELAY);
+}
 
 #define PA_ADOPT_DELAY_r(ldp) (pa_rand() % (ldp)->core->adopt_delay)
 #define PA_BACKOFF_DELAY_r(ldp) ((ldp)->core->adopt_delay + pa_rand() % ((ldp)->core->backoff_delay - (ldp)->core->adopt_delay))
@@ -222,12 +239,66 @@ static bool pa_ldp_global_valid(struct pa_ldp *ldp)
 }
 
 /*
- * Prefix Assignment Routine.
+ * Looks for the Best Assignment of a single ldp.
  */
-static void pa_routine(struct pa_ldp *ldp, bool backoff)
+static void pa_routine_best_assignment(struct pa_ldp *ldp)
 {
-	PA_DEBUG("Executing PA %sRoutine for "PA_LDP_P, backoff?"backoff ":"", PA_LDP_PA(ldp));
+	struct pa_advp *advp;
+	struct pa_pentry *pentry;
+	ldp->best_assignment = NULL;
+	btrie_for_each_updown_entry(pentry, &ldp->core->prefixes,
+			(btrie_key_t *)&ldp->dp->prefix, ldp->dp->plen, be) {
+		if(pentry->type == PAT_ADVERTISED) {
+			advp = container_of(pentry, struct pa_advp, in_core);
+			if(advp->link == ldp->link && pa_advp_better(advp, ldp->best_assignment))
+				ldp->best_assignment = advp;
+		}
+	}
+}
+
+/*
+ * Looks for the Best Assignment of all pending ldps of a given dp,
+ * walking the prefixes overlapping with the dp only once.
+ */
+static void pa_routine_dp_best_assignments(struct pa_core *core, struct pa_dp *dp)
+{
+	struct pa_advp *advp;
+	struct pa_pentry *pentry;
+	struct pa_ldp *ldp;
+	bool pending = false;
+	pa_for_each_ldp_in_dp(dp, ldp) {
+		if(!list_empty(&ldp->in_pending)) {
+			ldp->best_assignment = NULL;
+			pending = true;
+		}
+	}
+
+	if(!pending)
+		return;
+
+	btrie_for_each_updown_entry(pentry, &core->prefixes,
+			(btrie_key_t *)&dp->prefix, dp->plen, be) {
+		if(pentry->type != PAT_ADVERTISED)
+			continue;
+
+		advp = container_of(pentry, struct pa_advp, in_core);
+		pa_for_each_ldp_in_dp(dp, ldp) {
+			if(ldp->link != advp->link)
+				continue;
+			if(!list_empty(&ldp->in_pending) &&
+					pa_advp_better(advp, ldp->best_assignment))
+				ldp->best_assignment = advp;
+			break; //There is at most one ldp per link and dp
+		}
+	}
+}
 
+/*
+ * Prefix Assignment Routine.
+ * Steps 2 to 4, once the Best Assignment was looked up.
+ */
+static void pa_routine_execute(struct pa_ldp *ldp, bool backoff)
+{
 	/*
 	 * The algorithm is slightly modified in order to provide support for
 	 * custom behavior.
@@ -239,25 +310,6 @@ static void pa_routine(struct pa_ldp *ldp, bool backoff)
 	 * rules provide valid assignments).
 	 */
 
-	/*********************************
-	 * 1. Look for best Adv. Prefix  *
-	 *********************************/
-	struct pa_advp *advp;
-	struct pa_pentry *pentry;
-	ldp->best_assignment = NULL;
-	btrie_for_each_updown_entry(pentry, &ldp->core->prefixes,
-			(btrie_key_t *)&ldp->dp->prefix, ldp->dp->plen, be) {
-		if(pentry->type == PAT_ADVERTISED) {
-			advp = container_of(pentry, struct pa_advp, in_core);
-			if(advp->link == ldp->link &&
-					(!ldp->best_assignment ||
-					advp->priority > ldp->best_assignment->priority ||
-					((advp->priority == ldp->best_assignment->priority) &&
-							(PA_NODE_ID_CMP(advp->node_id, ldp->best_assignment->node_id) > 0))))
-				ldp->best_assignment = advp;
-		}
-	}
-
 	/*********************************
 	 * 2. Check Assignment Validity. *
 	 *********************************/
@@ -286,12 +338,12 @@ static void pa_routine(struct pa_ldp *ldp, bool backoff)
 	 *********************/
 
 	struct pa_rule *rule, *r2;
-	struct list_head rules, *insert;
-	INIT_LIST_HEAD(&rules);
 	ldp->backoff = backoff?1:0;
 
-	/* First, sort the rules with their max priority. */
+	/* First, get the max priority of each accepted rule. */
 	list_for_each_entry(rule, &ldp->core->rules, le) {
+		rule->_max_priority = 0;
+
 		/* Apply rule filter */
 		if(rule->filter_accept && !rule->filter_accept(rule, ldp, rule->filter_private))
 			continue;
@@ -299,18 +351,6 @@ static void pa_routine(struct pa_ldp *ldp, bool backoff)
 		/* Get priority */
 		rule->_max_priority = rule->get_max_priority?
 				rule->get_max_priority(rule, ldp):rule->max_priority;
-
-		if(!rule->_max_priority)
-			continue;
-
-		/* Insert the rule in descending order. */
-		insert = &rules;
-		list_for_each_entry(r2, &rules, _le) {
-			if(r2->_max_priority < rule->_max_priority)
-				break;
-			insert = &r2->_le;
-		}
-		list_add(&rule->_le, insert);
 	}
 
 	/* Now get the best rule result. */
@@ -323,9 +363,22 @@ static void pa_routine(struct pa_ldp *ldp, bool backoff)
 	//Get existing rule priority
 	best_prio = (ldp->published || ldp->adopting)?ldp->rule_priority:0;
 
-	list_for_each_entry(rule, &rules, _le) {
-		if(rule->_max_priority <= best_prio)
-			break; //Stop here as it is a sorted list
+	/* Rules are called in descending max priority order (in list order when
+	 * equal), until no remaining rule can beat the best match. Usually only
+	 * one or two rules are called, so the rules are picked one by one
+	 * rather than sorted. */
+	while(1) {
+		rule = NULL;
+		list_for_each_entry(r2, &ldp->core->rules, le) {
+			if(r2->_max_priority > best_prio &&
+					(!rule || r2->_max_priority > rule->_max_priority))
+				rule = r2;
+		}
+
+		if(!rule)
+			break;
+
+		rule->_max_priority = 0; //Each rule is called once
 
 		/* For now, we assume rules behave correctly.
 		 * They only return a match when they have the best
@@ -347,7 +400,7 @@ static void pa_routine(struct pa_ldp *ldp, bool backoff)
 
 	/* Now act upon the best rule */
 	struct pa_ldp *ldp2;
-	struct pa_pentry *pentry2;
+	struct pa_pentry *pentry, *pentry2;
 	switch (best_target) {
 		case PA_RULE_ADOPT:
 			PA_DEBUG("Target: Adoption %s - priority="PA_PRIO_P" rule_priority="PA_RULE_PRIO_P, pa_prefix_repr(&ldp->prefix, ldp->plen),
@@ -435,6 +488,18 @@ static void pa_routine(struct pa_ldp *ldp, bool backoff)
 	}
 }
 
+static void pa_routine(struct pa_ldp *ldp, bool backoff)
+{
+	PA_DEBUG("Executing PA %sRoutine for "PA_LDP_P, backoff?"backoff ":"", PA_LDP_PA(ldp));
+
+	/*********************************
+	 * 1. Look for best Adv. Prefix  *
+	 *********************************/
+	pa_routine_best_assignment(ldp);
+
+	pa_routine_execute(ldp, backoff);
+}
+
 static void pa_backoff_to(struct uloop_timeout *to)
 {
 	struct pa_ldp *ldp = container_of(to, struct pa_ldp, backoff_to);
@@ -453,6 +518,40 @@ static void pa_routine_to(struct uloop_timeout *to)
 	pa_routine(ldp, false);
 }
 
+static void pa_core_routine_to(struct uloop_timeout *to)
+{
+	struct pa_core *core = container_of(to, struct pa_core, routine_to);
+	uint32_t advp_version = core->advp_version;
+	struct list_head batch;
+	struct pa_ldp *ldp;
+	struct pa_dp *dp;
+
+	/* Pairs scheduled while processing the batch go to the next one. */
+	INIT_LIST_HEAD(&batch);
+	list_splice_init(&core->pending_ldps, &batch);
+
+	PA_DEBUG("Executing batched PA Routine");
+
+	/*********************************
+	 * 1. Look for best Adv. Prefix  *
+	 *********************************/
+	pa_for_each_dp(core, dp)
+		pa_routine_dp_best_assignments(core, dp);
+
+	while(!list_empty(&batch)) {
+		ldp = list_first_entry(&batch, struct pa_ldp, in_pending);
+		list_del_init(&ldp->in_pending);
+		PA_DEBUG("Executing PA Routine for "PA_LDP_P, PA_LDP_PA(ldp));
+
+		/* Users may modify Advertised Prefixes from callbacks,
+		 * in which case Best Assignments must be looked up again. */
+		if(core->advp_version != advp_version)
+			pa_routine_best_assignment(ldp);
+
+		pa_routine_execute(ldp, false);
+	}
+}
+
 /*
  * Create a new empty link/dp pairing.
  */
@@ -466,6 +565,7 @@ static int pa_ldp_create(struct pa_core *core, struct pa_link *link, struct pa_d
 
 	ldp->backoff_to.cb = pa_backoff_to;
 	ldp->routine_to.cb = pa_routine_to;
+	INIT_LIST_HEAD(&ldp->in_pending);
 	ldp->in_core.type = PAT_ASSIGNED;
 	ldp->core = core;
 	ldp->link = link;
@@ -487,6 +587,11 @@ static void pa_ldp_destroy(struct pa_ldp *ldp)
 	list_del(&ldp->in_dp);
 	uloop_timeout_cancel(&ldp->backoff_to);
 	uloop_timeout_cancel(&ldp->routine_to);
+	if(!list_empty(&ldp->in_pending)) {
+		list_del(&ldp->in_pending);
+		if(list_empty(&ldp->core->pending_ldps))
+			uloop_timeout_cancel(&ldp->core->routine_to);
+	}
 	free(ldp);
 }
 
@@ -602,6 +707,7 @@ static void _pa_advp_update(struct pa_core *core, struct pa_advp *advp)
 {
 	struct pa_dp *dp;
 	struct pa_ldp *ldp;
+	core->advp_version++;
 	pa_for_each_dp(core, dp) {
 		/* Schedule all for dps overlapping with the advp. */
 		//TODO: Maybe not necessary to schedule if we have Current and advp is not overlapping with it.
@@ -688,6 +794,34 @@ void pa_core_set_flooding_delay(struct pa_core *core, uint32_t flooding_delay)
 	core->flooding_delay = flooding_delay;
 }
 
+void pa_core_set_batched(struct pa_core *core, uint8_t batched)
+{
+	struct pa_link *link;
+	struct pa_ldp *ldp;
+	if(!batched == !core->batched)
+		return;
+
+	PA_INFO("%s batched routine", batched?"Enable":"Disable");
+	core->batched = !!batched;
+	if(batched) {
+		/* Move pending routines to the batch */
+		pa_for_each_link(core, link)
+			pa_for_each_ldp_in_link(link, ldp)
+				if(ldp->routine_to.pending) {
+					uloop_timeout_cancel(&ldp->routine_to);
+					pa_routine_schedule(ldp);
+				}
+	} else {
+		/* Move the batch to per-pair timers */
+		uloop_timeout_cancel(&core->routine_to);
+		while(!list_empty(&core->pending_ldps)) {
+			ldp = list_first_entry(&core->pending_ldps, struct pa_ldp, in_pending);
+			list_del_init(&ldp->in_pending);
+			pa_routine_schedule(ldp);
+		}
+	}
+}
+
 void pa_core_set_node_id(struct pa_core *core, const PA_NODE_ID_TYPE node_id[])
 {
 	PA_INFO("Set Node ID to "PA_NODE_ID_P, PA_NODE_ID_PA(node_id));
@@ -709,11 +843,16 @@ void pa_core_init(struct pa_core *core)
 	INIT_LIST_HEAD(&core->links);
 	INIT_LIST_HEAD(&core->users);
 	INIT_LIST_HEAD(&core->rules);
-	btrie_init(&core->prefixes);
+	btrie_init(&core->prefixes); //Counted once a rule needs it (see pa_rule_prefix_count)
 	memset(core->node_id, 0, PA_NODE_ID_LEN *sizeof(PA_NODE_ID_TYPE));
 	core->flooding_delay = PA_DEFAULT_FLOODING_DELAY;
 	core->adopt_delay = PA_ADOPT_DELAY_DEFAULT;
 	core->backoff_delay = PA_BACKOFF_DELAY_DEFAULT;
+	core->batched = 0;
+	INIT_LIST_HEAD(&core->pending_ldps);
+	memset(&core->routine_to, 0, sizeof(core->routine_to));
+	core->routine_to.cb = pa_core_routine_to;
+	core->advp_version = 0;
 #ifdef PA_HIERARCHICAL
 	core->ha_parent = NULL;
 #endif
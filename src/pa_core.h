@@ -175,6 +175,21 @@ struct pa_core {
 	/* List of all PA rules. */
 	struct list_head rules;
 
+	/* When set, the routine is run for all pending Link/Delegated Prefix
+	 * pairs at once instead of using one timer per pair
+	 * (see pa_core_set_batched). */
+	uint8_t batched;
+
+	/* (if batched) Pairs waiting for the routine to be executed. */
+	struct list_head pending_ldps;
+
+	/* (if batched) Timer used to schedule the routine. */
+	struct uloop_timeout routine_to;
+
+	/* Incremented each time an Advertised Prefix is added, updated or
+	 * removed. */
+	uint32_t advp_version;
+
 #ifdef PA_HIERARCHICAL
 
 	/* When not-null, points to the parent pa_core structure. */
@@ -222,6 +237,20 @@ void pa_core_set_node_id(struct pa_core *core,
  */
 void pa_core_set_flooding_delay(struct pa_core *core, uint32_t flooding_delay);
 
+/**
+ * Enables or disables batched routine execution.
+ *
+ * When enabled, Link/Delegated Prefix pairs which need the routine to be
+ * executed are queued and processed together after PA_RUN_DELAY. The prefix
+ * btrie is then walked once per Delegated Prefix instead of once per pair,
+ * which matters when many links are affected by a single change (e.g. a new
+ * Delegated Prefix). Backoff timeouts are still handled per pair.
+ *
+ * @param core The PA core structure.
+ * @param batched Whether batched mode is enabled (disabled by default).
+ */
+void pa_core_set_batched(struct pa_core *core, uint8_t batched);
+
 
 
 /**
@@ -433,6 +462,10 @@ struct pa_ldp {
 	/* Timer used to schedule the routine. */
 	struct uloop_timeout routine_to;
 
+	/* (if the core is batched and the routine is pending)
+	 * Linked in pa_core pending_ldps. */
+	struct list_head in_pending;
+
 	/* Timer used to backoff prefix generation, adoption or apply. */
 	struct uloop_timeout backoff_to;
 
@@ -646,7 +679,6 @@ struct pa_rule {
 
 	 /* PRIVATE - Used by pa_core. */
 	 pa_rule_priority _max_priority;
-	 struct list_head _le;
 };
 
 /* pa_rule print format and argument */
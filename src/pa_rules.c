@@ -38,17 +38,16 @@ void pa_rule_prefix_nth(pa_prefix *dst, pa_prefix *container, pa_plen container_
 void pa_rule_prefix_count(struct pa_core *core,
 		pa_prefix *subprefix, pa_plen subplen,
 		uint16_t *count, pa_plen max_plen) {
-	pa_prefix p;
+	uint32_t c[max_plen + 1];
 	pa_plen plen;
-	struct btrie *n;
 
-	for(plen = 0; plen <= max_plen; plen++)
-		count[plen] = 0;
+	//Counting costs memory and time on every change, so it starts when first needed
+	if(!core->prefixes.counted && btrie_count_enable(&core->prefixes))
+		PA_WARNING("Could not enable prefix counting");
 
-	btrie_for_each_available(&core->prefixes, n, (btrie_key_t *)&p, (btrie_plen_t *)&plen, (btrie_key_t *)subprefix, subplen) {
-		if(count[plen] != UINT16_MAX)
-			count[plen]++;
-	}
+	btrie_available_count(&core->prefixes, (btrie_key_t *)subprefix, subplen, c, max_plen);
+	for(plen = 0; plen <= max_plen; plen++)
+		count[plen] = (c[plen] > UINT16_MAX)?UINT16_MAX:c[plen];
 }
 
 /* Computes the candidate subset. */
@@ -85,23 +84,17 @@ uint32_t pa_rule_candidate_subset( //Returns the number of found prefixes
 int pa_rule_candidate_pick(struct pa_core *core, pa_prefix *subprefix, pa_plen subplen,
 		uint32_t n, pa_prefix *p, pa_plen plen, pa_plen min_plen, pa_plen max_plen)
 {
-	struct btrie *node;
 	pa_plen i;
 	pa_prefix iter;
-	int pass = 0;
-	do{
-		btrie_for_each_available(&core->prefixes, node, (btrie_key_t *)&iter, (btrie_plen_t *)&i,
-				(btrie_key_t *)subprefix, subplen) {
-			if((pass && i == min_plen) || (!pass && i > min_plen && i <= max_plen)) {
-				if((plen - i >= 32) || (n < (((uint32_t)1) << (plen - i)))) {
-					//The nth prefix is in this available prefix
-					pa_rule_prefix_nth(p, &iter, i, n, plen);
-					return 0;
-				}
-				n -= 1 << (plen - i);
-			}
-		}
-	} while(!(pass++));
+	if((min_plen < max_plen &&
+			!btrie_available_nth(&core->prefixes, (btrie_key_t *)&iter, (btrie_plen_t *)&i,
+					(btrie_key_t *)subprefix, subplen, min_plen + 1, max_plen, plen, &n)) ||
+			!btrie_available_nth(&core->prefixes, (btrie_key_t *)&iter, (btrie_plen_t *)&i,
+					(btrie_key_t *)subprefix, subplen, min_plen, min_plen, plen, &n)) {
+		//The nth prefix is in this available prefix
+		pa_rule_prefix_nth(p, &iter, i, n, plen);
+		return 0;
+	}
 	return -1;
 }
 
@@ -527,10 +520,10 @@ enum pa_rule_target pa_rule_static_match(struct pa_rule *rule, struct pa_ldp *ld
 			__unused pa_rule_priority best_match_priority, struct pa_rule_arg *pa_arg)
 {
 	struct pa_rule_static *srule = container_of(rule, struct pa_rule_static, rule);
+	pa_arg->rule_priority = srule->rule_priority;
 	if(!ldp->backoff && !ldp->best_assignment) //Do not return backoff when there is a best_assignment
 		return PA_RULE_BACKOFF;
 
-	pa_arg->rule_priority = srule->rule_priority;
 	pa_arg->priority = srule->priority;
 	pa_prefix_cpy(&srule->_prefix, srule->_plen, &pa_arg->prefix, pa_arg->plen);
 	return PA_RULE_PUBLISH;
@@ -545,4 +538,7 @@ void pa_rule_static_init(struct pa_rule_static *r, const char *name,
 	r->get_prefix = get_prefix;
 	r->rule_priority = rule_priority;
 	r->priority = priority;
+	r->override_priority = 0;
+	r->override_rule_priority = 0;
+	r->safety = 1;
 }
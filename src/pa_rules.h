@@ -179,15 +179,16 @@ struct pa_rule_static {
 
 	/* This rule may override prefixes advertised with a priority
 	 * strictly lower than this priority. */
-	pa_priority override_priority;
+	pa_priority override_priority; /* (default is 0) */
 
 	/* This rule may override prefixes locally published with a rule priority
 	 * strictly lower than this rule priority. */
-	pa_rule_priority override_rule_priority;
+	pa_rule_priority override_rule_priority; /* (default is 0) */
 
 	/* When set, published prefixes are not override unless the Advertised
 	 * Prefix Priority is lower or equal to override_priority.
-	 * When disabled, assignment loop may happen with other nodes. */
+	 * When disabled, assignment loop may happen with other nodes.
+	 * (default is 1) */
 	uint8_t safety;
 
 	/* Private */
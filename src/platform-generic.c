@@ -30,6 +30,8 @@
 #include "hncp_dump.h"
 #include "dncp_trust.h"
 #include "hncp_pa.h"
+#include "exeq.h"
+#include "coproc.h"
 
 static char backend[] = CMAKE_INSTALL_PREFIX "/sbin/hnetd-backend";
 static const char *hnetd_pd_socket = NULL;
@@ -43,6 +45,11 @@ static dncp dncp_p = NULL;
 static hncp_pa hncp_pa_p = NULL;
 static struct platform_rpc_method *hnet_rpc_methods[PLATFORM_RPC_MAX];
 static size_t rpc_methods_cnt = 0;
+static struct exeq backend_exeq;
+static platform_rpc_cb platform_backend_stats;
+static struct platform_rpc_method backend_stats_rpc = {
+	.name = "backend-stats", .cb = platform_backend_stats,
+};
 
 struct platform_iface {
 	pid_t dhcpv4;
@@ -63,8 +70,27 @@ int platform_init(hncp hncp_in, hncp_pa pa, const char *pd_socket)
 	}
 	uloop_fd_add(&ipcsock, ULOOP_EDGE_TRIGGER | ULOOP_READ);
 
+	exeq_init(&backend_exeq);
+	platform_rpc_register(&backend_stats_rpc);
+
 	char *argv[] = {backend, "setbfs", NULL};
-	platform_run(argv);
+	if (coproc_run(NULL, argv, NULL))
+		platform_run(argv);
+	return 0;
+}
+
+// Report backend queue metrics
+static int platform_backend_stats(__unused struct platform_rpc_method *m,
+		__unused const struct blob_attr *in, struct blob_buf *b)
+{
+	struct exeq_stats *s = &backend_exeq.stats;
+	blobmsg_add_u32(b, "queued", s->queued);
+	blobmsg_add_u32(b, "max_queued", s->max_queued);
+	blobmsg_add_u32(b, "executed", s->executed);
+	blobmsg_add_u32(b, "failed", s->failed);
+	blobmsg_add_u32(b, "coalesced", s->coalesced);
+	blobmsg_add_u64(b, "latency_avg", s->executed ? s->latency_sum / s->executed : 0);
+	blobmsg_add_u64(b, "latency_max", s->latency_max);
 	return 0;
 }
 
@@ -196,11 +222,29 @@ static pid_t platform_run(char *argv[])
 	return pid;
 }
 
-//
-static void platform_call(char *argv[])
+// Build a coalescing key from a name and the first n arguments after the command
+static const char *platform_key(char *buf, size_t len, const char *name, char *argv[], size_t n)
 {
-	pid_t pid = platform_run(argv);
-	waitpid(pid, NULL, 0);
+	size_t i, l = snprintf(buf, len, "%s", name);
+	for (i = 0; i < n && argv[i + 2] && l < len; ++i)
+		l += snprintf(buf + l, len - l, " %s", argv[i + 2]);
+	return buf;
+}
+
+// Queue platform script, replacing the pending call of the same class and key arguments
+static void platform_call(char *argv[], char *env[], const char *class, size_t key_args)
+{
+	char key[256];
+	exeq_add_key(&backend_exeq, argv, env, class ?
+			platform_key(key, sizeof(key), class, argv, key_args) : NULL);
+}
+
+// Queue platform script undoing the inverse command, or cancel the pending inverse call
+static void platform_call_toggle(char *argv[], const char *inverse, size_t key_args)
+{
+	char key[256];
+	if (!exeq_cancel(&backend_exeq, platform_key(key, sizeof(key), inverse, argv, key_args)))
+		exeq_add_key(&backend_exeq, argv, NULL, platform_key(key, sizeof(key), argv[1], argv, key_args));
 }
 
 // Constructor for openwrt-specific interface part
@@ -242,7 +286,7 @@ void platform_set_internal(struct iface *c, bool internal)
 {
 	char *argv[] = {backend, !internal ? "setfilter" : "unsetfilter",
 			c->ifname, NULL};
-	platform_call(argv);
+	platform_call_toggle(argv, internal ? "setfilter" : "unsetfilter", 1);
 }
 
 
@@ -252,29 +296,36 @@ void platform_filter_prefix(struct iface *c, const struct prefix *p, bool enable
 	prefix_ntopc(abuf, sizeof(abuf), &p->prefix, p->plen);
 	char *argv[] = {backend, (enable) ? "newblocked" : "delblocked",
 			c->ifname, abuf, NULL};
-	platform_call(argv);
+	platform_call_toggle(argv, (enable) ? "delblocked" : "newblocked", 2);
 }
 
 
 void platform_set_address(struct iface *c, struct iface_addr *a, bool enable)
 {
 	hnetd_time_t now = hnetd_time();
-	char abuf[PREFIX_MAXBUFFLEN], pbuf[10] = "", vbuf[10] = "", cbuf[10] = "";
-	prefix_ntop(abuf, sizeof(abuf), &a->prefix.prefix, a->prefix.plen);
+	hnetd_time_t valid = UINT32_MAX, preferred = UINT32_MAX;
 
 	if (!IN6_IS_ADDR_V4MAPPED(&a->prefix.prefix)) {
-		hnetd_time_t valid = (a->valid_until - now) / HNETD_TIME_PER_SECOND;
+		valid = (a->valid_until - now) / HNETD_TIME_PER_SECOND;
 		if (valid <= 0)
 			enable = false;
 		else if (valid > UINT32_MAX)
 			valid = UINT32_MAX;
 
-		hnetd_time_t preferred = (a->preferred_until - now) / HNETD_TIME_PER_SECOND;
+		preferred = (a->preferred_until - now) / HNETD_TIME_PER_SECOND;
 		if (preferred < 0)
 			preferred = 0;
 		else if (preferred > UINT32_MAX)
 			preferred = UINT32_MAX;
+	}
 
+#ifdef BACKEND_NETLINK
+	iface_set_kernel_address(c->ifname, &a->prefix, preferred, valid, enable);
+#else
+	char abuf[PREFIX_MAXBUFFLEN], pbuf[10] = "", vbuf[10] = "", cbuf[10] = "";
+	prefix_ntop(abuf, sizeof(abuf), &a->prefix.prefix, a->prefix.plen);
+
+	if (!IN6_IS_ADDR_V4MAPPED(&a->prefix.prefix)) {
 		snprintf(pbuf, sizeof(pbuf), "%u", (unsigned)preferred);
 		snprintf(vbuf, sizeof(vbuf), "%u", (unsigned)valid);
 	}
@@ -292,7 +343,8 @@ void platform_set_address(struct iface *c, struct iface_addr *a, bool enable)
 
 	char *argv[] = {backend, (enable) ? "newaddr" : "deladdr",
 			c->ifname, abuf, pbuf, vbuf, cbuf, NULL};
-	platform_call(argv);
+	platform_call(argv, NULL, "addr", 2);
+#endif
 }
 
 
@@ -307,7 +359,7 @@ void platform_set_snat(struct iface *c, const struct prefix *p)
 
 	char *argv[] = {backend, (p && c->v4_saddr.s_addr) ? "newnat" : "delnat",
 			c->ifname, sbuf, pbuf, prefix, NULL};
-	platform_call(argv);
+	platform_call(argv, NULL, NULL, 0);
 }
 
 void platform_set_dhcp(struct iface *c, enum hncp_link_elected elected)
@@ -318,10 +370,10 @@ void platform_set_dhcp(struct iface *c, enum hncp_link_elected elected)
 				(elected & HNCP_LINK_STATELESS) ? "" : "1",
 				(elected & (HNCP_LINK_STATELESS | HNCP_LINK_HOSTNAMES | HNCP_LINK_PREFIXDEL)) ? "1" : "",
 				(elected & HNCP_LINK_PREFIXDEL) ? (char*)hnetd_pd_socket : "", NULL};
-		platform_call(argv);
+		platform_call(argv, NULL, NULL, 0);
 	} else {
 		char *argv[] = {backend, "stopdhcp", c->ifname, NULL};
-		platform_call(argv);
+		platform_call(argv, NULL, NULL, 0);
 	}
 }
 
@@ -350,10 +402,14 @@ void platform_restart_dhcpv4(struct iface *c)
 
 void platform_set_prefix_route(const struct prefix *p, bool enable)
 {
+#ifdef BACKEND_NETLINK
+	iface_set_unreachable_route(p, enable);
+#else
 	char buf[PREFIX_MAXBUFFLEN];
 	prefix_ntopc(buf, sizeof(buf), &p->prefix, p->plen);
 	char *argv[] = {backend, (enable) ? "newprefixroute" : "delprefixroute", buf, NULL};
-	platform_call(argv);
+	platform_call(argv, NULL, "prefixroute", 1);
+#endif
 }
 
 
@@ -413,53 +469,47 @@ void platform_set_dhcpv6_send(struct iface *c, const void *dhcpv6_data, size_t l
 		}
 	}
 
-	pid_t pid = fork();
-	if (pid == 0) {
-		char *argv[] = {backend, "setdhcpv6", c->ifname, NULL};
+	char *argv[] = {backend, "setdhcpv6", c->ifname, NULL};
 
-		char *dnsbuf = malloc((dns_cnt + dns4_cnt) * INET6_ADDRSTRLEN + 5);
-		strcpy(dnsbuf, "DNS=");
-		size_t dnsbuflen = strlen(dnsbuf);
+	char dnsbuf[(dns_max * 2) * INET6_ADDRSTRLEN + 5];
+	strcpy(dnsbuf, "DNS=");
+	size_t dnsbuflen = strlen(dnsbuf);
 
-		char *rawbuf = malloc(c->dhcpv6_len_out * 2 + 10);
-		strncpy(rawbuf, "PASSTHRU=", 10);
+	char *rawbuf = malloc(c->dhcpv6_len_out * 2 + 10);
+	if (!rawbuf)
+		return;
+	strncpy(rawbuf, "PASSTHRU=", 10);
 
-		dhcpv6_for_each_option(c->dhcpv6_data_out, ((uint8_t*)c->dhcpv6_data_out) + c->dhcpv6_len_out, otype, olen, odata)
-			if (otype != DHCPV6_OPT_DNS_SERVERS && otype != DHCPV6_OPT_DNS_DOMAIN)
-				hexlify(rawbuf + strlen(rawbuf), &odata[-4], olen + 4);
+	dhcpv6_for_each_option(c->dhcpv6_data_out, ((uint8_t*)c->dhcpv6_data_out) + c->dhcpv6_len_out, otype, olen, odata)
+		if (otype != DHCPV6_OPT_DNS_SERVERS && otype != DHCPV6_OPT_DNS_DOMAIN)
+			hexlify(rawbuf + strlen(rawbuf), &odata[-4], olen + 4);
 
-		char *radefaultbuf = malloc(16);
-		snprintf(radefaultbuf, 16, "RA_DEFAULT=%d", (c->flags & IFACE_FLAG_ULA_DEFAULT) ? 1 : 0);
+	char radefaultbuf[16];
+	snprintf(radefaultbuf, 16, "RA_DEFAULT=%d", (c->flags & IFACE_FLAG_ULA_DEFAULT) ? 1 : 0);
 
-		for (size_t i = 0; i < dns_cnt; ++i) {
-			inet_ntop(AF_INET6, &dns[i], &dnsbuf[dnsbuflen], INET6_ADDRSTRLEN);
-			dnsbuflen = strlen(dnsbuf);
-			dnsbuf[dnsbuflen++] = ' ';
-		}
+	for (size_t i = 0; i < dns_cnt; ++i) {
+		inet_ntop(AF_INET6, &dns[i], &dnsbuf[dnsbuflen], INET6_ADDRSTRLEN);
+		dnsbuflen = strlen(dnsbuf);
+		dnsbuf[dnsbuflen++] = ' ';
+	}
 
-		for (size_t i = 0; i < dns4_cnt; ++i) {
-			inet_ntop(AF_INET, &dns4[i], &dnsbuf[dnsbuflen], INET_ADDRSTRLEN);
-			dnsbuflen = strlen(dnsbuf);
-			dnsbuf[dnsbuflen++] = ' ';
-		}
+	for (size_t i = 0; i < dns4_cnt; ++i) {
+		inet_ntop(AF_INET, &dns4[i], &dnsbuf[dnsbuflen], INET_ADDRSTRLEN);
+		dnsbuflen = strlen(dnsbuf);
+		dnsbuf[dnsbuflen++] = ' ';
+	}
 
-		if (dns_cnt || dns4_cnt)
-			dnsbuf[dnsbuflen - 1] = 0;
+	if (dns_cnt || dns4_cnt)
+		dnsbuf[dnsbuflen - 1] = 0;
 
-		char guestbuf[10];
-		sprintf(guestbuf, "GUEST=%s",
-			(c->flags & IFACE_FLAG_GUEST) == IFACE_FLAG_GUEST ?
-			"1": "");
-		putenv(guestbuf);
-		putenv(dnsbuf);
-		putenv(domainbuf);
-		putenv(rawbuf);
-		putenv(radefaultbuf);
+	char guestbuf[10];
+	sprintf(guestbuf, "GUEST=%s",
+		(c->flags & IFACE_FLAG_GUEST) == IFACE_FLAG_GUEST ?
+		"1": "");
 
-		execv(argv[0], argv);
-		_exit(128);
-	}
-	waitpid(pid, NULL, 0);
+	char *env[] = {guestbuf, dnsbuf, domainbuf, rawbuf, radefaultbuf, NULL};
+	platform_call(argv, env, "dhcpv6", 1);
+	free(rawbuf);
 }
 
 void platform_set_iface(const char *name, bool enable)
@@ -148,32 +148,13 @@ void udp46_get_fds(udp46 s, int *fd1, int *fd2)
     *fd2 = s->s6;
 }
 
-ssize_t udp46_recv(udp46 s,
-                   struct sockaddr_in6 *src,
-                   struct sockaddr_in6 *dst,
-                   void *buf, size_t buf_size)
+/* Convert the source address of a received message to IPv6 (if it
+ * is not already), and dig up the destination address from its
+ * control messages. Returns false if the destination was not found. */
+static bool _recv_addrs(udp46 s, struct msghdr *msg,
+                        struct sockaddr_in6 *src,
+                        struct sockaddr_in6 *dst)
 {
-  struct iovec iov[1] = {
-    {.iov_base = buf,
-     .iov_len = buf_size },
-  };
-  uint8_t c[1000];
-  struct msghdr msg = {
-    .msg_iov = iov,
-    .msg_iovlen = sizeof(iov) / sizeof(*iov),
-    .msg_name = src,
-    .msg_namelen = src ? sizeof(*src) : 0,
-    .msg_flags = 0,
-    .msg_control = c,
-    .msg_controllen = sizeof(c)
-  };
-  ssize_t l;
-
-  /* If we can't find a packet on IPv4 or IPv6 socket, return -1. */
-  if ((l = recvmsg(s->s6, &msg, 0)) < 0)
-    if ((l = recvmsg(s->s4, &msg, 0)) < 0)
-      return -1;
-
   /* Convert source address to IPv6 if it already isn't */
   if (src && src->sin6_family != AF_INET6)
     {
@@ -187,7 +168,7 @@ ssize_t udp46_recv(udp46 s,
 
   /* If we don't care about destination address, we're already done */
   if (!dst)
-    return l;
+    return true;
 
   sockaddr_in6_set(dst, NULL, s->port);
 
@@ -195,15 +176,15 @@ ssize_t udp46_recv(udp46 s,
   /* Iterate through the message headers looking for destination
    * address, and if finding it, return it (in dst, as V4 mapped if
    * need be). */
-  for (h = CMSG_FIRSTHDR(&msg); h;
-       h = CMSG_NXTHDR(&msg, h))
+  for (h = CMSG_FIRSTHDR(msg); h;
+       h = CMSG_NXTHDR(msg, h))
     if (h->cmsg_level == IPPROTO_IPV6
         && h->cmsg_type == IPV6_PKTINFO)
       {
         struct in6_pktinfo *ipi6 = (struct in6_pktinfo *)CMSG_DATA(h);
         dst->sin6_addr = ipi6->ipi6_addr;
         dst->sin6_scope_id = ipi6->ipi6_ifindex;
-        return l;
+        return true;
       }
 #ifdef IP_REVCDSTADDR
     else if (h->cmsg_level == IPPROTO_IP
@@ -211,7 +192,7 @@ ssize_t udp46_recv(udp46 s,
       {
         struct in_addr *a = (struct in_addr *)CMSG_DATA(h);
         IN_ADDR_TO_MAPPED_IN6_ADDR(a, &dst->sin6_addr);
-        return l;
+        return true;
       }
 #endif /* IP_REVCDSTADDR */
 #ifdef IP_PKTINFO
@@ -221,12 +202,147 @@ ssize_t udp46_recv(udp46 s,
         struct in_pktinfo *ipi = (struct in_pktinfo *) CMSG_DATA(h);
         IN_ADDR_TO_MAPPED_IN6_ADDR(&ipi->ipi_addr, &dst->sin6_addr);
         dst->sin6_scope_id = ipi->ipi_ifindex;
-        return l;
+        return true;
       }
 #endif /* IP_PKTINFO */
   /* By default, nothing happens if the option is AWOL. */
   DEBUG("unknown destination");
-  return -1;
+  return false;
+}
+
+ssize_t udp46_recv(udp46 s,
+                   struct sockaddr_in6 *src,
+                   struct sockaddr_in6 *dst,
+                   void *buf, size_t buf_size)
+{
+  struct iovec iov[1] = {
+    {.iov_base = buf,
+     .iov_len = buf_size },
+  };
+  uint8_t c[1000];
+  struct msghdr msg = {
+    .msg_iov = iov,
+    .msg_iovlen = sizeof(iov) / sizeof(*iov),
+    .msg_name = src,
+    .msg_namelen = src ? sizeof(*src) : 0,
+    .msg_flags = 0,
+    .msg_control = c,
+    .msg_controllen = sizeof(c)
+  };
+  ssize_t l;
+
+  /* If we can't find a packet on IPv4 or IPv6 socket, return -1. */
+  if ((l = recvmsg(s->s6, &msg, 0)) < 0)
+    if ((l = recvmsg(s->s4, &msg, 0)) < 0)
+      return -1;
+
+  if (!_recv_addrs(s, &msg, src, dst))
+    return -1;
+  return l;
+}
+
+#ifdef __linux__
+
+/* Drain up to count messages from one socket with single
+ * recvmmsg. Returns the number of valid messages stored in msgs;
+ * truncated messages and those with unknown destination are dropped. */
+static int _recv_batch_fd(udp46 s, int fd, udp46_msg msgs, int count)
+{
+  struct mmsghdr mh[UDP46_RECV_BATCH_MAX];
+  struct iovec iov[UDP46_RECV_BATCH_MAX];
+  uint8_t c[UDP46_RECV_BATCH_MAX][256];
+  int i, r, got = 0;
+
+  if (count > UDP46_RECV_BATCH_MAX)
+    count = UDP46_RECV_BATCH_MAX;
+  memset(mh, 0, sizeof(*mh) * count);
+  for (i = 0 ; i < count ; i++)
+    {
+      iov[i].iov_base = msgs[i].buf;
+      iov[i].iov_len = msgs[i].buf_size;
+      mh[i].msg_hdr.msg_iov = &iov[i];
+      mh[i].msg_hdr.msg_iovlen = 1;
+      mh[i].msg_hdr.msg_name = &msgs[i].src;
+      mh[i].msg_hdr.msg_namelen = sizeof(msgs[i].src);
+      mh[i].msg_hdr.msg_control = c[i];
+      mh[i].msg_hdr.msg_controllen = sizeof(c[i]);
+    }
+  if ((r = recvmmsg(fd, mh, count, 0, NULL)) <= 0)
+    return 0;
+  for (i = 0 ; i < r ; i++)
+    {
+      udp46_msg m = &msgs[got];
+
+      if (mh[i].msg_hdr.msg_flags & MSG_TRUNC)
+        {
+          DEBUG("dropping truncated message (%d bytes)", (int)mh[i].msg_len);
+          continue;
+        }
+      if (!_recv_addrs(s, &mh[i].msg_hdr, &msgs[i].src, &msgs[i].dst))
+        continue;
+      if (m != &msgs[i])
+        {
+          /* Compact over the dropped one(s); buffers are swapped so
+           * that each of them is still referred to exactly once. */
+          udp46_msg_s tmp = *m;
+
+          *m = msgs[i];
+          msgs[i].buf = tmp.buf;
+          msgs[i].buf_size = tmp.buf_size;
+        }
+      m->len = mh[i].msg_len;
+      got++;
+    }
+  return got;
+}
+
+#else
+
+static int _recv_batch_fd(udp46 s, int fd, udp46_msg msgs, int count)
+{
+  struct iovec iov;
+  uint8_t c[256];
+  struct msghdr msg;
+  int got = 0;
+  ssize_t l;
+
+  while (got < count)
+    {
+      udp46_msg m = &msgs[got];
+
+      iov.iov_base = m->buf;
+      iov.iov_len = m->buf_size;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_name = &m->src;
+      msg.msg_namelen = sizeof(m->src);
+      msg.msg_control = c;
+      msg.msg_controllen = sizeof(c);
+      if ((l = recvmsg(fd, &msg, 0)) < 0)
+        break;
+      if (msg.msg_flags & MSG_TRUNC)
+        {
+          DEBUG("dropping truncated message (%d bytes)", (int)l);
+          continue;
+        }
+      if (!_recv_addrs(s, &msg, &m->src, &m->dst))
+        continue;
+      m->len = l;
+      got++;
+    }
+  return got;
+}
+
+#endif /* __linux__ */
+
+int udp46_recv_batch(udp46 s, udp46_msg msgs, int count)
+{
+  int got = _recv_batch_fd(s, s->s6, msgs, count);
+
+  if (got < count)
+    got += _recv_batch_fd(s, s->s4, msgs + got, count - got);
+  return got;
 }
 
 int udp46_send_iovec(udp46 s,
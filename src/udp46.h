@@ -67,6 +67,32 @@ ssize_t udp46_recv(udp46 s,
                    struct sockaddr_in6 *dst,
                    void *buf, size_t buf_size);
 
+/* Maximum number of messages received with single system call. */
+#define UDP46_RECV_BATCH_MAX 32
+
+typedef struct udp46_msg_struct {
+  /* Provided by the caller */
+  void *buf;
+  size_t buf_size;
+
+  /* Filled in by udp46_recv_batch */
+  struct sockaddr_in6 src;
+  struct sockaddr_in6 dst;
+  size_t len;
+} udp46_msg_s, *udp46_msg;
+
+/**
+ * Receive a burst of packets.
+ *
+ * Drains up to count packets from the IPv6 and then the IPv4 socket
+ * (on Linux, using one recvmmsg() per socket). Returns the number of
+ * messages filled in at the start of msgs; 0 if nothing was
+ * available. The buffers of msgs may be reordered, but each of the
+ * provided buffers is still present exactly once. Packets that do not
+ * fit in their buffer are dropped.
+ */
+int udp46_recv_batch(udp46 s, udp46_msg msgs, int count);
+
 /**
  * Send a packet.
  *
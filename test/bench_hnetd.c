@@ -0,0 +1,649 @@
+/*
+ * Copyright (c) 2015 cisco Systems, Inc.
+ *
+ * Micro-benchmarks for the hot paths. Not part of 'make check'; build
+ * and run them with 'make bench'. The behavior itself is covered by the
+ * unit tests, this only prints timings.
+ */
+
+#include "hncp_i.h"
+#include "hncp_proto.h"
+#include "dncp_i.h"
+#include "hncp_md5.h"
+#include "btrie.h"
+#include "coproc.h"
+#include "exeq.h"
+#include "platform.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+
+/* Lots of stubs here, rather not put __unused all over the place. */
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+int log_level = LOG_WARNING;
+void (*hnetd_log)(int priority, const char *format, ...) = syslog;
+
+void iface_register_user(struct iface_user *user) {}
+void iface_unregister_user(struct iface_user *user) {}
+
+struct iface* iface_get(const char *ifname)
+{
+  return NULL;
+}
+
+struct iface* iface_next(struct iface *prev)
+{
+  return NULL;
+}
+
+void iface_all_set_dhcp_send(const void *dhcpv6_data, size_t dhcpv6_len,
+                             const void *dhcp_data, size_t dhcp_len)
+{
+}
+
+int iface_get_preferred_address(struct in6_addr *foo, bool v4, const char *ifname)
+{
+  return -1;
+}
+
+int iface_get_address(struct in6_addr *addr, bool v4, const struct in6_addr *preferred)
+{
+  return -1;
+}
+
+struct platform_rpc_method;
+struct blob_attr;
+
+int platform_rpc_register(struct platform_rpc_method *m)
+{
+  return 0;
+}
+
+int platform_rpc_cli(const char *method, struct blob_attr *in)
+{
+  return 0;
+}
+
+static int64_t _time_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/************************************************************ Network hash */
+
+static void bench_network_hash_nodes(int num_nodes, int num_updates)
+{
+  hncp_s s;
+  dncp o;
+  dncp_node n;
+  int64_t took = 0, start;
+  uint32_t i;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  for (i = 1 ; i < (uint32_t)num_nodes ; i++)
+    {
+      dncp_node_id_s ni;
+      struct tlv_buf tb;
+
+      memset(&ni, 0, sizeof(ni));
+      memcpy(&ni, &i, sizeof(i));
+      n = dncp_find_node_by_node_id(o, &ni, true);
+      n->reachable = true;
+      memset(&tb, 0, sizeof(tb));
+      tlv_buf_init(&tb, 0);
+      tlv_put(&tb, 123, &i, sizeof(i));
+      struct tlv_attr *a = dncp_node_data_alloc(o, tlv_pad_len(tb.head));
+      memcpy(a, tb.head, tlv_pad_len(tb.head));
+      tlv_buf_free(&tb);
+      dncp_node_set(n, 1, hnetd_time(), a);
+    }
+  o->network_hash_records_dirty = true;
+  dncp_calculate_network_hash(o);
+
+  /* Bump update numbers one node at a time. */
+  for (i = 0 ; i < (uint32_t)num_updates ; i++)
+    {
+      int skip = random() % num_nodes;
+
+      n = dncp_get_first_node(o);
+      while (skip--)
+        n = dncp_node_get_next(n);
+      dncp_node_set(n, n->update_number + 1, 0, NULL);
+      start = _time_us();
+      dncp_calculate_network_hash(o);
+      took += _time_us() - start;
+    }
+  printf("network hash: %d nodes, %d updates, %.2f us/update\n",
+         num_nodes, num_updates, (double)took / num_updates);
+  hncp_uninit(&s);
+}
+
+static void bench_network_hash(void)
+{
+  bench_network_hash_nodes(10, 1000);
+  bench_network_hash_nodes(100, 1000);
+  bench_network_hash_nodes(1000, 1000);
+}
+
+/***************************************************************** Receive */
+
+static struct tlv_attr *_recv_msg;
+static dncp_ep _recv_ep;
+static int _recv_left;
+
+static void _recv_src(struct sockaddr_in6 *src)
+{
+  struct in6_addr a;
+
+  inet_pton(AF_INET6, "fe80::1", &a);
+  sockaddr_in6_set(src, &a, HNCP_PORT);
+}
+
+static ssize_t _recv(dncp_ext ext, dncp_ep *ep,
+                     struct sockaddr_in6 **src,
+                     struct sockaddr_in6 **dst,
+                     int *flags,
+                     void *buf, size_t len)
+{
+  static struct sockaddr_in6 src_store;
+
+  if (!_recv_left)
+    return -1;
+  _recv_left--;
+  _recv_src(&src_store);
+  *ep = _recv_ep;
+  *src = &src_store;
+  *dst = NULL;
+  *flags = DNCP_RECV_FLAG_SRC_LINKLOCAL;
+  memcpy(buf, tlv_data(_recv_msg), tlv_len(_recv_msg));
+  return tlv_len(_recv_msg);
+}
+
+static int _recv_batch(dncp_ext ext, dncp_ext_msg msgs, int count)
+{
+  int i;
+
+  for (i = 0 ; i < count && _recv_left ; i++, _recv_left--)
+    {
+      dncp_ext_msg m = &msgs[i];
+
+      _recv_src(&m->src);
+      m->ep = _recv_ep;
+      m->multicast = true;
+      m->flags = DNCP_RECV_FLAG_SRC_LINKLOCAL;
+      memcpy(m->buf, tlv_data(_recv_msg), tlv_len(_recv_msg));
+      m->len = tlv_len(_recv_msg);
+    }
+  return i;
+}
+
+static void bench_readable_mode(hncp h, bool batch, int num_packets)
+{
+  int64_t took;
+
+  h->ext.cb.recv = _recv;
+  h->ext.cb.recv_batch = batch ? _recv_batch : NULL;
+  _recv_left = num_packets;
+  took = _time_us();
+  dncp_ext_readable(h->dncp);
+  took = _time_us() - took;
+  printf("%s receive: %d packets, %.0f packets/sec\n",
+         batch ? "batched" : "single", num_packets - _recv_left,
+         took ? (num_packets - _recv_left) * 1e6 / took : 0.0);
+}
+
+static void bench_readable(void)
+{
+  hncp_s s;
+  dncp o;
+  struct tlv_buf tb;
+  unsigned char epbuf[DNCP_NI_MAX_LEN + sizeof(dncp_t_ep_id_s)];
+  uint32_t ep_id = cpu_to_be32(1);
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  _recv_ep = dncp_find_ep_by_name(o, "eth0");
+  dncp_ext_ep_ready(_recv_ep, true);
+  dncp_ext_timeout(o);
+
+  /* Network state from a (consistent) neighbor on the link. */
+  memset(epbuf, 0x42, DNCP_NI_LEN(o));
+  memcpy(epbuf + DNCP_NI_LEN(o), &ep_id, sizeof(ep_id));
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  tlv_put(&tb, DNCP_T_NODE_ENDPOINT, epbuf, DNCP_NI_LEN(o) + sizeof(ep_id));
+  tlv_put(&tb, DNCP_T_NET_STATE, &o->network_hash, DNCP_HASH_LEN(o));
+  _recv_msg = tb.head;
+
+  bench_readable_mode(&s, false, 10000);
+  bench_readable_mode(&s, true, 10000);
+
+  tlv_buf_free(&tb);
+  hncp_uninit(&s);
+}
+
+/******************************************************************** Send */
+
+static int _send_len;
+
+static void _send_iovec(dncp_ext ext, dncp_ep ep,
+                        struct sockaddr_in6 *src,
+                        struct sockaddr_in6 *dst,
+                        struct iovec *iov, int iov_len)
+{
+  int i;
+
+  _send_len = 0;
+  for (i = 0 ; i < iov_len ; i++)
+    _send_len += iov[i].iov_len;
+}
+
+static void bench_send(void)
+{
+  hncp_s s;
+  dncp o;
+  dncp_ep_i l;
+  struct sockaddr_in6 dst;
+  uint32_t i;
+  int num_sends = 1000;
+  int64_t took;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  s.ext.cb.send_iovec = _send_iovec;
+  l = container_of(dncp_find_ep_by_name(o, "eth0"), dncp_ep_i_s, conf);
+  memset(&dst, 0, sizeof(dst));
+  for (i = 1 ; i < 500 ; i++)
+    {
+      dncp_node_id_s ni;
+
+      memset(&ni, 0, sizeof(ni));
+      memcpy(&ni, &i, sizeof(i));
+      dncp_find_node_by_node_id(o, &ni, true)->reachable = true;
+    }
+  o->network_hash_records_dirty = true;
+
+  took = _time_us();
+  for (i = 0 ; i < (uint32_t)num_sends ; i++)
+    dncp_ep_i_send_network_state(l, NULL, &dst, 0, 1, true);
+  took = _time_us() - took;
+  printf("network state send: 500 nodes, %d bytes, %.2f us/send"
+         " (%d hits, %d misses)\n", _send_len, (double)took / num_sends,
+         o->num_net_state_hits, o->num_net_state_misses);
+  hncp_uninit(&s);
+}
+
+/******************************************************************* Prune */
+
+#define PRUNE_NODES 1000
+#define PRUNE_MAX_DEG 16
+
+static dncp_node _prune_node[PRUNE_NODES];
+static int _prune_adj[PRUNE_NODES][PRUNE_MAX_DEG];
+static int _prune_deg[PRUNE_NODES];
+
+static void _prune_ni(dncp o, int i, void *ni)
+{
+  uint32_t v = cpu_to_be32(0xfe000000 | i);
+
+  if (!i)
+    memcpy(ni, &o->own_node->node_id, DNCP_NI_LEN(o));
+  else
+    memcpy(ni, &v, DNCP_NI_LEN(o));
+}
+
+static void _prune_publish(dncp o, int i, hnetd_time_t t)
+{
+  unsigned char buf[DNCP_NI_MAX_LEN + sizeof(dncp_t_peer_s)];
+  dncp_t_peer ne = (dncp_t_peer)(buf + DNCP_NI_LEN(o));
+  struct tlv_buf tb;
+  int j;
+
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  for (j = 0 ; j < _prune_deg[i] ; j++)
+    {
+      _prune_ni(o, _prune_adj[i][j], buf);
+      ne->ep_id = cpu_to_be32(1);
+      ne->peer_ep_id = cpu_to_be32(1);
+      tlv_put(&tb, DNCP_T_PEER, buf, DNCP_NI_LEN(o) + sizeof(*ne));
+    }
+  struct tlv_attr *a = dncp_node_data_alloc(o, tlv_pad_len(tb.head));
+  memcpy(a, tb.head, tlv_pad_len(tb.head));
+  tlv_buf_free(&tb);
+  dncp_node_set(_prune_node[i], _prune_node[i]->update_number + 1, t, a);
+}
+
+static bool _prune_link(int i, int j, bool add)
+{
+  int k, l;
+
+  for (k = 0 ; k < _prune_deg[i] ; k++)
+    if (_prune_adj[i][k] == j)
+      break;
+  if (add == (k < _prune_deg[i]))
+    return false;
+  if (add)
+    {
+      if (_prune_deg[i] == PRUNE_MAX_DEG || _prune_deg[j] == PRUNE_MAX_DEG)
+        return false;
+      _prune_adj[i][_prune_deg[i]++] = j;
+      _prune_adj[j][_prune_deg[j]++] = i;
+      return true;
+    }
+  _prune_adj[i][k] = _prune_adj[i][--_prune_deg[i]];
+  for (l = 0 ; _prune_adj[j][l] != i ; l++);
+  _prune_adj[j][l] = _prune_adj[j][--_prune_deg[j]];
+  return true;
+}
+
+/* Ring with random chords; full prunes, then one link flap at a time */
+static void bench_prune(void)
+{
+  hncp_s s;
+  dncp o;
+  unsigned char ni[DNCP_NI_MAX_LEN];
+  hnetd_time_t t, now;
+  int64_t start, took_full = 0, took_flap = 0;
+  int i, j, k, num_flaps = 0;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  t = hnetd_time();
+  now = t;
+
+  memset(_prune_deg, 0, sizeof(_prune_deg));
+  for (i = 0 ; i < PRUNE_NODES ; i++)
+    {
+      _prune_link(i, (i + 1) % PRUNE_NODES, true);
+      for (k = 0 ; k < 2 ; k++)
+        {
+          j = random() % PRUNE_NODES;
+          if (j != i)
+            _prune_link(i, j, true);
+        }
+    }
+  for (i = 0 ; i < PRUNE_NODES ; i++)
+    {
+      _prune_ni(o, i, ni);
+      _prune_node[i] = dncp_find_node_by_node_id(o, ni, true);
+    }
+  for (i = 0 ; i < PRUNE_NODES ; i++)
+    _prune_publish(o, i, t);
+
+  for (i = 0 ; i < 10 ; i++)
+    {
+      o->prune_full = true;
+      o->now = ++now;
+      start = _time_us();
+      dncp_prune(o);
+      took_full += _time_us() - start;
+    }
+
+  for (i = 0 ; i < 200 ; i++)
+    {
+      int a = random() % PRUNE_NODES;
+      int b = _prune_adj[a][random() % _prune_deg[a]];
+
+      if (!_prune_link(a, b, false))
+        continue;
+      for (k = 0 ; k < 2 ; k++)
+        {
+          if (k)
+            _prune_link(a, b, true);
+          _prune_publish(o, a, t);
+          _prune_publish(o, b, t);
+          o->now = ++now;
+          start = _time_us();
+          dncp_prune(o);
+          took_flap += _time_us() - start;
+          num_flaps++;
+        }
+    }
+  printf("prune: %d nodes, full %.2f us, incremental %.2f us/change\n",
+         PRUNE_NODES, (double)took_full / 10,
+         (double)took_flap / num_flaps);
+
+  o->now = 0;
+  hncp_uninit(&s);
+}
+
+/************************************************************** Self flush */
+
+static void bench_self_flush(void)
+{
+  hncp h = hncp_create();
+  dncp o = hncp_get_dncp(h);
+  dncp_node n = dncp_get_own_node(o);
+  dncp_tlv tlvs[500];
+  int i, num_updates = 1000;
+  uint32_t v[2] = { 0, 0 };
+  int64_t took;
+
+  for (i = 0 ; i < 500 ; i++)
+    {
+      v[0]++;
+      tlvs[i] = dncp_add_tlv(o, 100 + random() % 50, v, 4 + random() % 5, 0);
+    }
+  dncp_self_flush(n);
+
+  /* Replace one local TLV at a time. */
+  took = _time_us();
+  for (i = 0 ; i < num_updates ; i++)
+    {
+      int j = random() % 500;
+
+      v[0]++;
+      dncp_remove_tlv(o, tlvs[j]);
+      tlvs[j] = dncp_add_tlv(o, 100 + random() % 50, v, 4 + random() % 5, 0);
+      dncp_self_flush(n);
+    }
+  took = _time_us() - took;
+  printf("self flush: 500 tlvs, %d updates, %.2f us/update\n",
+         num_updates, (double)took / num_updates);
+  hncp_destroy(h);
+}
+
+/******************************************************************** Hash */
+
+static void bench_hash(void)
+{
+  static const size_t sizes[] = { 64, 256, 1024 };
+  const int num = 4096;
+  const void *bufs[num];
+  size_t lens[num];
+  void *dsts[num];
+  unsigned char *data, (*out)[16];
+  int64_t took_single, took_multi;
+  hncp_s s;
+  int i, j;
+
+  hncp_init(&s);
+  dncp_ext ext = dncp_get_ext(hncp_get_dncp(&s));
+
+  data = malloc(num * 1024);
+  out = malloc(num * sizeof(*out));
+  for (i = 0 ; i < num * 1024 ; i++)
+    data[i] = random();
+  for (j = 0 ; j < (int)ARRAY_SIZE(sizes) ; j++)
+    {
+      for (i = 0 ; i < num ; i++)
+        {
+          bufs[i] = data + i * 1024;
+          lens[i] = sizes[j];
+          dsts[i] = out[i];
+        }
+      took_single = _time_us();
+      for (i = 0 ; i < num ; i++)
+        ext->cb.hash(bufs[i], lens[i], dsts[i]);
+      took_single = _time_us() - took_single;
+      took_multi = _time_us();
+      for (i = 0 ; i < num ; i += DNCP_HASH_BATCH)
+        ext->cb.hash_multi(bufs + i, lens + i, dsts + i, DNCP_HASH_BATCH);
+      took_multi = _time_us() - took_multi;
+      printf("md5 %d bytes: %.0f hashes/s single, %.0f hashes/s multi"
+             " (%d lanes)\n", (int)sizes[j],
+             took_single ? num * 1e6 / took_single : 0.0,
+             took_multi ? num * 1e6 / took_multi : 0.0,
+             hncp_md5_lanes);
+    }
+  free(out);
+  free(data);
+  hncp_uninit(&s);
+}
+
+/******************************************************************* Btrie */
+
+#define BTRIE_BENCH_SIZE 4000
+#define BTRIE_BENCH_ROUNDS 200
+
+/* Counts and picks available /64s in a /48 containing BTRIE_BENCH_SIZE /64s */
+static void bench_btrie_available(bool counted)
+{
+  struct btrie t;
+  struct btrie_element *e = calloc(BTRIE_BENCH_SIZE, sizeof(*e));
+  uint32_t count[BTRIE_AVAILABLE_COUNT_PLEN + 1], n, total = 0, found = 0;
+  struct in6_addr key, iter;
+  btrie_plen_t len;
+  int64_t took;
+  int i, l;
+
+  if (counted)
+    btrie_init_counted(&t);
+  else
+    btrie_init(&t);
+
+  srandom(2);
+  inet_pton(AF_INET6, "2001:db8::", &key);
+  for (i = 0 ; i < BTRIE_BENCH_SIZE ; i++)
+    {
+      key.s6_addr16[3] = random();
+      btrie_add(&t, &e[i], (btrie_key_t *)&key, 64);
+    }
+
+  key.s6_addr16[3] = 0;
+  took = _time_us();
+  for (i = 0 ; i < BTRIE_BENCH_ROUNDS ; i++)
+    {
+      btrie_available_count(&t, (btrie_key_t *)&key, 48, count,
+                            BTRIE_AVAILABLE_COUNT_PLEN);
+      for (total = 0, l = 48 ; l <= 64 ; l++)
+        total += count[l] << (64 - l);
+      n = random() % total;
+      if (!btrie_available_nth(&t, (btrie_key_t *)&iter, &len,
+                               (btrie_key_t *)&key, 48, 48, 64, 64, &n)
+          && n < (1u << (64 - len)))
+        found++;
+    }
+  took = _time_us() - took;
+  printf("%s btrie: %d counts and picks (%d found) among %u available"
+         " /64s in %.2f ms\n", counted ? "counted" : "uncounted",
+         BTRIE_BENCH_ROUNDS, found, total, (double)took / 1000);
+
+  for (i = 0 ; i < BTRIE_BENCH_SIZE ; i++)
+    btrie_remove(&e[i]);
+  free(e);
+}
+
+/****************************************************************** Coproc */
+
+#define COPROC_BENCH_OPS 200
+
+static struct uloop_timeout _coproc_poll;
+static struct exeq *_coproc_exeq;
+static bool _coproc_done;
+
+static void _coproc_poll_cb(struct uloop_timeout *t)
+{
+  if (_coproc_exeq->stats.executed >= COPROC_BENCH_OPS)
+    uloop_end();
+  else
+    uloop_timeout_set(t, 1);
+}
+
+static void _coproc_cb(struct coproc_cmd *cmd, int status)
+{
+  _coproc_done = true;
+  uloop_end();
+}
+
+static void bench_coproc_exeq(char **args, const char *name)
+{
+  struct exeq e;
+  int64_t took = _time_us();
+  int i;
+
+  exeq_init(&e);
+  for (i = 0 ; i < COPROC_BENCH_OPS ; i++)
+    exeq_add(&e, args);
+  _coproc_exeq = &e;
+  _coproc_poll.cb = _coproc_poll_cb;
+  uloop_timeout_set(&_coproc_poll, 1);
+  uloop_run();
+  uloop_timeout_cancel(&_coproc_poll);
+  printf("%s: %u script calls at %.0f ops/sec\n", name, e.stats.executed,
+         e.stats.executed * 1e6 / (_time_us() - took));
+  exeq_term(&e);
+}
+
+static void bench_coproc(void)
+{
+  char dir[] = "/tmp/bench_hnetd.XXXXXX", script[64];
+  char *args[] = { script, "nop", NULL };
+  struct coproc_cmd cmd = { .cb = _coproc_cb };
+  int64_t took;
+  FILE *f;
+  int i;
+
+  if (!mkdtemp(dir))
+    return;
+  snprintf(script, sizeof(script), "%s/bench.sh", dir);
+  if (!(f = fopen(script, "w")))
+    return;
+  fputs("#!/bin/sh\n", f);
+  fclose(f);
+  chmod(script, 0755);
+
+  uloop_init();
+  bench_coproc_exeq(args, "fork+exec");
+  coproc_init();
+  bench_coproc_exeq(args, "co-process");
+
+  /* Batched: all commands are written at once */
+  took = _time_us();
+  for (i = 0 ; i < COPROC_BENCH_OPS - 1 ; i++)
+    coproc_run(NULL, args, NULL);
+  _coproc_done = false;
+  coproc_run(&cmd, args, NULL);
+  if (!_coproc_done)
+    uloop_run();
+  printf("batched co-process: %d script calls at %.0f ops/sec\n",
+         COPROC_BENCH_OPS, COPROC_BENCH_OPS * 1e6 / (_time_us() - took));
+  coproc_term();
+  uloop_done();
+
+  unlink(script);
+  rmdir(dir);
+}
+
+int main(int argc, char **argv)
+{
+  openlog("hnetd_bench", LOG_PERROR | LOG_PID, LOG_DAEMON);
+  bench_network_hash();
+  bench_readable();
+  bench_send();
+  bench_self_flush();
+  bench_prune();
+  bench_hash();
+  bench_btrie_available(false);
+  bench_btrie_available(true);
+  bench_coproc();
+  return 0;
+}
@@ -157,6 +157,7 @@ typedef struct net_sim_t {
 
   bool fake_unicast;
   bool fake_unicast_is_reliable_stream;
+  int fake_maximum_multicast_datagrams;
 
 } net_sim_s, *net_sim;
 
@@ -339,6 +340,9 @@ hncp net_sim_find_hncp(net_sim s, const char *name)
     n->h.ext.conf.per_ep.unicast_only = true;
   if (s->fake_unicast_is_reliable_stream)
     n->h.ext.conf.per_ep.unicast_is_reliable_stream = true;
+  if (s->fake_maximum_multicast_datagrams)
+    n->h.ext.conf.per_ep.maximum_multicast_datagrams =
+      s->fake_maximum_multicast_datagrams;
   n->d = hncp_get_dncp(&n->h);
   sput_fail_unless(r, "hncp_init");
 
@@ -121,6 +121,44 @@ static uint64_t test_count_space(struct btrie *root, const pkey_t *contain_key,
 	return ctr;
 }
 
+static void test_count_by_len(struct btrie *root, const pkey_t *contain_key, plen_t contain_len,
+		pkey_t *iter_key, uint32_t *count, plen_t max_len)
+{
+	struct btrie *n;
+	plen_t iter_len;
+	memset(count, 0, (max_len + 1) * sizeof(uint32_t));
+	btrie_for_each_available(root, n, iter_key, &iter_len, contain_key, contain_len) {
+		if(iter_len <= max_len)
+			count[iter_len]++;
+	}
+}
+
+static int test_available_nth(struct btrie *root, pkey_t *iter_key, plen_t *iter_len,
+		const pkey_t *contain_key, plen_t contain_len,
+		plen_t min_len, plen_t max_len, plen_t target_len, uint32_t *nth)
+{
+	struct btrie *n;
+	btrie_for_each_available(root, n, iter_key, iter_len, contain_key, contain_len) {
+		if(*iter_len >= min_len && *iter_len <= max_len) {
+			if(target_len - *iter_len >= 32 || *nth < (1u << (target_len - *iter_len)))
+				return 0;
+			*nth -= 1u << (target_len - *iter_len);
+		}
+	}
+	return -1;
+}
+
+static int test_key_equal(const pkey_t *a, const pkey_t *b, plen_t len)
+{
+	int i;
+	if(!len)
+		return 1;
+	for(i = 0; i < index(len - 1); i++)
+		if(a[i] != b[i])
+			return 0;
+	return !((a[i] ^ b[i]) & htonk(mask(remain(len - 1))));
+}
+
 void test_print_key(const pkey_t *k, uint8_t bitlen)
 {
 	if(!bitlen) {
@@ -300,6 +338,42 @@ int test_rand_getagain()
 	return smock_pull_int(STACK);
 }
 
+#define COUNT_LEN BTRIE_AVAILABLE_COUNT_PLEN
+
+/* Compares counted trie results with the available prefixes iteration */
+static void test_btrie_counts(struct btrie *root, const void *str, uint8_t bitlen)
+{
+	pkey_t key[STR_LEN / sizeof(pkey_t) + 1], key2[STR_LEN / sizeof(pkey_t) + 1];
+	uint32_t count[COUNT_LEN + 1], count2[COUNT_LEN + 1];
+	uint32_t nth, nth2, total;
+	plen_t len, len2, contain, min_len, max_len, target_len, l;
+	int ret, ret2;
+
+	for(contain = 0; contain <= bitlen; contain += 11) {
+		if(contain > COUNT_LEN)
+			break;
+
+		btrie_available_count(root, str, contain, count, COUNT_LEN);
+		test_count_by_len(root, str, contain, key, count2, COUNT_LEN);
+		if(memcmp(count, count2, sizeof(count))) {
+			sput_fail_if(1, "Invalid available count");
+			continue;
+		}
+
+		min_len = contain + rand() % (COUNT_LEN - contain + 1);
+		max_len = min_len + rand() % (COUNT_LEN - min_len + 1);
+		target_len = max_len + rand() % (COUNT_LEN - max_len + 1);
+		for(total = 0, l = min_len; l <= max_len; l++)
+			total += (target_len - l >= 16)?count[l] << 16:count[l] << (target_len - l);
+
+		nth = nth2 = total?(rand() % (total + 1)):0;
+		ret = btrie_available_nth(root, key, &len, str, contain, min_len, max_len, target_len, &nth);
+		ret2 = test_available_nth(root, key2, &len2, str, contain, min_len, max_len, target_len, &nth2);
+		if(ret != ret2 || nth != nth2 || (!ret && (len != len2 || !test_key_equal(key, key2, len))))
+			sput_fail_if(1, "Invalid nth available prefix");
+	}
+}
+
 void test_btrie_stress_push(struct btrie *root, void *str, void *check, uint8_t diversity, int id)
 {
 	struct btrie_entry *entry;
@@ -339,6 +413,9 @@ void test_btrie_stress_push(struct btrie *root, void *str, void *check, uint8_t
 			sput_fail_if(1, "Invalid space count 2");
 		}
 
+		if(root->counted)
+			test_btrie_counts(root, str, bitlen);
+
 		//Malloc fails
 		malloc_fails = 1;
 		malloc_called = 0;
@@ -401,7 +478,7 @@ void test_btrie_stress_pull(struct btrie *root, void *str, uint8_t diversity, in
 	sput_fail_if(1, "Element not found");
 }
 
-void test_btrie_stress()
+static void test_btrie_stress_root(int counted)
 {
 	struct btrie t;
 	int push = 0;
@@ -412,7 +489,10 @@ void test_btrie_stress()
 	void *check = calloc(1, STR_LEN);
 	srand(0);
 
-	btrie_init(&t);
+	if(counted)
+		btrie_init_counted(&t);
+	else
+		btrie_init(&t);
 
 	int i;
 	for(i = 0; i < TRIE_SIZE; i++) {
@@ -437,6 +517,16 @@ void test_btrie_stress()
 	sput_fail_if(t.child[1], "Only root");
 }
 
+void test_btrie_stress()
+{
+	test_btrie_stress_root(0);
+}
+
+void test_btrie_stress_counted()
+{
+	test_btrie_stress_root(1);
+}
+
 #ifdef BTRIE_KEY_NETWORK_BYTE_ORDER
 
 #include "prefixes_library.h"
@@ -699,6 +789,70 @@ static void test_btrie_prefix()
 #endif
 
 #define BTRIE_AVAIL_ITER 100
+#define BTRIE_COUNTED_SIZE 300
+#define BTRIE_COUNTED_ROUNDS 3000
+
+static void test_btrie_counted_key(pkey_t *key, plen_t *len)
+{
+	uint8_t *k = (uint8_t *)key;
+	int i;
+	memset(k, 0, 16);
+	k[0] = 0x20;
+	k[1] = 0x01;
+	for(i = 2; i < 16; i++)
+		k[i] = (rand() % 4)?0:rand();
+	*len = 16 + rand() % 113;
+}
+
+/* When late, counting is only enabled half way through */
+static void test_btrie_available_counted_root(int late)
+{
+	struct btrie t;
+	struct btrie_element e[BTRIE_COUNTED_SIZE];
+	uint8_t used[BTRIE_COUNTED_SIZE] = {0};
+	pkey_t key[4];
+	plen_t len;
+	int i, id;
+
+	srand(1);
+	if(late)
+		btrie_init(&t);
+	else
+		btrie_init_counted(&t);
+	for(i = 0; i < BTRIE_COUNTED_ROUNDS; i++) {
+		if(late && i == BTRIE_COUNTED_ROUNDS / 2)
+			sput_fail_if(btrie_count_enable(&t), "Enable counting");
+
+		id = rand() % BTRIE_COUNTED_SIZE;
+		test_btrie_counted_key(key, &len);
+		if(used[id]) {
+			btrie_remove(&e[id]);
+			used[id] = 0;
+		} else if(btrie_add(&t, &e[id], key, len)) {
+			sput_fail_if(1, "Can't add element");
+		} else {
+			used[id] = 1;
+		}
+
+		if(!(i % 10) && t.counted) {
+			test_btrie_counted_key(key, &len);
+			test_btrie_counts(&t, key, len);
+		}
+		if(!(i % 200))
+			btrie_check(&t);
+	}
+
+	for(id = 0; id < BTRIE_COUNTED_SIZE; id++)
+		if(used[id])
+			btrie_remove(&e[id]);
+	sput_fail_if(t.child[0] || t.child[1], "Only root");
+}
+
+static void test_btrie_available_counted()
+{
+	test_btrie_available_counted_root(0);
+	test_btrie_available_counted_root(1);
+}
 
 static void test_btrie_available()
 {
@@ -765,16 +919,65 @@ void test_btrie_available_prefix()
 }
 #endif
 
+#define BTRIE_PICK_SIZE 400
+#define BTRIE_PICK_ROUNDS 50
+
+/* Picks available /64s in a /48 containing BTRIE_PICK_SIZE /64s */
+static void test_btrie_available_pick_root(int counted)
+{
+	struct btrie t;
+	struct btrie_element *e = calloc(BTRIE_PICK_SIZE, sizeof(*e));
+	uint32_t count[COUNT_LEN + 1], n, total = 0, found = 0;
+	pkey_t key[4] = {htonk(0x20010db8), 0, 0, 0}, iter[4];
+	plen_t len;
+	int i, l;
+
+	if(counted)
+		btrie_init_counted(&t);
+	else
+		btrie_init(&t);
+
+	srand(2);
+	for(i = 0; i < BTRIE_PICK_SIZE; i++) {
+		key[1] = htonk(rand() & 0xffff);
+		btrie_add(&t, &e[i], key, 64);
+	}
+
+	key[1] = 0;
+	for(i = 0; i < BTRIE_PICK_ROUNDS; i++) {
+		btrie_available_count(&t, key, 48, count, COUNT_LEN);
+		for(total = 0, l = 48; l <= 64; l++)
+			total += count[l] << (64 - l);
+		n = rand() % total;
+		if(!btrie_available_nth(&t, iter, &len, key, 48, 48, 64, 64, &n) && n < (1u << (64 - len)))
+			found++;
+	}
+	sput_fail_unless(found == BTRIE_PICK_ROUNDS, "Picked available /64s");
+
+	for(i = 0; i < BTRIE_PICK_SIZE; i++)
+		btrie_remove(&e[i]);
+	free(e);
+}
+
+static void test_btrie_available_pick()
+{
+	test_btrie_available_pick_root(0);
+	test_btrie_available_pick_root(1);
+}
+
 int main( __unused int argc,  __unused char **argv)
 {
   sput_start_testing();
   sput_enter_suite("Test btrie"); /* optional */
   sput_run_test(test_btrie);
   sput_run_test(test_btrie_stress);
+  sput_run_test(test_btrie_stress_counted);
 #ifdef BTRIE_KEY_NETWORK_BYTE_ORDER
   sput_run_test(test_btrie_prefix);
 #endif
   sput_run_test(test_btrie_available);
+  sput_run_test(test_btrie_available_counted);
+  sput_run_test(test_btrie_available_pick);
 #ifdef BTRIE_KEY_NETWORK_BYTE_ORDER
   sput_run_test(test_btrie_available_prefix);
 #endif
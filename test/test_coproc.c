@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2015 Cisco Systems, Inc.
+ */
+
+#include "coproc.c"
+#include "exeq.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "sput.h"
+
+int log_level = 5;
+void (*hnetd_log)(int priority, const char *format, ...) = syslog;
+
+static char dir[] = "/tmp/test_coproc.XXXXXX";
+static char script[64], out[64], binary[] = "/bin/true";
+
+static struct uloop_timeout end;
+static int results[8], results_cnt, results_wanted;
+
+static void test_end(__unused struct uloop_timeout *t)
+{
+	uloop_end();
+}
+
+static void test_cb(__unused struct coproc_cmd *cmd, int status)
+{
+	results[results_cnt++] = status;
+	if(results_cnt == results_wanted)
+		uloop_end();
+}
+
+static struct uloop_timeout poll_timeout;
+static struct exeq *wait_exeq;
+static unsigned int wait_executed;
+
+static void test_poll(struct uloop_timeout *t)
+{
+	if(wait_exeq->stats.executed >= wait_executed)
+		uloop_end();
+	else
+		uloop_timeout_set(t, 5);
+}
+
+/* Runs the loop until the queue executed n tasks, or ms milliseconds */
+static void test_wait_exeq(struct exeq *e, unsigned int n, int ms)
+{
+	wait_exeq = e;
+	wait_executed = n;
+	end.cb = test_end;
+	poll_timeout.cb = test_poll;
+	uloop_timeout_set(&end, ms);
+	uloop_timeout_set(&poll_timeout, 5);
+	uloop_run();
+	uloop_timeout_cancel(&end);
+	uloop_timeout_cancel(&poll_timeout);
+}
+
+/* Runs the loop until n callbacks were called, or 5 seconds */
+static void test_wait(int n)
+{
+	results_wanted = n;
+	end.cb = test_end;
+	uloop_timeout_set(&end, 5000);
+	if(results_cnt < n)
+		uloop_run();
+	uloop_timeout_cancel(&end);
+}
+
+static void test_write(const char *path, const char *content)
+{
+	FILE *f = fopen(path, "w");
+	fputs(content, f);
+	fclose(f);
+	chmod(path, 0755);
+}
+
+static char *test_read(void)
+{
+	static char buf[512];
+	FILE *f = fopen(out, "r");
+	size_t len = f ? fread(buf, 1, sizeof(buf) - 1, f) : 0;
+	if(f)
+		fclose(f);
+	buf[len] = 0;
+	unlink(out);
+	return buf;
+}
+
+static void test_coproc_disabled(void)
+{
+	char *args[] = {script, "a", NULL};
+	sput_fail_unless(coproc_run(NULL, args, NULL) == -1, "Disabled");
+	sput_fail_unless(list_empty(&coprocs), "No helper");
+}
+
+static void test_coproc_run(void)
+{
+	struct coproc_cmd cmds[3] = {{ .cb = test_cb }, { .cb = test_cb }, { .cb = test_cb }};
+	char *args1[] = {script, "print", " spaced  arg ", "", "*", NULL};
+	char *args2[] = {script, "print", "env", NULL};
+	char *env2[] = {"COPROC_TEST=a b", NULL};
+	char *args3[] = {script, "exit", "3", NULL};
+	char *args4[] = {script, "new\nline", NULL};
+	char *args5[] = {binary, NULL};
+
+	coproc_init();
+	results_cnt = 0;
+	sput_fail_unless(!coproc_run(&cmds[0], args1, NULL), "Run");
+	sput_fail_unless(!coproc_run(&cmds[1], args2, env2), "Run with env");
+	sput_fail_unless(!coproc_run(&cmds[2], args3, NULL), "Run failing");
+	sput_fail_unless(coproc_run(NULL, args4, NULL) == -1, "Newline refused");
+	sput_fail_unless(coproc_run(NULL, args5, NULL) == -1, "Binary refused");
+	sput_fail_unless(cmds[0].req && cmds[1].req && cmds[2].req, "Pending");
+
+	test_wait(3);
+	sput_fail_unless(results_cnt == 3, "Completed");
+	sput_fail_unless(!results[0] && !results[1] && results[2] == 3, "Statuses");
+	sput_fail_unless(!cmds[0].req && !cmds[1].req && !cmds[2].req, "Not pending");
+	sput_fail_unless(!strcmp(test_read(),
+			"test.sh|3| spaced  arg ||*|\n"
+			"test.sh|1|env|a b\n"), "Arguments, $0 and environment");
+
+	/* Single helper per script, not started for binaries */
+	struct coproc *c = coproc_find(script);
+	sput_fail_unless(c && c->pid && list_empty(&c->reqs) && !c->len, "Helper");
+	c = coproc_find(binary);
+	sput_fail_unless(c && !c->pid, "No helper for binaries");
+}
+
+static void test_coproc_call(void)
+{
+	struct coproc_cmd cmd = { .cb = test_cb };
+	char *args1[] = {script, "print", "async", NULL};
+	char *args2[] = {script, "exit", "7", NULL};
+	char *args3[] = {binary, NULL};
+	int status = 0;
+
+	results_cnt = 0;
+	sput_fail_unless(!coproc_run(&cmd, args1, NULL), "Run");
+	sput_fail_unless(!coproc_call(args2, &status), "Call");
+	sput_fail_unless(status == 7, "Call status");
+	sput_fail_unless(results_cnt == 1 && !results[0], "Previous command completed");
+	sput_fail_unless(!strcmp(test_read(), "test.sh|1|async|\n"), "Previous command run");
+	sput_fail_unless(coproc_call(args3, &status) == -1, "Binary refused");
+}
+
+static void test_coproc_cancel(void)
+{
+	struct coproc_cmd cmds[2] = {{ .cb = test_cb }, { .cb = test_cb }};
+	char *args[] = {script, "print", "cancel", NULL};
+
+	results_cnt = 0;
+	sput_fail_unless(!coproc_run(&cmds[0], args, NULL), "Run");
+	sput_fail_unless(!coproc_run(&cmds[1], args, NULL), "Run");
+	coproc_cancel(&cmds[0]);
+	sput_fail_unless(!cmds[0].req, "Cancelled");
+	test_wait(1);
+	sput_fail_unless(results_cnt == 1 && !cmds[1].req, "Only one callback");
+	sput_fail_unless(!strcmp(test_read(), "test.sh|1|cancel|\ntest.sh|1|cancel|\n"),
+			"Both commands run");
+}
+
+static void test_coproc_death(void)
+{
+	struct coproc_cmd cmds[2] = {{ .cb = test_cb }, { .cb = test_cb }};
+	char *args1[] = {script, "sleep", NULL};
+	char *args2[] = {script, "print", "restarted", NULL};
+	struct coproc *c;
+	pid_t pid;
+
+	results_cnt = 0;
+	sput_fail_unless(!coproc_run(&cmds[0], args1, NULL), "Run");
+	sput_fail_unless(!coproc_run(&cmds[1], args1, NULL), "Run");
+	c = coproc_find(script);
+	pid = c->pid;
+	coproc_flush(NULL);
+	kill(pid, SIGKILL);
+	test_wait(2);
+	sput_fail_unless(results_cnt == 2 && results[0] == -1 && results[1] == -1,
+			"Commands failed");
+	sput_fail_unless(!coproc_find(script), "Helper removed");
+
+	results_cnt = 0;
+	sput_fail_unless(!coproc_run(&cmds[0], args2, NULL), "Run");
+	test_wait(1);
+	sput_fail_unless(results_cnt == 1 && !results[0], "Restarted");
+	sput_fail_unless(coproc_find(script)->pid != pid, "New helper");
+	sput_fail_unless(!strcmp(test_read(), "test.sh|1|restarted|\n"), "Run by new helper");
+}
+
+static void test_coproc_exeq(void)
+{
+	char *args1[] = {script, "print", "exeq", NULL};
+	char *args2[] = {script, "exit", "1", NULL};
+	char *env1[] = {"COPROC_TEST=exeq", NULL};
+	struct exeq e;
+
+	exeq_init(&e);
+	exeq_add_key(&e, args1, env1, NULL);
+	exeq_add(&e, args2);
+	sput_fail_unless(e.cmd.req && !e.process.pending, "Run by co-process");
+
+	test_wait_exeq(&e, 2, 5000);
+	sput_fail_unless(e.stats.executed == 2 && e.stats.failed == 1, "Executed");
+	sput_fail_unless(!strcmp(test_read(), "test.sh|1|exeq|exeq\n"), "Run in order");
+	exeq_term(&e);
+}
+
+static void test_coproc_shebang(void)
+{
+	char path[64];
+	char *args[] = {path, NULL};
+	struct exeq e;
+
+	snprintf(path, sizeof(path), "%s/shebang.sh", dir);
+	test_write(path, "#! /bin/sh \t\r\necho\n");
+	sput_fail_unless(coproc_is_sh(path), "Plain shell");
+	test_write(path, "#!/bin/sh -x\necho\n");
+	sput_fail_unless(!coproc_is_sh(path), "Shell with arguments");
+	test_write(path, "#!/bin/shell\necho\n");
+	sput_fail_unless(!coproc_is_sh(path), "Other interpreter");
+	test_write(path, "#!/bin/sh");
+	sput_fail_unless(!coproc_is_sh(path), "No newline");
+
+	/* -e is honoured, as the script is executed instead of sourced */
+	test_write(path, "#!/bin/sh -e\nfalse\necho ran >> ${0%/*}/out\n");
+	exeq_init(&e);
+	exeq_add(&e, args);
+	sput_fail_unless(!e.cmd.req && e.process.pending, "Run by fork and exec");
+	test_wait_exeq(&e, 1, 5000);
+	sput_fail_unless(e.stats.executed == 1 && e.stats.failed == 1, "Failed");
+	sput_fail_unless(!strcmp(test_read(), ""), "Stopped at the failing command");
+	exeq_term(&e);
+	unlink(path);
+}
+
+#define COPROC_BATCH_OPS 10
+
+static void test_coproc_batch(void)
+{
+	char arg[COPROC_BATCH_OPS][4], expect[512] = "";
+	char *args[] = {script, "print", "batch", NULL, NULL};
+	struct coproc_cmd cmd = { .cb = test_cb };
+
+	/* All commands are written at once, and run in order */
+	results_cnt = 0;
+	for(int i = 0; i < COPROC_BATCH_OPS; i++) {
+		snprintf(arg[i], sizeof(arg[i]), "%d", i);
+		args[3] = arg[i];
+		sput_fail_unless(!coproc_run(i == COPROC_BATCH_OPS - 1 ? &cmd : NULL, args, NULL), "Queued");
+		snprintf(expect + strlen(expect), sizeof(expect) - strlen(expect), "test.sh|2|batch|%d|\n", i);
+	}
+	test_wait(1);
+	sput_fail_unless(results_cnt == 1 && !results[0], "Executed");
+	sput_fail_unless(!strcmp(test_read(), expect), "Run in order");
+	coproc_term();
+}
+
+int main(void)
+{
+	openlog("hnetd_test_coproc", LOG_PERROR | LOG_PID, LOG_DAEMON);
+	uloop_init();
+	if(!mkdtemp(dir))
+		return 1;
+	snprintf(script, sizeof(script), "%s/test.sh", dir);
+	snprintf(out, sizeof(out), "%s/out", dir);
+	test_write(script,
+			"#!/bin/sh\n"
+			"cmd=$1\n"
+			"shift\n"
+			"case \"$cmd\" in\n"
+			"print) echo \"${0##*/}|$#|$(printf '%s|' \"$@\")$COPROC_TEST\" >> ${0%/*}/out;;\n"
+			"exit) exit $1;;\n"
+			"sleep) sleep 2;;\n"
+			"esac\n");
+
+	sput_start_testing();
+	sput_enter_suite("Test coproc"); /* optional */
+	sput_run_test(test_coproc_disabled);
+	sput_run_test(test_coproc_run);
+	sput_run_test(test_coproc_call);
+	sput_run_test(test_coproc_cancel);
+	sput_run_test(test_coproc_death);
+	sput_run_test(test_coproc_exeq);
+	sput_run_test(test_coproc_shebang);
+	sput_run_test(test_coproc_batch);
+	sput_leave_suite(); /* optional */
+	sput_finish_testing();
+
+	unlink(script);
+	unlink(out);
+	rmdir(dir);
+	return sput_get_return_value();
+}
@@ -334,6 +334,278 @@ static void dtls_unknown_2()
   _test_unknown_i(1);
 }
 
+static void dtls_resume()
+{
+  struct sockaddr_in6 dst = {.sin6_family = AF_INET6
+#ifdef __APPLE__
+                             , .sin6_len = sizeof(struct sockaddr_in6)
+#endif /* __APPLE__ */
+  };
+  struct sockaddr_in6 src = dst;
+  dtls_stats_s st1, st2;
+  char *msg = "foo";
+  int i, rv;
+
+  d1 = dtls_create(49020);
+  dtls_set_readable_cb(d1, _readable_cb, NULL);
+  d2 = dtls_create(49021);
+  dtls_set_readable_cb(d2, _readable_cb, NULL);
+  sput_fail_unless(dtls_set_psk(d1, "foo", 3), "dtls_set_psk");
+  sput_fail_unless(dtls_set_psk(d2, "foo", 3), "dtls_set_psk");
+  dtls_start(d1);
+  dtls_start(d2);
+  (void)inet_pton(AF_INET6, "::1", &src.sin6_addr);
+  (void)inet_pton(AF_INET6, "::1", &dst.sin6_addr);
+  src.sin6_port = htons(49020);
+  dst.sin6_port = htons(49021);
+
+  /* Connect, shut down, and connect again; the second time around,
+   * the cached session should be resumed. */
+  for (i = 0 ; i < 2 ; i++)
+    {
+      struct uloop_timeout t = { .cb = _timeout };
+      struct uloop_timeout t2 = { .cb = _no_connections_timeout };
+
+      smock_push_int("dtls_recv", 3);
+      smock_push("dtls_recv_src_in6", &src.sin6_addr);
+      smock_push("dtls_recv_buf", msg);
+      rv = dtls_send(d1, NULL, &dst, msg, strlen(msg));
+      sput_fail_unless(rv == 3, "sendto failed?");
+      pending_readable = 1;
+      uloop_timeout_set(&t, SINGLE_TEST_ERROR_TIMEOUT);
+      uloop_run();
+      sput_fail_unless(!pending_readable, "readable left");
+
+      dtls_connection dc = _connection_find(d1, -1, &dst);
+      sput_fail_unless(dc, "no connection at src");
+      if (dc)
+        _connection_shutdown(dc);
+      uloop_timeout_set(&t2, 5);
+      uloop_run();
+      uloop_timeout_cancel(&t);
+      uloop_timeout_cancel(&t2);
+    }
+
+  dtls_get_stats(d1, &st1);
+  dtls_get_stats(d2, &st2);
+  L_DEBUG("client %d full/%d resumed, server %d full/%d resumed",
+          st1.num_full_handshakes, st1.num_resumed_handshakes,
+          st2.num_full_handshakes, st2.num_resumed_handshakes);
+  sput_fail_unless(st1.num_full_handshakes == 1
+                   && st1.num_resumed_handshakes == 1, "client resumed");
+  sput_fail_unless(st2.num_full_handshakes == 1
+                   && st2.num_resumed_handshakes == 1, "server resumed");
+  sput_fail_unless(d1->num_sessions == 1, "one cached session");
+  dtls_destroy(d1);
+  dtls_destroy(d2);
+}
+
+/* Per-instance trust verdict; context points to it */
+typedef struct {
+  bool trusted;
+  int calls;
+} verdict_s, *verdict;
+
+bool _verdict_cb(dtls d, dtls_cert cert, void *context)
+{
+  verdict v = context;
+
+  v->calls++;
+  return v->trusted;
+}
+
+static void _round_timeout(struct uloop_timeout *t)
+{
+  uloop_timeout_set(t, 5);
+  if (d2->readable
+      || !(d1->num_data_connections || d1->num_non_data_connections
+           || d2->num_data_connections || d2->num_non_data_connections))
+    uloop_end();
+}
+
+/* Sends a message from d1 to d2, and runs until it is readable or all
+ * connections are gone; returns whether the message got through. All
+ * connections are gone on return. */
+static bool _resume_round(struct sockaddr_in6 *dst)
+{
+  struct uloop_timeout t = { .cb = _timeout };
+  struct uloop_timeout t2 = { .cb = _round_timeout };
+  struct sockaddr_in6 *rsrc, *rdst;
+  char buf[16], *msg = "foo";
+  dtls_connection dc;
+  bool delivered = false;
+  int rv;
+
+  rv = dtls_send(d1, NULL, dst, msg, strlen(msg));
+  sput_fail_unless(rv == 3, "sendto failed?");
+  uloop_timeout_set(&t, SINGLE_TEST_ERROR_TIMEOUT);
+  uloop_timeout_set(&t2, 5);
+  uloop_run();
+  uloop_timeout_cancel(&t2);
+  if (d2->readable)
+    {
+      delivered = dtls_recv(d2, &rsrc, &rdst, buf, sizeof(buf)) == 3;
+      if ((dc = _connection_find(d1, -1, dst)))
+        _connection_shutdown(dc);
+      t2.cb = _no_connections_timeout;
+      uloop_timeout_set(&t2, 5);
+      uloop_run();
+      uloop_timeout_cancel(&t2);
+    }
+  uloop_timeout_cancel(&t);
+  return delivered;
+}
+
+static void dtls_resume_distrust()
+{
+  struct sockaddr_in6 dst = {.sin6_family = AF_INET6
+#ifdef __APPLE__
+                             , .sin6_len = sizeof(struct sockaddr_in6)
+#endif /* __APPLE__ */
+  };
+  struct sockaddr_in6 src = dst;
+  verdict_s v1 = { .trusted = true }, v2 = { .trusted = true };
+  dtls_stats_s st1, st2;
+
+  d1 = dtls_create(49030);
+  dtls_set_unknown_cert_cb(d1, _verdict_cb, &v1);
+  d2 = dtls_create(49031);
+  dtls_set_unknown_cert_cb(d2, _verdict_cb, &v2);
+  sput_fail_unless(dtls_set_local_cert(d1, "test/cert1.pem", "test/key1.pem"),
+                   "dtls_set_local_cert 1");
+  sput_fail_unless(dtls_set_local_cert(d2, "test/cert2.pem", "test/key2.pem"),
+                   "dtls_set_local_cert 2");
+  dtls_start(d1);
+  dtls_start(d2);
+  (void)inet_pton(AF_INET6, "::1", &src.sin6_addr);
+  (void)inet_pton(AF_INET6, "::1", &dst.sin6_addr);
+  src.sin6_port = htons(49030);
+  dst.sin6_port = htons(49031);
+
+  /* Full handshake while the peers trust each other. */
+  sput_fail_unless(_resume_round(&dst), "delivered when trusted");
+  sput_fail_unless(d1->num_sessions == 1, "client session cached");
+
+  /* Server no longer trusts the client: the client resumes, but the
+   * server rejects it. */
+  v2.trusted = false;
+  v2.calls = 0;
+  sput_fail_unless(!_resume_round(&dst), "server distrust");
+  sput_fail_unless(v2.calls, "server checked trust");
+  dtls_get_stats(d1, &st1);
+  sput_fail_unless(st1.num_resumed_handshakes == 1, "client resumed");
+  dtls_get_stats(d2, &st2);
+  sput_fail_unless(st2.num_full_handshakes == 1
+                   && !st2.num_resumed_handshakes, "server not resumed");
+
+  /* Trusted again; a full handshake caches a new session. */
+  v2.trusted = true;
+  sput_fail_unless(_resume_round(&dst), "delivered when trusted");
+  sput_fail_unless(d1->num_sessions == 1, "client session cached");
+
+  /* Client no longer trusts the server: no data connection is made,
+   * and the session is forgotten. */
+  v1.trusted = false;
+  v1.calls = 0;
+  dtls_get_stats(d1, &st1);
+  sput_fail_unless(!_resume_round(&dst), "client distrust");
+  sput_fail_unless(v1.calls, "client checked trust");
+  dtls_get_stats(d1, &st2);
+  sput_fail_unless(st2.num_full_handshakes == st1.num_full_handshakes
+                   && st2.num_resumed_handshakes == st1.num_resumed_handshakes,
+                   "client not connected");
+  sput_fail_unless(d1->num_sessions == 0, "client session forgotten");
+
+  dtls_destroy(d1);
+  dtls_destroy(d2);
+}
+
+static void dtls_input_limits()
+{
+  dtls_limits_s limits = { .input_handshake_pps_per_source = 5,
+                           .input_data_pps_per_source = 10,
+                           .num_input_sources = 4 };
+  struct sockaddr_in6 sa[5];
+  dtls_stats_s st;
+  int i, j, c;
+
+  d1 = dtls_create(49030);
+  dtls_set_limits(d1, &limits);
+  memset(sa, 0, sizeof(sa));
+  for (i = 0 ; i < 5 ; i++)
+    {
+      sa[i].sin6_family = AF_INET6;
+      (void)inet_pton(AF_INET6, "fe80::1", &sa[i].sin6_addr);
+      sa[i].sin6_addr.s6_addr[15] += i;
+      sa[i].sin6_port = htons(1024 + i);
+    }
+
+  /* Handshake and data budgets are separate. */
+  for (c = 0, j = 0 ; j < 10 ; j++)
+    c += _source_admit(d1, &sa[0], false);
+  sput_fail_unless(c == 5, "handshake budget");
+  for (c = 0, j = 0 ; j < 20 ; j++)
+    c += _source_admit(d1, &sa[0], true);
+  sput_fail_unless(c == 10, "data budget");
+
+  /* Other sources are not affected (nor are other ports). */
+  sa[0].sin6_port = htons(2000);
+  sput_fail_unless(!_source_admit(d1, &sa[0], false), "same source");
+  for (i = 1 ; i < 4 ; i++)
+    sput_fail_unless(_source_admit(d1, &sa[i], false), "other source");
+
+  /* The least recently heard from source is forgotten first. */
+  sput_fail_unless(_source_admit(d1, &sa[4], false), "fifth source");
+  sput_fail_unless(_source_admit(d1, &sa[0], false), "first forgotten");
+
+  dtls_get_stats(d1, &st);
+  sput_fail_unless(st.num_dropped_handshake == 6, "handshake drops");
+  sput_fail_unless(st.num_dropped_data == 10, "data drops");
+  dtls_destroy(d1);
+}
+
+static void dtls_connection_table()
+{
+  dtls_limits_s limits = { .num_non_data_connections = 1000 };
+  struct sockaddr_in6 sa = {.sin6_family = AF_INET6
+#ifdef __APPLE__
+                            , .sin6_len = sizeof(struct sockaddr_in6)
+#endif /* __APPLE__ */
+  };
+  dtls_connection dcs[500];
+  int i, found = 0;
+
+  d1 = dtls_create(49010);
+  dtls_set_limits(d1, &limits);
+  (void)inet_pton(AF_INET6, "fe80::1", &sa.sin6_addr);
+  for (i = 0 ; i < 500 ; i++)
+    {
+      sa.sin6_port = htons(1024 + i);
+      sa.sin6_scope_id = i % 3;
+      dcs[i] = _connection_create(d1, false, &sa);
+      sput_fail_unless(dcs[i], "_connection_create");
+    }
+  for (i = 0 ; i < 500 ; i++)
+    {
+      sa.sin6_port = htons(1024 + i);
+      sa.sin6_scope_id = i % 3;
+      if (_connection_find(d1, false, &sa) == dcs[i])
+        found++;
+    }
+  sput_fail_unless(found == 500, "all connections found");
+  sput_fail_unless(!_connection_find(d1, true, &sa), "client not found");
+  sa.sin6_scope_id = 3;
+  sput_fail_unless(!_connection_find(d1, -1, &sa), "other not found");
+
+  /* Nothing has been received, so nothing is read either. */
+  sput_fail_unless(list_empty(&d1->readable_connections), "none readable");
+  _connection_free(dcs[42]);
+  sa.sin6_port = htons(1024 + 42);
+  sa.sin6_scope_id = 42 % 3;
+  sput_fail_unless(!_connection_find(d1, -1, &sa), "freed not found");
+  dtls_destroy(d1);
+}
+
 
 int main(int argc, char **argv)
 {
@@ -352,6 +624,10 @@ int main(int argc, char **argv)
   sput_maybe_run_test(dtls_basic_cc_psk, do {} while(0));
   sput_maybe_run_test(dtls_unknown_1, do {} while(0));
   sput_maybe_run_test(dtls_unknown_2, do {} while(0));
+  sput_maybe_run_test(dtls_resume, do {} while(0));
+  sput_maybe_run_test(dtls_resume_distrust, do {} while(0));
+  sput_maybe_run_test(dtls_input_limits, do {} while(0));
+  sput_maybe_run_test(dtls_connection_table, do {} while(0));
   sput_leave_suite(); /* optional */
   sput_finish_testing();
   return sput_get_return_value();
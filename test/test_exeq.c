@@ -14,7 +14,25 @@ void (*hnetd_log)(int priority, const char *format, ...) = syslog;
 
 void _end_to(__unused struct uloop_timeout *t)
 {
-	exit(0);
+	/* Replaced and cancelled tasks are not executed, and the
+	 * environment is given to the process (test exits with 0) */
+	exit(exeq[0].stats.executed != 5 || exeq[0].stats.coalesced != 2 ||
+			exeq[0].stats.failed || exeq[0].stats.queued ||
+			exeq[0].stats.max_queued != 2 || exeq[1].stats.executed != 3);
+}
+
+void _t3(__unused struct uloop_timeout *t)
+{
+	char *argv7[] = { "/bin/sh", "-c", "test \"$EXEQ_ENV\" = 7", NULL };
+	char *env7[] = { "EXEQ_ENV=7", NULL };
+	exeq_add_key(&exeq[0], argv7, env7, NULL);
+	char *argv8[] = { "/bin/echo", "8", NULL };
+	exeq_add_key(&exeq[0], argv8, NULL, "k");
+	char *argv9[] = { "/bin/echo", "9", NULL };
+	exeq_add_key(&exeq[0], argv9, NULL, "k");
+	char *argv10[] = { "/bin/echo", "10", NULL };
+	exeq_add_key(&exeq[0], argv10, NULL, "c");
+	exeq_cancel(&exeq[0], "c");
 }
 
 void _t2(__unused struct uloop_timeout *t)
@@ -25,6 +43,8 @@ void _t2(__unused struct uloop_timeout *t)
 	exeq_add(&exeq[1], argv5);
 	char *argv6[] = { "/bin/echo", "6", NULL };
 	exeq_add(&exeq[0], argv6);
+	to.cb = _t3;
+	uloop_timeout_set(&to, 200);
 }
 
 void _t1(__unused struct uloop_timeout *t)
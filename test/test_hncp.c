@@ -13,6 +13,7 @@
 
 #include "hncp_i.h"
 #include "hncp_proto.h"
+#include "hncp_md5.h"
 #include "sput.h"
 #include "smock.h"
 #include "platform.h"
@@ -206,6 +207,810 @@ void hncp_int(void)
   hncp_uninit(&s);
 }
 
+static void _reference_network_hash(dncp o, dncp_hash h)
+{
+  int onelen = 4 + DNCP_HASH_LEN(o);
+  int cnt = 0;
+  dncp_node n;
+
+  dncp_for_each_node(o, n)
+    cnt++;
+  unsigned char *buf = malloc(cnt * onelen), *dst = buf;
+  dncp_for_each_node(o, n)
+    {
+      struct tlv_attr *a = n->tlv_container;
+      uint32_t un = cpu_to_be32(n->update_number);
+      dncp_hash_s nh;
+
+      memcpy(dst, &un, 4);
+      o->ext->cb.hash(tlv_data(a), a ? tlv_len(a) : 0, &nh);
+      memcpy(dst + 4, &nh, DNCP_HASH_LEN(o));
+      dst += onelen;
+    }
+  o->ext->cb.hash(buf, cnt * onelen, h);
+  free(buf);
+}
+
+static void _network_hash_nodes(int num_nodes, int num_updates)
+{
+  hncp_s s;
+  dncp o;
+  dncp_node n;
+  dncp_hash_s h;
+  uint32_t i;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+
+  /* Pretend that we have num_nodes reachable nodes, each with a bit
+   * of unique node data. */
+  for (i = 1 ; i < (uint32_t)num_nodes ; i++)
+    {
+      dncp_node_id_s ni;
+      struct tlv_buf tb;
+
+      memset(&ni, 0, sizeof(ni));
+      memcpy(&ni, &i, sizeof(i));
+      n = dncp_find_node_by_node_id(o, &ni, true);
+      n->reachable = true;
+      memset(&tb, 0, sizeof(tb));
+      tlv_buf_init(&tb, 0);
+      tlv_put(&tb, 123, &i, sizeof(i));
+      struct tlv_attr *a = dncp_node_data_alloc(o, tlv_pad_len(tb.head));
+      memcpy(a, tb.head, tlv_pad_len(tb.head));
+      tlv_buf_free(&tb);
+      dncp_node_set(n, 1, hnetd_time(), a);
+    }
+  o->network_hash_records_dirty = true;
+  dncp_calculate_network_hash(o);
+  _reference_network_hash(o, &h);
+  sput_fail_unless(memcmp(&h, &o->network_hash, DNCP_HASH_LEN(o)) == 0,
+                   "initial network hash ok");
+
+  /* Bump update numbers one node at a time. */
+  for (i = 0 ; i < (uint32_t)num_updates ; i++)
+    {
+      int skip = random() % num_nodes;
+
+      n = dncp_get_first_node(o);
+      while (skip--)
+        n = dncp_node_get_next(n);
+      dncp_node_set(n, n->update_number + 1, 0, NULL);
+      dncp_calculate_network_hash(o);
+    }
+
+  _reference_network_hash(o, &h);
+  sput_fail_unless(memcmp(&h, &o->network_hash, DNCP_HASH_LEN(o)) == 0,
+                   "incremental network hash ok");
+
+  hncp_uninit(&s);
+}
+
+void hncp_network_hash(void)
+{
+  _network_hash_nodes(10, 100);
+  _network_hash_nodes(100, 100);
+  _network_hash_nodes(1000, 100);
+}
+
+void hncp_node_data_pool(void)
+{
+  hncp_s s;
+  dncp o;
+  struct tlv_attr *a, *a2, *big;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+
+  a = dncp_node_data_alloc(o, 100);
+  sput_fail_unless(a, "alloc");
+  dncp_node_data_free(o, a);
+  a2 = dncp_node_data_alloc(o, 200);
+  sput_fail_unless(a == a2, "same size class is recycled");
+  a = dncp_node_data_alloc(o, 300);
+  sput_fail_unless(a && a != a2, "different size class is not");
+  dncp_node_data_free(o, a);
+  dncp_node_data_free(o, a2);
+
+  big = dncp_node_data_alloc(o, 1 << 20);
+  sput_fail_unless(big, "alloc outside size classes");
+  memset(big, 0, 1 << 20);
+  dncp_node_data_free(o, big);
+
+  hncp_uninit(&s);
+}
+
+void hncp_tlv_index(void)
+{
+  static const uint16_t types[] = { 1, 8, 8, 8, 32, 36, 36, 63, 64,
+                                    881, 881, 882, 1000 };
+  static const uint16_t missing[] = { 0, 2, 33, 62, 65, 800, 883, 1001 };
+  int ntypes = sizeof(types) / sizeof(types[0]);
+  hncp_s s;
+  dncp o;
+  dncp_node n;
+  dncp_node_id_s ni;
+  struct tlv_buf tb;
+  struct tlv_attr *a, *c;
+  int i, j, bad = 0;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  memset(&ni, 42, sizeof(ni));
+  n = dncp_find_node_by_node_id(o, &ni, true);
+
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  for (i = 0 ; i < ntypes ; i++)
+    tlv_put(&tb, types[i], &i, sizeof(i));
+  c = dncp_node_data_alloc(o, tlv_pad_len(tb.head));
+  memcpy(c, tb.head, tlv_pad_len(tb.head));
+  tlv_buf_free(&tb);
+  dncp_node_set(n, 1, hnetd_time(), c);
+
+  /* Every TLV of a type is found, in order, and nothing else. */
+  for (i = 0 ; i < ntypes ; i = j)
+    {
+      int k = i;
+
+      for (j = i ; j < ntypes && types[j] == types[i] ; j++);
+      dncp_node_for_each_tlv_with_t_v(n, a, types[i], false)
+        {
+          if (tlv_id(a) != types[i] || k >= j || *(int *)tlv_data(a) != k)
+            bad++;
+          k++;
+        }
+      if (k != j)
+        bad++;
+    }
+  sput_fail_unless(!bad, "all types found");
+  for (i = 0 ; i < (int)(sizeof(missing) / sizeof(missing[0])) ; i++)
+    sput_fail_unless(!dncp_node_get_tlv_with_type(n, missing[i], true, false),
+                     "missing type");
+
+  /* Shorter data reuses the index. */
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  tlv_put(&tb, 36, &i, sizeof(i));
+  c = dncp_node_data_alloc(o, tlv_pad_len(tb.head));
+  memcpy(c, tb.head, tlv_pad_len(tb.head));
+  tlv_buf_free(&tb);
+  dncp_node_set(n, 2, hnetd_time(), c);
+  a = dncp_node_get_tlv_with_type(n, 36, true, false);
+  sput_fail_unless(a && tlv_id(a) == 36, "type after change");
+  sput_fail_unless(!dncp_node_get_tlv_with_type(n, 8, true, false),
+                   "old type gone");
+  sput_fail_unless(!dncp_node_get_tlv_with_type(n, 881, true, false),
+                   "old large type gone");
+
+  hncp_uninit(&s);
+}
+
+static const uint16_t _notify_types[] = { 124, 126 };
+static int _notify_batches, _notify_tlvs;
+static dncp_tlv_change_s _notify_last[8];
+static int _notify_last_num;
+
+static void _notify_tlv_cb(dncp_subscriber s, dncp_node n,
+                           struct tlv_attr *tlv, bool add)
+{
+  _notify_tlvs++;
+}
+
+static void _notify_tlvs_cb(dncp_subscriber s, dncp_node n,
+                            dncp_tlv_change changes, int num_changes)
+{
+  _notify_batches++;
+  _notify_last_num = num_changes;
+  if (num_changes <= 8)
+    memcpy(_notify_last, changes, num_changes * sizeof(*changes));
+}
+
+void hncp_tlv_notify(void)
+{
+  hncp h = hncp_create();
+  dncp o = hncp_get_dncp(h);
+  dncp_node n = dncp_get_own_node(o);
+  dncp_subscriber_s s1, s2;
+  int v1 = 1, v2 = 2, v3 = 3;
+  dncp_tlv t;
+
+  memset(&s1, 0, sizeof(s1));
+  s1.tlvs_change_cb = _notify_tlvs_cb;
+  s1.tlv_types = _notify_types;
+  s1.num_tlv_types = 2;
+  memset(&s2, 0, sizeof(s2));
+  s2.tlv_change_cb = _notify_tlv_cb;
+  s2.tlv_types = _notify_types;
+  s2.num_tlv_types = 2;
+  dncp_subscribe(o, &s1);
+  dncp_subscribe(o, &s2);
+  sput_fail_unless(!_notify_batches && !_notify_tlvs, "nothing to replay");
+
+  /* One change-set per node update, filtered by type. */
+  dncp_add_tlv(o, 123, &v1, sizeof(v1), 0);
+  dncp_add_tlv(o, 124, &v1, sizeof(v1), 0);
+  t = dncp_add_tlv(o, 124, &v2, sizeof(v2), 0);
+  dncp_add_tlv(o, 125, &v1, sizeof(v1), 0);
+  dncp_self_flush(n);
+  sput_fail_unless(_notify_batches == 1, "one batch");
+  sput_fail_unless(_notify_last_num == 2, "two filtered changes");
+  sput_fail_unless(_notify_last[0].add && _notify_last[1].add, "adds");
+  sput_fail_unless(tlv_id(_notify_last[0].tlv) == 124
+                   && tlv_id(_notify_last[1].tlv) == 124, "right type");
+  sput_fail_unless(_notify_tlvs == 2, "per-TLV filtered too");
+
+  /* Removals come before additions. */
+  dncp_remove_tlv(o, t);
+  dncp_add_tlv(o, 126, &v3, sizeof(v3), 0);
+  dncp_self_flush(n);
+  sput_fail_unless(_notify_batches == 2, "second batch");
+  sput_fail_unless(_notify_last_num == 2, "remove + add");
+  sput_fail_unless(!_notify_last[0].add
+                   && tlv_id(_notify_last[0].tlv) == 124, "remove first");
+  sput_fail_unless(_notify_last[1].add
+                   && tlv_id(_notify_last[1].tlv) == 126, "add second");
+  sput_fail_unless(_notify_tlvs == 4, "per-TLV count");
+
+  /* Changes of uninteresting types do not wake up the subscriber. */
+  dncp_remove_tlv_matching(o, 125, &v1, sizeof(v1));
+  dncp_self_flush(n);
+  sput_fail_unless(_notify_batches == 2, "no empty batch");
+  sput_fail_unless(_notify_tlvs == 4, "no per-TLV call");
+
+  /* Unsubscription replays the removals as one set. */
+  dncp_unsubscribe(o, &s1);
+  sput_fail_unless(_notify_batches == 3, "unsubscribe batch");
+  sput_fail_unless(_notify_last_num == 2
+                   && !_notify_last[0].add && !_notify_last[1].add,
+                   "unsubscribe removes");
+  dncp_unsubscribe(o, &s2);
+  hncp_destroy(h);
+}
+
+static bool _self_tlvs_ok(dncp o)
+{
+  struct tlv_buf tb;
+  dncp_tlv t;
+  bool ok;
+
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  for (t = dncp_get_first_tlv(o) ; t ; t = dncp_get_next_tlv(o, t))
+    tlv_put_raw(&tb, &t->tlv, tlv_pad_len(&t->tlv));
+  ok = tlv_attr_equal(tb.head, dncp_node_get_tlvs(dncp_get_own_node(o)));
+  tlv_buf_free(&tb);
+  return ok;
+}
+
+void hncp_self_flush(void)
+{
+  hncp h = hncp_create();
+  dncp o = hncp_get_dncp(h);
+  dncp_node n = dncp_get_own_node(o);
+  dncp_tlv tlvs[500];
+  int i, bad = 0, num_updates = 200;
+  uint32_t v[2] = { 0, 0 };
+
+  memset(tlvs, 0, sizeof(tlvs));
+  for (i = 0 ; i < 500 ; i++)
+    {
+      v[0]++;
+      tlvs[i] = dncp_add_tlv(o, 100 + random() % 50, v, 4 + random() % 5, 0);
+    }
+  dncp_self_flush(n);
+  sput_fail_unless(_self_tlvs_ok(o), "initial tlvs ok");
+
+  /* Replace one local TLV at a time. */
+  for (i = 0 ; i < num_updates ; i++)
+    {
+      int j = random() % 500;
+
+      v[0]++;
+      dncp_remove_tlv(o, tlvs[j]);
+      tlvs[j] = dncp_add_tlv(o, 100 + random() % 50, v, 4 + random() % 5, 0);
+      dncp_self_flush(n);
+      if (i % 20 == 0 && !_self_tlvs_ok(o))
+        bad++;
+    }
+  sput_fail_unless(!bad, "incremental tlvs ok");
+
+  /* Re-adding an identical TLV does not republish. */
+  uint32_t un = n->update_number;
+  tlvs[1] = dncp_add_tlv(o, tlv_id(&tlvs[1]->tlv), tlv_data(&tlvs[1]->tlv),
+                         tlv_len(&tlvs[1]->tlv), 0);
+  dncp_self_flush(n);
+  sput_fail_unless(n->update_number == un, "no change");
+
+  for (i = 0 ; i < 500 ; i += 2)
+    dncp_remove_tlv(o, tlvs[i]);
+  dncp_self_flush(n);
+  sput_fail_unless(_self_tlvs_ok(o), "bulk remove ok");
+  hncp_destroy(h);
+}
+
+void hncp_peer_index(void)
+{
+  hncp_s s;
+  dncp o;
+  unsigned char key[DNCP_NI_MAX_LEN + sizeof(dncp_t_peer_s)];
+  dncp_t_peer ne;
+  dncp_peer p;
+  dncp_tlv t;
+  struct sockaddr_in6 sa6;
+  int i, c, nilen, klen;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  nilen = DNCP_NI_LEN(o);
+  klen = nilen + sizeof(*ne);
+  ne = (dncp_t_peer)(key + nilen);
+  sockaddr_in6_set(&sa6, NULL, HNCP_PORT);
+
+  /* Lots of peers, and bunch of other TLVs. */
+  for (i = 0 ; i < 100 ; i++)
+    {
+      memset(key, i, nilen);
+      ne->ep_id = cpu_to_be32(1);
+      ne->peer_ep_id = cpu_to_be32(i);
+      t = dncp_add_tlv(o, DNCP_T_PEER, key, klen, sizeof(dncp_peer_s));
+      sput_fail_unless(t, "dncp_add_tlv peer");
+      sa6.sin6_addr.s6_addr[15] = i;
+      dncp_peer_set_last_sa6(o, dncp_tlv_get_extra(t), &sa6);
+      dncp_add_tlv(o, 123, &i, sizeof(i), 0);
+    }
+  c = 0;
+  dncp_for_each_peer(o, p)
+    c++;
+  sput_fail_unless(c == 100, "100 peers");
+
+  memset(key, 42, nilen);
+  ne->peer_ep_id = cpu_to_be32(42);
+  p = dncp_find_peer(o, key);
+  sput_fail_unless(p, "dncp_find_peer");
+  sput_fail_unless(p && !memcmp(tlv_data(&p->tlv->tlv), key, klen),
+                   "dncp_find_peer key");
+  sa6.sin6_addr.s6_addr[15] = 42;
+  sput_fail_unless(dncp_find_peer_by_sa6(o, &sa6) == p,
+                   "dncp_find_peer_by_sa6");
+
+  /* Address change moves the peer in the address index. */
+  sa6.sin6_addr.s6_addr[15] = 200;
+  dncp_peer_set_last_sa6(o, p, &sa6);
+  sput_fail_unless(dncp_find_peer_by_sa6(o, &sa6) == p,
+                   "dncp_find_peer_by_sa6 after change");
+  sa6.sin6_addr.s6_addr[15] = 42;
+  sput_fail_unless(!dncp_find_peer_by_sa6(o, &sa6),
+                   "dncp_find_peer_by_sa6 old address");
+
+  /* Removal takes it out of all indexes. */
+  dncp_remove_tlv(o, p->tlv);
+  sput_fail_unless(!dncp_find_peer(o, key), "removed");
+  sa6.sin6_addr.s6_addr[15] = 200;
+  sput_fail_unless(!dncp_find_peer_by_sa6(o, &sa6), "removed (sa6)");
+  ne->peer_ep_id = cpu_to_be32(43);
+  sput_fail_unless(!dncp_find_peer(o, key), "wrong key");
+
+  hncp_uninit(&s);
+}
+
+void hncp_timers(void)
+{
+  hncp_s s;
+  dncp o;
+  dncp_timer_s timers[200];
+  unsigned char key[DNCP_NI_MAX_LEN + sizeof(dncp_t_peer_s)];
+  dncp_t_peer ne;
+  dncp_peer p;
+  dncp_tlv t;
+  dncp_node n;
+  struct tlv_attr *a;
+  hnetd_time_t last;
+  int i, c;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+
+  /* The heap hands timers out in deadline order, also when some are
+   * cancelled or moved around. */
+  for (i = 0 ; i < 200 ; i++)
+    {
+      timers[i].index = -1;
+      dncp_timer_set(o, &timers[i], 1 + random() % 1000);
+    }
+  for (i = 0 ; i < 200 ; i += 3)
+    dncp_timer_set(o, &timers[i], 0);
+  for (i = 1 ; i < 200 ; i += 3)
+    dncp_timer_set(o, &timers[i], 1 + random() % 1000);
+  dncp_timer_advance(o, &timers[2], 2000);
+  sput_fail_unless(timers[2].at < 2000, "advance does not postpone");
+  sput_fail_unless(o->num_timers == 133, "133 scheduled");
+  last = 0;
+  c = 0;
+  while (o->num_timers)
+    {
+      dncp_timer tm = o->timers[0];
+      if (tm->at < last)
+        c++;
+      last = tm->at;
+      dncp_timer_set(o, tm, 0);
+      sput_fail_unless(tm->index == -1 && !tm->at, "unscheduled");
+    }
+  sput_fail_unless(!c, "in order");
+
+  /* Peers get a timer when they are added, and lose it when removed. */
+  memset(key, 1, DNCP_NI_LEN(o));
+  ne = (dncp_t_peer)(key + DNCP_NI_LEN(o));
+  ne->ep_id = cpu_to_be32(1);
+  ne->peer_ep_id = cpu_to_be32(2);
+  t = dncp_add_tlv(o, DNCP_T_PEER, key, DNCP_NI_LEN(o) + sizeof(*ne),
+                   sizeof(dncp_peer_s));
+  p = dncp_tlv_get_extra(t);
+  sput_fail_unless(p->timer.index >= 0, "peer timer scheduled");
+  sput_fail_unless(p->keepalive_interval < 0, "keepalive not known yet");
+
+  /* Node data change of the peer drops the cached keepalive interval. */
+  p->keepalive_interval = 1234;
+  dncp_timer_set(o, &p->timer, hnetd_time() + 100000);
+  n = dncp_find_node_by_node_id(o, key, true);
+  a = dncp_node_data_alloc(o, TLV_SIZE);
+  tlv_init(a, 0, TLV_SIZE);
+  dncp_node_set(n, 1, hnetd_time(), a);
+  sput_fail_unless(p->keepalive_interval < 0, "keepalive invalidated");
+  sput_fail_unless(p->timer.at <= hnetd_time(), "peer timer advanced");
+
+  dncp_remove_tlv(o, t);
+  sput_fail_unless(!o->num_timers, "peer timer gone");
+
+  hncp_uninit(&s);
+}
+
+#define PRUNE_NODES 1000
+#define PRUNE_TAIL 10
+#define PRUNE_MAX_DEG 16
+
+static dncp_node _prune_node[PRUNE_NODES];
+static int _prune_adj[PRUNE_NODES][PRUNE_MAX_DEG];
+static int _prune_deg[PRUNE_NODES];
+
+static void _prune_ni(dncp o, int i, void *ni)
+{
+  uint32_t v = cpu_to_be32(0xfe000000 | i);
+
+  if (!i)
+    memcpy(ni, &o->own_node->node_id, DNCP_NI_LEN(o));
+  else
+    memcpy(ni, &v, DNCP_NI_LEN(o));
+}
+
+static void _prune_publish(dncp o, int i, hnetd_time_t t)
+{
+  unsigned char buf[DNCP_NI_MAX_LEN + sizeof(dncp_t_peer_s)];
+  dncp_t_peer ne = (dncp_t_peer)(buf + DNCP_NI_LEN(o));
+  struct tlv_buf tb;
+  int j;
+
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  for (j = 0 ; j < _prune_deg[i] ; j++)
+    {
+      _prune_ni(o, _prune_adj[i][j], buf);
+      ne->ep_id = cpu_to_be32(1);
+      ne->peer_ep_id = cpu_to_be32(1);
+      tlv_put(&tb, DNCP_T_PEER, buf, DNCP_NI_LEN(o) + sizeof(*ne));
+    }
+  struct tlv_attr *a = dncp_node_data_alloc(o, tlv_pad_len(tb.head));
+  memcpy(a, tb.head, tlv_pad_len(tb.head));
+  tlv_buf_free(&tb);
+  dncp_node_set(_prune_node[i], _prune_node[i]->update_number + 1, t, a);
+}
+
+static bool _prune_link(int i, int j, bool add)
+{
+  int k, l;
+
+  for (k = 0 ; k < _prune_deg[i] ; k++)
+    if (_prune_adj[i][k] == j)
+      break;
+  if (add == (k < _prune_deg[i]))
+    return false;
+  if (add)
+    {
+      if (_prune_deg[i] == PRUNE_MAX_DEG || _prune_deg[j] == PRUNE_MAX_DEG)
+        return false;
+      _prune_adj[i][_prune_deg[i]++] = j;
+      _prune_adj[j][_prune_deg[j]++] = i;
+      return true;
+    }
+  _prune_adj[i][k] = _prune_adj[i][--_prune_deg[i]];
+  for (l = 0 ; _prune_adj[j][l] != i ; l++);
+  _prune_adj[j][l] = _prune_adj[j][--_prune_deg[j]];
+  return true;
+}
+
+/* Check reachability against plain flood fill over the topology;
+ * returns the number of reachable nodes. Mismatches are counted in
+ * *bad. */
+static int _prune_check(int *bad)
+{
+  bool seen[PRUNE_NODES];
+  int queue[PRUNE_NODES];
+  int i, j, c = 0;
+
+  memset(seen, 0, sizeof(seen));
+  seen[0] = true;
+  queue[c++] = 0;
+  for (i = 0 ; i < c ; i++)
+    for (j = 0 ; j < _prune_deg[queue[i]] ; j++)
+      if (!seen[_prune_adj[queue[i]][j]])
+        {
+          seen[_prune_adj[queue[i]][j]] = true;
+          queue[c++] = _prune_adj[queue[i]][j];
+        }
+  for (i = 0 ; i < PRUNE_NODES ; i++)
+    if (_prune_node[i]->reachable != seen[i])
+      (*bad)++;
+  return c;
+}
+
+void hncp_prune(void)
+{
+  hncp_s s;
+  dncp o;
+  unsigned char ni[DNCP_NI_MAX_LEN];
+  hnetd_time_t t, now;
+  int i, j, k, bad = 0, tail_bad = 0;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  t = hnetd_time();
+  now = t;
+
+  /* Ring of the core nodes with random chords, and a chain hanging off
+   * node #500 (which is cut off whenever its first link is down). */
+  memset(_prune_deg, 0, sizeof(_prune_deg));
+  for (i = 0 ; i < PRUNE_NODES - PRUNE_TAIL ; i++)
+    {
+      _prune_link(i, (i + 1) % (PRUNE_NODES - PRUNE_TAIL), true);
+      for (k = 0 ; k < 2 ; k++)
+        {
+          j = random() % (PRUNE_NODES - PRUNE_TAIL);
+          if (j != i)
+            _prune_link(i, j, true);
+        }
+    }
+  for (i = PRUNE_NODES - PRUNE_TAIL ; i < PRUNE_NODES ; i++)
+    _prune_link(i, i == PRUNE_NODES - PRUNE_TAIL ? 500 : i - 1, true);
+
+  for (i = 0 ; i < PRUNE_NODES ; i++)
+    {
+      _prune_ni(o, i, ni);
+      _prune_node[i] = dncp_find_node_by_node_id(o, ni, true);
+    }
+  for (i = 0 ; i < PRUNE_NODES ; i++)
+    _prune_publish(o, i, t);
+
+  o->prune_full = true;
+  o->now = ++now;
+  dncp_prune(o);
+  sput_fail_unless(_prune_check(&bad) == PRUNE_NODES && !bad,
+                   "all reachable");
+
+  /* Flap links one at a time. */
+  for (i = 0 ; i < 200 ; i++)
+    {
+      int a = i % 20 ? (int)(random() % (PRUNE_NODES - PRUNE_TAIL)) : 500;
+      int b = a == 500 && !(i % 20) ? PRUNE_NODES - PRUNE_TAIL
+        : _prune_adj[a][random() % _prune_deg[a]];
+
+      if (!_prune_link(a, b, false))
+        continue;
+      for (k = 0 ; k < 2 ; k++)
+        {
+          if (k)
+            _prune_link(a, b, true);
+          _prune_publish(o, a, t);
+          _prune_publish(o, b, t);
+          o->now = ++now;
+          dncp_prune(o);
+          j = _prune_check(&bad);
+          if (!(i % 20) && j != PRUNE_NODES - (k ? 0 : PRUNE_TAIL))
+            tail_bad++;
+        }
+    }
+  sput_fail_unless(!bad, "reachability matches flood fill");
+  sput_fail_unless(!tail_bad, "tail cut off and back");
+  sput_fail_unless(!o->prune_full, "no full prune due to flaps");
+
+  o->now = 0;
+  hncp_uninit(&s);
+}
+
+static struct tlv_attr *_recv_msg;
+static dncp_ep _recv_ep;
+static int _recv_left;
+
+static void _recv_src(struct sockaddr_in6 *src)
+{
+  struct in6_addr a;
+
+  inet_pton(AF_INET6, "fe80::1", &a);
+  sockaddr_in6_set(src, &a, HNCP_PORT);
+}
+
+static ssize_t _recv(dncp_ext ext, dncp_ep *ep,
+                           struct sockaddr_in6 **src,
+                           struct sockaddr_in6 **dst,
+                           int *flags,
+                           void *buf, size_t len)
+{
+  static struct sockaddr_in6 src_store;
+
+  if (!_recv_left)
+    return -1;
+  _recv_left--;
+  _recv_src(&src_store);
+  *ep = _recv_ep;
+  *src = &src_store;
+  *dst = NULL;
+  *flags = DNCP_RECV_FLAG_SRC_LINKLOCAL;
+  memcpy(buf, tlv_data(_recv_msg), tlv_len(_recv_msg));
+  return tlv_len(_recv_msg);
+}
+
+static int _recv_batch(dncp_ext ext, dncp_ext_msg msgs, int count)
+{
+  int i;
+
+  for (i = 0 ; i < count && _recv_left ; i++, _recv_left--)
+    {
+      dncp_ext_msg m = &msgs[i];
+
+      _recv_src(&m->src);
+      m->ep = _recv_ep;
+      m->multicast = true;
+      m->flags = DNCP_RECV_FLAG_SRC_LINKLOCAL;
+      memcpy(m->buf, tlv_data(_recv_msg), tlv_len(_recv_msg));
+      m->len = tlv_len(_recv_msg);
+    }
+  return i;
+}
+
+static void _readable_packets(hncp h, bool batch, int num_packets)
+{
+  h->ext.cb.recv = _recv;
+  h->ext.cb.recv_batch = batch ? _recv_batch : NULL;
+  _recv_left = num_packets;
+  dncp_ext_readable(h->dncp);
+  sput_fail_unless(!_recv_left, "all packets received");
+}
+
+static int _send_len, _send_count, _send_iov_len;
+static void *_send_iov_base;
+
+static void _count_send(dncp_ext ext, dncp_ep ep,
+                        struct sockaddr_in6 *src, struct sockaddr_in6 *dst,
+                        void *buf, size_t len)
+{
+  _send_len = len;
+  _send_count++;
+}
+
+static void _count_send_iovec(dncp_ext ext, dncp_ep ep,
+                              struct sockaddr_in6 *src,
+                              struct sockaddr_in6 *dst,
+                              struct iovec *iov, int iov_len)
+{
+  int i;
+
+  _send_len = 0;
+  for (i = 0 ; i < iov_len ; i++)
+    _send_len += iov[i].iov_len;
+  _send_iov_len = iov_len;
+  _send_iov_base = iov[iov_len - 1].iov_base;
+  _send_count++;
+}
+
+void hncp_send_buf(void)
+{
+  hncp_s s;
+  dncp o;
+  dncp_ep_i l;
+  struct sockaddr_in6 dst;
+  struct tlv_attr *a;
+  void *buf;
+  uint32_t i;
+  int c;
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  s.ext.cb.send = _count_send;
+  s.ext.cb.send_iovec = NULL;
+  l = container_of(dncp_find_ep_by_name(o, "eth0"), dncp_ep_i_s, conf);
+  memset(&dst, 0, sizeof(dst));
+
+  for (i = 1 ; i < 500 ; i++)
+    {
+      dncp_node_id_s ni;
+
+      memset(&ni, 0, sizeof(ni));
+      memcpy(&ni, &i, sizeof(i));
+      dncp_find_node_by_node_id(o, &ni, true)->reachable = true;
+    }
+  o->network_hash_records_dirty = true;
+
+  /* Without gather support, the first send sizes the buffer;
+   * afterwards it is just reused. */
+  dncp_ep_i_send_network_state(l, NULL, &dst, 0, 1, true);
+  sput_fail_unless(_send_count == 1, "sent");
+  sput_fail_unless(o->send_buf && o->send_buf_size >= _send_len + 4,
+                   "buffer cached");
+  sput_fail_unless(o->num_net_state_misses == 1, "network state built");
+  buf = o->send_buf;
+  dncp_ep_i_send_network_state(l, NULL, &dst, 0, 1, true);
+  sput_fail_unless(o->send_buf == buf, "buffer reused");
+  sput_fail_unless(o->num_net_state_misses == 1
+                   && o->num_net_state_hits == 1, "network state cached");
+
+  /* The cached network state is what is sent. */
+  c = 0;
+  tlv_for_each_in_buf(a, o->net_state, o->net_state_len)
+    {
+      if (!c)
+        sput_fail_unless(tlv_id(a) == DNCP_T_NET_STATE
+                         && !memcmp(tlv_data(a), &o->network_hash,
+                                    DNCP_HASH_LEN(o)), "network hash");
+      else if (tlv_id(a) != DNCP_T_NODE_STATE)
+        break;
+      c++;
+    }
+  sput_fail_unless(c == 1 + o->network_hash_records_count, "node states");
+
+  /* With gather support, it is passed on without copying. */
+  s.ext.cb.send_iovec = _count_send_iovec;
+  dncp_ep_i_send_network_state(l, NULL, &dst, 0, 1, true);
+  sput_fail_unless(_send_iov_len == 2 && _send_iov_base == o->net_state,
+                   "network state not copied");
+
+  /* Network hash change invalidates it. */
+  dncp_node_set(o->own_node, o->own_node->update_number + 1, 0, NULL);
+  dncp_ep_i_send_network_state(l, NULL, &dst, 0, 1, true);
+  sput_fail_unless(o->num_net_state_misses == 2
+                   && o->num_net_state_hits == 2, "network state rebuilt");
+
+  hncp_uninit(&s);
+}
+
+void hncp_readable(void)
+{
+  hncp_s s;
+  dncp o;
+  struct tlv_buf tb;
+  unsigned char epbuf[DNCP_NI_MAX_LEN + sizeof(dncp_t_ep_id_s)];
+  uint32_t ep_id = cpu_to_be32(1);
+
+  hncp_init(&s);
+  o = hncp_get_dncp(&s);
+  _recv_ep = dncp_find_ep_by_name(o, "eth0");
+  dncp_ext_ep_ready(_recv_ep, true);
+  dncp_ext_timeout(o);
+
+  /* Network state from a (consistent) neighbor on the link. */
+  memset(epbuf, 0x42, DNCP_NI_LEN(o));
+  memcpy(epbuf + DNCP_NI_LEN(o), &ep_id, sizeof(ep_id));
+  memset(&tb, 0, sizeof(tb));
+  tlv_buf_init(&tb, 0);
+  tlv_put(&tb, DNCP_T_NODE_ENDPOINT, epbuf, DNCP_NI_LEN(o) + sizeof(ep_id));
+  tlv_put(&tb, DNCP_T_NET_STATE, &o->network_hash, DNCP_HASH_LEN(o));
+  _recv_msg = tb.head;
+
+  _readable_packets(&s, false, 100);
+  _readable_packets(&s, true, 100);
+
+  tlv_buf_free(&tb);
+  hncp_uninit(&s);
+}
+
 void hncp_hash(void)
 {
   /*
@@ -230,6 +1035,47 @@ void hncp_hash(void)
   hncp_uninit(&s);
 }
 
+void hncp_hash_multi(void)
+{
+  const int num = 201;
+  const void *bufs[num];
+  size_t lens[num];
+  void *dsts[num];
+  unsigned char *data, (*out)[16];
+  unsigned char exp_buf[16];
+  hncp_s s;
+  int i, bad = 0;
+
+  hncp_init(&s);
+  dncp o = hncp_get_dncp(&s);
+  dncp_ext ext = dncp_get_ext(o);
+
+  sput_fail_unless(ext->cb.hash_multi, "hash_multi set");
+  data = malloc(num * 1024);
+  out = malloc(num * sizeof(*out));
+  for (i = 0 ; i < num * 1024 ; i++)
+    data[i] = random();
+
+  /* Messages of all lengths around the block boundaries, at once. */
+  for (i = 0 ; i < num ; i++)
+    {
+      bufs[i] = data + i * 1024 + i % 7;
+      lens[i] = num - 1 - i;
+      dsts[i] = out[i];
+    }
+  ext->cb.hash_multi(bufs, lens, dsts, num);
+  for (i = 0 ; i < num ; i++)
+    {
+      ext->cb.hash(bufs[i], lens[i], exp_buf);
+      if (memcmp(exp_buf, out[i], DNCP_HASH_LEN(o)))
+        bad++;
+    }
+  sput_fail_unless(!bad, "hash_multi matches hash");
+  free(out);
+  free(data);
+  hncp_uninit(&s);
+}
+
 int main(int argc, char **argv)
 {
   setbuf(stdout, NULL); /* so that it's in sync with stderr when redirected */
@@ -237,8 +1083,19 @@ int main(int argc, char **argv)
   sput_start_testing();
   sput_enter_suite("hncp"); /* optional */
   sput_run_test(hncp_hash);
+  sput_run_test(hncp_hash_multi);
   sput_run_test(hncp_ext);
   sput_run_test(hncp_int);
+  sput_run_test(hncp_network_hash);
+  sput_run_test(hncp_readable);
+  sput_run_test(hncp_send_buf);
+  sput_run_test(hncp_node_data_pool);
+  sput_run_test(hncp_tlv_index);
+  sput_run_test(hncp_tlv_notify);
+  sput_run_test(hncp_self_flush);
+  sput_run_test(hncp_peer_index);
+  sput_run_test(hncp_timers);
+  sput_run_test(hncp_prune);
   sput_leave_suite(); /* optional */
   sput_finish_testing();
   return sput_get_return_value();
@@ -0,0 +1,373 @@
+/*
+ * $Id: test_hncp_dns.c $
+ *
+ * Copyright (c) 2015 cisco Systems, Inc.
+ *
+ */
+
+/* Queries the built-in DNS server over loopback with a minimal stub
+ * resolver, while TLVs come and go. */
+
+#include "hncp_dns.c"
+
+#include <resolv.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "sput.h"
+
+int log_level = 5;
+void (*hnetd_log)(int priority, const char *format, ...) = syslog;
+
+static hncp_dns d;
+static struct sockaddr_in server;
+static struct uloop_fd stub, zone;
+static int spoof_fd;
+static struct uloop_timeout end;
+static uint8_t reply[HNCP_DNS_MAX_MSG];
+static int reply_len;
+
+/* Upstream server of zones delegated by the local node; when spoofing,
+ * it first sends forged replies (REFUSED) from another port and with
+ * another id */
+static int zone_queries;
+static bool zone_spoof;
+
+static void _end_cb(struct uloop_timeout *t __unused)
+{
+  uloop_end();
+}
+
+static void _stub_cb(struct uloop_fd *fd, unsigned int events __unused)
+{
+  reply_len = recv(fd->fd, reply, sizeof(reply), 0);
+  uloop_end();
+}
+
+static void _zone_cb(struct uloop_fd *fd, unsigned int events __unused)
+{
+  struct sockaddr_in6 src;
+  socklen_t src_len = sizeof(src);
+  uint8_t msg[HNCP_DNS_MAX_MSG];
+  HEADER *h = (HEADER *)msg;
+  ssize_t len;
+
+  len = recvfrom(fd->fd, msg, sizeof(msg), 0, (void *)&src, &src_len);
+  if (len < (ssize_t)sizeof(HEADER))
+    return;
+  zone_queries++;
+  h->qr = 1;
+  if (zone_spoof)
+    {
+      h->rcode = ns_r_refused;
+      sendto(spoof_fd, msg, len, 0, (void *)&src, src_len);
+      h->id ^= 1;
+      sendto(fd->fd, msg, len, 0, (void *)&src, src_len);
+      h->id ^= 1;
+    }
+  /* NXDOMAIN, but recognizable by its rcode and ra bit */
+  h->ra = 1;
+  h->rcode = ns_r_nxdomain;
+  sendto(fd->fd, msg, len, 0, (void *)&src, src_len);
+}
+
+static int _open(uint16_t port)
+{
+  struct sockaddr_in a = { .sin_family = AF_INET,
+                           .sin_port = htons(port),
+                           .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+
+  if (bind(fd, (void *)&a, sizeof(a)))
+    return -1;
+  return fd;
+}
+
+static uint16_t _port(int fd)
+{
+  struct sockaddr_in a;
+  socklen_t len = sizeof(a);
+
+  getsockname(fd, (void *)&a, &len);
+  return ntohs(a.sin_port);
+}
+
+/* Send a raw message and wait for the reply */
+static int _send(const uint8_t *msg, int len)
+{
+  reply_len = -1;
+  sendto(stub.fd, msg, len, 0, (void *)&server, sizeof(server));
+  uloop_timeout_set(&end, 1000);
+  uloop_run();
+  uloop_timeout_cancel(&end);
+  return reply_len;
+}
+
+/* Query, and return the rcode (or -1 if no valid reply) */
+static int _query(const char *name, int type, ns_msg *m)
+{
+  uint8_t msg[HNCP_DNS_MAX_UDP];
+  int len = res_mkquery(ns_o_query, name, ns_c_in, type,
+                        NULL, 0, NULL, msg, sizeof(msg));
+
+  if (len < 0 || _send(msg, len) < 0
+      || ns_initparse(reply, reply_len, m) < 0
+      || ns_msg_id(*m) != ntohs(((HEADER *)msg)->id))
+    return -1;
+  return ns_msg_getflag(*m, ns_f_rcode);
+}
+
+/* Whether the answer contains the given A/AAAA address or PTR name */
+static bool _answer_has(ns_msg *m, int type, const char *value)
+{
+  char buf[DNS_MAX_ESCAPED_LEN];
+  ns_rr rr;
+  int i;
+
+  for (i = 0 ; i < ns_msg_count(*m, ns_s_an) ; i++)
+    {
+      if (ns_parserr(m, ns_s_an, i, &rr) || (int)ns_rr_type(rr) != type)
+        continue;
+      if (type == ns_t_ptr)
+        {
+          if (ns_name_uncompress(ns_msg_base(*m), ns_msg_end(*m),
+                                 ns_rr_rdata(rr), buf, sizeof(buf)) < 0)
+            continue;
+        }
+      else if (!inet_ntop(type == ns_t_a ? AF_INET : AF_INET6,
+                          ns_rr_rdata(rr), buf, sizeof(buf)))
+        continue;
+      if (!strcmp(buf, value))
+        return true;
+    }
+  return false;
+}
+
+static struct tlv_attr *_node_name(const char *name, const char *addr)
+{
+  static uint8_t buf[3][256];
+  static int i;
+  struct tlv_attr *a = (void *)buf[i++ % 3];
+  hncp_t_node_name nn = tlv_data(a);
+
+  memset(nn, 0, sizeof(*nn));
+  if (!strchr(addr, ':'))
+    {
+      nn->address.s6_addr[10] = nn->address.s6_addr[11] = 0xff;
+      inet_pton(AF_INET, addr, &nn->address.s6_addr[12]);
+    }
+  else
+    inet_pton(AF_INET6, addr, &nn->address);
+  nn->name_length = strlen(name);
+  memcpy(nn->name, name, nn->name_length);
+  tlv_init(a, HNCP_T_NODE_NAME,
+           sizeof(*a) + sizeof(*nn) + nn->name_length);
+  return a;
+}
+
+static struct tlv_attr *_ddz(const char *zone, int flags)
+{
+  static uint8_t buf[3][512];
+  static int i;
+  struct tlv_attr *a = (void *)buf[i++ % 3];
+  hncp_t_dns_delegated_zone dh = tlv_data(a);
+  int r;
+
+  memset(dh, 0, sizeof(*dh));
+  inet_pton(AF_INET6, "2001:db8::1", dh->address);
+  dh->flags = flags;
+  r = escaped2ll(zone, dh->ll, DNS_MAX_LL_LEN);
+  tlv_init(a, HNCP_T_DNS_DELEGATED_ZONE, sizeof(*a) + sizeof(*dh) + r);
+  return a;
+}
+
+static int node1, node2;
+
+void hncp_dns_records(void)
+{
+  struct tlv_attr *n1 = _node_name("r1", "192.0.2.1");
+  struct tlv_attr *n2 = _node_name("r2", "2001:db8::2");
+  ns_msg m;
+
+  hncp_dns_tlv_change(d, &node1, true, n1, true);
+  hncp_dns_tlv_change(d, &node2, false, n2, true);
+
+  sput_fail_unless(_query("r1.home", ns_t_a, &m) == ns_r_noerror, "r1 A");
+  sput_fail_unless(ns_msg_getflag(m, ns_f_aa), "authoritative");
+  sput_fail_unless(_answer_has(&m, ns_t_a, "192.0.2.1"), "r1 address");
+  sput_fail_unless(_query("R1.Home.", ns_t_a, &m) == ns_r_noerror
+                   && _answer_has(&m, ns_t_a, "192.0.2.1"),
+                   "case insensitive");
+  sput_fail_unless(_query("r1.home", ns_t_aaaa, &m) == ns_r_noerror
+                   && !ns_msg_count(m, ns_s_an), "r1 AAAA nodata");
+  sput_fail_unless(_query("r2.home", ns_t_any, &m) == ns_r_noerror
+                   && _answer_has(&m, ns_t_aaaa, "2001:db8::2"), "r2 ANY");
+  sput_fail_unless(_query("r3.home", ns_t_a, &m) == ns_r_nxdomain
+                   && ns_msg_getflag(m, ns_f_aa), "r3 nxdomain");
+  sput_fail_unless(_query("home", ns_t_a, &m) == ns_r_noerror
+                   && !ns_msg_count(m, ns_s_an), "domain nodata");
+  sput_fail_unless(_query("example.com", ns_t_a, &m) == ns_r_refused,
+                   "outside domain refused");
+
+  /* Incremental changes */
+  hncp_dns_tlv_change(d, &node2, false, n1, false);
+  sput_fail_unless(_query("r1.home", ns_t_a, &m) == ns_r_noerror,
+                   "other node's TLV removal ignored");
+  hncp_dns_tlv_change(d, &node1, true, n1, false);
+  sput_fail_unless(_query("r1.home", ns_t_a, &m) == ns_r_nxdomain,
+                   "r1 removed");
+  hncp_dns_tlv_change(d, &node1, true, _node_name("r1", "192.0.2.11"), true);
+  sput_fail_unless(_query("r1.home", ns_t_a, &m) == ns_r_noerror
+                   && _answer_has(&m, ns_t_a, "192.0.2.11")
+                   && ns_msg_count(m, ns_s_an) == 1, "r1 readded");
+
+  hncp_dns_set_domain(d, "Lan.");
+  sput_fail_unless(_query("r1.home", ns_t_a, &m) == ns_r_refused,
+                   "old domain refused");
+  sput_fail_unless(_query("r2.lan", ns_t_aaaa, &m) == ns_r_noerror
+                   && _answer_has(&m, ns_t_aaaa, "2001:db8::2"),
+                   "r2 in new domain");
+  hncp_dns_set_domain(d, "home.");
+}
+
+void hncp_dns_browse(void)
+{
+  struct tlv_attr *z1 = _ddz("eth0.r1.home.",
+                             HNCP_T_DNS_DELEGATED_ZONE_FLAG_BROWSE
+                             | HNCP_T_DNS_DELEGATED_ZONE_FLAG_LEGACY_BROWSE);
+  struct tlv_attr *z2 = _ddz("eth1.r2.home.",
+                             HNCP_T_DNS_DELEGATED_ZONE_FLAG_BROWSE);
+  ns_msg m;
+
+  hncp_dns_tlv_change(d, &node1, true, z1, true);
+  hncp_dns_tlv_change(d, &node2, false, z2, true);
+  sput_fail_unless(_query("b._dns-sd._udp.home", ns_t_ptr, &m) == ns_r_noerror
+                   && ns_msg_count(m, ns_s_an) == 2
+                   && _answer_has(&m, ns_t_ptr, "eth0.r1.home")
+                   && _answer_has(&m, ns_t_ptr, "eth1.r2.home"), "b PTRs");
+  sput_fail_unless(_query("lb._dns-sd._udp.home", ns_t_ptr, &m) == ns_r_noerror
+                   && ns_msg_count(m, ns_s_an) == 1
+                   && _answer_has(&m, ns_t_ptr, "eth0.r1.home"), "lb PTR");
+
+  hncp_dns_tlv_change(d, &node2, false, z2, false);
+  sput_fail_unless(_query("b._dns-sd._udp.home", ns_t_ptr, &m) == ns_r_noerror
+                   && ns_msg_count(m, ns_s_an) == 1, "b PTR removed");
+}
+
+void hncp_dns_forward(void)
+{
+  ns_msg m;
+
+  /* eth0.r1.home is delegated by the local node (see above) */
+  zone_queries = 0;
+  sput_fail_unless(_query("printer._ipp._tcp.eth0.r1.home", ns_t_srv, &m)
+                   == ns_r_nxdomain, "forwarded");
+  sput_fail_unless(ns_msg_getflag(m, ns_f_ra), "reply from zone server");
+  sput_fail_unless(_query("EtH0.r1.home", ns_t_soa, &m) == ns_r_nxdomain
+                   && ns_msg_getflag(m, ns_f_ra), "zone apex forwarded");
+  sput_fail_unless(zone_queries == 2, "zone server queried");
+  sput_fail_unless(list_empty(&d->queries) && !d->num_queries,
+                   "no pending queries");
+
+  /* Host records of the zone's parent are still answered locally */
+  sput_fail_unless(_query("r1.home", ns_t_a, &m) == ns_r_noerror
+                   && !ns_msg_getflag(m, ns_f_ra), "parent local");
+  sput_fail_unless(zone_queries == 2, "zone server not queried");
+}
+
+void hncp_dns_forward_spoof(void)
+{
+  ns_msg m;
+
+  zone_queries = 0;
+  zone_spoof = true;
+  sput_fail_unless(_query("scanner._uscan._tcp.eth0.r1.home", ns_t_srv, &m)
+                   == ns_r_nxdomain, "forged replies dropped");
+  sput_fail_unless(ns_msg_getflag(m, ns_f_ra), "reply from zone server");
+  sput_fail_unless(zone_queries == 1, "zone server queried");
+  sput_fail_unless(list_empty(&d->queries) && !d->num_queries,
+                   "no pending queries");
+  zone_spoof = false;
+}
+
+void hncp_dns_malformed(void)
+{
+  uint8_t msg[HNCP_DNS_MAX_UDP];
+  HEADER *h = (HEADER *)msg;
+  ns_msg m;
+  int len = res_mkquery(ns_o_query, "r1.home", ns_c_in, ns_t_a,
+                        NULL, 0, NULL, msg, sizeof(msg));
+
+  /* Compressed question */
+  msg[sizeof(HEADER)] = 0xc0;
+  sput_fail_unless(_send(msg, len) == sizeof(HEADER)
+                   && ((HEADER *)reply)->rcode == ns_r_formerr,
+                   "compressed question");
+
+  /* Truncated question */
+  len = res_mkquery(ns_o_query, "r1.home", ns_c_in, ns_t_a,
+                    NULL, 0, NULL, msg, sizeof(msg));
+  sput_fail_unless(_send(msg, len - 3) == sizeof(HEADER)
+                   && ((HEADER *)reply)->rcode == ns_r_formerr,
+                   "truncated question");
+
+  /* Update */
+  h->opcode = ns_o_update;
+  sput_fail_unless(_send(msg, len) == sizeof(HEADER)
+                   && ((HEADER *)reply)->rcode == ns_r_notimpl,
+                   "update not implemented");
+
+  /* Responses and runts are ignored */
+  h->opcode = ns_o_query;
+  h->qr = 1;
+  sput_fail_unless(_send(msg, len) < 0, "response ignored");
+  sput_fail_unless(_send(msg, 5) < 0, "runt ignored");
+
+  /* Still serving */
+  sput_fail_unless(_query("r1.home", ns_t_a, &m) == ns_r_noerror, "serving");
+}
+
+int main(int argc, char **argv)
+{
+  int fd4, fd6;
+
+  setbuf(stdout, NULL);
+  openlog("test_hncp_dns", LOG_CONS | LOG_PERROR, LOG_DAEMON);
+  uloop_init();
+  end.cb = _end_cb;
+
+  zone.fd = _open(0);
+  zone.cb = _zone_cb;
+  uloop_fd_add(&zone, ULOOP_READ);
+  spoof_fd = _open(0);
+  stub.fd = _open(0);
+  stub.cb = _stub_cb;
+  uloop_fd_add(&stub, ULOOP_READ);
+
+  d = hncp_dns_create(0, "127.0.0.1", _port(zone.fd));
+  if (!d)
+    return 1;
+  hncp_dns_set_domain(d, "home.");
+  udp46_get_fds(d->server, &fd4, &fd6);
+  server.sin_family = AF_INET;
+  server.sin_port = htons(_port(fd4));
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  sput_start_testing();
+  sput_enter_suite("hncp_dns"); /* optional */
+  argc -= 1;
+  argv += 1;
+
+  sput_maybe_run_test(hncp_dns_records, do {} while(0));
+  sput_maybe_run_test(hncp_dns_browse, do {} while(0));
+  sput_maybe_run_test(hncp_dns_forward, do {} while(0));
+  sput_maybe_run_test(hncp_dns_forward_spoof, do {} while(0));
+  sput_maybe_run_test(hncp_dns_malformed, do {} while(0));
+  sput_leave_suite(); /* optional */
+  sput_finish_testing();
+
+  hncp_dns_destroy(d);
+  close(stub.fd);
+  close(zone.fd);
+  return sput_get_return_value();
+}
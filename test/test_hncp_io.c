@@ -137,6 +137,84 @@ static void dncp_io_basic_2()
   hncp_io_uninit(&h2);
 }
 
+static void dncp_io_batch()
+{
+  hncp_s h1, h2;
+  dncp_s d1, d2;
+  bool r;
+  struct in6_addr a;
+  char *msg[] = { "foo", "bar", "bazz" };
+  int i, got = 0;
+  char bufs[4][64], big[sizeof(bufs[0]) + 1];
+  dncp_ext_msg_s msgs[4];
+
+  memset(&h1, 0, sizeof(h1));
+  memset(&h2, 0, sizeof(h2));
+  memset(&d1, 0, sizeof(d1));
+  memset(&d2, 0, sizeof(d2));
+  h1.udp_port = 62002;
+  h2.udp_port = 62003;
+  h1.dncp = &d1;
+  h2.dncp = &d2;
+  d1.ext = &h1.ext;
+  d2.ext = &h2.ext;
+  r = hncp_io_init(&h1);
+  sput_fail_unless(r, "dncp_io_init h1");
+  r = hncp_io_init(&h2);
+  sput_fail_unless(r, "dncp_io_init h2");
+
+  (void)inet_pton(AF_INET6, "::1", &a);
+  struct sockaddr_in6 dst = {
+    .sin6_family = AF_INET6,
+    .sin6_port = htons(h2.udp_port),
+    .sin6_addr = a
+#ifdef __APPLE__
+    , .sin6_len = sizeof(struct sockaddr_in6)
+#endif /* __APPLE__ */
+  };
+  for (i = 0 ; i < 3 ; i++)
+    h1.ext.cb.send(&h1.ext, dncp_find_ep_by_name(h1.dncp, "lo"),
+                   NULL, &dst, msg[i], strlen(msg[i]));
+
+  /* Whole burst should be received with one call. */
+  for (i = 0 ; i < 4 ; i++)
+    {
+      msgs[i].buf = bufs[i];
+      msgs[i].buf_len = sizeof(bufs[i]);
+    }
+  got = h2.ext.cb.recv_batch(&h2.ext, msgs, 4);
+  sput_fail_unless(got == 3, "recv_batch got 3");
+  for (i = 0 ; i < got ; i++)
+    {
+      sput_fail_unless(msgs[i].len == strlen(msg[i]), "len mismatch");
+      sput_fail_unless(memcmp(msgs[i].buf, msg[i], msgs[i].len) == 0,
+                       "buf mismatch");
+      sput_fail_unless(msgs[i].ep == &static_ep, "ep mismatch");
+      sput_fail_unless(!msgs[i].multicast, "not multicast");
+      sput_fail_unless(ntohs(msgs[i].src.sin6_port) == h1.udp_port,
+                       "src port mismatch");
+      sput_fail_unless(memcmp(&msgs[i].dst.sin6_addr, &a, sizeof(a)) == 0,
+                       "dst mismatch");
+    }
+  sput_fail_unless(h2.ext.cb.recv_batch(&h2.ext, msgs, 4) == 0,
+                   "recv_batch drained");
+
+  /* Messages that do not fit in their buffer are dropped. */
+  memset(big, 'x', sizeof(big));
+  h1.ext.cb.send(&h1.ext, dncp_find_ep_by_name(h1.dncp, "lo"),
+                 NULL, &dst, big, sizeof(big));
+  h1.ext.cb.send(&h1.ext, dncp_find_ep_by_name(h1.dncp, "lo"),
+                 NULL, &dst, msg[0], strlen(msg[0]));
+  got = h2.ext.cb.recv_batch(&h2.ext, msgs, 4);
+  sput_fail_unless(got == 1, "oversized message dropped");
+  sput_fail_unless(msgs[0].len == strlen(msg[0])
+                   && !memcmp(msgs[0].buf, msg[0], msgs[0].len),
+                   "next message received");
+
+  hncp_io_uninit(&h1);
+  hncp_io_uninit(&h2);
+}
+
 int main(int argc, char **argv)
 {
   setbuf(stdout, NULL); /* so that it's in sync with stderr when redirected */
@@ -147,6 +225,7 @@ int main(int argc, char **argv)
   argv += 1;
 
   sput_maybe_run_test(dncp_io_basic_2, do {} while(0));
+  sput_maybe_run_test(dncp_io_batch, do {} while(0));
   sput_leave_suite(); /* optional */
   sput_finish_testing();
   return sput_get_return_value();
@@ -463,6 +463,34 @@ void hncp_tube_beyond_multicast_unique(void)
   raw_hncp_tube(&s, BIG_TUBE_LENGTH, false);
 }
 
+#define SPLIT_TUBE_LENGTH 1800 / NS_LENGTH
+
+/* Node states that do not fit in one multicast are split across
+ * several; compare against the unsplit short form, which makes the
+ * receivers ask for the network state via unicast instead. */
+void hncp_tube_beyond_multicast_split(void)
+{
+  net_sim_s s1, s2;
+  hnetd_time_t t1, t2;
+
+  net_sim_init(&s1);
+  s1.fake_maximum_multicast_datagrams = 1;
+  raw_hncp_tube(&s1, SPLIT_TUBE_LENGTH, true);
+  t1 = hnetd_time() - s1.start;
+
+  net_sim_init(&s2);
+  raw_hncp_tube(&s2, SPLIT_TUBE_LENGTH, true);
+  t2 = hnetd_time() - s2.start;
+
+  L_NOTICE("short form: %lld ms, %d unicasts, %d multicasts",
+           (long long)t1, s1.sent_unicast, s1.sent_multicast);
+  L_NOTICE("split: %lld ms, %d unicasts, %d multicasts",
+           (long long)t2, s2.sent_unicast, s2.sent_multicast);
+  sput_fail_unless(t2 <= t1, "split converges faster");
+  sput_fail_unless(s2.sent_unicast <= s1.sent_unicast,
+                   "split needs fewer unicasts");
+}
+
 /* Note: As we play with bitmasks,
    NUM_MONKEY_ROUTERS * NUM_MONKEY_PORTS^2 <= 31
 */
@@ -847,6 +875,7 @@ int main(__unused int argc, __unused char **argv)
   maybe_run_test(hncp_tube_medium_nc);
   maybe_run_test(hncp_tube_beyond_multicast_nc);
   maybe_run_test(hncp_tube_beyond_multicast_unique);
+  maybe_run_test(hncp_tube_beyond_multicast_split);
   maybe_run_test(hncp_random_monkey);
   sput_leave_suite(); /* optional */
   sput_finish_testing();
@@ -0,0 +1,568 @@
+/*
+ * $Id: test_hncp_routing.c $
+ *
+ * Copyright (c) 2015 cisco Systems, Inc.
+ *
+ */
+
+/* Exercises the route diff of hncp_routing and how it is applied,
+ * both over a fake rtnetlink socket and with the bfsbatch script. */
+
+#include <net/if.h>
+#include <sys/socket.h>
+
+#include "net_sim.h"
+#include "sput.h"
+
+/* Interfaces known to the fake kernel; eth9 comes and goes */
+static bool has_eth9;
+
+static unsigned int _if_nametoindex(const char *ifname)
+{
+  if (!strcmp(ifname, "eth0"))
+    return 2;
+  if (!strcmp(ifname, "eth1"))
+    return 3;
+  if (!strcmp(ifname, "eth9") && has_eth9)
+    return 9;
+  return 0;
+}
+
+#define if_nametoindex _if_nametoindex
+
+bool iface_has_ipv4_address(const char *ifname __unused)
+{
+  return true;
+}
+
+#include "hncp_routing.c"
+
+static struct prefix p1 = {
+  .prefix = { .s6_addr = { 0x20, 0x01, 0x00, 0x01 } },
+  .plen = 54 };
+
+static struct prefix p2 = {
+  .prefix = { .s6_addr = { 0x20, 0x02, 0x00, 0x01 } },
+  .plen = 48 };
+
+static struct prefix p4 = {
+  .prefix = { .s6_addr = { [10] = 0xff, [11] = 0xff, 10, 1 } },
+  .plen = 112 };
+
+static struct prefix any = { .plen = 0 };
+
+static struct in6_addr a1 = { .s6_addr = { 0xfe, 0x80, [15] = 1 } };
+static struct in6_addr a2 = { .s6_addr = { 0xfe, 0x80, [15] = 2 } };
+static struct in6_addr a4 = { .s6_addr = { [10] = 0xff, [11] = 0xff, 10, 0, 0, 1 } };
+
+static hncp_bfs _create(net_sim s, const char *script)
+{
+  hncp h = net_sim_find_hncp(s, "n1");
+  net_node node = container_of(h, net_node_s, h);
+  hncp_bfs bfs;
+
+  /* Runs are driven by the test, not by dncp changes */
+  current_iface_users = &node->iface_users;
+  bfs = hncp_routing_create(h, script, false, false);
+  current_iface_users = NULL;
+  return bfs;
+}
+
+static void _begin(hncp_bfs bfs)
+{
+  ++bfs->run;
+  vlist_update(&bfs->routes);
+}
+
+static void _end(hncp_bfs bfs)
+{
+  vlist_flush(&bfs->routes);
+  hncp_routing_apply(bfs);
+}
+
+/* Reads one batch from the fake kernel; returns the number of messages */
+static int _nl_read(int fd, int *types, uint32_t *oifs, int max)
+{
+  uint8_t buf[8192];
+  ssize_t len = recv(fd, buf, sizeof(buf), 0);
+  int c = 0;
+
+  if (len <= 0)
+    return 0;
+  for (struct nlmsghdr *nh = (void *)buf; NLMSG_OK(nh, (size_t)len);
+       nh = NLMSG_NEXT(nh, len))
+    {
+      struct rtmsg *rtm = NLMSG_DATA(nh);
+      struct rtattr *rta = RTM_RTA(rtm);
+      int rlen = RTM_PAYLOAD(nh);
+
+      if (c < max)
+        {
+          types[c] = nh->nlmsg_type;
+          oifs[c] = 0;
+          for (; RTA_OK(rta, rlen); rta = RTA_NEXT(rta, rlen))
+            if (rta->rta_type == RTA_OIF)
+              memcpy(&oifs[c], RTA_DATA(rta), sizeof(oifs[c]));
+        }
+      c++;
+    }
+  return c;
+}
+
+void hncp_routing_netlink(void)
+{
+  net_sim_s s;
+  hncp_bfs bfs;
+  int sv[2], types[8], c;
+  uint32_t oifs[8];
+
+  net_sim_init(&s);
+  s.disable_sd = true;
+  s.disable_pa = true;
+  s.disable_multicast = true;
+  bfs = _create(&s, NULL);
+  sput_fail_unless(bfs->rtnl.fd < 0, "no netlink unless asked for");
+
+  sput_fail_unless(!socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, sv),
+                   "socketpair");
+  hncp_routing_nl_init(bfs, sv[0]);
+
+  /* New routes are added */
+  _begin(bfs);
+  hncp_routing_add(bfs, HNCP_ROUTE_IPV6_ASSIGNED, &p1, &a1, "eth0", 256, NULL);
+  hncp_routing_add(bfs, HNCP_ROUTE_IPV6_PREFIX, &p2, NULL, NULL, 0, NULL);
+  _end(bfs);
+  c = _nl_read(sv[1], types, oifs, 8);
+  sput_fail_unless(c == 2, "2 messages");
+  sput_fail_unless(types[0] == RTM_NEWROUTE && types[1] == RTM_NEWROUTE,
+                   "add both");
+  sput_fail_unless(oifs[0] == 2, "via eth0");
+
+  /* Nothing changed, nothing is sent */
+  _begin(bfs);
+  hncp_routing_add(bfs, HNCP_ROUTE_IPV6_ASSIGNED, &p1, &a1, "eth0", 256, NULL);
+  hncp_routing_add(bfs, HNCP_ROUTE_IPV6_PREFIX, &p2, NULL, NULL, 0, NULL);
+  _end(bfs);
+  sput_fail_unless(_nl_read(sv[1], types, oifs, 8) == 0, "no change");
+
+  /* Replaced and removed routes: all deletions come first */
+  _begin(bfs);
+  hncp_routing_add(bfs, HNCP_ROUTE_IPV6_ASSIGNED, &p1, &a2, "eth1", 256, NULL);
+  _end(bfs);
+  c = _nl_read(sv[1], types, oifs, 8);
+  sput_fail_unless(c == 3, "3 messages");
+  sput_fail_unless(types[0] == RTM_DELROUTE && types[1] == RTM_DELROUTE,
+                   "deletions first");
+  sput_fail_unless(types[2] == RTM_NEWROUTE && oifs[2] == 3, "add via eth1");
+
+  /* Missing interface: route is not installed, but remembered */
+  _begin(bfs);
+  hncp_routing_add(bfs, HNCP_ROUTE_IPV6_ASSIGNED, &p1, &a2, "eth1", 256, NULL);
+  hncp_routing_add(bfs, HNCP_ROUTE_IPV6_UPLINK, &p1, &a1, "eth9", 1, &any);
+  _end(bfs);
+  sput_fail_unless(_nl_read(sv[1], types, oifs, 8) == 0, "eth9 missing");
+  sput_fail_unless(bfs->retry, "retry scheduled");
+
+  /* Next run retries it (source-specific default is two routes) */
+  has_eth9 = true;
+  _begin(bfs);
+  hncp_routing_add(bfs, HNCP_ROUTE_IPV6_ASSIGNED, &p1, &a2, "eth1", 256, NULL);
+  hncp_routing_add(bfs, HNCP_ROUTE_IPV6_UPLINK, &p1, &a1, "eth9", 1, &any);
+  _end(bfs);
+  c = _nl_read(sv[1], types, oifs, 8);
+  sput_fail_unless(c == 2, "2 messages");
+  sput_fail_unless(types[0] == RTM_NEWROUTE && oifs[0] == 9 &&
+                   types[1] == RTM_NEWROUTE && oifs[1] == 9, "add via eth9");
+
+  /* Routes which never made it are not deleted */
+  has_eth9 = false;
+  _begin(bfs);
+  hncp_routing_add(bfs, HNCP_ROUTE_IPV6_ASSIGNED, &p1, &a2, "eth1", 256, NULL);
+  hncp_routing_add(bfs, HNCP_ROUTE_IPV6_UPLINK, &p1, &a1, "eth9", 1, &any);
+  hncp_routing_add(bfs, HNCP_ROUTE_IPV4_ASSIGNED, &p4, &a4, "eth8", 256, NULL);
+  _end(bfs);
+  sput_fail_unless(_nl_read(sv[1], types, oifs, 8) == 0, "eth8 missing");
+  _begin(bfs);
+  hncp_routing_add(bfs, HNCP_ROUTE_IPV6_ASSIGNED, &p1, &a2, "eth1", 256, NULL);
+  hncp_routing_add(bfs, HNCP_ROUTE_IPV6_UPLINK, &p1, &a1, "eth9", 1, &any);
+  _end(bfs);
+  sput_fail_unless(_nl_read(sv[1], types, oifs, 8) == 0, "no delete");
+
+  /* Acknowledgements (also errors) are consumed asynchronously */
+  struct {
+    struct nlmsghdr nh;
+    struct nlmsgerr err;
+  } ack = {
+    .nh = { .nlmsg_len = sizeof(ack), .nlmsg_type = NLMSG_ERROR },
+    .err = { .error = -EPERM, .msg = { .nlmsg_type = RTM_NEWROUTE } },
+  };
+  sput_fail_unless(send(sv[1], &ack, sizeof(ack), 0) == sizeof(ack), "send");
+  bfs->rtnl.cb(&bfs->rtnl, ULOOP_READ);
+  sput_fail_unless(recv(sv[0], &ack, sizeof(ack), 0) < 0 && errno == EAGAIN,
+                   "acks drained");
+
+  hncp_routing_destroy(bfs);
+  close(sv[1]);
+  net_sim_uninit(&s);
+}
+
+static bool _batch_contains(const char *path, const char *line)
+{
+  char buf[1024];
+  FILE *f = fopen(path, "r");
+  bool found = false;
+
+  if (!f)
+    return false;
+  while (!found && fgets(buf, sizeof(buf), f))
+    found = !strncmp(buf, line, strlen(line));
+  fclose(f);
+  return found;
+}
+
+void hncp_routing_script(void)
+{
+  net_sim_s s;
+  hncp_bfs bfs;
+  char batch[sizeof(bfs->batch)];
+  int execs_start;
+
+  net_sim_init(&s);
+  s.disable_sd = true;
+  s.disable_pa = true;
+  s.disable_multicast = true;
+  bfs = _create(&s, "s-routing");
+
+  /* Without netlink, the batch goes to the script */
+  execs_start = execs;
+  _begin(bfs);
+  hncp_routing_add(bfs, HNCP_ROUTE_IPV6_ASSIGNED, &p1, &a1, "eth0", 256, NULL);
+  _end(bfs);
+  sput_fail_unless(execs == execs_start + 1, "bfsbatch run");
+  sput_fail_unless(bfs->routing_proc.pending, "bfsbatch pending");
+  strcpy(batch, bfs->batch);
+  sput_fail_unless(_batch_contains(batch, "add bfsipv6assigned 2001:1::/54 fe80::1 eth0 256"),
+                   "add in batch");
+
+  /* Next run waits for the running batch */
+  bfs->routing_pending = true;
+  hncp_routing_exec(bfs);
+  sput_fail_unless(execs == execs_start + 1, "no run while busy");
+
+  /* When it is done, the pending run starts: own node has no routes */
+  uloop_process_delete(&bfs->routing_proc);
+  bfs->routing_proc.cb(&bfs->routing_proc, 0);
+  sput_fail_unless(access(batch, F_OK), "batch file removed");
+  sput_fail_unless(bfs->prepared, "bfsprepare run");
+  sput_fail_unless(execs == execs_start + 3, "bfsprepare + bfsbatch run");
+  sput_fail_unless(_batch_contains(bfs->batch, "del bfsipv6assigned 2001:1::/54"),
+                   "del in batch");
+
+  strcpy(batch, bfs->batch);
+  uloop_process_delete(&bfs->routing_proc);
+  bfs->routing_proc.cb(&bfs->routing_proc, 0);
+  sput_fail_unless(access(batch, F_OK), "batch file removed");
+
+  hncp_routing_destroy(bfs);
+  net_sim_uninit(&s);
+}
+
+/* Randomized topology of point-to-point links between nodes; node 0
+ * runs the incremental routing. Nodes are taken down by taking all
+ * of their links down. */
+#define TREE_NODES 10
+#define TREE_EXTRA_LINKS 8
+#define TREE_ROUNDS 40
+
+struct tree_link {
+  int a, b;
+  dncp_ep ea, eb;
+  bool up;
+};
+
+static net_node tree_nodes[TREE_NODES];
+static bool tree_node_down[TREE_NODES];
+static struct tree_link tree_links[TREE_NODES - 1 + TREE_EXTRA_LINKS];
+static int tree_num_links;
+
+static bool _tree_link_up(struct tree_link *l)
+{
+  return l->up && !tree_node_down[l->a] && !tree_node_down[l->b];
+}
+
+static void _tree_set_links(bool *was_up)
+{
+  for (int i = 0; i < tree_num_links; i++)
+    {
+      struct tree_link *l = &tree_links[i];
+      bool up = _tree_link_up(l);
+
+      if (up == was_up[i])
+        continue;
+      net_sim_set_connected(l->ea, l->eb, up);
+      net_sim_set_connected(l->eb, l->ea, up);
+    }
+}
+
+static int _tree_index(dncp o, dncp_node n)
+{
+  for (int i = 0; i < TREE_NODES; i++)
+    if (dncp_find_node_by_node_id(o, &tree_nodes[i]->d->own_node->node_id,
+                                  false) == n)
+      return i;
+  return -1;
+}
+
+/* Node 0 sees exactly the links which are up within its component */
+static bool _tree_settled(net_sim s)
+{
+  dncp o = tree_nodes[0]->d;
+  bool comp[TREE_NODES] = { [0] = true };
+  bool changed = true;
+
+  if (net_sim_is_busy(s))
+    return false;
+
+  while (changed)
+    {
+      changed = false;
+      for (int i = 0; i < tree_num_links; i++)
+        if (_tree_link_up(&tree_links[i]) &&
+            comp[tree_links[i].a] != comp[tree_links[i].b])
+          {
+            comp[tree_links[i].a] = comp[tree_links[i].b] = true;
+            changed = true;
+          }
+    }
+
+  for (int i = 0; i < TREE_NODES; i++)
+    {
+      dncp_node n = dncp_find_node_by_node_id(o, &tree_nodes[i]->d->own_node->node_id, false);
+      int num_neighbors = 0;
+
+      if (!comp[i])
+        {
+          if (n && n->reachable)
+            return false;
+          continue;
+        }
+      if (!n || (i && !n->reachable))
+        return false;
+
+      for (int j = 0; j < tree_num_links; j++)
+        if (_tree_link_up(&tree_links[j]) &&
+            (tree_links[j].a == i || tree_links[j].b == i))
+          num_neighbors++;
+      if (n->num_neighbors != num_neighbors)
+        return false;
+      for (int j = 0; j < n->num_neighbors; j++)
+        {
+          int k = _tree_index(o, n->neighbors[j]), l;
+
+          for (l = 0; l < tree_num_links; l++)
+            if (_tree_link_up(&tree_links[l]) &&
+                ((tree_links[l].a == i && tree_links[l].b == k) ||
+                 (tree_links[l].a == k && tree_links[l].b == i)))
+              break;
+          if (l == tree_num_links)
+            return false;
+        }
+    }
+  return true;
+}
+
+/* Compares the tree with a full BFS over node 0's view of the graph:
+ * hopcounts have to match, and the next-hop has to be that of one of
+ * our neighbors which starts a shortest path to the node. */
+static int _tree_check(hncp_bfs bfs)
+{
+  dncp o = bfs->dncp;
+  dncp_node nodes[TREE_NODES], n;
+  int dist[TREE_NODES], queue[TREE_NODES], qlen = 0, count = 0, errors = 0;
+  uint32_t first[TREE_NODES];
+  struct hncp_bfs_head tmp;
+
+  dncp_for_each_node_including_unreachable(o, n)
+    if (count < TREE_NODES)
+      {
+        nodes[count] = n;
+        dist[count] = (n == o->own_node) ? 0 : -1;
+        first[count] = 0;
+        if (!dist[count])
+          queue[qlen++] = count;
+        count++;
+      }
+
+  for (int q = 0; q < qlen; q++)
+    {
+      dncp_node u = nodes[queue[q]];
+      for (int j = 0; j < u->num_neighbors; j++)
+        {
+          int v;
+          for (v = 0; v < count && nodes[v] != u->neighbors[j]; v++);
+          if (v == count)
+            continue;
+
+          uint32_t via = (u == o->own_node) ? 1U << v : first[queue[q]];
+          if (dist[v] < 0)
+            {
+              dist[v] = dist[queue[q]] + 1;
+              queue[qlen++] = v;
+            }
+          if (dist[v] == dist[queue[q]] + 1)
+            first[v] |= via;
+        }
+    }
+
+  for (int i = 0; i < count; i++)
+    {
+      struct hncp_bfs_head *h = hncp_routing_head(nodes[i]);
+      bool ok = false;
+
+      if (nodes[i] == o->own_node)
+        continue;
+
+      if (!h->ifname[0] || dist[i] < 0)
+        {
+          if (!h->ifname[0] != (dist[i] < 0))
+            {
+              L_ERR("%s reached %d, distance %d", DNCP_NODE_REPR(nodes[i]),
+                    !!h->ifname[0], dist[i]);
+              errors++;
+            }
+          continue;
+        }
+
+      for (int f = 0; f < count && !ok; f++)
+        ok = (first[i] & (1U << f)) &&
+          hncp_routing_own_next_hop(bfs, nodes[f], &tmp) &&
+          !memcmp(&tmp.next_hop, &h->next_hop, sizeof(tmp.next_hop)) &&
+          !strcmp(tmp.ifname, h->ifname) &&
+          tmp.has_next_hop4 == h->has_next_hop4 &&
+          (!tmp.has_next_hop4 ||
+           !memcmp(&tmp.next_hop4, &h->next_hop4, sizeof(tmp.next_hop4)));
+
+      if ((int)h->hopcount != dist[i] || !ok)
+        {
+          L_ERR("%s hopcount %u, distance %d, next-hop %s%s",
+                DNCP_NODE_REPR(nodes[i]), h->hopcount, dist[i], h->ifname,
+                ok ? "" : " (not on a shortest path)");
+          errors++;
+        }
+    }
+  return errors;
+}
+
+void hncp_routing_tree(void)
+{
+  net_sim_s s;
+  hncp_bfs bfs;
+  bool was_up[ARRAY_SIZE(tree_links)] = { false };
+  char name[16];
+  int i, j, iter, errors = 0, reached = 0, flap_link = -1, flap_node = -1;
+  dncp_node n;
+
+  srandom(1);
+  net_sim_init(&s);
+  s.disable_sd = true;
+  s.disable_pa = true;
+  s.disable_multicast = true;
+  for (i = 0; i < TREE_NODES; i++)
+    {
+      sprintf(name, "n%d", i);
+      tree_nodes[i] = container_of(net_sim_find_hncp(&s, name), net_node_s, h);
+    }
+
+  current_iface_users = &tree_nodes[0]->iface_users;
+  bfs = hncp_routing_create(&tree_nodes[0]->h, NULL, true, false);
+  current_iface_users = NULL;
+
+  /* Spanning tree plus some random links (no parallel ones) */
+  while (tree_num_links < (int)ARRAY_SIZE(tree_links))
+    {
+      struct tree_link *l = &tree_links[tree_num_links];
+      int n = tree_num_links;
+
+      l->a = (n < TREE_NODES - 1) ? n + 1 : random() % TREE_NODES;
+      l->b = random() % ((n < TREE_NODES - 1) ? n + 1 : TREE_NODES);
+      for (j = 0; j < n; j++)
+        if ((tree_links[j].a == l->a && tree_links[j].b == l->b) ||
+            (tree_links[j].a == l->b && tree_links[j].b == l->a))
+          break;
+      if (l->a == l->b || j < n)
+        continue;
+
+      sprintf(name, "eth%d", n);
+      l->ea = net_sim_dncp_find_ep_by_name(tree_nodes[l->a]->d, name);
+      l->eb = net_sim_dncp_find_ep_by_name(tree_nodes[l->b]->d, name);
+      l->up = true;
+      tree_num_links++;
+    }
+
+  for (i = 0; i <= TREE_ROUNDS; i++)
+    {
+      /* Odd rounds take a link or a node (other than ours) down, even
+       * rounds bring it back */
+      for (j = 0; i && j < tree_num_links; j++)
+        was_up[j] = _tree_link_up(&tree_links[j]);
+      if (i % 2)
+        {
+          if (random() % 3)
+            flap_link = random() % tree_num_links;
+          else
+            flap_node = 1 + random() % (TREE_NODES - 1);
+        }
+      if (flap_link >= 0)
+        tree_links[flap_link].up = !tree_links[flap_link].up;
+      if (flap_node >= 0)
+        tree_node_down[flap_node] = !tree_node_down[flap_node];
+      if (i && !(i % 2))
+        flap_link = flap_node = -1;
+      _tree_set_links(was_up);
+
+      for (iter = 0; iter < 100000 && !_tree_settled(&s); iter++)
+        {
+          if (fu_loop(1))
+            break;
+          while (fu_poll());
+        }
+      sput_fail_unless(_tree_settled(&s), "settled");
+
+      /* Run the pending (coalesced) routing run right away */
+      if (bfs->t.pending)
+        {
+          uloop_timeout_cancel(&bfs->t);
+          bfs->t.cb(&bfs->t);
+        }
+
+      errors += _tree_check(bfs);
+      dncp_for_each_node(bfs->dncp, n)
+        reached += !!hncp_routing_head(n)->ifname[0];
+    }
+  sput_fail_unless(!errors, "incremental tree matches full BFS");
+  sput_fail_unless(reached > TREE_ROUNDS, "nodes reached");
+
+  hncp_routing_destroy(bfs);
+  s.del_neighbor_is_error = false;
+  for (j = 0; j < tree_num_links; j++)
+    if (_tree_link_up(&tree_links[j]))
+      {
+        net_sim_set_connected(tree_links[j].ea, tree_links[j].eb, false);
+        net_sim_set_connected(tree_links[j].eb, tree_links[j].ea, false);
+      }
+  net_sim_uninit(&s);
+}
+
+int main(__unused int argc, __unused char **argv)
+{
+  setbuf(stdout, NULL); /* so that it's in sync with stderr when redirected */
+  openlog(argv[0], LOG_CONS | LOG_PERROR, LOG_DAEMON);
+  sput_start_testing();
+  sput_enter_suite(argv[0]); /* optional */
+  sput_run_test(hncp_routing_netlink);
+  sput_run_test(hncp_routing_script);
+  sput_run_test(hncp_routing_tree);
+  sput_leave_suite(); /* optional */
+  sput_finish_testing();
+  return sput_get_return_value();
+}
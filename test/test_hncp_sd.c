@@ -155,6 +155,20 @@ void test_hncp_sd(void)
   file_contains("/tmp/n2.conf", "label.r.home");
   file_contains("/tmp/n2.conf", "r1.home");
 
+  /* With the built-in DNS server, only forwarders to it are written */
+  node1->sd->p.dns_port = 5353;
+  memset(&node1->sd->dnsmasq_state, 0, HNCP_HASH_LEN);
+  rv = hncp_sd_write_dnsmasq_forward_conf(node1->sd, "/tmp/n1-fwd.conf");
+  sput_fail_unless(rv, "write forward works");
+  file_contains("/tmp/n1-fwd.conf", "server=/home./::1#5353\n");
+  file_contains("/tmp/n1-fwd.conf", "server=/3.2.1.in-addr.arpa./::1#5353\n");
+  file_contains("/tmp/n1-fwd.conf", "ip6.arpa./::1#5353\n");
+  file_does_not_contain("/tmp/n1-fwd.conf", "r.home");
+  file_does_not_contain("/tmp/n1-fwd.conf", "ptr-record");
+  rv = hncp_sd_write_dnsmasq_forward_conf(node1->sd, "/tmp/n1-fwd.conf");
+  sput_fail_unless(!rv, "write forward 'fails'");
+  node1->sd->p.dns_port = 0;
+
   check_exec = true;
   smock_push("execv_cmd", "s-dnsmasq");
   smock_push("execv_arg", "restart");
@@ -234,6 +248,49 @@ void test_hncp_sd(void)
   sput_fail_unless(!rv, "reconfigure pcp works (2)");
   debug_exec = false;
 
+  /* PCP records follow external connections of other nodes */
+  unsigned char ecbuf[32];
+  struct tlv_attr *dpa = (void *)ecbuf;
+  hncp_t_delegated_prefix_header dp = tlv_data(dpa);
+  const char *pcp_key = "p2001:db8::/32=2001:dead:beef::1";
+  hncp_sd_record r;
+
+  memset(ecbuf, 0, sizeof(ecbuf));
+  dp->prefix_length_bits = 32;
+  dp->prefix_data[0] = 0x20;
+  dp->prefix_data[1] = 0x01;
+  dp->prefix_data[2] = 0x0d;
+  dp->prefix_data[3] = 0xb8;
+  tlv_init(dpa, HNCP_T_DELEGATED_PREFIX, TLV_SIZE + sizeof(*dp) + 4);
+  tlv_fill_pad(dpa);
+  dncp_add_tlv(n1, HNCP_T_EXTERNAL_CONNECTION, dpa, tlv_pad_len(dpa), 0);
+  SIM_WHILE(&s, 1000, net_sim_is_busy(&s) || !net_sim_is_converged(&s));
+  r = avl_find_element(&node2->sd->records, pcp_key, r, in_records);
+  sput_fail_unless(r && r->refcount == 1, "pcp record added");
+
+  dncp_remove_tlv_matching(n1, HNCP_T_EXTERNAL_CONNECTION,
+                           dpa, tlv_pad_len(dpa));
+  SIM_WHILE(&s, 1000, net_sim_is_busy(&s) || !net_sim_is_converged(&s));
+  r = avl_find_element(&node2->sd->records, pcp_key, r, in_records);
+  sput_fail_unless(!r, "pcp record removed");
+  sput_fail_unless(!_first_record(node2->sd, RECORD_PCP), "no pcp records");
+
+  /* Republishing unchanged DDZs leaves them in place */
+  dncp_tlv t;
+  dncp_for_each_tlv(n1, t)
+    if (tlv_id(dncp_tlv_get_attr(t)) == HNCP_T_DNS_DELEGATED_ZONE)
+      break;
+  sput_fail_unless(t, "local ddz");
+  if (t)
+    {
+      struct tlv_attr *a = dncp_tlv_get_attr(t);
+
+      node1->sd->should_update |= UPDATE_FLAG_LOCAL_DDZ;
+      _publish_ddzs(node1->sd);
+      sput_fail_unless(dncp_find_tlv(n1, tlv_id(a), tlv_data(a), tlv_len(a))
+                       == t, "local ddz kept");
+    }
+
 
   /* Add third node, with hardcoded .domain (yay). It should result in
    * .home disappearing from n1 eventually. */
@@ -265,6 +322,52 @@ void test_hncp_sd(void)
   file_contains("/tmp/n12.conf", "xorbo.domain");
   file_does_not_contain("/tmp/n12.conf", "home");
 
+  /* The same zone from two nodes shares the records; dnsmasq keeps
+   * it until the last one is withdrawn */
+  struct __packed {
+    hncp_t_dns_delegated_zone_s h;
+    uint8_t ll[13];
+  } ddz = {
+    .h = { .address = { 0x20, 0x01, 0x0d, 0xb8, [15] = 0x53 },
+           .flags = HNCP_T_DNS_DELEGATED_ZONE_FLAG_BROWSE },
+    .ll = "\6shared\4test"
+  };
+  const char *server_key = "sshared.test./2001:db8::53#53";
+  const char *b_key = "bshared.test.";
+
+  dncp_add_tlv(n1, HNCP_T_DNS_DELEGATED_ZONE, &ddz, sizeof(ddz), 0);
+  dncp_add_tlv(n2, HNCP_T_DNS_DELEGATED_ZONE, &ddz, sizeof(ddz), 0);
+  SIM_WHILE(&s, 1000, net_sim_is_busy(&s) || !net_sim_is_converged(&s));
+  r = avl_find_element(&node3->sd->records, server_key, r, in_records);
+  sput_fail_unless(r && r->refcount == 2, "shared server record");
+  r = avl_find_element(&node3->sd->records, b_key, r, in_records);
+  sput_fail_unless(r && r->refcount == 2, "shared b record");
+  memset(&node3->sd->dnsmasq_state, 0, HNCP_HASH_LEN);
+  rv = hncp_sd_write_dnsmasq_conf(node3->sd, "/tmp/n3-shared.conf");
+  sput_fail_unless(rv, "write shared works");
+  file_contains("/tmp/n3-shared.conf", "server=/shared.test./2001:db8::53#53");
+  file_contains("/tmp/n3-shared.conf", "b._dns-sd._udp.domain.,shared.test.");
+
+  dncp_remove_tlv_matching(n1, HNCP_T_DNS_DELEGATED_ZONE, &ddz, sizeof(ddz));
+  SIM_WHILE(&s, 1000, net_sim_is_busy(&s) || !net_sim_is_converged(&s));
+  r = avl_find_element(&node3->sd->records, server_key, r, in_records);
+  sput_fail_unless(r && r->refcount == 1, "server record kept");
+  r = avl_find_element(&node3->sd->records, b_key, r, in_records);
+  sput_fail_unless(r && r->refcount == 1, "b record kept");
+  memset(&node3->sd->dnsmasq_state, 0, HNCP_HASH_LEN);
+  rv = hncp_sd_write_dnsmasq_conf(node3->sd, "/tmp/n3-shared.conf");
+  sput_fail_unless(rv, "write shared works (2)");
+  file_contains("/tmp/n3-shared.conf", "server=/shared.test./2001:db8::53#53");
+
+  dncp_remove_tlv_matching(n2, HNCP_T_DNS_DELEGATED_ZONE, &ddz, sizeof(ddz));
+  SIM_WHILE(&s, 1000, net_sim_is_busy(&s) || !net_sim_is_converged(&s));
+  sput_fail_unless(!avl_find(&node3->sd->records, server_key), "server record removed");
+  sput_fail_unless(!avl_find(&node3->sd->records, b_key), "b record removed");
+  memset(&node3->sd->dnsmasq_state, 0, HNCP_HASH_LEN);
+  rv = hncp_sd_write_dnsmasq_conf(node3->sd, "/tmp/n3-shared.conf");
+  sput_fail_unless(rv, "write shared works (3)");
+  file_does_not_contain("/tmp/n3-shared.conf", "shared.test");
+
   net_sim_uninit(&s);
 }
 
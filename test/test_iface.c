@@ -15,7 +15,22 @@
 #include "hncp_sd.h"
 #define hncp_get_dncp(o) NULL
 
+/* Captures what is sent on the rtnetlink socket */
+static int send_calls;
+static size_t send_len;
+static uint8_t send_buf[32768];
+
+ssize_t test_send(__unused int fd, const void *buf, size_t len, __unused int flags)
+{
+	send_calls++;
+	send_len = len;
+	memcpy(send_buf, buf, len < sizeof(send_buf) ? len : sizeof(send_buf));
+	return len;
+}
+
+#define send test_send
 #include "iface.c"
+#undef send
 
 #include "fake_log.h"
 
@@ -175,12 +190,97 @@ void iface_test_new_managed(void)
 }
 
 
+static struct rtattr *iface_test_rta(struct nlmsghdr *nhm, int type)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(nhm);
+	struct rtattr *rta = IFA_RTA(ifa);
+	int len = IFA_PAYLOAD(nhm);
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		if (rta->rta_type == type)
+			return rta;
+	return NULL;
+}
+
+void iface_test_rtnl_batch(void)
+{
+	struct prefix p6 = {{{{0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1}}}, 64};
+	struct prefix p4, route = {{{{0x20, 0x01, 0x0d, 0xb8}}}, 48};
+	struct nlmsghdr *nhm;
+	struct ifaddrmsg *ifa;
+	struct rtmsg *rtm;
+	struct rtattr *rta;
+	size_t len;
+	int i;
+
+	prefix_pton("192.168.1.1/24", &p4.prefix, &p4.plen);
+	fu_init();
+	send_calls = 0;
+
+	/* Nothing is sent until the end of the loop iteration */
+	iface_set_kernel_address("lo", &p6, 100, 200, true);
+	iface_set_unreachable_route(&route, true);
+	iface_set_kernel_address("lo", &p4, 0, 0, false);
+	iface_set_kernel_address("nonexistent0", &p6, 100, 200, true);
+	sput_fail_unless(send_calls == 0, "batched");
+	sput_fail_unless(rtnl_batch.flush.pending && !hnetd_time_timeout_remaining(&rtnl_batch.flush), "flush scheduled");
+
+	fu_poll();
+	sput_fail_unless(send_calls == 1 && !rtnl_batch.len, "flushed at once");
+	sput_fail_unless(!rtnl_batch.flush.pending, "flush done");
+
+	nhm = (struct nlmsghdr *)send_buf;
+	len = send_len;
+	sput_fail_unless(NLMSG_OK(nhm, len) && nhm->nlmsg_type == RTM_NEWADDR &&
+			(nhm->nlmsg_flags & (NLM_F_CREATE | NLM_F_REPLACE)), "new v6 address");
+	ifa = NLMSG_DATA(nhm);
+	sput_fail_unless(ifa->ifa_family == AF_INET6 && ifa->ifa_prefixlen == 64 &&
+			ifa->ifa_index == if_nametoindex("lo"), "v6 address on lo");
+	rta = iface_test_rta(nhm, IFA_LOCAL);
+	sput_fail_unless(rta && RTA_PAYLOAD(rta) == sizeof(struct in6_addr) &&
+			!memcmp(RTA_DATA(rta), &p6.prefix, sizeof(struct in6_addr)), "v6 address");
+	rta = iface_test_rta(nhm, IFA_CACHEINFO);
+	sput_fail_unless(rta && ((struct ifa_cacheinfo *)RTA_DATA(rta))->ifa_prefered == 100 &&
+			((struct ifa_cacheinfo *)RTA_DATA(rta))->ifa_valid == 200, "v6 lifetimes");
+
+	nhm = NLMSG_NEXT(nhm, len);
+	sput_fail_unless(NLMSG_OK(nhm, len) && nhm->nlmsg_type == RTM_NEWROUTE, "new route");
+	rtm = NLMSG_DATA(nhm);
+	sput_fail_unless(rtm->rtm_family == AF_INET6 && rtm->rtm_dst_len == 48 &&
+			rtm->rtm_type == RTN_UNREACHABLE, "unreachable route");
+
+	nhm = NLMSG_NEXT(nhm, len);
+	sput_fail_unless(NLMSG_OK(nhm, len) && nhm->nlmsg_type == RTM_DELADDR, "del v4 address");
+	ifa = NLMSG_DATA(nhm);
+	sput_fail_unless(ifa->ifa_family == AF_INET && ifa->ifa_prefixlen == 24, "v4 address");
+	rta = iface_test_rta(nhm, IFA_LOCAL);
+	sput_fail_unless(rta && RTA_PAYLOAD(rta) == sizeof(struct in_addr) &&
+			!memcmp(RTA_DATA(rta), &p4.prefix.s6_addr[12], sizeof(struct in_addr)), "v4 address");
+	sput_fail_unless(!iface_test_rta(nhm, IFA_CACHEINFO), "no v4 lifetimes");
+
+	nhm = NLMSG_NEXT(nhm, len);
+	sput_fail_unless(!NLMSG_OK(nhm, len), "unknown interface skipped");
+
+	/* A full batch is sent right away, the rest at the end of the iteration */
+	send_calls = 0;
+	for (i = 0; i < 400; i++)
+		iface_set_unreachable_route(&route, false);
+	sput_fail_unless(send_calls == 1 && send_len <= sizeof(rtnl_batch.buf), "full batch sent");
+	len = send_len;
+	fu_poll();
+	nhm = (struct nlmsghdr *)send_buf;
+	sput_fail_unless(send_calls == 2 && nhm->nlmsg_type == RTM_DELROUTE &&
+			len + send_len == 400 * NLMSG_ALIGN(nhm->nlmsg_len), "rest sent");
+	sput_fail_if(fu_next(), "No scheduled timer");
+}
+
+
 int main()
 {
 	sput_start_testing();
 	sput_enter_suite("iface");
 	sput_run_test(iface_test_new_unmanaged);
 	sput_run_test(iface_test_new_managed);
+	sput_run_test(iface_test_rtnl_batch);
 	sput_leave_suite();
 	sput_finish_testing();
 	return sput_get_return_value();
@@ -1095,6 +1095,98 @@ void pa_core_data() {
 	sput_fail_if(fu_next(), "No scheduled timer.");
 }
 
+/* Assigns the /64 with the link index as subnet id */
+static struct pa_link *settle_links;
+static int settle_get_prefix(__unused struct pa_rule_static *srule,
+		struct pa_ldp *ldp, pa_prefix *prefix, pa_plen *plen)
+{
+	int i = ldp->link - settle_links;
+	pa_prefix_cpy(&ldp->dp->prefix, ldp->dp->plen, prefix, *plen);
+	prefix->s6_addr[6] = i >> 8;
+	prefix->s6_addr[7] = i & 0xff;
+	*plen = 64;
+	return 0;
+}
+
+/* Adds n_dps Delegated Prefixes to n_links links and runs until all
+ * prefixes are applied. Returns the number of executed timeouts. */
+static int pa_core_settle(int n_links, int n_dps, uint8_t batched)
+{
+	struct pa_core core;
+	struct pa_link *links = settle_links = calloc(n_links, sizeof(*links));
+	struct pa_dp *dps = calloc(n_dps, sizeof(*dps));
+	struct test_rule counter = {.rule = CUSTOM_RULE_INIT, .filter_accept = 1};
+	struct pa_rule_static srule;
+	struct pa_ldp *ldp;
+	struct pa_pentry *pentry;
+	pa_prefix prefix = {};
+	int i, j, timeouts, overlaps = 0, not_applied = 0;
+	int level = log_level;
+
+	fu_init();
+	fr_mask_random = 0;
+	pa_core_init(&core);
+	pa_core_set_batched(&core, batched);
+	pa_rule_static_init(&srule, "settle", settle_get_prefix, 1, 1);
+	pa_rule_add(&core, &srule.rule);
+	pa_rule_add(&core, &counter.rule);
+
+	for(i = 0; i < n_links; i++) {
+		pa_link_init(&links[i], "batched");
+		pa_link_add(&core, &links[i]);
+	}
+
+	log_level = LOG_NOTICE; //Debug output per ldp is way too verbose
+	for(i = 0; i < n_dps; i++) {
+		prefix.s6_addr[0] = 0x20;
+		prefix.s6_addr[1] = 0x01;
+		prefix.s6_addr[5] = i;
+		pa_dp_init(&dps[i], &prefix, 48);
+		pa_dp_add(&core, &dps[i]);
+	}
+	timeouts = -1 - fu_loop(-1);
+	log_level = level;
+	L_NOTICE("pa settle: %d links x %d dps, %s: %d routines, %d timeouts",
+			n_links, n_dps, batched?"batched":"per-ldp",
+			counter.prio_ctr, timeouts);
+
+	for(i = 0; i < n_links; i++)
+		pa_for_each_ldp_in_link(&links[i], ldp) {
+			if(!ldp->applied || !ldp->published)
+				not_applied++;
+			j = 0;
+			btrie_for_each_updown_entry(pentry, &core.prefixes,
+					(btrie_key_t *)&ldp->prefix, ldp->plen, be)
+				j++;
+			if(j != 1)
+				overlaps++;
+		}
+	sput_fail_if(not_applied, "All prefixes applied");
+	sput_fail_if(overlaps, "No overlapping prefixes");
+
+	for(i = 0; i < n_dps; i++)
+		pa_dp_del(&dps[i]);
+	for(i = 0; i < n_links; i++)
+		pa_link_del(&links[i]);
+	pa_rule_del(&core, &counter.rule);
+	pa_rule_del(&core, &srule.rule);
+	sput_fail_if(fu_next(), "No scheduled timer");
+	free(links);
+	free(dps);
+	return timeouts;
+}
+
+void pa_core_batched() {
+	int per_ldp, batched;
+
+	per_ldp = pa_core_settle(50, 4, 0);
+	batched = pa_core_settle(50, 4, 1);
+	sput_fail_unless(batched < per_ldp, "Batched mode runs fewer timeouts");
+
+	pa_core_settle(200, 8, 0);
+	pa_core_settle(200, 8, 1);
+}
+
 int main() {
 	fu_init();
 	sput_start_testing();
@@ -1104,6 +1196,7 @@ int main() {
 	sput_run_test(pa_core_rule);
 	sput_run_test(pa_core_hierarchical);
 	sput_run_test(pa_core_override);
+	sput_run_test(pa_core_batched);
 	sput_leave_suite(); /* optional */
 	sput_finish_testing();
 	return sput_get_return_value();